@@ -37,7 +37,17 @@
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include "shapes/triangle.h"
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#ifdef PBRT_HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 
@@ -45,6 +55,15 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_MEMORY_COUNTER("Memory/BVH tree (compressed nodes)", compressedTreeBytes);
+STAT_COUNTER("BVH/Spatial splits", spatialSplits);
+STAT_COUNTER("BVH/Duplicated primitive references", duplicatedReferences);
+STAT_COUNTER("BVH/Trees loaded from cache", nCacheLoads);
+STAT_COUNTER("BVH/Refits", nRefits);
+STAT_COUNTER("BVH/Subtrees rebuilt by refits", nRefitSubtreeRebuilds);
+STAT_COUNTER("BVH/Trees rebuilt by refits", nRefitFullRebuilds);
+STAT_COUNTER("BVH/Treelets restructured", nTreeletsRestructured);
+STAT_RATIO("BVH/Triangle leaves", nTriangleLeaves, nTriangleLeafCandidates);
 
 #pragma region
 
@@ -97,6 +116,9 @@ struct BVHBuildNode
     Bounds3f bounds;
     BVHBuildNode *children[2];
     int splitAxis, firstPrimOffset, nPrimitives;
+    // SAH cost of the subtree times its surface area; only maintained
+    // during treelet restructuring
+    Float cost;
 };
 
 struct MortonPrimitive {
@@ -109,50 +131,81 @@ struct LBVHTreelet {
     BVHBuildNode *buildNodes;
 };
 
-struct LinearBVHNode {
-    Bounds3f bounds;
+// Parallel BVH construction: the top of the tree is built serially down to
+// subtrees of at most _bvhTaskPrimitives_ primitives, which are then built
+// in parallel.  Since the task size doesn't depend on the number of
+// threads, the tree is the same as the one built serially.
+static PBRT_CONSTEXPR int bvhTaskPrimitives = 4096;
+static PBRT_CONSTEXPR int bvhParallelChunkSize = 16384;
+// The upper levels of HLBVH trees are likewise split into tasks of at
+// most this many treelets
+static PBRT_CONSTEXPR int upperSAHTaskTreelets = 64;
+
+struct BVHBuildTask {
+    BVHBuildNode *node;  // placeholder for the subtree's root
+    int start, end;
+};
+
+static void RestructureTreelets(BVHBuildNode *root, int rounds);
+
+// Compressed BVH node: an interior node stores the bounds of its two
+// children as 8-bit fractions of its own (decoded) bounds, so that the
+// bounds are only stored once at full precision, for the root.
+struct CompressedBVHNode {
     union {
-        int primitivesOffset;   // leaf
-        int secondChildOffset;  // interior
+        uint8_t childBounds[2][2][3];  // interior: [child][min/max][axis]
+        uint16_t nPrimitives;          // leaf
     };
-    uint16_t nPrimitives;  // 0 -> interior node
-    uint8_t axis;          // interior node: xyz
-    uint8_t pad[1];        // ensure 32 byte total size
+    // The top bit flags leaves.  The remaining bits hold the primitive
+    // offset of a leaf, or the split axis (2 bits) and second child offset
+    // (29 bits) of an interior node.
+    uint32_t info;
+
+    bool IsLeaf() const { return info & 0x80000000u; }
+    int PrimitivesOffset() const { return info & 0x7fffffff; }
+    int Axis() const { return (info >> 29) & 3; }
+    int SecondChildOffset() const { return info & 0x1fffffff; }
 };
 
-// BVHAccel Utility Functions
-inline uint32_t LeftShift3(uint32_t x) {
-    CHECK_LE(x, (1 << 10));
-    if (x == (1 << 10)) --x;
-#ifdef PBRT_HAVE_BINARY_CONSTANTS
-    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
-    // x = ---- --98 ---- ---- ---- ---- 7654 3210
-    x = (x | (x <<  8)) & 0b00000011000000001111000000001111;
-    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
-    x = (x | (x <<  4)) & 0b00000011000011000011000011000011;
-    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
-    x = (x | (x <<  2)) & 0b00001001001001001001001001001001;
-    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
-#else
-    x = (x | (x << 16)) & 0x30000ff;
-    // x = ---- --98 ---- ---- ---- ---- 7654 3210
-    x = (x | (x <<  8)) & 0x300f00f;
-    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
-    x = (x | (x <<  4)) & 0x30c30c3;
-    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
-    x = (x | (x <<  2)) & 0x9249249;
-    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
-#endif // PBRT_HAVE_BINARY_CONSTANTS
-    return x;
+// The bounds decoded from a quantized value are always exactly _lo_ and
+// _hi_ at the ends of the range; quantization searches for the values
+// whose decoded positions conservatively enclose the child's bounds, so
+// traversal stays watertight.
+inline Float DecodeQuantized(uint8_t q, Float lo, Float hi) {
+    return Lerp(q / Float(255), lo, hi);
 }
 
-inline uint32_t EncodeMorton3(const Vector3f &v) {
-    CHECK_GE(v.x, 0);
-    CHECK_GE(v.y, 0);
-    CHECK_GE(v.z, 0);
-    return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+inline uint8_t QuantizeMin(Float v, Float lo, Float hi) {
+    if (!(hi > lo)) return 0;
+    int q = Clamp(int(std::floor((v - lo) / (hi - lo) * 255)), 0, 255);
+    while (q > 0 && DecodeQuantized(q, lo, hi) > v) --q;
+    return q;
 }
 
+inline uint8_t QuantizeMax(Float v, Float lo, Float hi) {
+    if (!(hi > lo)) return 255;
+    int q = Clamp(int(std::ceil((v - lo) / (hi - lo) * 255)), 0, 255);
+    while (q < 255 && DecodeQuantized(q, lo, hi) < v) ++q;
+    return q;
+}
+
+inline Bounds3f DecodeChildBounds(const CompressedBVHNode &node, int child,
+                                  const Bounds3f &bounds) {
+    Bounds3f b;
+    for (int a = 0; a < 3; ++a) {
+        b.pMin[a] = DecodeQuantized(node.childBounds[child][0][a],
+                                    bounds.pMin[a], bounds.pMax[a]);
+        b.pMax[a] = DecodeQuantized(node.childBounds[child][1][a],
+                                    bounds.pMin[a], bounds.pMax[a]);
+    }
+    return b;
+}
+
+// BVHAccel Utility Functions
+// Large arrays are split into chunks that are counted and scattered in
+// parallel.  Each chunk's elements of a bucket go after those of the
+// chunks before it, so the sort stays stable and its result doesn't
+// depend on the number of chunks.
 static void RadixSort(std::vector<MortonPrimitive> *v) {
     std::vector<MortonPrimitive> tempVector(v->size());
     PBRT_CONSTEXPR int bitsPerPass = 6;
@@ -160,6 +213,21 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     static_assert((nBits % bitsPerPass) == 0,
                   "Radix sort bitsPerPass must evenly divide nBits");
     PBRT_CONSTEXPR int nPasses = nBits / bitsPerPass;
+    PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
+    PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
+
+    int n = v->size();
+    int nChunks = n > 4 * bvhParallelChunkSize
+                      ? (n + bvhParallelChunkSize - 1) / bvhParallelChunkSize
+                      : 1;
+    auto forEachChunk = [nChunks](std::function<void(int64_t)> func) {
+        if (nChunks > 1)
+            ParallelFor(std::move(func), nChunks);
+        else
+            func(0);
+    };
+    auto chunkStart = [n, nChunks](int c) { return int(int64_t(n) * c / nChunks); };
+    std::vector<int> bucketOffsets(nChunks * nBuckets);
 
     for (int pass = 0; pass < nPasses; ++pass) {
         // Perform one pass of radix sort, sorting _bitsPerPass_ bits
@@ -169,28 +237,35 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
         std::vector<MortonPrimitive> &in = (pass & 1) ? tempVector : *v;
         std::vector<MortonPrimitive> &out = (pass & 1) ? *v : tempVector;
 
-        // Count number of zero bits in array for current radix sort bit
-        PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
-        int bucketCount[nBuckets] = {0};
-        PBRT_CONSTEXPR int bitMask = (1 << bitsPerPass) - 1;
-        for (const MortonPrimitive &mp : in) {
-            int bucket = (mp.mortonCode >> lowBit) & bitMask;
-            CHECK_GE(bucket, 0);
-            CHECK_LT(bucket, nBuckets);
-            ++bucketCount[bucket];
-        }
+        // Count number of elements in each chunk for each bucket
+        forEachChunk([&](int64_t c) {
+            int *bucketCount = &bucketOffsets[c * nBuckets];
+            for (int b = 0; b < nBuckets; ++b) bucketCount[b] = 0;
+            for (int i = chunkStart(c); i < chunkStart(c + 1); ++i) {
+                int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                CHECK_GE(bucket, 0);
+                CHECK_LT(bucket, nBuckets);
+                ++bucketCount[bucket];
+            }
+        });
 
-        // Compute starting index in output array for each bucket
-        int outIndex[nBuckets];
-        outIndex[0] = 0;
-        for (int i = 1; i < nBuckets; ++i)
-            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+        // Compute starting index in output array for each chunk's bucket
+        int offset = 0;
+        for (int b = 0; b < nBuckets; ++b)
+            for (int c = 0; c < nChunks; ++c) {
+                int count = bucketOffsets[c * nBuckets + b];
+                bucketOffsets[c * nBuckets + b] = offset;
+                offset += count;
+            }
 
         // Store sorted values in output array
-        for (const MortonPrimitive &mp : in) {
-            int bucket = (mp.mortonCode >> lowBit) & bitMask;
-            out[outIndex[bucket]++] = mp;
-        }
+        forEachChunk([&](int64_t c) {
+            int *outIndex = &bucketOffsets[c * nBuckets];
+            for (int i = chunkStart(c); i < chunkStart(c + 1); ++i) {
+                int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                out[outIndex[bucket]++] = in[i];
+            }
+        });
     }
     // Copy final result from _tempVector_, if needed
     if (nPasses & 1) std::swap(*v, tempVector);
@@ -202,13 +277,44 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
 
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod,
+                   bool compressNodes, Float splitBudget, Float maxRefitCost,
+                   const std::string &cacheFile, int treeletRounds,
+                   bool triangleLeaves)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
+      compressNodes(compressNodes),
+      splitBudget(splitBudget),
+      maxRefitCost(maxRefitCost),
+      treeletRounds(treeletRounds),
+      triangleLeaves(triangleLeaves),
       primitives(std::move(p)) 
 {
     ProfilePhase _(Prof::AccelConstruction);
+    if (cacheFile.empty() || primitives.empty())
+        build();
+    else if (splitMethod == SplitMethod::SBVH) {
+        // Spatial splits depend on more than the primitives' bounds, which
+        // is all that the cache is keyed by
+        Warning("BVH cache not supported with \"sbvh\" split method; "
+                "ignoring \"%s\".", cacheFile.c_str());
+        build();
+    } else {
+        uint64_t hash = geometryHash();
+        if (!readCache(cacheFile, hash)) {
+            std::vector<std::shared_ptr<Primitive>> input = primitives;
+            build();
+            writeCache(cacheFile, hash, input);
+        }
+    }
+    if (triangleLeaves && compressNodes)
+        Warning("Triangle leaves aren't supported with compressed BVH nodes; "
+                "ignoring \"triangleleaves\".");
+    initTriangleLeaves();
+    if (compressNodes) compressTree();
+}
 
+void BVHAccel::build() {
     if (primitives.empty()) 
         return;
 
@@ -220,33 +326,59 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
         primitiveInfo[i] = {i, primitives[i]->WorldBound()};
 
     // 2.Build BVH tree for primitives using _primitiveInfo_
-    MemoryArena arena(1024 * 1024); // нڵ arena зͷ
-    int totalNodes = 0; // ܼƴĽڵ
-    std::vector<std::shared_ptr<Primitive>> orderedPrims; // ڽд洢ҶڵָͼԪ
-    orderedPrims.reserve(primitives.size());
+    // Each thread allocates build nodes from its own arena
+    std::vector<MemoryArena> arenas(MaxThreadIndex());
+    MemoryArena &arena = arenas[ThreadIndex]; // нڵ arena зͷ
+    totalNodes = 0; // ܼƴĽڵ
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(primitives.size()); // ڽд洢ҶڵָͼԪ
 
     // If the HLBVH construction algorithm has been selected, HLBVHBuild()is called to build the tree.
     // The other three construction algorithms are all handled by recursiveBuild(). 
     BVHBuildNode *root; // 󷵻صڵ
     if (splitMethod == SplitMethod::HLBVH)
-        root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
+        root = HLBVHBuild(arenas, primitiveInfo, &totalNodes, orderedPrims);
+    else if (splitMethod == SplitMethod::SBVH) {
+        // Leaves append their references, which may repeat primitives
+        orderedPrims.clear();
+        int budget = std::max<Float>(0, splitBudget) * primitives.size();
+        Bounds3f rootBounds;
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            rootBounds = Union(rootBounds, pi.bounds);
+        root = sbvhBuild(arena, primitiveInfo, 0, rootBounds.SurfaceArea(),
+                         &totalNodes, orderedPrims, &budget);
+    } else if (primitives.size() > 4 * bvhTaskPrimitives) {
+        // Build the top of the tree, then its deferred subtrees in parallel
+        std::vector<BVHBuildTask> tasks;
+        root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
+                              &totalNodes, orderedPrims, &tasks);
+        std::vector<int> taskNodes(tasks.size(), 0);
+        ParallelFor([&](int64_t i) {
+            const BVHBuildTask &task = tasks[i];
+            BVHBuildNode *subtree =
+                recursiveBuild(arenas[ThreadIndex], primitiveInfo, task.start,
+                               task.end, &taskNodes[i], orderedPrims);
+            *task.node = *subtree;
+        }, tasks.size());
+        for (int n : taskNodes) totalNodes += n;
+    } else
         // recursiveBuild һ primitives ķΧ [start, end)  BVH Ӽ
 
         root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
                               &totalNodes, orderedPrims);
+    if (treeletRounds > 0) RestructureTreelets(root, treeletRounds);
 
     //  orderedPrims ÿҶӽڵжӦϵ, 滻ԭʼ primitives
     primitives.swap(orderedPrims);
     primitiveInfo.resize(0);
 
+    size_t arenaBytes = 0;
+    for (const MemoryArena &a : arenas) arenaBytes += a.TotalAllocated();
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
                               "primitives (%.2f MB), arena allocated %.2f MB",
                               totalNodes, (int)primitives.size(),
                               float(totalNodes * sizeof(LinearBVHNode)) /
                               (1024.f * 1024.f),
-                              float(arena.TotalAllocated()) /
-                              (1024.f * 1024.f));
+                              float(arenaBytes) / (1024.f * 1024.f));
 
     // Compute representation of depth-first traversal of BVH tree
     treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
@@ -259,7 +391,246 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
     CHECK_EQ(totalNodes, offset);
 }
 
+// Replaces the flattened nodes with their compressed representation,
+// which keeps the same node indices
+void BVHAccel::compressTree() {
+    if (!nodes) return;
+    CHECK_LT(totalNodes, 1 << 29);
+    FreeAligned(compressedNodes);
+    compressedNodes = AllocAligned<CompressedBVHNode>(totalNodes);
+    compressedRootBounds = nodes[0].bounds;
+    compressBVHTree(0, compressedRootBounds);
+    compressedTreeBytes += totalNodes * sizeof(CompressedBVHNode);
+    LOG(INFO) << StringPrintf("BVH nodes compressed from %.2f MB to %.2f MB",
+                              float(totalNodes * sizeof(LinearBVHNode)) /
+                              (1024.f * 1024.f),
+                              float(totalNodes * sizeof(CompressedBVHNode)) /
+                              (1024.f * 1024.f));
+    freeNodes();
+}
+
+// Releases the flattened nodes, which may live in a mapped cache file
+void BVHAccel::freeNodes() {
+#ifdef PBRT_HAVE_MMAP
+    if (mappedCache) {
+        if (munmap(mappedCache, mappedCacheLength) != 0)
+            Error("munmap: %s", strerror(errno));
+        mappedCache = nullptr;
+        nodes = nullptr;
+        return;
+    }
+#endif
+    FreeAligned(nodes);
+    nodes = nullptr;
+}
+
+// Frees the flattened nodes for good, once another representation of the
+// tree has replaced them, and stops counting them in the tree's memory
+void BVHAccel::releaseNodes() {
+    freeNodes();
+    treeBytes -= totalNodes * sizeof(LinearBVHNode);
+    totalNodes = 0;
+}
+
+// BVH cache files hold this header, followed by the flattened nodes and
+// then, for each primitive reference in leaf order, the index of the
+// primitive in the order the BVH was given them.  The header is 64 bytes
+// so that the nodes stay aligned when the file is mapped.
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version, floatSize, nodeSize, maxPrimsInNode;
+    uint64_t hash;  // of the primitives' bounds and the build settings
+    int32_t nPrimitives, nReferences, totalNodes, splitMethod;
+    uint64_t contentHash;  // of the nodes and indices that follow
+    char pad[8];
+};
+static_assert(sizeof(BVHCacheHeader) == 64, "Unexpected BVH cache header size");
+static const char bvhCacheMagic[8] = "pbrtbvh";
+static PBRT_CONSTEXPR uint32_t bvhCacheVersion = 2;
+
+// FNV-1a, as used for the API's transform cache
+static uint64_t HashBytes(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *ptr = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= ptr[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// The tree only depends on the primitives' bounds and on the build
+// settings, so that's what identifies a cached tree
+uint64_t BVHAccel::geometryHash() const {
+    int32_t settings[5] = {int32_t(bvhCacheVersion), int32_t(sizeof(Float)),
+                           maxPrimsInNode, int32_t(splitMethod),
+                           int32_t(std::max(0, treeletRounds))};
+    uint64_t hash = HashBytes(settings, sizeof(settings), 14695981039346656037ull);
+    for (const std::shared_ptr<Primitive> &p : primitives) {
+        Bounds3f b = p->WorldBound();
+        hash = HashBytes(&b, sizeof(b), hash);
+    }
+    return hash;
+}
+
+bool BVHAccel::readCache(const std::string &filename, uint64_t hash) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    BVHCacheHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        Warning("BVH cache \"%s\" is truncated; rebuilding it.",
+                filename.c_str());
+        return false;
+    }
+    bool valid = memcmp(header.magic, bvhCacheMagic, 8) == 0 &&
+                 header.version == bvhCacheVersion &&
+                 header.floatSize == sizeof(Float) &&
+                 header.nodeSize == sizeof(LinearBVHNode) &&
+                 header.maxPrimsInNode == uint32_t(maxPrimsInNode) &&
+                 header.splitMethod == int32_t(splitMethod) &&
+                 header.hash == hash &&
+                 header.nPrimitives == int32_t(primitives.size()) &&
+                 header.totalNodes > 0 && header.nReferences > 0;
+    size_t length = sizeof(header) + header.totalNodes * sizeof(LinearBVHNode) +
+                    header.nReferences * sizeof(int32_t);
+    valid = valid && fseek(f, 0, SEEK_END) == 0 && size_t(ftell(f)) == length;
+    if (!valid) {
+        fclose(f);
+        Warning("BVH cache \"%s\" doesn't match the scene; rebuilding it.",
+                filename.c_str());
+        return false;
+    }
+
+    const int32_t *indices;
+#ifdef PBRT_HAVE_MMAP
+    // Map the file privately so that refitting can still modify the nodes
+    void *ptr =
+        mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    fclose(f);
+    if (ptr == MAP_FAILED) {
+        Warning("%s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+    mappedCache = ptr;
+    mappedCacheLength = length;
+    nodes = (LinearBVHNode *)((char *)ptr + sizeof(header));
+    indices = (const int32_t *)(nodes + header.totalNodes);
+#else
+    nodes = AllocAligned<LinearBVHNode>(header.totalNodes);
+    std::vector<int32_t> indexStorage(header.nReferences);
+    valid = fseek(f, sizeof(header), SEEK_SET) == 0 &&
+            fread(nodes, sizeof(LinearBVHNode), header.totalNodes, f) ==
+                size_t(header.totalNodes) &&
+            fread(indexStorage.data(), sizeof(int32_t), header.nReferences,
+                  f) == size_t(header.nReferences);
+    fclose(f);
+    indices = indexStorage.data();
+#endif
+    totalNodes = header.totalNodes;
+
+    // Make sure that the tree is intact and can be traversed safely
+    // before using it
+    uint64_t contentHash =
+        HashBytes(nodes, totalNodes * sizeof(LinearBVHNode),
+                  14695981039346656037ull);
+    contentHash = HashBytes(indices, header.nReferences * sizeof(int32_t),
+                            contentHash);
+    valid = valid && contentHash == header.contentHash;
+    for (int i = 0; valid && i < header.nReferences; ++i)
+        valid = indices[i] >= 0 && indices[i] < header.nPrimitives;
+    for (int i = 0; valid && i < totalNodes; ++i) {
+        const LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0)
+            valid = node.primitivesOffset >= 0 &&
+                    node.primitivesOffset + node.nPrimitives <=
+                        header.nReferences;
+        else
+            valid = node.secondChildOffset > i + 1 &&
+                    node.secondChildOffset < totalNodes && node.axis < 3;
+    }
+    if (!valid) {
+        Warning("BVH cache \"%s\" is corrupt; rebuilding it.",
+                filename.c_str());
+        freeNodes();
+        totalNodes = 0;
+        return false;
+    }
+
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(header.nReferences);
+    for (int i = 0; i < header.nReferences; ++i)
+        orderedPrims[i] = primitives[indices[i]];
+    primitives.swap(orderedPrims);
+    ++nCacheLoads;
+    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
+                 primitives.size() * sizeof(primitives[0]);
+    LOG(INFO) << StringPrintf("BVH with %d nodes loaded from \"%s\"",
+                              totalNodes, filename.c_str());
+    return true;
+}
+
+void BVHAccel::writeCache(
+    const std::string &filename, uint64_t hash,
+    const std::vector<std::shared_ptr<Primitive>> &input) const {
+    if (!nodes) return;
+    std::unordered_map<const Primitive *, int32_t> inputIndex;
+    for (size_t i = 0; i < input.size(); ++i) inputIndex[input[i].get()] = i;
+    std::vector<int32_t> indices(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        indices[i] = inputIndex[primitives[i].get()];
+
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bvhCacheMagic, 8);
+    header.version = bvhCacheVersion;
+    header.floatSize = sizeof(Float);
+    header.nodeSize = sizeof(LinearBVHNode);
+    header.maxPrimsInNode = maxPrimsInNode;
+    header.hash = hash;
+    header.nPrimitives = input.size();
+    header.nReferences = primitives.size();
+    header.totalNodes = totalNodes;
+    header.splitMethod = int32_t(splitMethod);
+    header.contentHash = HashBytes(nodes, totalNodes * sizeof(LinearBVHNode),
+                                   14695981039346656037ull);
+    header.contentHash = HashBytes(indices.data(),
+                                   indices.size() * sizeof(int32_t),
+                                   header.contentHash);
+
+    // Write to a temporary file and then rename it, so that other renders
+    // never see a partially-written cache
+#ifdef PBRT_HAVE_MMAP
+    std::string tempFilename = StringPrintf("%s.%d", filename.c_str(),
+                                            int(getpid()));
+#else
+    std::string tempFilename = filename + ".tmp";
+#endif
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if (!f) {
+        Warning("%s: %s", tempFilename.c_str(), strerror(errno));
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(nodes, sizeof(LinearBVHNode), totalNodes, f) ==
+                  size_t(totalNodes) &&
+              fwrite(indices.data(), sizeof(int32_t), indices.size(), f) ==
+                  indices.size();
+    ok = (fclose(f) == 0) && ok;
+    if (ok) {
+#ifndef PBRT_HAVE_MMAP
+        // rename() may not replace an existing file here
+        remove(filename.c_str());
+#endif
+        ok = rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+    if (!ok) {
+        Warning("Unable to write BVH cache \"%s\": %s", filename.c_str(),
+                strerror(errno));
+        remove(tempFilename.c_str());
+    }
+}
+
 Bounds3f BVHAccel::WorldBound() const {
+    if (compressedNodes) return compressedRootBounds;
     return nodes ? nodes[0].bounds : Bounds3f();
 }
 
@@ -269,33 +640,115 @@ struct BucketInfo {
     Bounds3f bounds;
 };
 
+// Computes the bounds of the primitives in _[start, end)_ and of their
+// centroids, in parallel for large ranges.
+static void ComputeRangeBounds(
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+    Bounds3f *bounds, Bounds3f *centroidBounds) {
+    *bounds = *centroidBounds = Bounds3f();
+    if (end - start <= 4 * bvhParallelChunkSize) {
+        for (int i = start; i < end; ++i) {
+            *bounds = Union(*bounds, primitiveInfo[i].bounds);
+            *centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+        }
+        return;
+    }
+    int nChunks = (end - start + bvhParallelChunkSize - 1) / bvhParallelChunkSize;
+    std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+    ParallelFor([&](int64_t c) {
+        int chunkEnd = std::min<int>(end, start + (c + 1) * bvhParallelChunkSize);
+        for (int i = start + c * bvhParallelChunkSize; i < chunkEnd; ++i) {
+            chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+            chunkCentroidBounds[c] =
+                Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+        }
+    }, nChunks);
+    for (int c = 0; c < nChunks; ++c) {
+        *bounds = Union(*bounds, chunkBounds[c]);
+        *centroidBounds = Union(*centroidBounds, chunkCentroidBounds[c]);
+    }
+}
+
+inline int SAHBucket(const BVHPrimitiveInfo &pi, const Bounds3f &centroidBounds,
+                     int dim, int nBuckets) {
+    int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
+    if (b == nBuckets) b = nBuckets - 1;
+    CHECK_GE(b, 0);
+    CHECK_LT(b, nBuckets);
+    return b;
+}
+
+// Bins the primitives in _[start, end)_ into _nBuckets_ SAH buckets along
+// _dim_, in parallel for large ranges; per-chunk buckets are merged in a
+// fixed order.
+static void ComputeSAHBuckets(
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end,
+    const Bounds3f &centroidBounds, int dim, BucketInfo *buckets,
+    int nBuckets) {
+    if (end - start <= 4 * bvhParallelChunkSize) {
+        for (int i = start; i < end; ++i) {
+            int b = SAHBucket(primitiveInfo[i], centroidBounds, dim, nBuckets);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+        }
+        return;
+    }
+    int nChunks = (end - start + bvhParallelChunkSize - 1) / bvhParallelChunkSize;
+    std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+    ParallelFor([&](int64_t c) {
+        BucketInfo *cb = &chunkBuckets[c * nBuckets];
+        int chunkEnd = std::min<int>(end, start + (c + 1) * bvhParallelChunkSize);
+        for (int i = start + c * bvhParallelChunkSize; i < chunkEnd; ++i) {
+            int b = SAHBucket(primitiveInfo[i], centroidBounds, dim, nBuckets);
+            cb[b].count++;
+            cb[b].bounds = Union(cb[b].bounds, primitiveInfo[i].bounds);
+        }
+    }, nChunks);
+    for (int c = 0; c < nChunks; ++c)
+        for (int b = 0; b < nBuckets; ++b) {
+            buckets[b].count += chunkBuckets[c * nBuckets + b].count;
+            buckets[b].bounds =
+                Union(buckets[b].bounds, chunkBuckets[c * nBuckets + b].bounds);
+        }
+}
+
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
     int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) 
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+    std::vector<BVHBuildTask> *deferredTasks) 
 {
     CHECK_NE(start, end);
 
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
-    (*totalNodes)++;
 
     // Compute bounds of all primitives in BVH node
     // ΧǸԶµĹ, кܶظ?
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    Bounds3f bounds, centroidBounds;
+    ComputeRangeBounds(primitiveInfo, start, end, &bounds, &centroidBounds);
+
+    if (deferredTasks && end - start <= bvhTaskPrimitives) {
+        // Leave the subtree to a parallel task; until then, the placeholder
+        // node only needs its bounds, which the subtree's root will share
+        node->bounds = bounds;
+        deferredTasks->push_back({node, start, end});
+        return node;
+    }
+    (*totalNodes)++;
 
     // һݹĹ, Զ´Ҷӽڵ, ٻмڵ
     int nPrimitives = end - start;
 
+    // Leaves store their primitives at _[start, end)_ in _orderedPrims_,
+    // which matches the order that a depth-first build would add them in
     if (nPrimitives == 1) 
     {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
+        int firstPrimOffset = start;
         for (int i = start; i < end; ++i) // ֻһԪ, ΪʲôҪ for-loop?
         {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims[i] = primitives[primNum];
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
         return node;
@@ -305,9 +758,6 @@ BVHBuildNode *BVHAccel::recursiveBuild(
         // Compute bound of primitive centroids, choose split dimension _dim_
         // ĳὫһͼԪΪ
         // ͼԪΧеһµİΧ(ο Figure4.3), ѡΧһΪֵ
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
@@ -317,10 +767,10 @@ BVHBuildNode *BVHAccel::recursiveBuild(
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
         {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
+            int firstPrimOffset = start;
             for (int i = start; i < end; ++i) {
                 int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                orderedPrims[i] = primitives[primNum];
             }
             node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
             return node;
@@ -394,20 +844,8 @@ BVHBuildNode *BVHAccel::recursiveBuild(
 
                     // Initialize _BucketInfo_ for SAH partition buckets
                     // ȽͼԪֵͬο Figure4.6ȽЩĿ
-                    for (int i = start; i < end; ++i) 
-                    {
-                        int b = nBuckets *
-                                centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) 
-                            b = nBuckets - 1;
-
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
-
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+                    ComputeSAHBuckets(primitiveInfo, start, end, centroidBounds,
+                                      dim, buckets, nBuckets);
 
                     // Compute costs for splitting after each bucket
                     // Ϊ n 䣬  n-1 ָ
@@ -459,24 +897,18 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                             &primitiveInfo[end - 1] + 1,
                             [=](const BVHPrimitiveInfo &pi) 
                             {
-                                int b = nBuckets *
-                                        centroidBounds.Offset(pi.centroid)[dim];
-                                if (b == nBuckets) b = nBuckets - 1;
-
-                                CHECK_GE(b, 0);
-                                CHECK_LT(b, nBuckets);
-
-                                return b <= minCostSplitBucket;
+                                return SAHBucket(pi, centroidBounds, dim,
+                                                 nBuckets) <= minCostSplitBucket;
                             });
                         mid = pmid - &primitiveInfo[0];
                     } 
                     else 
                     {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
+                        int firstPrimOffset = start;
                         for (int i = start; i < end; ++i) {
                             int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            orderedPrims[i] = primitives[primNum];
                         }
                         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
                         return node;
@@ -488,11 +920,215 @@ BVHBuildNode *BVHAccel::recursiveBuild(
             
             node->InitInterior(dim,
                                recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
+                                              totalNodes, orderedPrims,
+                                              deferredTasks),
                                recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+                                              totalNodes, orderedPrims,
+                                              deferredTasks));
+        }
+    }
+    return node;
+}
+
+// SBVH Construction
+// _refs_ holds references to primitives along with their bounds clipped to
+// the part of space the node covers.  Besides the usual SAH object splits,
+// spatial splits are tried when the object split's children overlap; they
+// split space with a plane and reference straddling primitives from both
+// children, each with its bounds clipped to its side.
+static PBRT_CONSTEXPR Float sbvhOverlapThreshold = 1e-5f;
+static PBRT_CONSTEXPR int sbvhSpatialBins = 16;
+static PBRT_CONSTEXPR int sbvhMaxSpatialSplitDepth = 48;
+
+inline bool IsEmpty(const Bounds3f &b) {
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+BVHBuildNode *BVHAccel::sbvhBuild(
+    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &refs, int depth,
+    Float rootArea, int *totalNodes,
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims, int *splitBudget) {
+    CHECK(!refs.empty());
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    int nRefs = refs.size();
+    Bounds3f bounds, centroidBounds;
+    ComputeRangeBounds(refs, 0, nRefs, &bounds, &centroidBounds);
+
+    auto makeLeaf = [&]() {
+        int firstPrimOffset = orderedPrims.size();
+        for (const BVHPrimitiveInfo &ref : refs)
+            orderedPrims.push_back(primitives[ref.primitiveNumber]);
+        node->InitLeaf(firstPrimOffset, nRefs, bounds);
+        return node;
+    };
+    if (nRefs == 1) return makeLeaf();
+
+    // Find the best SAH object split along the longest centroid axis
+    PBRT_CONSTEXPR int nBuckets = 12;
+    int objectDim = centroidBounds.MaximumExtent();
+    Float objectCost = Infinity;
+    int objectSplitBucket = -1;
+    Bounds3f objectChildBounds[2];
+    if (centroidBounds.pMax[objectDim] > centroidBounds.pMin[objectDim]) {
+        BucketInfo buckets[nBuckets];
+        ComputeSAHBuckets(refs, 0, nRefs, centroidBounds, objectDim, buckets,
+                          nBuckets);
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            Bounds3f b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = Union(b1, buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+            if (count0 == 0 || count1 == 0) continue;
+            Float cost = 1 + (count0 * b0.SurfaceArea() +
+                              count1 * b1.SurfaceArea()) /
+                                 bounds.SurfaceArea();
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectSplitBucket = i;
+                objectChildBounds[0] = b0;
+                objectChildBounds[1] = b1;
+            }
+        }
+    }
+
+    // Look for a better spatial split if the object split's children
+    // overlap significantly
+    Float spatialCost = Infinity;
+    int spatialDim = -1;
+    Float spatialPlane = 0;
+    Bounds3f overlap =
+        pbrt::Intersect(objectChildBounds[0], objectChildBounds[1]);
+    bool overlaps = objectSplitBucket == -1 ||
+                    (!IsEmpty(overlap) &&
+                     overlap.SurfaceArea() > sbvhOverlapThreshold * rootArea);
+    if (*splitBudget > 0 && depth < sbvhMaxSpatialSplitDepth && overlaps) {
+        for (int dim = 0; dim < 3; ++dim) {
+            Float lo = bounds.pMin[dim], hi = bounds.pMax[dim];
+            if (!(hi > lo)) continue;
+            auto binEdge = [&](int i) {
+                return i == sbvhSpatialBins
+                           ? hi
+                           : lo + (hi - lo) * i / sbvhSpatialBins;
+            };
+            auto binIndex = [&](Float v) {
+                return Clamp(int((v - lo) / (hi - lo) * sbvhSpatialBins), 0,
+                             sbvhSpatialBins - 1);
+            };
+
+            // Chop each reference into the bins that it overlaps
+            Bounds3f binBounds[sbvhSpatialBins];
+            int entries[sbvhSpatialBins] = {0}, exits[sbvhSpatialBins] = {0};
+            for (const BVHPrimitiveInfo &ref : refs) {
+                int first = binIndex(ref.bounds.pMin[dim]);
+                int last = std::max(first, binIndex(ref.bounds.pMax[dim]));
+                const Primitive *prim = primitives[ref.primitiveNumber].get();
+                for (int b = first; b <= last; ++b) {
+                    Bounds3f slab = ref.bounds;
+                    if (b > first) slab.pMin[dim] = binEdge(b);
+                    if (b < last) slab.pMax[dim] = binEdge(b + 1);
+                    Bounds3f chopped = first == last
+                                           ? ref.bounds
+                                           : prim->ClippedWorldBound(slab);
+                    if (!IsEmpty(chopped))
+                        binBounds[b] = Union(binBounds[b], chopped);
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+
+            // Evaluate the SAH cost of splitting at each bin boundary
+            for (int i = 1; i < sbvhSpatialBins; ++i) {
+                Bounds3f b0, b1;
+                int count0 = 0, count1 = 0;
+                for (int j = 0; j < i; ++j) {
+                    b0 = Union(b0, binBounds[j]);
+                    count0 += entries[j];
+                }
+                for (int j = i; j < sbvhSpatialBins; ++j) {
+                    b1 = Union(b1, binBounds[j]);
+                    count1 += exits[j];
+                }
+                // Require both children to make progress
+                if (count0 == 0 || count1 == 0 || count0 == nRefs ||
+                    count1 == nRefs)
+                    continue;
+                Float cost = 1 + (count0 * b0.SurfaceArea() +
+                                  count1 * b1.SurfaceArea()) /
+                                     bounds.SurfaceArea();
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialDim = dim;
+                    spatialPlane = binEdge(i);
+                }
+            }
+        }
+    }
+
+    // Create a leaf if no split is worthwhile
+    Float leafCost = nRefs;
+    Float minCost = std::min(objectCost, spatialCost);
+    if (minCost == Infinity || (nRefs <= maxPrimsInNode && minCost >= leafCost))
+        return makeLeaf();
+
+    // Partition the references between the two children
+    std::vector<BVHPrimitiveInfo> left, right;
+    int dim = objectDim;
+    if (spatialCost < objectCost) {
+        for (const BVHPrimitiveInfo &ref : refs) {
+            if (ref.bounds.pMax[spatialDim] <= spatialPlane)
+                left.push_back(ref);
+            else if (ref.bounds.pMin[spatialDim] >= spatialPlane)
+                right.push_back(ref);
+            else {
+                // Clip straddling references to each side, referencing the
+                // primitive twice only if it really extends into both
+                const Primitive *prim = primitives[ref.primitiveNumber].get();
+                Bounds3f b0 = ref.bounds, b1 = ref.bounds;
+                b0.pMax[spatialDim] = spatialPlane;
+                b1.pMin[spatialDim] = spatialPlane;
+                b0 = prim->ClippedWorldBound(b0);
+                b1 = prim->ClippedWorldBound(b1);
+                if (!IsEmpty(b0))
+                    left.push_back(BVHPrimitiveInfo(ref.primitiveNumber, b0));
+                if (!IsEmpty(b1))
+                    right.push_back(BVHPrimitiveInfo(ref.primitiveNumber, b1));
+                if (IsEmpty(b0) && IsEmpty(b1)) left.push_back(ref);
+            }
+        }
+        int nDuplicated = int(left.size() + right.size()) - nRefs;
+        if (nDuplicated <= *splitBudget && !left.empty() && !right.empty()) {
+            *splitBudget -= nDuplicated;
+            duplicatedReferences += nDuplicated;
+            ++spatialSplits;
+            dim = spatialDim;
+        } else {
+            // Over budget: fall back to the object split, if there is one
+            left.clear();
+            right.clear();
+            if (objectSplitBucket == -1) return makeLeaf();
+        }
+    }
+    if (left.empty()) {
+        for (const BVHPrimitiveInfo &ref : refs) {
+            int b = SAHBucket(ref, centroidBounds, objectDim, nBuckets);
+            (b <= objectSplitBucket ? left : right).push_back(ref);
         }
     }
+
+    // Free this node's references before building the children, left first
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+    BVHBuildNode *c0 = sbvhBuild(arena, left, depth + 1, rootArea, totalNodes,
+                                 orderedPrims, splitBudget);
+    BVHBuildNode *c1 = sbvhBuild(arena, right, depth + 1, rootArea, totalNodes,
+                                 orderedPrims, splitBudget);
+    node->InitInterior(dim, c0, c1);
     return node;
 }
 
@@ -501,13 +1137,15 @@ BVHBuildNode *BVHAccel::recursiveBuild(
 #pragma region HLBVH
 
 BVHBuildNode *BVHAccel::HLBVHBuild(
-    MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    int *totalNodes,
+    std::vector<MemoryArena> &arenas,
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
     std::vector<std::shared_ptr<Primitive>> &orderedPrims) const {
+    MemoryArena &arena = arenas[ThreadIndex];
+    int nPrimitives = primitiveInfo.size();
+
     // Compute bounding box of all primitive centroids
-    Bounds3f bounds;
-    for (const BVHPrimitiveInfo &pi : primitiveInfo)
-        bounds = Union(bounds, pi.centroid);
+    Bounds3f primBounds, bounds;
+    ComputeRangeBounds(primitiveInfo, 0, nPrimitives, &primBounds, &bounds);
 
     // Compute Morton indices of primitives
     std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
@@ -525,43 +1163,62 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
 
     // Create LBVH treelets at bottom of BVH
 
-    // Find intervals of primitives for each treelet
-    std::vector<LBVHTreelet> treeletsToBuild;
-    for (int start = 0, end = 1; end <= (int)mortonPrims.size(); ++end) {
+    // Find intervals of primitives for each treelet; a treelet starts
+    // wherever the high 12 bits of the Morton codes change
 #ifdef PBRT_HAVE_BINARY_CONSTANTS
-      uint32_t mask = 0b00111111111111000000000000000000;
+    const uint32_t mask = 0b00111111111111000000000000000000;
 #else
-      uint32_t mask = 0x3ffc0000;
+    const uint32_t mask = 0x3ffc0000;
 #endif
-      if (end == (int)mortonPrims.size() ||
-            ((mortonPrims[start].mortonCode & mask) !=
-             (mortonPrims[end].mortonCode & mask))) {
-            // Add entry to _treeletsToBuild_ for this treelet
-            int nPrimitives = end - start;
-            int maxBVHNodes = 2 * nPrimitives;
-            BVHBuildNode *nodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
-            treeletsToBuild.push_back({start, nPrimitives, nodes});
-            start = end;
-        }
+    auto startsTreelet = [&](int i) {
+        return i == 0 || ((mortonPrims[i - 1].mortonCode & mask) !=
+                          (mortonPrims[i].mortonCode & mask));
+    };
+    std::vector<int> treeletStarts;
+    if (nPrimitives > 4 * bvhParallelChunkSize) {
+        int nChunks =
+            (nPrimitives + bvhParallelChunkSize - 1) / bvhParallelChunkSize;
+        std::vector<std::vector<int>> chunkStarts(nChunks);
+        ParallelFor([&](int64_t c) {
+            int chunkEnd =
+                std::min<int>(nPrimitives, (c + 1) * bvhParallelChunkSize);
+            for (int i = c * bvhParallelChunkSize; i < chunkEnd; ++i)
+                if (startsTreelet(i)) chunkStarts[c].push_back(i);
+        }, nChunks);
+        for (const std::vector<int> &starts : chunkStarts)
+            treeletStarts.insert(treeletStarts.end(), starts.begin(),
+                                 starts.end());
+    } else
+        for (int i = 0; i < nPrimitives; ++i)
+            if (startsTreelet(i)) treeletStarts.push_back(i);
+
+    // Each treelet gets the build nodes at twice its starting index, which
+    // is the most nodes that the treelets before it can use
+    BVHBuildNode *buildNodes = arena.Alloc<BVHBuildNode>(2 * nPrimitives, false);
+    std::vector<LBVHTreelet> treeletsToBuild(treeletStarts.size());
+    for (size_t i = 0; i < treeletStarts.size(); ++i) {
+        int start = treeletStarts[i];
+        int end = i + 1 < treeletStarts.size() ? treeletStarts[i + 1]
+                                               : nPrimitives;
+        treeletsToBuild[i] = {start, end - start, &buildNodes[2 * start]};
     }
 
     // Create LBVHs for treelets in parallel
-    std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
+    std::vector<int> treeletNodes(treeletsToBuild.size(), 0);
     orderedPrims.resize(primitives.size());
     ParallelFor([&](int i) 
     {
         // Generate _i_th LBVH treelet
-        int nodesCreated = 0;
         const int firstBitIndex = 29 - 12;
         LBVHTreelet &tr = treeletsToBuild[i];
 
         tr.buildNodes =
             emitLBVH(tr.buildNodes, primitiveInfo, &mortonPrims[tr.startIndex],
-                     tr.nPrimitives, &nodesCreated, orderedPrims,
-                     &orderedPrimsOffset, firstBitIndex);
-        atomicTotal += nodesCreated;
+                     tr.nPrimitives, &treeletNodes[i], orderedPrims,
+                     mortonPrims.data(), firstBitIndex);
     }, treeletsToBuild.size());
-    *totalNodes = atomicTotal;
+    *totalNodes = 0;
+    for (int n : treeletNodes) *totalNodes += n;
 
     // Create and return SAH BVH from LBVH treelets
     std::vector<BVHBuildNode *> finishedTreelets;
@@ -570,8 +1227,24 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
     for (LBVHTreelet &treelet : treeletsToBuild)
         finishedTreelets.push_back(treelet.buildNodes);
 
-    return buildUpperSAH(arena, finishedTreelets, 0, finishedTreelets.size(),
-                         totalNodes);
+    if (finishedTreelets.size() <= 4 * upperSAHTaskTreelets)
+        return buildUpperSAH(arena, finishedTreelets, 0,
+                             finishedTreelets.size(), totalNodes);
+
+    // Build the top of the upper tree, then its deferred subtrees in
+    // parallel
+    std::vector<BVHBuildTask> tasks;
+    BVHBuildNode *root = buildUpperSAH(arena, finishedTreelets, 0,
+                                       finishedTreelets.size(), totalNodes,
+                                       &tasks);
+    std::vector<int> taskNodes(tasks.size(), 0);
+    ParallelFor([&](int64_t i) {
+        const BVHBuildTask &task = tasks[i];
+        *task.node = *buildUpperSAH(arenas[ThreadIndex], finishedTreelets,
+                                    task.start, task.end, &taskNodes[i]);
+    }, tasks.size());
+    for (int n : taskNodes) *totalNodes += n;
+    return root;
 }
 
 BVHBuildNode *BVHAccel::emitLBVH(
@@ -579,14 +1252,16 @@ BVHBuildNode *BVHAccel::emitLBVH(
     const std::vector<BVHPrimitiveInfo> &primitiveInfo,
     MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
     std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-    std::atomic<int> *orderedPrimsOffset, int bitIndex) const {
+    const MortonPrimitive *firstMortonPrim, int bitIndex) const {
     CHECK_GT(nPrimitives, 0);
     if (bitIndex == -1 || nPrimitives < maxPrimsInNode) {
         // Create and return leaf node of LBVH treelet
         (*totalNodes)++;
         BVHBuildNode *node = buildNodes++;
         Bounds3f bounds;
-        int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
+        // Leaves keep the primitives in Morton order, wherever the
+        // treelet is built
+        int firstPrimOffset = mortonPrims - firstMortonPrim;
         for (int i = 0; i < nPrimitives; ++i) {
             int primitiveIndex = mortonPrims[i].primitiveIndex;
             orderedPrims[firstPrimOffset + i] = primitives[primitiveIndex];
@@ -600,7 +1275,7 @@ BVHBuildNode *BVHAccel::emitLBVH(
         if ((mortonPrims[0].mortonCode & mask) ==
             (mortonPrims[nPrimitives - 1].mortonCode & mask))
             return emitLBVH(buildNodes, primitiveInfo, mortonPrims, nPrimitives,
-                            totalNodes, orderedPrims, orderedPrimsOffset,
+                            totalNodes, orderedPrims, firstMortonPrim,
                             bitIndex - 1);
 
         // Find LBVH split point for this dimension
@@ -627,25 +1302,23 @@ BVHBuildNode *BVHAccel::emitLBVH(
         BVHBuildNode *node = buildNodes++;
         BVHBuildNode *lbvh[2] = {
             emitLBVH(buildNodes, primitiveInfo, mortonPrims, splitOffset,
-                     totalNodes, orderedPrims, orderedPrimsOffset,
+                     totalNodes, orderedPrims, firstMortonPrim,
                      bitIndex - 1),
             emitLBVH(buildNodes, primitiveInfo, &mortonPrims[splitOffset],
                      nPrimitives - splitOffset, totalNodes, orderedPrims,
-                     orderedPrimsOffset, bitIndex - 1)};
+                     firstMortonPrim, bitIndex - 1)};
         int axis = bitIndex % 3;
         node->InitInterior(axis, lbvh[0], lbvh[1]);
         return node;
     }
 }
 
-BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
-                                      std::vector<BVHBuildNode *> &treeletRoots,
-                                      int start, int end,
-                                      int *totalNodes) const {
+BVHBuildNode *BVHAccel::buildUpperSAH(
+    MemoryArena &arena, std::vector<BVHBuildNode *> &treeletRoots, int start,
+    int end, int *totalNodes, std::vector<BVHBuildTask> *deferredTasks) const {
     CHECK_LT(start, end);
     int nNodes = end - start;
     if (nNodes == 1) return treeletRoots[start];
-    (*totalNodes)++;
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
 
     // Compute bounds of all nodes under this HLBVH node
@@ -653,6 +1326,14 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     for (int i = start; i < end; ++i)
         bounds = Union(bounds, treeletRoots[i]->bounds);
 
+    if (deferredTasks && nNodes <= upperSAHTaskTreelets) {
+        // Leave the subtree to a parallel task, as in recursiveBuild()
+        node->bounds = bounds;
+        deferredTasks->push_back({node, start, end});
+        return node;
+    }
+    (*totalNodes)++;
+
     // Compute bound of HLBVH node centroids, choose split dimension _dim_
     Bounds3f centroidBounds;
     for (int i = start; i < end; ++i) {
@@ -734,14 +1415,168 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     int mid = pmid - &treeletRoots[0];
     CHECK_GT(mid, start);
     CHECK_LT(mid, end);
-    node->InitInterior(
-        dim, this->buildUpperSAH(arena, treeletRoots, start, mid, totalNodes),
-        this->buildUpperSAH(arena, treeletRoots, mid, end, totalNodes));
+    node->InitInterior(dim,
+                       this->buildUpperSAH(arena, treeletRoots, start, mid,
+                                           totalNodes, deferredTasks),
+                       this->buildUpperSAH(arena, treeletRoots, mid, end,
+                                           totalNodes, deferredTasks));
     return node;
 }
 
 #pragma endregion
 
+// Treelet restructuring (Karras and Aila 2013): each interior node in
+// turn, bottom-up, is taken as the root of a treelet of up to
+// _treeletLeaves_ subtrees, and the treelet's topology is replaced with
+// the one of lowest SAH cost, found by dynamic programming over the
+// subsets of its leaves.  Leaves of the BVH are never split or merged.
+static PBRT_CONSTEXPR int treeletLeaves = 7;
+
+struct Treelet {
+    BVHBuildNode *leaves[treeletLeaves];
+    BVHBuildNode *interior[treeletLeaves - 2];
+    int nLeaves = 0, nInterior = 0;
+    // Lowest cost of a subtree over each subset of the leaves, and the
+    // subset that goes to its first child
+    Float cost[1 << treeletLeaves];
+    int partition[1 << treeletLeaves];
+};
+
+static BVHBuildNode *EmitTreelet(Treelet &treelet, int subset,
+                                 BVHBuildNode *node) {
+    if ((subset & (subset - 1)) == 0) {
+        int leaf = 0;
+        while (!(subset & (1 << leaf))) ++leaf;
+        return treelet.leaves[leaf];
+    }
+    if (!node) node = treelet.interior[treelet.nInterior++];
+    int p = treelet.partition[subset];
+    BVHBuildNode *c0 = EmitTreelet(treelet, p, nullptr);
+    BVHBuildNode *c1 = EmitTreelet(treelet, subset ^ p, nullptr);
+
+    // Split along the axis that best separates the children, with the
+    // lower one first, as the traversal expects
+    Vector3f d = (c1->bounds.pMin - c0->bounds.pMin) +
+                 (c1->bounds.pMax - c0->bounds.pMax);
+    int axis = MaxDimension(Abs(d));
+    if (d[axis] < 0) std::swap(c0, c1);
+    node->children[0] = c0;
+    node->children[1] = c1;
+    node->bounds = Union(c0->bounds, c1->bounds);
+    node->splitAxis = axis;
+    node->cost = treelet.cost[subset];
+    return node;
+}
+
+static void RestructureTreelet(BVHBuildNode *root) {
+    // Grow the treelet by expanding the leaf with the largest surface area
+    Treelet treelet;
+    treelet.leaves[treelet.nLeaves++] = root->children[0];
+    treelet.leaves[treelet.nLeaves++] = root->children[1];
+    while (treelet.nLeaves < treeletLeaves) {
+        int expand = -1;
+        Float maxArea = -1;
+        for (int i = 0; i < treelet.nLeaves; ++i) {
+            const BVHBuildNode *leaf = treelet.leaves[i];
+            if (leaf->nPrimitives == 0 && leaf->bounds.SurfaceArea() > maxArea) {
+                expand = i;
+                maxArea = leaf->bounds.SurfaceArea();
+            }
+        }
+        if (expand == -1) break;
+        BVHBuildNode *node = treelet.leaves[expand];
+        treelet.interior[treelet.nInterior++] = node;
+        treelet.leaves[expand] = node->children[0];
+        treelet.leaves[treelet.nLeaves++] = node->children[1];
+    }
+    if (treelet.nLeaves < 3) return;
+
+    // Find the best topology for each subset; a subset's own subsets are
+    // smaller numbers, so they have already been handled
+    int nSubsets = 1 << treelet.nLeaves;
+    for (int s = 1; s < nSubsets; ++s) {
+        if ((s & (s - 1)) == 0) {
+            int leaf = 0;
+            while (!(s & (1 << leaf))) ++leaf;
+            treelet.cost[s] = treelet.leaves[leaf]->cost;
+            continue;
+        }
+        Bounds3f b;
+        for (int i = 0; i < treelet.nLeaves; ++i)
+            if (s & (1 << i)) b = Union(b, treelet.leaves[i]->bounds);
+        // Only consider partitions with the lowest leaf in the first
+        // subset, since the others are the same with the children swapped
+        int lowest = s & -s;
+        Float minCost = Infinity;
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+            if (!(p & lowest)) continue;
+            Float c = treelet.cost[p] + treelet.cost[s ^ p];
+            if (c < minCost) {
+                minCost = c;
+                treelet.partition[s] = p;
+            }
+        }
+        treelet.cost[s] = b.SurfaceArea() + minCost;
+    }
+
+    // Keep the current topology unless the new one is meaningfully better
+    if (treelet.cost[nSubsets - 1] >= (1 - 1e-4f) * root->cost) return;
+    ++nTreeletsRestructured;
+    treelet.nInterior = 0;
+    EmitTreelet(treelet, nSubsets - 1, root);
+}
+
+// Restructures the subtree at _node_ bottom-up, updating the nodes'
+// costs; subtrees in _done_ have already been restructured
+static void RestructureSubtree(BVHBuildNode *node,
+                               const std::unordered_set<BVHBuildNode *> &done) {
+    Float area = node->bounds.SurfaceArea();
+    if (node->nPrimitives > 0) {
+        node->cost = node->nPrimitives * area;
+        return;
+    }
+    if (done.count(node)) return;
+    for (BVHBuildNode *child : node->children) RestructureSubtree(child, done);
+    node->cost = area + node->children[0]->cost + node->children[1]->cost;
+    RestructureTreelet(node);
+}
+
+// Finds the largest subtrees of at most _bvhTaskPrimitives_ primitives,
+// which are restructured independently; returns the number of primitives
+// under _node_
+static int CollectTreeletTasks(BVHBuildNode *node,
+                               std::vector<BVHBuildNode *> *tasks) {
+    if (node->nPrimitives > 0) return node->nPrimitives;
+    int n0 = CollectTreeletTasks(node->children[0], tasks);
+    int n1 = CollectTreeletTasks(node->children[1], tasks);
+    if (n0 + n1 > bvhTaskPrimitives) {
+        if (n0 <= bvhTaskPrimitives) tasks->push_back(node->children[0]);
+        if (n1 <= bvhTaskPrimitives) tasks->push_back(node->children[1]);
+    }
+    return n0 + n1;
+}
+
+// Runs _rounds_ passes of treelet restructuring over the tree at _root_.
+// The independent subtrees are handled in parallel, then the nodes above
+// them; since the subtrees don't depend on the number of threads, neither
+// does the result.
+static void RestructureTreelets(BVHBuildNode *root, int rounds) {
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<BVHBuildNode *> tasks;
+        int nPrimitives = CollectTreeletTasks(root, &tasks);
+        std::unordered_set<BVHBuildNode *> done;
+        auto restructure = [&](int64_t i) {
+            RestructureSubtree(tasks[i], done);
+        };
+        if (nPrimitives > 4 * bvhTaskPrimitives)
+            ParallelFor(restructure, tasks.size());
+        else
+            for (size_t i = 0; i < tasks.size(); ++i) restructure(i);
+        done.insert(tasks.begin(), tasks.end());
+        RestructureSubtree(root, done);
+    }
+}
+
 // ״ BVH ȱʾΪڴеԽṹο Figure 4.13offset Ի
 int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) 
 {
@@ -758,12 +1593,16 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset)
 
         linearNode->primitivesOffset = node->firstPrimOffset;
         linearNode->nPrimitives = node->nPrimitives;
+        linearNode->occludeSecondFirst = 0;
     } 
     else // мڵ
     {
         // Create interior flattened BVH node
         linearNode->axis = node->splitAxis;
         linearNode->nPrimitives = 0;
+        linearNode->occludeSecondFirst =
+            node->children[1]->bounds.SurfaceArea() >
+            node->children[0]->bounds.SurfaceArea();
 
         // ȱ
         //  ͨƫ
@@ -775,18 +1614,323 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset)
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+// Quantizes the children of flattened node _nodeIndex_ relative to
+// _bounds_, the decoded bounds of the node itself
+void BVHAccel::compressBVHTree(int nodeIndex, const Bounds3f &bounds) {
+    const LinearBVHNode &node = nodes[nodeIndex];
+    CompressedBVHNode &cnode = compressedNodes[nodeIndex];
+    if (node.nPrimitives > 0) {
+        cnode.nPrimitives = node.nPrimitives;
+        cnode.info = 0x80000000u | uint32_t(node.primitivesOffset);
+        return;
+    }
+    int children[2] = {nodeIndex + 1, node.secondChildOffset};
+    for (int c = 0; c < 2; ++c) {
+        const Bounds3f &b = nodes[children[c]].bounds;
+        for (int a = 0; a < 3; ++a) {
+            cnode.childBounds[c][0][a] =
+                QuantizeMin(b.pMin[a], bounds.pMin[a], bounds.pMax[a]);
+            cnode.childBounds[c][1][a] =
+                QuantizeMax(b.pMax[a], bounds.pMin[a], bounds.pMax[a]);
+        }
+    }
+    cnode.info = (uint32_t(node.axis) << 29) | uint32_t(node.secondChildOffset);
+    for (int c = 0; c < 2; ++c)
+        compressBVHTree(children[c], DecodeChildBounds(cnode, c, bounds));
+}
+
+// Restores flattened node _nodeIndex_ from the compressed tree, given its
+// decoded _bounds_
+void BVHAccel::decompressBVHTree(int nodeIndex, const Bounds3f &bounds) {
+    const CompressedBVHNode &cnode = compressedNodes[nodeIndex];
+    LinearBVHNode &node = nodes[nodeIndex];
+    node.bounds = bounds;
+    if (cnode.IsLeaf()) {
+        node.primitivesOffset = cnode.PrimitivesOffset();
+        node.nPrimitives = cnode.nPrimitives;
+        return;
+    }
+    node.secondChildOffset = cnode.SecondChildOffset();
+    node.nPrimitives = 0;
+    node.axis = cnode.Axis();
+    for (int c = 0; c < 2; ++c)
+        decompressBVHTree(c == 0 ? nodeIndex + 1 : node.secondChildOffset,
+                          DecodeChildBounds(cnode, c, bounds));
+}
+
+// Computes the SAH cost of each node's subtree, relative to the surface
+// area of the node, with the same unit costs as the SAH build
+void BVHAccel::computeSAHCosts(std::vector<Float> *cost) const {
+    cost->resize(totalNodes);
+    // Children are always stored after their parent
+    for (int i = totalNodes - 1; i >= 0; --i) {
+        const LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0) {
+            (*cost)[i] = node.nPrimitives;
+            continue;
+        }
+        int second = node.secondChildOffset;
+        Float area = node.bounds.SurfaceArea();
+        if (area > 0)
+            (*cost)[i] = 1 + ((*cost)[i + 1] * nodes[i + 1].bounds.SurfaceArea() +
+                              (*cost)[second] * nodes[second].bounds.SurfaceArea()) /
+                                 area;
+        else
+            (*cost)[i] = 1 + (*cost)[i + 1] + (*cost)[second];
+    }
+}
+
+void BVHAccel::Refit() {
+    ProfilePhase _(Prof::AccelConstruction);
+    if (primitives.empty()) return;
+    ++nRefits;
+
+    // Compressed trees are refit through a temporary flattened copy
+    if (compressedNodes) {
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        decompressBVHTree(0, compressedRootBounds);
+        compressedTreeBytes -= totalNodes * sizeof(CompressedBVHNode);
+    }
+
+    // The node bounds still describe the tree as it was before the
+    // primitives moved; take them as the reference costs the first time
+    if (refitBaseCosts.empty()) {
+        computeSAHCosts(&refitBaseCosts);
+        refitRootCost = refitBaseCosts[0];
+    }
+
+    // Nested aggregates, such as object instances, are brought up to date
+    // before their bounds are used
+    RefitPrimitives(primitives);
+
+    // Update the leaves' bounds, then the interior nodes' bottom-up
+    auto refitLeaf = [&](int64_t i) {
+        LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives == 0) return;
+        Bounds3f b;
+        for (int j = 0; j < node.nPrimitives; ++j)
+            b = Union(b, primitives[node.primitivesOffset + j]->WorldBound());
+        node.bounds = b;
+    };
+    if (totalNodes > 4 * bvhParallelChunkSize)
+        ParallelFor(refitLeaf, totalNodes, 1024);
+    else
+        for (int i = 0; i < totalNodes; ++i) refitLeaf(i);
+    for (int i = totalNodes - 1; i >= 0; --i) {
+        LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0) continue;
+        const Bounds3f &b0 = nodes[i + 1].bounds;
+        const Bounds3f &b1 = nodes[node.secondChildOffset].bounds;
+        node.bounds = Union(b0, b1);
+        node.occludeSecondFirst = b1.SurfaceArea() > b0.SurfaceArea();
+    }
+
+    // Rebuild the whole tree if its cost has grown too much
+    std::vector<Float> costs;
+    computeSAHCosts(&costs);
+    if (costs[0] > maxRefitCost * refitRootCost) {
+        ++nRefitFullRebuilds;
+        rebuild();
+        return;
+    }
+
+    // Otherwise rebuild the topmost subtrees whose cost has grown too much
+    // relative to what it was when they were built
+    std::vector<char> rebuildNode(totalNodes, 0);
+    bool rebuildAny = false;
+    std::vector<int> todo(1, 0);
+    while (!todo.empty()) {
+        int i = todo.back();
+        todo.pop_back();
+        if (nodes[i].nPrimitives > 0) continue;
+        if (costs[i] > maxRefitCost * refitBaseCosts[i]) {
+            rebuildNode[i] = rebuildAny = true;
+            ++nRefitSubtreeRebuilds;
+        } else {
+            todo.push_back(nodes[i].secondChildOffset);
+            todo.push_back(i + 1);
+        }
+    }
+    if (rebuildAny) rebuildSubtrees(rebuildNode);
+    initTriangleLeaves();
+    if (compressNodes) compressTree();
+}
+
+// Builds the tree again from scratch, for when refitting isn't enough
+void BVHAccel::rebuild() {
+    treeBytes -= totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
+                 primitives.size() * sizeof(primitives[0]);
+    if (splitMethod == SplitMethod::SBVH) {
+        // Drop the duplicate references made by spatial splits
+        std::unordered_set<const Primitive *> seen;
+        std::vector<std::shared_ptr<Primitive>> unique;
+        for (const std::shared_ptr<Primitive> &p : primitives)
+            if (seen.insert(p.get()).second) unique.push_back(p);
+        primitives.swap(unique);
+    }
+    freeNodes();
+    FreeAligned(compressedNodes);
+    compressedNodes = nullptr;
+    refitBaseCosts.clear();
+    build();
+    initTriangleLeaves();
+    if (compressNodes) compressTree();
+}
+
+// Replaces the subtrees flagged in _rebuild_ with newly built ones
+void BVHAccel::rebuildSubtrees(const std::vector<char> &rebuild) {
+    MemoryArena arena(1024 * 1024);
+    int newTotalNodes = 0;
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    BVHBuildNode *root =
+        unflattenBVHTree(arena, 0, rebuild, &newTotalNodes, orderedPrims);
+    primitives.swap(orderedPrims);
+
+    // Keep the topology of the old tree to match its nodes' reference
+    // costs with the new tree's nodes
+    std::vector<int> oldSecondChild(totalNodes, -1);
+    for (int i = 0; i < totalNodes; ++i)
+        if (nodes[i].nPrimitives == 0)
+            oldSecondChild[i] = nodes[i].secondChildOffset;
+
+    freeNodes();
+    treeBytes += (int64_t(newTotalNodes) - totalNodes) *
+                 int64_t(sizeof(LinearBVHNode));
+    totalNodes = newTotalNodes;
+    nodes = AllocAligned<LinearBVHNode>(totalNodes);
+    int offset = 0;
+    flattenBVHTree(root, &offset);
+    CHECK_EQ(totalNodes, offset);
+
+    // Later refits measure the new subtrees against their current cost,
+    // and the nodes that were kept against the costs they had before
+    std::vector<Float> costs, baseCosts(totalNodes);
+    computeSAHCosts(&costs);
+    struct NodePair {
+        int oldIndex, newIndex;  // _oldIndex_ is -1 in rebuilt subtrees
+    };
+    std::vector<NodePair> todo(1, {0, 0});
+    while (!todo.empty()) {
+        NodePair n = todo.back();
+        todo.pop_back();
+        if (n.oldIndex >= 0 && rebuild[n.oldIndex]) n.oldIndex = -1;
+        baseCosts[n.newIndex] =
+            n.oldIndex >= 0 ? refitBaseCosts[n.oldIndex] : costs[n.newIndex];
+        const LinearBVHNode &node = nodes[n.newIndex];
+        if (node.nPrimitives > 0) continue;
+        bool kept = n.oldIndex >= 0;
+        todo.push_back({kept ? n.oldIndex + 1 : -1, n.newIndex + 1});
+        todo.push_back({kept ? oldSecondChild[n.oldIndex] : -1,
+                        node.secondChildOffset});
+    }
+    refitBaseCosts.swap(baseCosts);
+}
+
+static void OffsetLeaves(BVHBuildNode *node, int offset) {
+    if (node->nPrimitives > 0)
+        node->firstPrimOffset += offset;
+    else
+        for (BVHBuildNode *child : node->children) OffsetLeaves(child, offset);
+}
+
+// Converts the subtree at flattened node _nodeIndex_ back to build nodes,
+// building the subtrees flagged in _rebuild_ anew.  Primitives are
+// appended to _orderedPrims_ in the order of the leaves.
+BVHBuildNode *BVHAccel::unflattenBVHTree(
+    MemoryArena &arena, int nodeIndex, const std::vector<char> &rebuild,
+    int *totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    const LinearBVHNode &linearNode = nodes[nodeIndex];
+    if (rebuild[nodeIndex]) {
+        // Gather the subtree's primitives and build a new subtree over them
+        std::vector<BVHPrimitiveInfo> primitiveInfo;
+        std::vector<int> todo(1, nodeIndex);
+        while (!todo.empty()) {
+            int i = todo.back();
+            todo.pop_back();
+            const LinearBVHNode &node = nodes[i];
+            if (node.nPrimitives == 0) {
+                todo.push_back(node.secondChildOffset);
+                todo.push_back(i + 1);
+                continue;
+            }
+            for (int j = 0; j < node.nPrimitives; ++j) {
+                size_t primNum = node.primitivesOffset + j;
+                primitiveInfo.push_back(
+                    {primNum, primitives[primNum]->WorldBound()});
+            }
+        }
+        std::vector<std::shared_ptr<Primitive>> subtreePrims(
+            primitiveInfo.size());
+        BVHBuildNode *subtree =
+            recursiveBuild(arena, primitiveInfo, 0, primitiveInfo.size(),
+                           totalNodes, subtreePrims);
+        OffsetLeaves(subtree, orderedPrims.size());
+        orderedPrims.insert(orderedPrims.end(), subtreePrims.begin(),
+                            subtreePrims.end());
+        return subtree;
+    }
+
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    if (linearNode.nPrimitives > 0) {
+        node->InitLeaf(orderedPrims.size(), linearNode.nPrimitives,
+                       linearNode.bounds);
+        for (int j = 0; j < linearNode.nPrimitives; ++j)
+            orderedPrims.push_back(primitives[linearNode.primitivesOffset + j]);
+    } else {
+        BVHBuildNode *c0 = unflattenBVHTree(arena, nodeIndex + 1, rebuild,
+                                            totalNodes, orderedPrims);
+        BVHBuildNode *c1 =
+            unflattenBVHTree(arena, linearNode.secondChildOffset, rebuild,
+                             totalNodes, orderedPrims);
+        node->InitInterior(linearNode.axis, c0, c1);
+    }
+    return node;
+}
+
+BVHAccel::~BVHAccel() {
+    freeNodes();
+    FreeAligned(compressedNodes);
+}
+
+// Leaves whose primitives are all plain triangles are intersected from a
+// copy of their vertices, a batch at a time, instead of through each
+// primitive; only the closest hit's primitive is then asked for its
+// _SurfaceInteraction_.
+void BVHAccel::initTriangleLeaves() {
+    packedTriangles.reset();
+    if (!triangleLeaves || compressNodes || !nodes) return;
+
+    std::vector<const Primitive *> prims;
+    for (const auto &p : primitives) prims.push_back(p.get());
+    packedTriangles.reset(new PackedTriangles(std::move(prims)));
+    for (int n = 0; n < totalNodes; ++n) {
+        LinearBVHNode &node = nodes[n];
+        if (node.nPrimitives == 0) continue;
+        ++nTriangleLeafCandidates;
+        node.triangleLeaf = true;
+        for (int i = 0; i < node.nPrimitives; ++i)
+            if (!packedTriangles->IsTriangle(node.primitivesOffset + i))
+                node.triangleLeaf = false;
+        if (node.triangleLeaf) ++nTriangleLeaves;
+    }
+}
 
 #pragma region
 
 // ҲԲ Figure4.13
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const 
 {
+    if (compressedNodes) return intersectCompressed(ray, isect);
     if (!nodes) 
         return false;
     ProfilePhase p(Prof::AccelIntersect);
 
     bool hit = false;
+    DeferredTriangleHit deferred;
+    TriangleBatchRay triRay;
+    if (packedTriangles) triRay = TriangleBatchRay(ray);
 
     //  BVH  ray-bounds intersect Ż 
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
@@ -806,10 +1950,18 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const
             if (node->nPrimitives > 0) // Ҷӽڵ
             {
                 // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->nPrimitives; ++i)
-                    if (primitives[node->primitivesOffset + i]->Intersect(
-                            ray, isect))
+                if (node->triangleLeaf) {
+                    if (packedTriangles->Intersect(node->primitivesOffset,
+                                                   node->nPrimitives, ray,
+                                                   triRay, isect, &deferred))
                         hit = true;
+                } else
+                    for (int i = 0; i < node->nPrimitives; ++i)
+                        if (primitives[node->primitivesOffset + i]->Intersect(
+                                ray, isect)) {
+                            hit = true;
+                            deferred.primitive = nullptr;
+                        }
 
                 if (toVisitOffset == 0) 
                     break;
@@ -840,32 +1992,48 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const
         }
     }
 
+    // Only now compute the closest triangle hit's _SurfaceInteraction_
+    deferred.Resolve(ray, isect);
     return hit;
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    const Primitive *occluder;
+    return FindOccluder(ray, &occluder);
+}
+
+bool BVHAccel::FindOccluder(const Ray &ray, const Primitive **occluder) const {
+    if (compressedNodes) return findOccluderCompressed(ray, occluder);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    TriangleBatchRay triRay;
+    if (packedTriangles) triRay = TriangleBatchRay(ray);
     int nodesToVisit[64];
     int toVisitOffset = 0, currentNodeIndex = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
         if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
             // Process BVH node _node_ for traversal
-            if (node->nPrimitives > 0) {
+            if (node->nPrimitives > 0 && node->triangleLeaf) {
+                *occluder = packedTriangles->FindOccluder(
+                    node->primitivesOffset, node->nPrimitives, ray, triRay);
+                if (*occluder) return true;
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else if (node->nPrimitives > 0) {
                 for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
+                    const Primitive *prim =
+                        primitives[node->primitivesOffset + i].get();
+                    if (prim->FindOccluder(ray, occluder)) {
                         return true; // ཻ
                     }
                 }
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
-                if (dirIsNeg[node->axis]) {
-                    /// second child first
+                if (node->occludeSecondFirst) {
                     nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
                     currentNodeIndex = node->secondChildOffset;
                 } else {
@@ -881,11 +2049,287 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
     return false;
 }
 
+// BVHAccel Ray Stream Traversal
+// Each node is fetched and tested once for all of the rays in the batch
+// that reach it.  The indices of the rays that are still active at each
+// node are kept in _active_; since nodes are visited depth-first, the ray
+// lists of the nodes on the stack always form a prefix of it.
+struct BVHStreamRay {
+    Vector3f invDir;
+    int dirIsNeg[3];
+    TriangleBatchRay triRay;  // only with _packedTriangles_
+};
+
+struct BVHStreamEntry {
+    int nodeIndex;
+    int begin, end;  // range of ray indices in _active_
+};
+
+void BVHAccel::IntersectBatch(const Ray *rays, int nRays,
+                              SurfaceInteraction *isects, bool *hits) const {
+    if (compressedNodes) {
+        Primitive::IntersectBatch(rays, nRays, isects, hits);
+        return;
+    }
+    for (int i = 0; i < nRays; ++i) hits[i] = false;
+    if (!nodes || nRays == 0) return;
+    ProfilePhase p(Prof::AccelIntersect);
+
+    std::vector<BVHStreamRay> streamRays(nRays);
+    std::vector<DeferredTriangleHit> deferred(nRays);
+    std::vector<int> active(nRays);
+    for (int i = 0; i < nRays; ++i) {
+        const Vector3f &d = rays[i].d;
+        streamRays[i].invDir = Vector3f(1 / d.x, 1 / d.y, 1 / d.z);
+        for (int a = 0; a < 3; ++a)
+            streamRays[i].dirIsNeg[a] = streamRays[i].invDir[a] < 0;
+        if (packedTriangles)
+            streamRays[i].triRay = TriangleBatchRay(rays[i]);
+        active[i] = i;
+    }
+
+    // Follow the rays through BVH nodes to find primitive intersections
+    BVHStreamEntry nodesToVisit[64];
+    int toVisitOffset = 0;
+    BVHStreamEntry current = {0, 0, nRays};
+    while (true) {
+        const LinearBVHNode *node = &nodes[current.nodeIndex];
+
+        // Gather the rays that hit _node_'s bounds, counting how many of
+        // them travel in the negative direction along its split axis
+        active.resize(current.end);
+        int begin = active.size(), nNeg = 0;
+        int axis = node->nPrimitives > 0 ? 0 : node->axis;
+        for (int i = current.begin; i < current.end; ++i) {
+            int r = active[i];
+            const BVHStreamRay &sr = streamRays[r];
+            if (node->bounds.IntersectP(rays[r], sr.invDir, sr.dirIsNeg)) {
+                active.push_back(r);
+                nNeg += sr.dirIsNeg[axis];
+            }
+        }
+        int end = active.size();
+
+        if (begin < end && node->nPrimitives > 0 && node->triangleLeaf) {
+            for (int j = begin; j < end; ++j) {
+                int r = active[j];
+                if (packedTriangles->Intersect(
+                        node->primitivesOffset, node->nPrimitives, rays[r],
+                        streamRays[r].triRay, &isects[r], &deferred[r]))
+                    hits[r] = true;
+            }
+        } else if (begin < end && node->nPrimitives > 0) {
+            // Intersect the active rays with the primitives in the leaf
+            for (int i = 0; i < node->nPrimitives; ++i) {
+                const Primitive *prim =
+                    primitives[node->primitivesOffset + i].get();
+                for (int j = begin; j < end; ++j)
+                    if (prim->Intersect(rays[active[j]], &isects[active[j]])) {
+                        hits[active[j]] = true;
+                        deferred[active[j]].primitive = nullptr;
+                    }
+            }
+        } else if (begin < end) {
+            // Visit first the child that most of the active rays reach first
+            if (2 * nNeg > end - begin) {
+                nodesToVisit[toVisitOffset++] = {current.nodeIndex + 1, begin,
+                                                 end};
+                current = {node->secondChildOffset, begin, end};
+            } else {
+                nodesToVisit[toVisitOffset++] = {node->secondChildOffset,
+                                                 begin, end};
+                current = {current.nodeIndex + 1, begin, end};
+            }
+            continue;
+        }
+        if (toVisitOffset == 0) break;
+        current = nodesToVisit[--toVisitOffset];
+    }
+    for (int i = 0; i < nRays; ++i) deferred[i].Resolve(rays[i], &isects[i]);
+}
+
+void BVHAccel::IntersectPBatch(const Ray *rays, int nRays, bool *hits) const {
+    if (compressedNodes) {
+        Primitive::IntersectPBatch(rays, nRays, hits);
+        return;
+    }
+    for (int i = 0; i < nRays; ++i) hits[i] = false;
+    if (!nodes || nRays == 0) return;
+    ProfilePhase p(Prof::AccelIntersectP);
+
+    std::vector<BVHStreamRay> streamRays(nRays);
+    std::vector<int> active(nRays);
+    for (int i = 0; i < nRays; ++i) {
+        const Vector3f &d = rays[i].d;
+        streamRays[i].invDir = Vector3f(1 / d.x, 1 / d.y, 1 / d.z);
+        for (int a = 0; a < 3; ++a)
+            streamRays[i].dirIsNeg[a] = streamRays[i].invDir[a] < 0;
+        if (packedTriangles)
+            streamRays[i].triRay = TriangleBatchRay(rays[i]);
+        active[i] = i;
+    }
+
+    // Rays drop out of the stream as soon as they are found to be occluded
+    int nOccluded = 0;
+    BVHStreamEntry nodesToVisit[64];
+    int toVisitOffset = 0;
+    BVHStreamEntry current = {0, 0, nRays};
+    while (true) {
+        const LinearBVHNode *node = &nodes[current.nodeIndex];
+        active.resize(current.end);
+        int begin = active.size(), nNeg = 0;
+        int axis = node->nPrimitives > 0 ? 0 : node->axis;
+        for (int i = current.begin; i < current.end; ++i) {
+            int r = active[i];
+            const BVHStreamRay &sr = streamRays[r];
+            if (!hits[r] &&
+                node->bounds.IntersectP(rays[r], sr.invDir, sr.dirIsNeg)) {
+                active.push_back(r);
+                nNeg += sr.dirIsNeg[axis];
+            }
+        }
+        int end = active.size();
+
+        if (begin < end && node->nPrimitives > 0 && node->triangleLeaf) {
+            for (int j = begin; j < end; ++j) {
+                int r = active[j];
+                if (!hits[r] && packedTriangles->FindOccluder(
+                                    node->primitivesOffset, node->nPrimitives,
+                                    rays[r], streamRays[r].triRay)) {
+                    hits[r] = true;
+                    ++nOccluded;
+                }
+            }
+            if (nOccluded == nRays) return;
+        } else if (begin < end && node->nPrimitives > 0) {
+            for (int i = 0; i < node->nPrimitives; ++i) {
+                const Primitive *prim =
+                    primitives[node->primitivesOffset + i].get();
+                for (int j = begin; j < end; ++j)
+                    if (!hits[active[j]] && prim->IntersectP(rays[active[j]])) {
+                        hits[active[j]] = true;
+                        ++nOccluded;
+                    }
+            }
+            if (nOccluded == nRays) return;
+        } else if (begin < end) {
+            if (2 * nNeg > end - begin) {
+                nodesToVisit[toVisitOffset++] = {current.nodeIndex + 1, begin,
+                                                 end};
+                current = {node->secondChildOffset, begin, end};
+            } else {
+                nodesToVisit[toVisitOffset++] = {node->secondChildOffset,
+                                                 begin, end};
+                current = {current.nodeIndex + 1, begin, end};
+            }
+            continue;
+        }
+        if (toVisitOffset == 0) break;
+        current = nodesToVisit[--toVisitOffset];
+    }
+}
+
+// Compressed BVH Traversal
+// Child bounds are decoded from their parent's bounds, so the stack
+// carries each pending node's decoded bounds along with its index.
+struct CompressedBVHStackEntry {
+    int nodeIndex;
+    Bounds3f bounds;
+};
+
+bool BVHAccel::intersectCompressed(const Ray &ray,
+                                   SurfaceInteraction *isect) const {
+    ProfilePhase p(Prof::AccelIntersect);
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    if (!compressedRootBounds.IntersectP(ray, invDir, dirIsNeg)) return false;
+
+    bool hit = false;
+    CompressedBVHStackEntry nodesToVisit[64];
+    int toVisitOffset = 0;
+    CompressedBVHStackEntry current = {0, compressedRootBounds};
+    while (true) {
+        const CompressedBVHNode &node = compressedNodes[current.nodeIndex];
+        if (node.IsLeaf()) {
+            for (int i = 0; i < node.nPrimitives; ++i)
+                if (primitives[node.PrimitivesOffset() + i]->Intersect(ray,
+                                                                      isect))
+                    hit = true;
+        } else {
+            // Test both children, advance to the near one that is hit
+            int children[2] = {current.nodeIndex + 1, node.SecondChildOffset()};
+            Bounds3f childBounds[2] = {DecodeChildBounds(node, 0, current.bounds),
+                                       DecodeChildBounds(node, 1, current.bounds)};
+            int nearChild = dirIsNeg[node.Axis()];
+            bool hitNear =
+                childBounds[nearChild].IntersectP(ray, invDir, dirIsNeg);
+            bool hitFar =
+                childBounds[1 - nearChild].IntersectP(ray, invDir, dirIsNeg);
+            if (hitNear && hitFar)
+                nodesToVisit[toVisitOffset++] = {children[1 - nearChild],
+                                                 childBounds[1 - nearChild]};
+            if (hitNear || hitFar) {
+                int c = hitNear ? nearChild : 1 - nearChild;
+                current = {children[c], childBounds[c]};
+                continue;
+            }
+        }
+
+        // Pop the next node, skipping those beyond the closest hit so far
+        do {
+            if (toVisitOffset == 0) return hit;
+            current = nodesToVisit[--toVisitOffset];
+        } while (hit && !current.bounds.IntersectP(ray, invDir, dirIsNeg));
+    }
+}
+
+bool BVHAccel::findOccluderCompressed(const Ray &ray,
+                                      const Primitive **occluder) const {
+    ProfilePhase p(Prof::AccelIntersectP);
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    if (!compressedRootBounds.IntersectP(ray, invDir, dirIsNeg)) return false;
+
+    CompressedBVHStackEntry nodesToVisit[64];
+    int toVisitOffset = 0;
+    CompressedBVHStackEntry current = {0, compressedRootBounds};
+    while (true) {
+        const CompressedBVHNode &node = compressedNodes[current.nodeIndex];
+        if (node.IsLeaf()) {
+            for (int i = 0; i < node.nPrimitives; ++i) {
+                const Primitive *prim =
+                    primitives[node.PrimitivesOffset() + i].get();
+                if (prim->FindOccluder(ray, occluder)) return true;
+            }
+        } else {
+            int children[2] = {current.nodeIndex + 1, node.SecondChildOffset()};
+            Bounds3f childBounds[2] = {DecodeChildBounds(node, 0, current.bounds),
+                                       DecodeChildBounds(node, 1, current.bounds)};
+            bool hit0 = childBounds[0].IntersectP(ray, invDir, dirIsNeg);
+            bool hit1 = childBounds[1].IntersectP(ray, invDir, dirIsNeg);
+            if (hit0 && hit1) {
+                // Visit the larger child first, as for uncompressed nodes
+                int first = childBounds[1].SurfaceArea() >
+                            childBounds[0].SurfaceArea();
+                nodesToVisit[toVisitOffset++] = {children[1 - first],
+                                                 childBounds[1 - first]};
+                current = {children[first], childBounds[first]};
+                continue;
+            }
+            if (hit0 || hit1) {
+                int c = hit0 ? 0 : 1;
+                current = {children[c], childBounds[c]};
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) return false;
+        current = nodesToVisit[--toVisitOffset];
+    }
+}
+
 #pragma endregion
 
-std::shared_ptr<BVHAccel> CreateBVHAccelerator(
-    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) 
-{
+BVHAccel::SplitMethod BVHSplitMethodFromParams(const ParamSet &ps) {
     std::string splitMethodName = ps.FindOneString("splitmethod", "sah");
 
     BVHAccel::SplitMethod splitMethod;
@@ -897,14 +2341,31 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
         splitMethod = BVHAccel::SplitMethod::Middle;
     else if (splitMethodName == "equal")
         splitMethod = BVHAccel::SplitMethod::EqualCounts;
+    else if (splitMethodName == "sbvh")
+        splitMethod = BVHAccel::SplitMethod::SBVH;
     else {
         Warning("BVH split method \"%s\" unknown.  Using \"sah\".",
                 splitMethodName.c_str());
         splitMethod = BVHAccel::SplitMethod::SAH; // Ĭʹ SAH 
     }
+    return splitMethod;
+}
 
+std::shared_ptr<BVHAccel> CreateBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) 
+{
+    BVHAccel::SplitMethod splitMethod = BVHSplitMethodFromParams(ps);
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4); // ĬÿҶӽڵдĸͼԪ
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    bool compressNodes = ps.FindOneBool("compressnodes", false);
+    Float splitBudget = ps.FindOneFloat("splitbudget", .3f);
+    Float maxRefitCost = ps.FindOneFloat("maxrefitcost", 1.5f);
+    std::string cacheFile = ps.FindOneFilename("cachefile", "");
+    int treeletRounds = ps.FindOneInt("treeletrounds", 0);
+    bool triangleLeaves = ps.FindOneBool("triangleleaves", false);
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, compressNodes, splitBudget,
+                                      maxRefitCost, cacheFile, treeletRounds,
+                                      triangleLeaves);
 }
 
 }  // namespace pbrt
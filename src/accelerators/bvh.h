@@ -56,11 +56,32 @@ p258 4.3.1 BVH CONSTRUCTION
 namespace pbrt {
 
 struct BVHBuildNode;
+class PackedTriangles;
 
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHBuildTask;
 struct MortonPrimitive;
-struct LinearBVHNode;
+struct CompressedBVHNode;
+
+// Flattened BVH node; also read by the accelerators that reuse BVHAccel's
+// tree construction.
+struct LinearBVHNode {
+    Bounds3f bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+    union {
+        // Interior node: shadow rays visit the second child first
+        uint8_t occludeSecondFirst;
+        // Leaf: all of the primitives are triangles in the accelerator's
+        // _packedTriangles_
+        uint8_t triangleLeaf;
+    };
+};
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
@@ -72,30 +93,80 @@ class BVHAccel : public Aggregate {
     // can be constructed more efﬁciently (and more easily parallelized), but it doesn’t build
     // trees that are as effective as SAH. The remaining two approaches use even less computa-
     // tion to build the tree but create fairly low-quality trees.
-    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts };
+    // SBVH extends SAH with spatial splits, which may reference a primitive
+    // from more than one leaf to reduce the overlap between nodes.
+    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts, SBVH };
 
     // BVHAccel Public Methods
+    // With _compressNodes_, the flattened tree is replaced by 16-byte nodes
+    // that store their children's bounds quantized to 8 bits per plane.
+    // _splitBudget_ bounds the extra primitive references made by SBVH
+    // spatial splits, as a fraction of the number of primitives.
+    // _maxRefitCost_ is how far Refit() lets the SAH cost of the tree or
+    // of a subtree grow, relative to the tree it started from, before
+    // rebuilding it.  If _cacheFile_ is given, the tree is loaded from it
+    // when it was saved for primitives with the same bounds and build
+    // settings; otherwise the tree is built and saved there.
+    // _treeletRounds_ passes of treelet restructuring are run over the
+    // built tree to lower its SAH cost, which mostly helps HLBVH trees.
+    // With _triangleLeaves_, leaves that hold only triangles are
+    // intersected from a copy of their vertices, four at a time, rather
+    // than through each primitive.
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH,
+             bool compressNodes = false, Float splitBudget = .3f,
+             Float maxRefitCost = 1.5f, const std::string &cacheFile = "",
+             int treeletRounds = 0, bool triangleLeaves = false);
 
     Bounds3f WorldBound() const;
     ~BVHAccel();
 
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Shadow rays only need any hit, so their traversal visits first the
+    // child with the larger surface area, which is the likelier one to
+    // hold an occluder, regardless of the ray direction.
+    bool FindOccluder(const Ray &ray, const Primitive **occluder) const;
+    void IntersectBatch(const Ray *rays, int nRays, SurfaceInteraction *isects,
+                        bool *hits) const;
+    void IntersectPBatch(const Ray *rays, int nRays, bool *hits) const;
+    // Refits the primitives, which may be aggregates themselves, and then
+    // recomputes the node bounds bottom-up, keeping the tree's topology.
+    // Subtrees whose SAH cost has degraded too far are rebuilt, as is the
+    // whole tree if its own cost has.
+    void Refit();
+
+  protected:
+    // BVHAccel Protected Methods
+    void rebuild();
+    void freeNodes();
+    void releaseNodes();
 
   private:
     // BVHAccel Private Methods
+    void build();
+    void compressTree();
+    void initTriangleLeaves();
+    uint64_t geometryHash() const;
+    bool readCache(const std::string &filename, uint64_t hash);
+    void writeCache(const std::string &filename, uint64_t hash,
+                    const std::vector<std::shared_ptr<Primitive>> &input) const;
     BVHBuildNode *recursiveBuild(
         MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
         int start, int end, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+        std::vector<BVHBuildTask> *deferredTasks = nullptr);
+    BVHBuildNode *sbvhBuild(
+        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &refs, int depth,
+        Float rootArea, int *totalNodes,
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+        int *splitBudget);
 
 #pragma region HLBVH
     BVHBuildNode *HLBVHBuild(
-        MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int *totalNodes,
+        std::vector<MemoryArena> &arenas,
+        const std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims) const;
 
     BVHBuildNode *emitLBVH(
@@ -103,22 +174,51 @@ class BVHAccel : public Aggregate {
         const std::vector<BVHPrimitiveInfo> &primitiveInfo,
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-        std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
+        const MortonPrimitive *firstMortonPrim, int bitIndex) const;
 
-    BVHBuildNode *buildUpperSAH(MemoryArena &arena,
-                                std::vector<BVHBuildNode *> &treeletRoots,
-                                int start, int end, int *totalNodes) const;
+    BVHBuildNode *buildUpperSAH(
+        MemoryArena &arena, std::vector<BVHBuildNode *> &treeletRoots,
+        int start, int end, int *totalNodes,
+        std::vector<BVHBuildTask> *deferredTasks = nullptr) const;
 #pragma endregion
   
     int flattenBVHTree(BVHBuildNode *node, int *offset);
-
-    // BVHAccel Private Data
+    void computeSAHCosts(std::vector<Float> *cost) const;
+    void rebuildSubtrees(const std::vector<char> &rebuild);
+    BVHBuildNode *unflattenBVHTree(
+        MemoryArena &arena, int nodeIndex, const std::vector<char> &rebuild,
+        int *totalNodes, std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+    void compressBVHTree(int nodeIndex, const Bounds3f &bounds);
+    void decompressBVHTree(int nodeIndex, const Bounds3f &bounds);
+    bool intersectCompressed(const Ray &ray, SurfaceInteraction *isect) const;
+    bool findOccluderCompressed(const Ray &ray,
+                                const Primitive **occluder) const;
+
+  protected:
+    // BVHAccel Protected Data
     const int maxPrimsInNode; // 每个叶子包围盒节点下最大的 primitive 数量
     const SplitMethod splitMethod;
+    const bool compressNodes;
+    const Float splitBudget, maxRefitCost;
+    const int treeletRounds;
+    const bool triangleLeaves;
     std::vector<std::shared_ptr<Primitive>> primitives;
+    int totalNodes = 0;
     LinearBVHNode *nodes = nullptr; // 根节点???
+    CompressedBVHNode *compressedNodes = nullptr;
+    Bounds3f compressedRootBounds;
+    // Copies of the triangle primitives' vertices, in _primitives_ order
+    std::unique_ptr<PackedTriangles> packedTriangles;
+    // Mapping of the cache file that _nodes_ points into, if any
+    void *mappedCache = nullptr;
+    size_t mappedCacheLength = 0;
+    // Per-node SAH costs that Refit() measures degradation against, and
+    // the cost of the whole tree when it was last built from scratch
+    std::vector<Float> refitBaseCosts;
+    Float refitRootCost = 0;
 };
 
+BVHAccel::SplitMethod BVHSplitMethodFromParams(const ParamSet &ps);
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps);
 
@@ -0,0 +1,323 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// accelerators/instancebvh.cpp*
+#include "accelerators/instancebvh.h"
+#include "interaction.h"
+#include "stats.h"
+#include <algorithm>
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Instance BVH", instanceBVHBytes);
+STAT_COUNTER("Scene/Instances in instance BVHs", nInstancesStored);
+
+static PBRT_CONSTEXPR int maxInstancesInNode = 4;
+
+// InstanceBVHAccel Method Definitions
+InstanceBVHAccel::InstanceBVHAccel(
+    std::vector<std::shared_ptr<Primitive>> objects,
+    const std::vector<Instance> &instances)
+    : objects(std::move(objects)), nInstances(instances.size()) {
+    ProfilePhase _(Prof::AccelConstruction);
+    instanceObject.resize(nInstances);
+    for (int e = 0; e < 12; ++e) {
+        xform[e].resize(nInstances);
+        xformInv[e].resize(nInstances);
+    }
+    for (int i = 0; i < nInstances; ++i) {
+        const Instance &inst = instances[i];
+        CHECK(inst.object >= 0 && inst.object < (int)this->objects.size());
+        instanceObject[i] = inst.object;
+        const Matrix4x4 &m = inst.InstanceToWorld.GetMatrix();
+        const Matrix4x4 &mInv = inst.InstanceToWorld.GetInverseMatrix();
+        for (int e = 0; e < 12; ++e) {
+            xform[e][i] = m.m[e / 4][e % 4];
+            xformInv[e][i] = mInv.m[e / 4][e % 4];
+        }
+    }
+    buildTree();
+
+    nInstancesStored += nInstances;
+    instanceBVHBytes += sizeof(*this) +
+                        nInstances * (sizeof(int) + 24 * sizeof(Float)) +
+                        nodes.size() * sizeof(LinearBVHNode);
+}
+
+Transform InstanceBVHAccel::instanceToWorld(int i) const {
+    return Transform(
+        Matrix4x4(xform[0][i], xform[1][i], xform[2][i], xform[3][i],
+                  xform[4][i], xform[5][i], xform[6][i], xform[7][i],
+                  xform[8][i], xform[9][i], xform[10][i], xform[11][i], 0, 0,
+                  0, 1),
+        Matrix4x4(xformInv[0][i], xformInv[1][i], xformInv[2][i],
+                  xformInv[3][i], xformInv[4][i], xformInv[5][i],
+                  xformInv[6][i], xformInv[7][i], xformInv[8][i],
+                  xformInv[9][i], xformInv[10][i], xformInv[11][i], 0, 0, 0,
+                  1));
+}
+
+// Transforms _ray_ into instance _i_'s space straight from the stored
+// inverse matrix, as Transform::operator()(const Ray &) would, without
+// assembling the full Transform for every instance the ray visits
+Ray InstanceBVHAccel::worldToInstance(int i, const Ray &ray) const {
+    Float m[12];
+    for (int e = 0; e < 12; ++e) m[e] = xformInv[e][i];
+    Float x = ray.o.x, y = ray.o.y, z = ray.o.z;
+    Point3f o((m[0] * x + m[1] * y) + (m[2] * z + m[3]),
+              (m[4] * x + m[5] * y) + (m[6] * z + m[7]),
+              (m[8] * x + m[9] * y) + (m[10] * z + m[11]));
+    Vector3f oError =
+        gamma(3) * Vector3f(std::abs(m[0] * x) + std::abs(m[1] * y) +
+                                std::abs(m[2] * z) + std::abs(m[3]),
+                            std::abs(m[4] * x) + std::abs(m[5] * y) +
+                                std::abs(m[6] * z) + std::abs(m[7]),
+                            std::abs(m[8] * x) + std::abs(m[9] * y) +
+                                std::abs(m[10] * z) + std::abs(m[11]));
+    x = ray.d.x, y = ray.d.y, z = ray.d.z;
+    Vector3f d(m[0] * x + m[1] * y + m[2] * z, m[4] * x + m[5] * y + m[6] * z,
+               m[8] * x + m[9] * y + m[10] * z);
+
+    // Offset the origin to the edge of its error bounds, as for any
+    // transformed ray
+    Float tMax = ray.tMax;
+    Float lengthSquared = d.LengthSquared();
+    if (lengthSquared > 0) {
+        Float dt = Dot(Abs(d), oError) / lengthSquared;
+        o += d * dt;
+        tMax -= dt;
+    }
+    return Ray(o, d, tMax, ray.time, ray.medium);
+}
+
+Bounds3f InstanceBVHAccel::instanceBound(int i) const {
+    return instanceToWorld(i)(objects[instanceObject[i]]->WorldBound());
+}
+
+// Builds the BVH over the instances and reorders the instance data so
+// that each leaf's instances are contiguous
+void InstanceBVHAccel::buildTree() {
+    nodes.clear();
+    bounds = Bounds3f();
+    if (nInstances == 0) return;
+    std::vector<Bounds3f> instanceBounds(nInstances);
+    for (int i = 0; i < nInstances; ++i) instanceBounds[i] = instanceBound(i);
+    std::vector<int> order(nInstances);
+    for (int i = 0; i < nInstances; ++i) order[i] = i;
+    nodes.reserve(2 * nInstances);
+    recursiveBuild(order, instanceBounds, 0, nInstances);
+    bounds = nodes[0].bounds;
+
+    std::vector<int> newObject(nInstances);
+    for (int i = 0; i < nInstances; ++i) newObject[i] = instanceObject[order[i]];
+    instanceObject.swap(newObject);
+    std::vector<Float> newXform(nInstances);
+    for (std::vector<Float> *x : {xform, xformInv})
+        for (int e = 0; e < 12; ++e) {
+            for (int i = 0; i < nInstances; ++i) newXform[i] = x[e][order[i]];
+            x[e].swap(newXform);
+        }
+}
+
+// Binned SAH build, as for BVHAccel; returns the index of the new node
+int InstanceBVHAccel::recursiveBuild(std::vector<int> &order,
+                                     const std::vector<Bounds3f> &instanceBounds,
+                                     int start, int end) {
+    int nodeIndex = nodes.size();
+    nodes.push_back(LinearBVHNode());
+    Bounds3f b, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        const Bounds3f &ib = instanceBounds[order[i]];
+        b = Union(b, ib);
+        centroidBounds = Union(centroidBounds, .5f * ib.pMin + .5f * ib.pMax);
+    }
+    nodes[nodeIndex].bounds = b;
+
+    int n = end - start, dim = centroidBounds.MaximumExtent();
+    auto makeLeaf = [&]() {
+        nodes[nodeIndex].primitivesOffset = start;
+        nodes[nodeIndex].nPrimitives = n;
+        return nodeIndex;
+    };
+    if (n == 1) return makeLeaf();
+    auto centroid = [&](int i) {
+        const Bounds3f &ib = instanceBounds[i];
+        return .5f * (ib.pMin[dim] + ib.pMax[dim]);
+    };
+
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        if (n <= maxInstancesInNode) return makeLeaf();
+    } else {
+        // Find the cheapest split between SAH buckets
+        PBRT_CONSTEXPR int nBuckets = 12;
+        int counts[nBuckets] = {0};
+        Bounds3f bucketBounds[nBuckets];
+        auto bucketOf = [&](int i) {
+            int bucket = nBuckets * (centroid(i) - centroidBounds.pMin[dim]) /
+                         (centroidBounds.pMax[dim] - centroidBounds.pMin[dim]);
+            return std::min(bucket, nBuckets - 1);
+        };
+        for (int i = start; i < end; ++i) {
+            int bucket = bucketOf(order[i]);
+            ++counts[bucket];
+            bucketBounds[bucket] = Union(bucketBounds[bucket],
+                                         instanceBounds[order[i]]);
+        }
+        Float minCost = Infinity;
+        int minCostSplitBucket = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            Bounds3f b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, bucketBounds[j]);
+                count0 += counts[j];
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = Union(b1, bucketBounds[j]);
+                count1 += counts[j];
+            }
+            Float cost = 1 + (count0 * b0.SurfaceArea() +
+                              count1 * b1.SurfaceArea()) / b.SurfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
+        }
+        if (n <= maxInstancesInNode && minCost >= n) return makeLeaf();
+        int *pmid = std::partition(
+            &order[start], &order[end - 1] + 1,
+            [&](int i) { return bucketOf(i) <= minCostSplitBucket; });
+        mid = pmid - &order[0];
+    }
+    if (mid == start || mid == end) {
+        mid = (start + end) / 2;
+        std::nth_element(&order[start], &order[mid], &order[end - 1] + 1,
+                         [&](int a, int b) { return centroid(a) < centroid(b); });
+    }
+
+    recursiveBuild(order, instanceBounds, start, mid);
+    int second = recursiveBuild(order, instanceBounds, mid, end);
+    nodes[nodeIndex].axis = dim;
+    nodes[nodeIndex].nPrimitives = 0;
+    nodes[nodeIndex].secondChildOffset = second;
+    return nodeIndex;
+}
+
+void InstanceBVHAccel::Refit() {
+    ProfilePhase _(Prof::AccelConstruction);
+    RefitPrimitives(objects);
+    buildTree();
+}
+
+bool InstanceBVHAccel::Intersect(const Ray &ray,
+                                 SurfaceInteraction *isect) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                // Intersect ray with the objects of the leaf's instances
+                for (int i = 0; i < node->nPrimitives; ++i) {
+                    int inst = node->primitivesOffset + i;
+                    Ray r = worldToInstance(inst, ray);
+                    if (objects[instanceObject[inst]]->Intersect(r, isect)) {
+                        ray.tMax = r.tMax;
+                        Transform InstanceToWorld = instanceToWorld(inst);
+                        if (!InstanceToWorld.IsIdentity())
+                            *isect = InstanceToWorld(*isect);
+                        CHECK_GE(Dot(isect->n, isect->shading.n), 0);
+                        hit = true;
+                    }
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return hit;
+}
+
+bool InstanceBVHAccel::IntersectP(const Ray &ray) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                for (int i = 0; i < node->nPrimitives; ++i) {
+                    int inst = node->primitivesOffset + i;
+                    Ray r = worldToInstance(inst, ray);
+                    if (objects[instanceObject[inst]]->IntersectP(r))
+                        return true;
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return false;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,92 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_INSTANCEBVH_H
+#define PBRT_ACCELERATORS_INSTANCEBVH_H
+
+// accelerators/instancebvh.h*
+#include "accelerators/bvh.h"
+#include "transform.h"
+
+namespace pbrt {
+
+// InstanceBVHAccel Declarations
+// Aggregate over object instances with static transformations.  Each
+// instance is just the index of its shared object and its
+// instance-to-world transformation, stored as 3x4 affine matrices (and
+// their inverses) in structure-of-arrays form; the instances are
+// organized in a BVH of their own.
+class InstanceBVHAccel : public Aggregate {
+  public:
+    // InstanceBVHAccel Public Types
+    struct Instance {
+        int object;
+        Transform InstanceToWorld;
+    };
+
+    // InstanceBVHAccel Public Methods
+    InstanceBVHAccel(std::vector<std::shared_ptr<Primitive>> objects,
+                     const std::vector<Instance> &instances);
+    Bounds3f WorldBound() const { return bounds; }
+    bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &ray) const;
+    void Refit();
+
+  private:
+    // InstanceBVHAccel Private Methods
+    Transform instanceToWorld(int instance) const;
+    Ray worldToInstance(int instance, const Ray &ray) const;
+    Bounds3f instanceBound(int instance) const;
+    void buildTree();
+    int recursiveBuild(std::vector<int> &order,
+                       const std::vector<Bounds3f> &instanceBounds,
+                       int start, int end);
+
+    // InstanceBVHAccel Private Data
+    const std::vector<std::shared_ptr<Primitive>> objects;
+    int nInstances;
+    std::vector<int> instanceObject;
+    // Row-major 3x4 instance-to-world matrices and their inverses, as
+    // [element][instance]
+    std::vector<Float> xform[12], xformInv[12];
+    std::vector<LinearBVHNode> nodes;
+    Bounds3f bounds;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_INSTANCEBVH_H
@@ -36,6 +36,8 @@
 #include "paramset.h"
 #include "interaction.h"
 #include "stats.h"
+#include "parallel.h"
+#include "shapes/triangle.h"
 #include <algorithm>
 
 namespace pbrt {
@@ -65,6 +67,13 @@ struct KdAccelNode
     int SplitAxis()   const { return flags & 3; } // flags λ¼ split axis0/1/2x/y/z Ữ
     bool IsLeaf()     const { return (flags & 3) == 3; } // λΪ 3 ʱ һҶӽڵ
     int AboveChild()  const { return aboveChild >> 2; }
+    // Moves a node of a subtree built on its own into the final tree
+    void Offset(int nodeOffset, int indicesOffset) {
+        if (!IsLeaf())
+            aboveChild += nodeOffset << 2;
+        else if (nPrimitives() > 1)
+            primitiveIndicesOffset += indicesOffset;
+    }
 
     union 
     {
@@ -100,6 +109,43 @@ struct BoundEdge
     EdgeType type;
 };
 
+// Edges are ordered by position, with starting edges before ending ones;
+// the primitive number breaks the remaining ties so that the order is
+// unique.
+inline bool operator<(const BoundEdge &e0, const BoundEdge &e1) {
+    if (e0.t != e1.t) return e0.t < e1.t;
+    if (e0.type != e1.type) return (int)e0.type < (int)e1.type;
+    return e0.primNum < e1.primNum;
+}
+
+// The edges of a node's primitives along each axis, sorted.  They're
+// sorted once for the root; each node then splits its lists between its
+// children, which keeps them sorted.
+struct KdBuildEdges {
+    std::vector<BoundEdge> axis[3];
+};
+
+// Nodes of a tree or subtree as it's built, with child offsets relative
+// to its root and leaf offsets into its own _primitiveIndices_
+struct KdBuildOutput {
+    std::vector<KdAccelNode> nodes;
+    std::vector<int> primitiveIndices;
+};
+
+// Parallel kd-tree construction: the top of the tree is built serially
+// down to subtrees of at most _kdTaskPrimitives_ primitives, which are
+// then built independently and spliced in where their placeholder leaves
+// are.  The tree doesn't depend on the number of threads.
+static PBRT_CONSTEXPR int kdTaskPrimitives = 4096;
+
+struct KdBuildTask {
+    int nodeNum;  // placeholder in the top of the tree
+    Bounds3f bounds;
+    KdBuildEdges edges;
+    int depth, badRefines;
+    KdBuildOutput output;
+};
+
 #pragma endregion
 
 #pragma region
@@ -107,7 +153,7 @@ struct BoundEdge
 // KdTreeAccel Method Definitions
 KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
                          int isectCost, int traversalCost, Float emptyBonus,
-                         int maxPrims, int maxDepth)
+                         int maxPrims, int maxDepth, bool triangleLeaves)
     : isectCost(isectCost),
       traversalCost(traversalCost),
       maxPrims(maxPrims),
@@ -133,31 +179,90 @@ KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
         primBounds.push_back(b);
     }
 
-    // Allocate working memory for kd-tree construction
-    // ¼x/y/z ϵİΧеı߽Ϣ, ο Figure4.15
-    // һʼͰ, ֻҪһ, οռ
-    std::unique_ptr<BoundEdge[]> edges[3];
-    for (int i = 0; i < 3; ++i)
-        edges[i].reset(new BoundEdge[2 * primitives.size()]);
-
-    // ¼ӽڵཻͼԪ, ҲһʼͰڴ
-    // ݹ黮ʱ, ܸǵ(prims1),  prims һĿռ
-    std::unique_ptr<int[]> prims0(new int[primitives.size()]);
-    std::unique_ptr<int[]> prims1(new int[(maxDepth + 1) * primitives.size()]);
-
-    // Initialize _primNums_ for kd-tree construction
-    // primNums ¼**ǰڵ**ཻͼԪ, ʼʱͼԪ͸ڵཻ
-    std::unique_ptr<int[]> primNums(new int[primitives.size()]);
-    for (size_t i = 0; i < primitives.size(); ++i) 
-        primNums[i] = i;
-
-    // Start recursive construction of kd-tree
-    buildTree(
-        0, 
-        bounds, primBounds, 
-        primNums.get(), primitives.size(),
-        maxDepth, // ݹ, ڵݹ buildTree ,  depth == 0 ʱ, ֹͣݹ
-        edges, prims0.get(), prims1.get());
+    // Sort the edges of the primitives' bounds along each axis
+    KdBuildEdges edges;
+    bool parallel = primitives.size() > 4 * kdTaskPrimitives;
+    auto sortEdges = [&](int64_t axis) {
+        std::vector<BoundEdge> &e = edges.axis[axis];
+        e.reserve(2 * primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i) {
+            e.push_back(BoundEdge(primBounds[i].pMin[axis], i, true));
+            e.push_back(BoundEdge(primBounds[i].pMax[axis], i, false));
+        }
+        std::sort(e.begin(), e.end());
+    };
+    if (parallel)
+        ParallelFor(sortEdges, 3);
+    else
+        for (int axis = 0; axis < 3; ++axis) sortEdges(axis);
+
+    // Build the top of the tree, then its deferred subtrees
+    KdBuildOutput top;
+    std::vector<KdBuildTask> tasks;
+    buildTree(&top, bounds, primBounds, edges, maxDepth, 0, &tasks);
+    auto buildTask = [&](int64_t i) {
+        KdBuildTask &task = tasks[i];
+        buildTree(&task.output, task.bounds, primBounds, task.edges,
+                  task.depth, task.badRefines, nullptr);
+    };
+    if (parallel)
+        ParallelFor(buildTask, tasks.size());
+    else
+        for (size_t i = 0; i < tasks.size(); ++i) buildTask(i);
+
+    // Find where each node of the top of the tree ends up once the
+    // subtrees replace their placeholders; tasks are in depth-first order
+    std::vector<int> topOffset(top.nodes.size());
+    nAllocedNodes = 0;
+    for (size_t i = 0, t = 0; i < top.nodes.size(); ++i) {
+        topOffset[i] = nAllocedNodes;
+        if (t < tasks.size() && tasks[t].nodeNum == (int)i)
+            nAllocedNodes += tasks[t++].output.nodes.size();
+        else
+            ++nAllocedNodes;
+    }
+
+    // Lay out the final tree in the same order as a serial build
+    nodes = AllocAligned<KdAccelNode>(nAllocedNodes);
+    nextFreeNode = nAllocedNodes;
+    for (size_t i = 0, t = 0; i < top.nodes.size(); ++i) {
+        KdAccelNode *node = &nodes[topOffset[i]];
+        const KdAccelNode &topNode = top.nodes[i];
+        if (t < tasks.size() && tasks[t].nodeNum == (int)i) {
+            const KdBuildOutput &subtree = tasks[t++].output;
+            int indicesOffset = primitiveIndices.size();
+            primitiveIndices.insert(primitiveIndices.end(),
+                                    subtree.primitiveIndices.begin(),
+                                    subtree.primitiveIndices.end());
+            for (size_t j = 0; j < subtree.nodes.size(); ++j) {
+                node[j] = subtree.nodes[j];
+                node[j].Offset(topOffset[i], indicesOffset);
+            }
+        } else if (!topNode.IsLeaf()) {
+            *node = topNode;
+            node->InitInterior(topNode.SplitAxis(),
+                               topOffset[topNode.AboveChild()],
+                               topNode.SplitPos());
+        } else {
+            *node = topNode;
+            if (topNode.nPrimitives() > 1) {
+                node->primitiveIndicesOffset = primitiveIndices.size();
+                const int *indices =
+                    &top.primitiveIndices[topNode.primitiveIndicesOffset];
+                primitiveIndices.insert(primitiveIndices.end(), indices,
+                                        indices + topNode.nPrimitives());
+            }
+        }
+    }
+
+    if (triangleLeaves) {
+        std::vector<const Primitive *> prims;
+        prims.reserve(primitiveIndices.size() + primitives.size());
+        for (int index : primitiveIndices)
+            prims.push_back(primitives[index].get());
+        for (const auto &p : primitives) prims.push_back(p.get());
+        packedTriangles.reset(new PackedTriangles(std::move(prims)));
+    }
 }
 
 void KdAccelNode::InitLeaf(int *primNums, int np,
@@ -178,38 +283,49 @@ void KdAccelNode::InitLeaf(int *primNums, int np,
 
 KdTreeAccel::~KdTreeAccel() { FreeAligned(nodes); }
 
+// Returns where a leaf's primitives start in _packedTriangles_
+int KdTreeAccel::packedOffset(const KdAccelNode *node) const {
+    if (node->nPrimitives() == 1)
+        return primitiveIndices.size() + node->onePrimitive;
+    return node->primitiveIndicesOffset;
+}
+
 void KdTreeAccel::buildTree(
-    int nodeNum, 
+    KdBuildOutput *out,
     const Bounds3f &nodeBounds, const std::vector<Bounds3f> &allPrimBounds,
-    int *primNums, int nPrimitives, 
-    int depth,
-    const std::unique_ptr<BoundEdge[]> edges[3],
-    int *prims0, int *prims1, int badRefines) 
+    KdBuildEdges &edges,
+    int depth, int badRefines,
+    std::vector<KdBuildTask> *tasks) const
 {
-    CHECK_EQ(nodeNum, nextFreeNode);
-
-    // Get next free node from _nodes_ array
-    // kdtree ڽʱ޷Ԥ֪Ҫڴ, Ҫм䲻ȥ
-    if (nextFreeNode == nAllocedNodes) 
-    {
-        int nNewAllocNodes = std::max(2 * nAllocedNodes, 512); // ÿΰ
-        KdAccelNode *n = AllocAligned<KdAccelNode>(nNewAllocNodes);
-
-        if (nAllocedNodes > 0) {
-            memcpy(n, nodes, nAllocedNodes * sizeof(KdAccelNode));
-            FreeAligned(nodes);
-        }
-        nodes = n;
-        nAllocedNodes = nNewAllocNodes;
+    // ڵ out->nodes аȵ˳
+    int nodeNum = out->nodes.size();
+    out->nodes.push_back(KdAccelNode());
+    int nPrimitives = edges.axis[0].size() / 2;
+
+    // Defer small enough subtrees to be built as separate tasks, leaving
+    // a placeholder for them
+    if (tasks && nPrimitives <= kdTaskPrimitives) {
+        out->nodes[nodeNum].InitLeaf(nullptr, 0, nullptr);
+        tasks->push_back({nodeNum, nodeBounds, std::move(edges), depth,
+                          badRefines, KdBuildOutput()});
+        return;
     }
-    ++nextFreeNode;
+
+    auto initLeaf = [&]() {
+        std::vector<int> primNums;
+        primNums.reserve(nPrimitives);
+        for (const BoundEdge &e : edges.axis[0])
+            if (e.type == EdgeType::Start) primNums.push_back(e.primNum);
+        out->nodes[nodeNum].InitLeaf(primNums.data(), nPrimitives,
+                                     &out->primitiveIndices);
+    };
 
     // Initialize leaf node if termination criteria met
     // ڵµͼԪ̫, ߴﵽݹ, Ͳָ
     if (nPrimitives <= maxPrims || depth == 0) 
     {
         // 뵱ǰڵཻͼԪ, ͼԪ, Ҫд KdTreeAccel::primitiveIndices
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+        initLeaf();
         return;
     }
 
@@ -234,36 +350,16 @@ void KdTreeAccel::buildTree(
 
 retrySplit:
 
-    // Initialize edges for _axis_
-    // kdtree һϰΧеı߽紦л, ο Figure 4.15
-    for (int i = 0; i < nPrimitives; ++i) 
-    {
-        int pn = primNums[i];
-        const Bounds3f &bounds = allPrimBounds[pn];
-        edges[axis][2 * i] = BoundEdge(bounds.pMin[axis], pn, true);
-        edges[axis][2 * i + 1] = BoundEdge(bounds.pMax[axis], pn, false);
-    }
-
-    // Sort _edges_ for _axis_
-    // Ӹķ
-    std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives],
-              [](const BoundEdge &e0, const BoundEdge &e1) -> bool 
-              {
-                  if (e0.t == e1.t)
-                      return (int)e0.type < (int)e1.type;
-                  else
-                      return e0.t < e1.t;
-              });
-
+    // The edges along _axis_ are already sorted, see Figure 4.15
     // Compute cost of all splits for _axis_ to find best
     int nBelow = 0, nAbove = nPrimitives;
     for (int i = 0; i < 2 * nPrimitives; ++i) 
     {
         // if(i % 2 == 1)
-        if (edges[axis][i].type == EdgeType::End) 
+        if (edges.axis[axis][i].type == EdgeType::End) 
             --nAbove;
 
-        Float edgeT = edges[axis][i].t;
+        Float edgeT = edges.axis[axis][i].t;
         if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis]) 
         {
             // Compute cost for split at _i_th edge
@@ -295,7 +391,7 @@ retrySplit:
             }
         }
 
-        if (edges[axis][i].type == EdgeType::Start) 
+        if (edges.axis[axis][i].type == EdgeType::Start) 
             ++nBelow;
     }
     //  CHEKC Ӧʼ 'int nBelow = 0, nAbove = nPrimitives;'
@@ -319,40 +415,47 @@ retrySplit:
     if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 ||
         badRefines == 3) 
     {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+        initLeaf();
         return;
     }
 
     // Classify primitives with respect to split
-    // ӽڵཻͼԪ, Ӧ KdTreeAccel::primitives  allPrimBounds
-    int n0 = 0, n1 = 0;
-
-    for (int i = 0;              i < bestOffset;      ++i)
-        if (edges[bestAxis][i].type == EdgeType::Start)
-            prims0[n0++] = edges[bestAxis][i].primNum;
-
-    for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
-        if (edges[bestAxis][i].type == EdgeType::End)
-            prims1[n1++] = edges[bestAxis][i].primNum;
+    // ӵ split ֮ǰʼߵͼԪ·ӽڵ, ӵ split ֮ĽߵͼԪϷӽڵ;
+    // źı߰˳ָӽڵ, ӽڵıȻ
+    const BoundEdge splitEdge = edges.axis[bestAxis][bestOffset];
+    auto isBelow = [&](int pn) {
+        return BoundEdge(allPrimBounds[pn].pMin[bestAxis], pn, true) <
+               splitEdge;
+    };
+    auto isAbove = [&](int pn) {
+        return splitEdge <
+               BoundEdge(allPrimBounds[pn].pMax[bestAxis], pn, false);
+    };
+    KdBuildEdges edges0, edges1;
+    for (int a = 0; a < 3; ++a) {
+        for (const BoundEdge &e : edges.axis[a]) {
+            if (isBelow(e.primNum)) edges0.axis[a].push_back(e);
+            if (isAbove(e.primNum)) edges1.axis[a].push_back(e);
+        }
+        // The node's own edges aren't needed any more
+        std::vector<BoundEdge>().swap(edges.axis[a]);
+    }
 
     // Recursively initialize children nodes
     // ֱӶ nodeBounds ֲµ subNodeBounds
-    Float tSplit = edges[bestAxis][bestOffset].t;
+    Float tSplit = splitEdge.t;
     Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
     bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
 
-    // ʱ, Ȼ primNums  prims0 ͬһ,  'Classify primitives with respect to split' ʱ, primNums Ѿ, Ըǵ
-    // , ʼʱ, Ҫõ prims1 , prims1 ݲܱ, Դ 'prims1 + nPrimitives'
-
     // 'nodeNum + 1' -> ӽڵڸڵ, Ҫ¼, һӽڵ, Ҫ 'InitInterior' ¼һ
-    buildTree(nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines); // עﴫ 'prims1 + nPrimitives'
+    buildTree(out, bounds0, allPrimBounds, edges0, depth - 1, badRefines,
+              tasks);
 
-    int aboveChild = nextFreeNode; // ȱǰһڵ, µ nextFreeNode value
-    nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
+    int aboveChild = out->nodes.size(); // ȱǰһڵ, һڵλ
+    out->nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
 
-    buildTree(aboveChild,  bounds1, allPrimBounds, prims1, n1, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
+    buildTree(out, bounds1, allPrimBounds, edges1, depth - 1, badRefines,
+              tasks);
 }
 
 #pragma endregion
@@ -379,6 +482,9 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const
 
     // Traverse kd-tree nodes in order for ray
     bool hit = false;
+    DeferredTriangleHit deferred;
+    TriangleBatchRay triRay;
+    if (packedTriangles) triRay = TriangleBatchRay(ray);
     const KdAccelNode *node = &nodes[0];
     
     //  while ѭʱ, ȵɱ, ݹ, , ֹ, Ȼٿ kdtree Ŀռṹ
@@ -440,7 +546,13 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const
         {
             // Check for intersections inside leaf node
             int nPrimitives = node->nPrimitives();
-            if (nPrimitives == 1) 
+            if (packedTriangles)
+            {
+                if (packedTriangles->Intersect(packedOffset(node), nPrimitives,
+                                               ray, triRay, isect, &deferred))
+                    hit = true;
+            }
+            else if (nPrimitives == 1) 
             {
                 const std::shared_ptr<Primitive> &p =
                     primitives[node->onePrimitive];
@@ -478,6 +590,8 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const
         }
     }
 
+    // Only now compute the closest triangle hit's _SurfaceInteraction_
+    deferred.Resolve(ray, isect);
     return hit;
 }
 
@@ -494,12 +608,18 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
     PBRT_CONSTEXPR int maxTodo = 64;
     KdToDo todo[maxTodo];
     int todoPos = 0;
+    TriangleBatchRay triRay;
+    if (packedTriangles) triRay = TriangleBatchRay(ray);
     const KdAccelNode *node = &nodes[0];
     while (node != nullptr) {
         if (node->IsLeaf()) {
             // Check for shadow ray intersections inside leaf node
             int nPrimitives = node->nPrimitives();
-            if (nPrimitives == 1) {
+            if (packedTriangles) {
+                if (packedTriangles->FindOccluder(packedOffset(node),
+                                                  nPrimitives, ray, triRay))
+                    return true;
+            } else if (nPrimitives == 1) {
                 const std::shared_ptr<Primitive> &p =
                     primitives[node->onePrimitive];
                 if (p->IntersectP(ray)) {
@@ -574,8 +694,9 @@ std::shared_ptr<KdTreeAccel> CreateKdTreeAccelerator(
     Float emptyBonus = ps.FindOneFloat("emptybonus", 0.5f);
     int maxPrims = ps.FindOneInt("maxprims", 1);
     int maxDepth = ps.FindOneInt("maxdepth", -1);
+    bool triangleLeaves = ps.FindOneBool("triangleleaves", false);
     return std::make_shared<KdTreeAccel>(std::move(prims), isectCost, travCost, emptyBonus,
-                                         maxPrims, maxDepth);
+                                         maxPrims, maxDepth, triangleLeaves);
 }
 
 }  // namespace pbrt
@@ -47,13 +47,20 @@ namespace pbrt {
 // KdTreeAccel Declarations
 struct KdAccelNode;
 struct BoundEdge;
+struct KdBuildEdges;
+struct KdBuildOutput;
+struct KdBuildTask;
+class PackedTriangles;
 class KdTreeAccel : public Aggregate {
   public:
     // KdTreeAccel Public Methods
     // isectCosttraversalCost  kd-tree ĵĹкܴӰ, Բο 'CreateKdTreeAccelerator' иĬֵ
+    // With _triangleLeaves_, the triangles in each leaf are intersected a
+    // batch at a time from a copy of their vertices.
     KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
                 int isectCost = 80, int traversalCost = 1,
-                Float emptyBonus = 0.5, int maxPrims = 1, int maxDepth = -1);
+                Float emptyBonus = 0.5, int maxPrims = 1, int maxDepth = -1,
+                bool triangleLeaves = false);
 
     Bounds3f WorldBound() const { return bounds; }
     ~KdTreeAccel();
@@ -63,11 +70,11 @@ class KdTreeAccel : public Aggregate {
 
   private:
     // KdTreeAccel Private Methods
-    void buildTree(int nodeNum, const Bounds3f &bounds,
-                   const std::vector<Bounds3f> &primBounds, int *primNums,
-                   int nprims, int depth,
-                   const std::unique_ptr<BoundEdge[]> edges[3], int *prims0,
-                   int *prims1, int badRefines = 0);
+    void buildTree(KdBuildOutput *out, const Bounds3f &bounds,
+                   const std::vector<Bounds3f> &primBounds,
+                   KdBuildEdges &edges, int depth, int badRefines,
+                   std::vector<KdBuildTask> *tasks) const;
+    int packedOffset(const KdAccelNode *node) const;
 
     // KdTreeAccel Private Data
     const int isectCost, traversalCost; // ray-bounds intersect Ŀͱ kdtree node Ŀ
@@ -76,6 +83,9 @@ class KdTreeAccel : public Aggregate {
 
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::vector<int> primitiveIndices;
+    // Copies of the primitives' vertices, in _primitiveIndices_ order and
+    // then in _primitives_ order for leaves with a single primitive
+    std::unique_ptr<PackedTriangles> packedTriangles;
 
     KdAccelNode *nodes; // KdAccelNode[] nodes,  KdAccelNode 洢ڴ nodes ʼڴ
     int nAllocedNodes;  // KdAccelNode 
@@ -0,0 +1,417 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// accelerators/widebvh.cpp*
+#include "accelerators/widebvh.h"
+#include "interaction.h"
+#include "paramset.h"
+#include "stats.h"
+#if defined(PBRT_HAVE_SSE) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <xmmintrin.h>
+#define PBRT_WIDEBVH_SSE
+#endif
+#if defined(PBRT_HAVE_AVX) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <immintrin.h>
+#define PBRT_WIDEBVH_AVX
+#endif
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Wide BVH tree", wideTreeBytes);
+STAT_COUNTER("Wide BVH/Nodes", totalWideNodes);
+STAT_RATIO("Wide BVH/Children per node", usedChildSlots, totalChildSlots);
+
+// WideBVHAccel Local Declarations
+template <int Width>
+struct WideBVHNode {
+    // Child bounds, indexed as [min/max][axis][child]
+    Float bounds[2][3][Width];
+    // Interior child: index of its node; leaf child: offset of its first
+    // primitive; empty slot: -1
+    int32_t child[Width];
+    uint16_t nPrimitives[Width];  // 0 -> interior child or empty slot
+};
+
+// Per-ray values shared by all of the node tests
+struct WideBVHRay {
+    WideBVHRay(const Ray &ray) {
+        for (int a = 0; a < 3; ++a) {
+            o[a] = ray.o[a];
+            invDir[a] = 1 / ray.d[a];
+            dirIsNeg[a] = invDir[a] < 0;
+#ifdef PBRT_WIDEBVH_SSE
+            o4[a] = _mm_set1_ps(o[a]);
+            invDir4[a] = _mm_set1_ps(invDir[a]);
+#endif
+#ifdef PBRT_WIDEBVH_AVX
+            o8[a] = _mm256_set1_ps(o[a]);
+            invDir8[a] = _mm256_set1_ps(invDir[a]);
+#endif
+        }
+    }
+    Float o[3], invDir[3];
+    int dirIsNeg[3];
+#ifdef PBRT_WIDEBVH_SSE
+    __m128 o4[3], invDir4[3];
+#endif
+#ifdef PBRT_WIDEBVH_AVX
+    __m256 o8[3], invDir8[3];
+#endif
+};
+
+// Stack entry for wide traversal; _nPrimitives_ is zero for interior nodes
+struct WideBVHStackEntry {
+    int index;
+    int nPrimitives;
+    Float tNear;
+};
+
+// WideBVHAccel Utility Functions
+// Tests the ray against the child boxes _[first, first + count)_ with the
+// same conservative slab test as _Bounds3::IntersectP()_, returning a bit
+// mask of the children that are hit and their entry distances in _tNear_.
+// NaNs from degenerate slabs leave _t0_/_t1_ unchanged, as in the scalar
+// test.
+template <int Width>
+static int IntersectChildrenScalar(const WideBVHNode<Width> &node,
+                                   const WideBVHRay &r, Float tMax,
+                                   int first, int count, Float *tNear) {
+    int mask = 0;
+    for (int i = first; i < first + count; ++i) {
+        Float t0 = 0, t1 = tMax;
+        for (int a = 0; a < 3; ++a) {
+            Float tMinA = (node.bounds[r.dirIsNeg[a]][a][i] - r.o[a]) *
+                          r.invDir[a];
+            Float tMaxA = (node.bounds[1 - r.dirIsNeg[a]][a][i] - r.o[a]) *
+                          r.invDir[a];
+            tMaxA *= 1 + 2 * gamma(3);
+            t0 = tMinA > t0 ? tMinA : t0;
+            t1 = tMaxA < t1 ? tMaxA : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef PBRT_WIDEBVH_SSE
+// Four-wide version of _IntersectChildrenScalar()_; _max_ps_/_min_ps_
+// return their second operand when the first is NaN.
+template <int Width>
+static int IntersectChildrenSSE(const WideBVHNode<Width> &node,
+                                const WideBVHRay &r, Float tMax, int first,
+                                Float *tNear) {
+    const __m128 scale = _mm_set1_ps(1 + 2 * gamma(3));
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m128 bMin = _mm_loadu_ps(&node.bounds[r.dirIsNeg[a]][a][first]);
+        __m128 bMax = _mm_loadu_ps(&node.bounds[1 - r.dirIsNeg[a]][a][first]);
+        __m128 tMinA = _mm_mul_ps(_mm_sub_ps(bMin, r.o4[a]), r.invDir4[a]);
+        __m128 tMaxA = _mm_mul_ps(
+            _mm_mul_ps(_mm_sub_ps(bMax, r.o4[a]), r.invDir4[a]), scale);
+        t0 = _mm_max_ps(tMinA, t0);
+        t1 = _mm_min_ps(tMaxA, t1);
+    }
+    _mm_storeu_ps(tNear + first, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << first;
+}
+#endif  // PBRT_WIDEBVH_SSE
+
+#ifdef PBRT_WIDEBVH_AVX
+static int IntersectChildrenAVX(const WideBVHNode<8> &node,
+                                const WideBVHRay &r, Float tMax,
+                                Float *tNear) {
+    const __m256 scale = _mm256_set1_ps(1 + 2 * gamma(3));
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m256 bMin = _mm256_loadu_ps(&node.bounds[r.dirIsNeg[a]][a][0]);
+        __m256 bMax = _mm256_loadu_ps(&node.bounds[1 - r.dirIsNeg[a]][a][0]);
+        __m256 tMinA =
+            _mm256_mul_ps(_mm256_sub_ps(bMin, r.o8[a]), r.invDir8[a]);
+        __m256 tMaxA = _mm256_mul_ps(
+            _mm256_mul_ps(_mm256_sub_ps(bMax, r.o8[a]), r.invDir8[a]), scale);
+        t0 = _mm256_max_ps(tMinA, t0);
+        t1 = _mm256_min_ps(tMaxA, t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif  // PBRT_WIDEBVH_AVX
+
+template <int Width>
+static int IntersectChildren(const WideBVHNode<Width> &node,
+                             const WideBVHRay &r, Float tMax, Float *tNear) {
+#ifdef PBRT_WIDEBVH_SSE
+    if (Width % 4 == 0) {
+        int mask = 0;
+        for (int first = 0; first < Width; first += 4)
+            mask |= IntersectChildrenSSE(node, r, tMax, first, tNear);
+        return mask;
+    }
+#endif
+    return IntersectChildrenScalar(node, r, tMax, 0, Width, tNear);
+}
+
+#ifdef PBRT_WIDEBVH_AVX
+static int IntersectChildren(const WideBVHNode<8> &node, const WideBVHRay &r,
+                             Float tMax, Float *tNear) {
+    return IntersectChildrenAVX(node, r, tMax, tNear);
+}
+#endif  // PBRT_WIDEBVH_AVX
+
+// Gathers the (up to _Width_) binary nodes that become the children of the
+// wide node rooted at binary node _index_, repeatedly opening the interior
+// child with the largest surface area.
+template <int Width>
+static int GatherChildren(const LinearBVHNode *nodes, int index,
+                          int children[Width]) {
+    const LinearBVHNode &root = nodes[index];
+    if (root.nPrimitives > 0) {
+        // Only possible when the whole tree is a single leaf
+        children[0] = index;
+        return 1;
+    }
+    int nChildren = 0;
+    children[nChildren++] = index + 1;
+    children[nChildren++] = root.secondChildOffset;
+    while (nChildren < Width) {
+        int best = -1;
+        Float bestArea = -1;
+        for (int i = 0; i < nChildren; ++i) {
+            const LinearBVHNode &node = nodes[children[i]];
+            if (node.nPrimitives == 0 && node.bounds.SurfaceArea() > bestArea) {
+                best = i;
+                bestArea = node.bounds.SurfaceArea();
+            }
+        }
+        if (best == -1) break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[nChildren++] = nodes[opened].secondChildOffset;
+    }
+    return nChildren;
+}
+
+template <int Width>
+static int CountWideNodes(const LinearBVHNode *nodes, int index) {
+    int children[Width];
+    int nChildren = GatherChildren<Width>(nodes, index, children);
+    int count = 1;
+    for (int i = 0; i < nChildren; ++i)
+        if (nodes[children[i]].nPrimitives == 0)
+            count += CountWideNodes<Width>(nodes, children[i]);
+    return count;
+}
+
+// WideBVHAccel Method Definitions
+template <int Width>
+WideBVHAccel<Width>::WideBVHAccel(std::vector<std::shared_ptr<Primitive>> p,
+                                  int maxPrimsInNode, SplitMethod splitMethod)
+    : BVHAccel(std::move(p), maxPrimsInNode, splitMethod) {
+    ProfilePhase _(Prof::AccelConstruction);
+    collapseTree();
+}
+
+template <int Width>
+void WideBVHAccel<Width>::Refit() {
+    // The binary tree is gone, so there is nothing to refit; rebuild it
+    // and collapse it again
+    ProfilePhase _(Prof::AccelConstruction);
+    RefitPrimitives(primitives);
+    wideTreeBytes -= nWideNodes * sizeof(WideBVHNode<Width>);
+    FreeAligned(wideNodes);
+    wideNodes = nullptr;
+    nWideNodes = 0;
+    bounds = Bounds3f();
+    rebuild();
+    collapseTree();
+}
+
+template <int Width>
+void WideBVHAccel<Width>::collapseTree() {
+    if (!nodes) return;
+    bounds = nodes[0].bounds;
+
+    // Collapse the binary tree into wide nodes and release it
+    nWideNodes = CountWideNodes<Width>(nodes, 0);
+    wideNodes = AllocAligned<WideBVHNode<Width>>(nWideNodes);
+    int offset = 0;
+    collapse(0, &offset);
+    CHECK_EQ(offset, nWideNodes);
+    releaseNodes();
+
+    // The rest of the accelerator is still counted with the binary tree's
+    wideTreeBytes += nWideNodes * sizeof(WideBVHNode<Width>);
+    totalWideNodes += nWideNodes;
+    totalChildSlots += nWideNodes * Width;
+    LOG(INFO) << StringPrintf("Collapsed BVH into %d %d-wide nodes",
+                              nWideNodes, Width);
+}
+
+template <int Width>
+int WideBVHAccel<Width>::collapse(int binaryIndex, int *offset) {
+    int wideIndex = (*offset)++;
+    WideBVHNode<Width> &node = wideNodes[wideIndex];
+    int children[Width];
+    int nChildren = GatherChildren<Width>(nodes, binaryIndex, children);
+    for (int i = 0; i < Width; ++i) {
+        if (i >= nChildren) {
+            // Empty slots get inverted bounds so that no ray can hit them
+            for (int a = 0; a < 3; ++a) {
+                node.bounds[0][a][i] = Infinity;
+                node.bounds[1][a][i] = -Infinity;
+            }
+            node.child[i] = -1;
+            node.nPrimitives[i] = 0;
+            continue;
+        }
+        const LinearBVHNode &child = nodes[children[i]];
+        for (int a = 0; a < 3; ++a) {
+            node.bounds[0][a][i] = child.bounds.pMin[a];
+            node.bounds[1][a][i] = child.bounds.pMax[a];
+        }
+        node.nPrimitives[i] = child.nPrimitives;
+        if (child.nPrimitives > 0)
+            node.child[i] = child.primitivesOffset;
+        else
+            node.child[i] = collapse(children[i], offset);
+    }
+    usedChildSlots += nChildren;
+    return wideIndex;
+}
+
+template <int Width>
+WideBVHAccel<Width>::~WideBVHAccel() {
+    FreeAligned(wideNodes);
+}
+
+template <int Width>
+bool WideBVHAccel<Width>::Intersect(const Ray &ray,
+                                    SurfaceInteraction *isect) const {
+    if (!wideNodes) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    WideBVHRay r(ray);
+    bool hit = false;
+
+    // Follow ray through wide BVH nodes to find primitive intersections
+    WideBVHStackEntry stack[64 * Width];
+    int toVisitOffset = 0;
+    stack[toVisitOffset++] = {0, 0, 0};
+    while (toVisitOffset > 0) {
+        WideBVHStackEntry entry = stack[--toVisitOffset];
+        // Skip entries that are beyond the closest hit found so far
+        if (entry.tNear > ray.tMax) continue;
+        if (entry.nPrimitives > 0) {
+            for (int i = 0; i < entry.nPrimitives; ++i)
+                if (primitives[entry.index + i]->Intersect(ray, isect))
+                    hit = true;
+            continue;
+        }
+
+        // Push the children that the ray hits, farthest first
+        const WideBVHNode<Width> &node = wideNodes[entry.index];
+        Float tNear[Width];
+        int mask = IntersectChildren(node, r, ray.tMax, tNear);
+        int order[Width], nHit = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i))) continue;
+            int j = nHit++;
+            while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+        for (int j = 0; j < nHit; ++j) {
+            int i = order[j];
+            stack[toVisitOffset++] = {node.child[i], node.nPrimitives[i],
+                                      tNear[i]};
+        }
+    }
+    return hit;
+}
+
+template <int Width>
+bool WideBVHAccel<Width>::IntersectP(const Ray &ray) const {
+    const Primitive *occluder;
+    return FindOccluder(ray, &occluder);
+}
+
+template <int Width>
+bool WideBVHAccel<Width>::FindOccluder(const Ray &ray,
+                                       const Primitive **occluder) const {
+    if (!wideNodes) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    WideBVHRay r(ray);
+
+    // Any hit terminates the search, so children are visited unordered
+    WideBVHStackEntry stack[64 * Width];
+    int toVisitOffset = 0;
+    stack[toVisitOffset++] = {0, 0, 0};
+    while (toVisitOffset > 0) {
+        WideBVHStackEntry entry = stack[--toVisitOffset];
+        if (entry.nPrimitives > 0) {
+            for (int i = 0; i < entry.nPrimitives; ++i) {
+                const Primitive *prim = primitives[entry.index + i].get();
+                if (prim->FindOccluder(ray, occluder)) return true;
+            }
+            continue;
+        }
+        const WideBVHNode<Width> &node = wideNodes[entry.index];
+        Float tNear[Width];
+        int mask = IntersectChildren(node, r, ray.tMax, tNear);
+        for (int i = 0; i < Width; ++i)
+            if (mask & (1 << i))
+                stack[toVisitOffset++] = {node.child[i], node.nPrimitives[i],
+                                          tNear[i]};
+    }
+    return false;
+}
+
+template class WideBVHAccel<4>;
+template class WideBVHAccel<8>;
+
+std::shared_ptr<Primitive> CreateWideBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps,
+    int width) {
+    BVHAccel::SplitMethod splitMethod = BVHSplitMethodFromParams(ps);
+    int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
+    if (width == 8)
+        return std::make_shared<WideBVHAccel<8>>(std::move(prims),
+                                                 maxPrimsInNode, splitMethod);
+    CHECK_EQ(width, 4);
+    return std::make_shared<WideBVHAccel<4>>(std::move(prims), maxPrimsInNode,
+                                             splitMethod);
+}
+
+}  // namespace pbrt
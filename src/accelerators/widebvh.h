@@ -0,0 +1,97 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_WIDEBVH_H
+#define PBRT_ACCELERATORS_WIDEBVH_H
+
+// accelerators/widebvh.h*
+#include "accelerators/bvh.h"
+
+namespace pbrt {
+
+// WideBVHAccel Forward Declarations
+template <int Width>
+struct WideBVHNode;
+
+// WideBVHAccel Declarations
+// The binary tree built by BVHAccel is collapsed into nodes with _Width_
+// (4 or 8) children, whose bounds are stored as structure-of-arrays so
+// that a ray can be tested against all of them at once with SSE/AVX.
+// Leaves are stored inline in their parent's child slots.
+template <int Width>
+class WideBVHAccel : public BVHAccel {
+  public:
+    // WideBVHAccel Public Methods
+    WideBVHAccel(std::vector<std::shared_ptr<Primitive>> p,
+                 int maxPrimsInNode = 1,
+                 SplitMethod splitMethod = SplitMethod::SAH);
+    ~WideBVHAccel();
+
+    Bounds3f WorldBound() const { return bounds; }
+    bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &ray) const;
+    bool FindOccluder(const Ray &ray, const Primitive **occluder) const;
+    // The binary nodes used by BVHAccel's ray stream traversal are freed
+    // once collapsed, so batches are traced one ray at a time.
+    void IntersectBatch(const Ray *rays, int nRays, SurfaceInteraction *isects,
+                        bool *hits) const {
+        Primitive::IntersectBatch(rays, nRays, isects, hits);
+    }
+    void IntersectPBatch(const Ray *rays, int nRays, bool *hits) const {
+        Primitive::IntersectPBatch(rays, nRays, hits);
+    }
+    void Refit();
+
+  private:
+    // WideBVHAccel Private Methods
+    void collapseTree();
+    int collapse(int binaryIndex, int *offset);
+
+    // WideBVHAccel Private Data
+    Bounds3f bounds;
+    WideBVHNode<Width> *wideNodes = nullptr;
+    int nWideNodes = 0;
+};
+
+std::shared_ptr<Primitive> CreateWideBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps,
+    int width);
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_WIDEBVH_H
@@ -42,7 +42,9 @@
 
 // API Additional Headers
 #include "accelerators/bvh.h"
+#include "accelerators/instancebvh.h"
 #include "accelerators/kdtreeaccel.h"
+#include "accelerators/widebvh.h"
 #include "cameras/environment.h"
 #include "cameras/orthographic.h"
 #include "cameras/perspective.h"
@@ -91,6 +93,7 @@
 #include "shapes/curve.h"
 #include "shapes/cylinder.h"
 #include "shapes/disk.h"
+#include "shapes/displacedsubdiv.h"
 #include "shapes/heightfield.h"
 #include "shapes/hyperboloid.h"
 #include "shapes/loopsubdiv.h"
@@ -155,10 +158,18 @@ struct TransformSet {
     Transform t[MaxTransforms];
 };
 
+// A triangle mesh given a name with the "name" shape parameter, whose
+// vertices can be updated between frames with pbrtUpdateMesh()
+struct NamedTriangleMesh {
+    std::shared_ptr<TriangleMesh> mesh;
+    Transform ObjectToWorld;
+};
+
 struct RenderOptions {
     // RenderOptions Public Methods
-    Integrator *MakeIntegrator() const;
+    Integrator *MakeIntegrator(Film **film = nullptr) const;
     Scene *MakeScene();
+    std::vector<std::shared_ptr<Primitive>> TakePrimitives();
     Camera *MakeCamera() const;
 
     // RenderOptions Public Data
@@ -181,9 +192,26 @@ struct RenderOptions {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
+    // Instances with static transformations are collected here and go
+    // into a single _InstanceBVHAccel_ rather than each getting a
+    // _TransformedPrimitive_
+    std::vector<std::shared_ptr<Primitive>> instancedObjects;
+    std::map<const Primitive *, int> instancedObjectIndices;
+    std::vector<InstanceBVHAccel::Instance> staticInstances;
+    std::map<std::string, NamedTriangleMesh> namedMeshes;
     bool haveScatteringMedia = false;
 };
 
+// After pbrtWorldEnd(), a scene with named meshes is kept around so that
+// further frames can be rendered with pbrtRenderFrame() without parsing
+// it again.
+struct RetainedScene {
+    std::unique_ptr<Integrator> integrator;
+    std::unique_ptr<Scene> scene;
+    Film *film;
+    std::map<std::string, NamedTriangleMesh> namedMeshes;
+};
+
 // MaterialInstance represents both an instance of a material as well as
 // the information required to create another instance of it (possibly with
 // different parameters from the shape).
@@ -369,6 +397,16 @@ static std::vector<GraphicsState> pushedGraphicsStates;
 static std::vector<TransformSet> pushedTransforms;
 static std::vector<uint32_t> pushedActiveTransformBits;
 static TransformCache transformCache;
+static std::unique_ptr<RetainedScene> retainedScene;
+static WorldEndCallback worldEndCallback;
+
+static void ReleaseRetainedScene() {
+    if (!retainedScene) return;
+    retainedScene.reset();
+    transformCache.Clear();
+    ImageTexture<Float, Float>::ClearCache();
+    ImageTexture<RGBSpectrum, Spectrum>::ClearCache();
+}
 int catIndentCount = 0;
 
 // API Forward Declarations
@@ -455,6 +493,9 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
     else if (name == "curve")
         shapes = CreateCurveShape(object2world, world2object,
                                   reverseOrientation, paramSet);
+    else if (name == "curves")
+        shapes = CreateCurveSetShape(object2world, world2object,
+                                     reverseOrientation, paramSet);
     else if (name == "trianglemesh") {
         if (PbrtOptions.toPly) {
             int nvi;
@@ -521,9 +562,29 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
     else if (name == "heightfield")
         shapes = CreateHeightfield(object2world, world2object,
                                    reverseOrientation, paramSet);
-    else if (name == "loopsubdiv")
+    else if (name == "loopsubdiv") {
+        // Describe the camera so that subdivision levels can follow the
+        // projected size of the control mesh
+        SubdivisionView view, *viewp = nullptr;
+        if (renderOptions->CameraName == "perspective") {
+            const ParamSet &cp = renderOptions->CameraParams;
+            Float fov = cp.FindOneFloat("fov", 90.);
+            Float halffov = cp.FindOneFloat("halffov", -1.f);
+            if (halffov > 0.f) fov = 2.f * halffov;
+            const ParamSet &fp = renderOptions->FilmParams;
+            int xres = fp.FindOneInt("xresolution", 1280);
+            int yres = fp.FindOneInt("yresolution", 720);
+            view.pCamera = renderOptions->CameraToWorld[0](Point3f(0, 0, 0));
+            view.pixelsPerUnit =
+                std::min(xres, yres) / (2 * std::tan(Radians(fov) / 2));
+            viewp = &view;
+        }
         shapes = CreateLoopSubdiv(object2world, world2object,
-                                  reverseOrientation, paramSet);
+                                  reverseOrientation, paramSet, viewp);
+    } else if (name == "displacedsubdiv")
+        shapes = CreateDisplacedSubdiv(object2world, world2object,
+                                       reverseOrientation, paramSet,
+                                       &*graphicsState.floatTextures);
     else if (name == "nurbs")
         shapes = CreateNURBS(object2world, world2object, reverseOrientation,
                              paramSet);
@@ -767,6 +828,22 @@ std::shared_ptr<AreaLight> MakeAreaLight(const std::string &name,
     return area;
 }
 
+// Makes a single light for all of the shapes that a shape directive
+// created, like the triangles of a mesh
+std::shared_ptr<AreaLight> MakeMeshAreaLight(
+    const std::string &name, const Transform &light2world,
+    const MediumInterface &mediumInterface, const ParamSet &paramSet,
+    const std::vector<std::shared_ptr<Shape>> &shapes) {
+    std::shared_ptr<AreaLight> area;
+    if (name == "area" || name == "diffuse")
+        area = CreateDiffuseMeshLight(light2world, mediumInterface.outside,
+                                      paramSet, shapes);
+    else
+        Warning("Area light \"%s\" unknown.", name.c_str());
+    paramSet.ReportUnused();
+    return area;
+}
+
 std::shared_ptr<Primitive> MakeAccelerator(
     const std::string &name,
     std::vector<std::shared_ptr<Primitive>> prims,
@@ -774,6 +851,10 @@ std::shared_ptr<Primitive> MakeAccelerator(
     std::shared_ptr<Primitive> accel;
     if (name == "bvh")
         accel = CreateBVHAccelerator(std::move(prims), paramSet);
+    else if (name == "bvh4")
+        accel = CreateWideBVHAccelerator(std::move(prims), paramSet, 4);
+    else if (name == "bvh8")
+        accel = CreateWideBVHAccelerator(std::move(prims), paramSet, 8);
     else if (name == "kdtree")
         accel = CreateKdTreeAccelerator(std::move(prims), paramSet);
     else
@@ -892,6 +973,7 @@ void pbrtCleanup() {
         Error("pbrtCleanup() called without pbrtInit().");
     else if (currentApiState == APIState::WorldBlock)
         Error("pbrtCleanup() called while inside world block.");
+    ReleaseRetainedScene();
     currentApiState = APIState::Uninitialized;
     ParallelCleanup();
     CleanupProfiler();
@@ -1118,6 +1200,7 @@ void pbrtMediumInterface(const std::string &insideName,
 
 void pbrtWorldBegin() {
     VERIFY_OPTIONS("WorldBegin");
+    ReleaseRetainedScene();
     currentApiState = APIState::WorldBlock;
     for (int i = 0; i < MaxTransforms; ++i) curTransform[i] = Transform();
     activeTransformBits = AllTransformsBits;
@@ -1327,6 +1410,22 @@ void pbrtAreaLightSource(const std::string &name, const ParamSet &params) {
     }
 }
 
+// Records the mesh that the triangles in _shapes_ belong to as _name_
+static void AddNamedMesh(const std::string &name,
+                         const std::vector<std::shared_ptr<Shape>> &shapes,
+                         const Transform &ObjectToWorld) {
+    const Triangle *tri = dynamic_cast<const Triangle *>(shapes[0].get());
+    if (!tri) {
+        Warning("Shape \"%s\" isn't a triangle mesh; its vertices can't be "
+                "updated.", name.c_str());
+        return;
+    }
+    if (renderOptions->namedMeshes.find(name) !=
+        renderOptions->namedMeshes.end())
+        Warning("Mesh \"%s\" being redefined.", name.c_str());
+    renderOptions->namedMeshes[name] = {tri->GetMesh(), ObjectToWorld};
+}
+
 void pbrtShape(const std::string &name, const ParamSet &params) {
     VERIFY_WORLD("Shape");
     std::vector<std::shared_ptr<Primitive>> prims;
@@ -1336,6 +1435,7 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         params.Print(catIndentCount);
         printf("\n");
     }
+    std::string meshName = params.FindOneString("name", "");
 
     if (!curTransform.IsAnimated()) {
         // Initialize _prims_ and _areaLights_ for static shape
@@ -1350,11 +1450,25 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        if (!meshName.empty()) {
+            AddNamedMesh(meshName, shapes, curTransform[0]);
+            if (graphicsState.areaLight != "")
+                Warning("Area light for mesh \"%s\" won't follow updates to "
+                        "its vertices.", meshName.c_str());
+        }
+        // Emissive shapes that come from the same directive share a light
+        std::shared_ptr<AreaLight> meshArea;
+        if (graphicsState.areaLight != "" && shapes.size() > 1) {
+            meshArea = MakeMeshAreaLight(graphicsState.areaLight,
+                                         curTransform[0], mi,
+                                         graphicsState.areaLightParams, shapes);
+            if (meshArea) areaLights.push_back(meshArea);
+        }
         prims.reserve(shapes.size());
         for (auto s : shapes) {
             // Possibly create area light for shape
-            std::shared_ptr<AreaLight> area;
-            if (graphicsState.areaLight != "") {
+            std::shared_ptr<AreaLight> area = meshArea;
+            if (graphicsState.areaLight != "" && shapes.size() == 1) {
                 area = MakeAreaLight(graphicsState.areaLight, curTransform[0],
                                      mi, graphicsState.areaLightParams, s);
                 if (area) areaLights.push_back(area);
@@ -1379,6 +1493,7 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        if (!meshName.empty()) AddNamedMesh(meshName, shapes, Transform());
         prims.reserve(shapes.size());
         for (auto s : shapes)
             prims.push_back(
@@ -1427,9 +1542,10 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
 // Therefore, we'll apply some "heuristics".
 bool shapeMaySetMaterialParameters(const ParamSet &ps) {
     for (const auto &param : ps.textures)
-        // Any texture other than one for an alpha mask is almost certainly
-        // for a Material (or is unused!).
-        if (param->name != "alpha" && param->name != "shadowalpha")
+        // Any texture other than one for an alpha mask or a displacement is
+        // almost certainly for a Material (or is unused!).
+        if (param->name != "alpha" && param->name != "shadowalpha" &&
+            param->name != "displacement")
             return true;
 
     // Special case spheres, which are the most common non-mesh primitive.
@@ -1573,6 +1689,20 @@ void pbrtObjectInstance(const std::string &name) {
         in.clear();
         in.push_back(accel);
     }
+    if (!curTransform.IsAnimated()) {
+        // Record a compact instance of the shared object
+        auto iter = renderOptions->instancedObjectIndices.find(in[0].get());
+        int object;
+        if (iter != renderOptions->instancedObjectIndices.end())
+            object = iter->second;
+        else {
+            object = renderOptions->instancedObjects.size();
+            renderOptions->instancedObjects.push_back(in[0]);
+            renderOptions->instancedObjectIndices[in[0].get()] = object;
+        }
+        renderOptions->staticInstances.push_back({object, curTransform[0]});
+        return;
+    }
     static_assert(MaxTransforms == 2,
                   "TransformCache assumes only two transforms");
     // Create _animatedInstanceToWorld_ transform for instance
@@ -1588,6 +1718,35 @@ void pbrtObjectInstance(const std::string &name) {
     renderOptions->primitives.push_back(prim);
 }
 
+static void RenderScene(Integrator *integrator, const Scene *scene) {
+    // This is kind of ugly; we directly override the current profiler
+    // state to switch from parsing/scene construction related stuff to
+    // rendering stuff and then switch it back below. The underlying
+    // issue is that all the rest of the profiling system assumes
+    // hierarchical inheritance of profiling state; this is the only
+    // place where that isn't the case.
+    CHECK_EQ(CurrentProfilerState(), ProfToBits(Prof::SceneConstruction));
+    ProfilerState = ProfToBits(Prof::IntegratorRender);
+
+    if (scene && integrator) integrator->Render(*scene);
+
+    CHECK_EQ(CurrentProfilerState(), ProfToBits(Prof::IntegratorRender));
+    ProfilerState = ProfToBits(Prof::SceneConstruction);
+}
+
+static void ReportRenderStats() {
+    if (!PbrtOptions.cat && !PbrtOptions.toPly) {
+        MergeWorkerThreadStats();
+        ReportThreadStats();
+        if (!PbrtOptions.quiet) {
+            PrintStats(stdout);
+            ReportProfilerResults(stdout);
+            ClearStats();
+            ClearProfiler();
+        }
+    }
+}
+
 void pbrtWorldEnd() {
     VERIFY_WORLD("WorldEnd");
     // Ensure there are no pushed graphics states
@@ -1604,68 +1763,143 @@ void pbrtWorldEnd() {
     // Create scene and render
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sWorldEnd\n", catIndentCount, "");
+    } else if (worldEndCallback) {
+        std::unique_ptr<Camera> camera(renderOptions->MakeCamera());
+        if (camera)
+            worldEndCallback(renderOptions->TakePrimitives(), *camera);
+        else
+            Error("Unable to create camera");
     } else {
-        std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
+        Film *film = nullptr;
+        std::unique_ptr<Integrator> integrator(
+            renderOptions->MakeIntegrator(&film));
         std::unique_ptr<Scene> scene(renderOptions->MakeScene());
 
-        // This is kind of ugly; we directly override the current profiler
-        // state to switch from parsing/scene construction related stuff to
-        // rendering stuff and then switch it back below. The underlying
-        // issue is that all the rest of the profiling system assumes
-        // hierarchical inheritance of profiling state; this is the only
-        // place where that isn't the case.
-        CHECK_EQ(CurrentProfilerState(), ProfToBits(Prof::SceneConstruction));
-        ProfilerState = ProfToBits(Prof::IntegratorRender);
-
-        if (scene && integrator) integrator->Render(*scene);
+        RenderScene(integrator.get(), scene.get());
 
-        CHECK_EQ(CurrentProfilerState(), ProfToBits(Prof::IntegratorRender));
-        ProfilerState = ProfToBits(Prof::SceneConstruction);
+        // Keep the scene if later frames may update its meshes
+        if (scene && integrator && !renderOptions->namedMeshes.empty()) {
+            retainedScene.reset(new RetainedScene);
+            retainedScene->integrator = std::move(integrator);
+            retainedScene->scene = std::move(scene);
+            retainedScene->film = film;
+            retainedScene->namedMeshes = std::move(renderOptions->namedMeshes);
+        }
     }
 
     // Clean up after rendering. Do this before reporting stats so that
     // destructors can run and update stats as needed.
     graphicsState = GraphicsState();
-    transformCache.Clear();
     currentApiState = APIState::OptionsBlock;
-    ImageTexture<Float, Float>::ClearCache();
-    ImageTexture<RGBSpectrum, Spectrum>::ClearCache();
     renderOptions.reset(new RenderOptions);
-
-    if (!PbrtOptions.cat && !PbrtOptions.toPly) {
-        MergeWorkerThreadStats();
-        ReportThreadStats();
-        if (!PbrtOptions.quiet) {
-            PrintStats(stdout);
-            ReportProfilerResults(stdout);
-            ClearStats();
-            ClearProfiler();
-        }
+    // A retained scene still refers to the cached transforms and textures
+    if (!retainedScene) {
+        transformCache.Clear();
+        ImageTexture<Float, Float>::ClearCache();
+        ImageTexture<RGBSpectrum, Spectrum>::ClearCache();
     }
 
+    ReportRenderStats();
+
     for (int i = 0; i < MaxTransforms; ++i) curTransform[i] = Transform();
     activeTransformBits = AllTransformsBits;
     namedCoordinateSystems.erase(namedCoordinateSystems.begin(),
                                  namedCoordinateSystems.end());
 }
 
+void pbrtSetWorldEndCallback(WorldEndCallback callback) {
+    worldEndCallback = std::move(callback);
+}
+
+void pbrtUpdateMesh(const std::string &name, const ParamSet &params) {
+    VERIFY_OPTIONS("UpdateMesh");
+    if (PbrtOptions.cat || PbrtOptions.toPly) {
+        printf("%*sUpdateMesh \"%s\" ", catIndentCount, "", name.c_str());
+        params.Print(catIndentCount);
+        printf("\n");
+        return;
+    }
+    if (!retainedScene) {
+        Error("No scene with named meshes has been rendered; ignoring "
+              "\"UpdateMesh\".");
+        return;
+    }
+    auto iter = retainedScene->namedMeshes.find(name);
+    if (iter == retainedScene->namedMeshes.end()) {
+        Error("Mesh \"%s\" unknown; ignoring \"UpdateMesh\".", name.c_str());
+        return;
+    }
+    TriangleMesh &mesh = *iter->second.mesh;
+    int npi, nni;
+    const Point3f *P = params.FindPoint3f("P", &npi);
+    const Normal3f *N = params.FindNormal3f("N", &nni);
+    if (!P || npi != mesh.nVertices) {
+        Error("\"P\" must provide %d positions for mesh \"%s\"; ignoring "
+              "\"UpdateMesh\".", mesh.nVertices, name.c_str());
+        return;
+    }
+    if (N && nni != mesh.nVertices) {
+        Error("\"N\" must provide %d normals for mesh \"%s\"; ignoring "
+              "\"UpdateMesh\".", mesh.nVertices, name.c_str());
+        return;
+    }
+    params.ReportUnused();
+    mesh.UpdateVertices(iter->second.ObjectToWorld, P, N);
+}
+
+void pbrtRenderFrame(const std::string &filename) {
+    VERIFY_OPTIONS("RenderFrame");
+    if (PbrtOptions.cat || PbrtOptions.toPly) {
+        printf("%*sRenderFrame \"%s\"\n", catIndentCount, "",
+               filename.c_str());
+        return;
+    }
+    if (!retainedScene) {
+        Error("No scene with named meshes has been rendered; ignoring "
+              "\"RenderFrame\".");
+        return;
+    }
+    // Refit the scene to the updated meshes and render it again
+    retainedScene->scene->Refit();
+    retainedScene->film->Clear();
+    if (!filename.empty()) retainedScene->film->filename = filename;
+    RenderScene(retainedScene->integrator.get(), retainedScene->scene.get());
+    ReportRenderStats();
+}
+
 Scene *RenderOptions::MakeScene() {
+    std::vector<std::shared_ptr<Primitive>> prims = TakePrimitives();
     std::shared_ptr<Primitive> accelerator =
-        MakeAccelerator(AcceleratorName, std::move(primitives), AcceleratorParams);
-    if (!accelerator) accelerator = std::make_shared<BVHAccel>(primitives);
+        MakeAccelerator(AcceleratorName, std::move(prims), AcceleratorParams);
+    if (!accelerator) accelerator = std::make_shared<BVHAccel>(prims);
     Scene *scene = new Scene(accelerator, lights);
-    // Erase primitives and lights from _RenderOptions_
-    primitives.clear();
+    // Erase lights from _RenderOptions_
     lights.clear();
     return scene;
 }
 
-Integrator *RenderOptions::MakeIntegrator() const {
+// Returns the primitives that go into the scene's accelerator, erasing
+// them from _RenderOptions_
+std::vector<std::shared_ptr<Primitive>> RenderOptions::TakePrimitives() {
+    if (!staticInstances.empty()) {
+        primitives.push_back(std::make_shared<InstanceBVHAccel>(
+            std::move(instancedObjects), staticInstances));
+        instancedObjects.clear();
+        instancedObjectIndices.clear();
+        staticInstances.clear();
+    }
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.swap(primitives);
+    return prims;
+}
+
+Integrator *RenderOptions::MakeIntegrator(Film **film) const {
     std::shared_ptr<const Camera> camera(MakeCamera());
     if (!camera) {
         Error("Unable to create camera");
         return nullptr;
     }
+    if (film) *film = camera->film;
 
     std::shared_ptr<Sampler> sampler =
         MakeSampler(SamplerName, SamplerParams, camera->film);
@@ -40,9 +40,18 @@
 
 // core/api.h*
 #include "pbrt.h"
+#include <functional>
 
 namespace pbrt {
 
+// Called by pbrtWorldEnd() in place of rendering, if set with
+// pbrtSetWorldEndCallback(), with the primitives that would have gone into
+// the scene's accelerator and the scene's camera; for tools that analyze
+// scenes rather than render them.
+typedef std::function<void(std::vector<std::shared_ptr<Primitive>>,
+                           const Camera &)>
+    WorldEndCallback;
+
 // API Function Declarations
 void pbrtInit(const Options &opt);
 void pbrtCleanup();
@@ -87,6 +96,12 @@ void pbrtObjectBegin(const std::string &name);
 void pbrtObjectEnd();
 void pbrtObjectInstance(const std::string &name);
 void pbrtWorldEnd();
+// Animation support: after pbrtWorldEnd(), a scene that has triangle meshes
+// named with the "name" parameter is kept; pbrtUpdateMesh() replaces a
+// mesh's vertices and pbrtRenderFrame() renders the scene again.
+void pbrtUpdateMesh(const std::string &name, const ParamSet &params);
+void pbrtRenderFrame(const std::string &filename);
+void pbrtSetWorldEndCallback(WorldEndCallback callback);
 
 void pbrtParseFile(std::string filename);
 void pbrtParseString(std::string str);
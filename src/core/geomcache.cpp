@@ -0,0 +1,132 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// core/geomcache.cpp*
+#include "geomcache.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_PERCENT("Geometry cache/Lookup hits", nCacheHits, nCacheLookups);
+STAT_COUNTER("Geometry cache/Entries generated", nCacheCreated);
+STAT_COUNTER("Geometry cache/Entries evicted", nCacheEvicted);
+STAT_MEMORY_COUNTER("Memory/Geometry cache (generated in total)",
+                    cacheBytesCreated);
+
+// GeometryCache Method Definitions
+CachedGeometry::~CachedGeometry() {}
+
+GeometryCache::GeometryCache(size_t maxBytes)
+    : maxBytes(maxBytes), bytesUsed(0), clock(0) {}
+
+std::shared_ptr<const CachedGeometry> GeometryCache::Lookup(
+    uint64_t key,
+    const std::function<std::shared_ptr<const CachedGeometry>()> &create) {
+    ++nCacheLookups;
+    // Hash _key_ to pick its shard, since callers' keys are consecutive
+    Shard &shard = shards[(key * 0x9e3779b97f4a7c15ull) >> 58];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.entries.find(key);
+        if (iter != shard.entries.end()) {
+            ++nCacheHits;
+            shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+            iter->second->lastUsed = clock++;
+            return iter->second->geom;
+        }
+    }
+
+    // Create the entry without holding the lock
+    std::shared_ptr<const CachedGeometry> geom = create();
+    size_t bytes = geom->BytesUsed();
+    ++nCacheCreated;
+    cacheBytesCreated += bytes;
+
+    std::unique_lock<std::mutex> shardLock(shard.mutex);
+    auto iter = shard.entries.find(key);
+    if (iter != shard.entries.end()) {
+        // Another thread added the entry in the meantime
+        shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+        iter->second->lastUsed = clock++;
+        return iter->second->geom;
+    }
+    shard.lru.push_front(Entry{key, clock++, geom});
+    shard.entries[key] = shard.lru.begin();
+    bytesUsed += bytes;
+    shardLock.unlock();
+
+    // Evict the least recently used entries until the cache is within its
+    // budget, keeping the entry that was just added.  Each shard's own
+    // least recently used entry is the last one in its list, so the oldest
+    // of those is the oldest in the cache; only one shard is locked at a
+    // time.
+    while (bytesUsed > maxBytes) {
+        int oldest = -1;
+        uint64_t oldestUsed = 0;
+        for (int i = 0; i < NumShards; ++i) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            const std::list<Entry> &lru = shards[i].lru;
+            if (lru.empty() || lru.back().key == key) continue;
+            if (oldest < 0 || lru.back().lastUsed < oldestUsed) {
+                oldest = i;
+                oldestUsed = lru.back().lastUsed;
+            }
+        }
+        if (oldest < 0) break;
+        Shard &victim = shards[oldest];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        // Look again if another thread used or evicted the entry meanwhile
+        if (victim.lru.empty() || victim.lru.back().lastUsed != oldestUsed)
+            continue;
+        const Entry &last = victim.lru.back();
+        bytesUsed -= last.geom->BytesUsed();
+        victim.entries.erase(last.key);
+        victim.lru.pop_back();
+        ++nCacheEvicted;
+    }
+    return geom;
+}
+
+size_t GeometryCache::BytesUsed() const { return bytesUsed; }
+
+uint64_t GeometryCache::NewKeyRange(uint64_t count) {
+    static std::atomic<uint64_t> nextKey(0);
+    return nextKey.fetch_add(count);
+}
+
+GeometryCache *GetGeometryCache() {
+    static GeometryCache cache(size_t(PbrtOptions.geometryCacheMB) << 20);
+    return &cache;
+}
+
+}  // namespace pbrt
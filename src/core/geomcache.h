@@ -0,0 +1,110 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+#ifndef PBRT_CORE_GEOMCACHE_H
+#define PBRT_CORE_GEOMCACHE_H
+
+// core/geomcache.h*
+#include "pbrt.h"
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace pbrt {
+
+// GeometryCache Declarations
+
+// Geometry that is generated on demand and stored in a _GeometryCache_
+class CachedGeometry {
+  public:
+    virtual ~CachedGeometry();
+    virtual size_t BytesUsed() const = 0;
+};
+
+// A memory-bounded cache of generated geometry, such as the tessellations
+// of displaced patches.  When the cache goes over its budget, the least
+// recently used entries are dropped; they're freed once no thread is still
+// using them, and generated again if they're needed later.  Entries are
+// spread over independently locked shards to keep the threads that look
+// them up during rendering from contending for one lock; the budget holds
+// for all of them together.  Entries are stamped from one clock whenever
+// they're used, so that eviction can find the least recently used entry
+// of all of the shards.  The most recently added entry is always kept,
+// even if it alone goes over the budget.
+class GeometryCache {
+  public:
+    // GeometryCache Public Methods
+    GeometryCache(size_t maxBytes);
+    // Returns the entry for _key_, first calling _create_ to make it if it
+    // isn't in the cache.  Two threads that miss on the same key at once
+    // may both call _create_; one of the results is kept.
+    std::shared_ptr<const CachedGeometry> Lookup(
+        uint64_t key,
+        const std::function<std::shared_ptr<const CachedGeometry>()> &create);
+    size_t BytesUsed() const;
+    size_t MaxBytes() const { return maxBytes; }
+    // Reserves _count_ consecutive keys for a caller's entries and returns
+    // the first one
+    static uint64_t NewKeyRange(uint64_t count);
+
+  private:
+    // GeometryCache Private Data
+    struct Entry {
+        uint64_t key, lastUsed;
+        std::shared_ptr<const CachedGeometry> geom;
+    };
+    struct Shard {
+        mutable std::mutex mutex;
+        // Most recently used first
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+    };
+    static PBRT_CONSTEXPR int NumShards = 64;
+    const size_t maxBytes;
+    Shard shards[NumShards];
+    std::atomic<size_t> bytesUsed;
+    std::atomic<uint64_t> clock;
+};
+
+// Returns the cache that displaced shapes share, whose budget is set with
+// the --geomcache command-line option
+GeometryCache *GetGeometryCache();
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_GEOMCACHE_H
@@ -1703,6 +1703,69 @@ inline Float SphericalPhi(const Vector3f &v) {
     return (p < 0) ? (p + 2 * Pi) : p;
 }
 
+// Octahedral Normal Encoding
+// Unit vectors are stored in 2x16 bits by projecting them onto the
+// octahedron |x| + |y| + |z| = 1 and unfolding it onto the square
+inline uint32_t EncodeOctahedral(const Normal3f &nIn) {
+    Float sum = std::abs(nIn.x) + std::abs(nIn.y) + std::abs(nIn.z);
+    Normal3f n = sum > 0 ? nIn / sum : Normal3f(0, 0, 1);
+    Float x = n.x, y = n.y;
+    if (n.z < 0) {
+        // Fold the lower hemisphere over the upper one's diagonals
+        x = (1 - std::abs(n.y)) * std::copysign(Float(1), n.x);
+        y = (1 - std::abs(n.x)) * std::copysign(Float(1), n.y);
+    }
+    auto encode = [](Float v) {
+        return (uint32_t)std::round(Clamp((v + 1) / 2, 0, 1) * 65535);
+    };
+    return encode(x) | (encode(y) << 16);
+}
+
+inline Normal3f DecodeOctahedral(uint32_t q) {
+    Float x = -1 + 2 * (q & 0xffff) / Float(65535);
+    Float y = -1 + 2 * (q >> 16) / Float(65535);
+    Float z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        Float xo = x;
+        x = (1 - std::abs(y)) * std::copysign(Float(1), xo);
+        y = (1 - std::abs(xo)) * std::copysign(Float(1), y);
+    }
+    return Normalize(Normal3f(x, y, z));
+}
+
+// Morton Code Utility Functions
+inline uint32_t LeftShift3(uint32_t x) {
+    CHECK_LE(x, (1 << 10));
+    if (x == (1 << 10)) --x;
+#ifdef PBRT_HAVE_BINARY_CONSTANTS
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    // x = ---- --98 ---- ---- ---- ---- 7654 3210
+    x = (x | (x <<  8)) & 0b00000011000000001111000000001111;
+    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
+    x = (x | (x <<  4)) & 0b00000011000011000011000011000011;
+    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
+    x = (x | (x <<  2)) & 0b00001001001001001001001001001001;
+    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+#else
+    x = (x | (x << 16)) & 0x30000ff;
+    // x = ---- --98 ---- ---- ---- ---- 7654 3210
+    x = (x | (x <<  8)) & 0x300f00f;
+    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
+    x = (x | (x <<  4)) & 0x30c30c3;
+    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
+    x = (x | (x <<  2)) & 0x9249249;
+    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+#endif // PBRT_HAVE_BINARY_CONSTANTS
+    return x;
+}
+
+inline uint32_t EncodeMorton3(const Vector3f &v) {
+    CHECK_GE(v.x, 0);
+    CHECK_GE(v.y, 0);
+    CHECK_GE(v.z, 0);
+    return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+}
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_GEOMETRY_H
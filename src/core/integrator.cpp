@@ -212,7 +212,7 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
                 Li *= visibility.Tr(scene, sampler);
                 VLOG(2) << "  after Tr, Li: " << Li;
             } else {			
-              if (!visibility.Unoccluded(scene)) {
+              if (!visibility.Unoccluded(scene, &light)) {
                 VLOG(2) << "  shadow ray blocked";
                 Li = Spectrum(0.f);
               } else
@@ -270,8 +270,15 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
             // Account for light contributions along sampled direction _wi_
 			// 计算沿采样方向 wi 的光照贡献
 
+            // Lights like _DiffuseMeshLight_ only find the pdf from the
+            // surface that the ray reaches
+            const AreaLight *hitPdfLight = nullptr;
+            if ((light.flags & (int)LightFlags::Area) &&
+                static_cast<const AreaLight &>(light).PdfNeedsHit())
+                hitPdfLight = static_cast<const AreaLight *>(&light);
+
             Float weight = 1;
-            if (!sampledSpecular) 
+            if (!sampledSpecular && !hitPdfLight) 
             {
                 lightPdf = light.Pdf_Li(it, wi);	// 计算沿 wi 方向采样到 light 的概率
                 if (lightPdf == 0) return Ld;
@@ -293,8 +300,14 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
 			// 如果 wi 与面积光源相交，则需要进一步处理，否则直接计算 light 向 ray 方向发射的辐射度
             Spectrum Li(0.f);
             if (foundSurfaceInteraction) {
-                if (lightIsect.primitive->GetAreaLight() == &light) // 如果这个区域光源正好是当前采样的光源   
+                if (lightIsect.primitive->GetAreaLight() == &light) { // 如果这个区域光源正好是当前采样的光源   
                     Li = lightIsect.Le(-wi);
+                    if (hitPdfLight && !sampledSpecular && !Li.IsBlack()) {
+                        lightPdf = hitPdfLight->Pdf_LiHit(it, wi, lightIsect);
+                        if (lightPdf == 0) return Ld;
+                        weight = PowerHeuristic(1, scatteringPdf, 1, lightPdf);
+                    }
+                }
             } else
                 Li = light.Le(ray);
 
@@ -57,10 +57,10 @@ Light::Light(int flags, const Transform &LightToWorld,
 
 Light::~Light() {}
 
-bool VisibilityTester::Unoccluded(const Scene &scene) const 
+bool VisibilityTester::Unoccluded(const Scene &scene, const Light *light) const 
 {
     //  p0  p1 Ĺδ볡ཻ, ǿɼ
-    return !scene.IntersectP(p0.SpawnRayTo(p1));
+    return !scene.IntersectP(p0.SpawnRayTo(p1), light);
 }
 
 Spectrum VisibilityTester::Tr(const Scene &scene, Sampler &sampler) const 
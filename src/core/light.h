@@ -139,7 +139,8 @@ class VisibilityTester {
     const Interaction &P1() const { return p1; }
 
     // ǲ, Ŀɼ
-    bool Unoccluded(const Scene &scene) const;
+    // With _light_ given, the scene's per-light occluder cache is used
+    bool Unoccluded(const Scene &scene, const Light *light = nullptr) const;
     // ͬʱ赲Ͳ, 䴫ݵķ
     Spectrum Tr(const Scene &scene, Sampler &sampler) const;
 
@@ -160,6 +161,16 @@ class AreaLight : public Light {
     //     const AreaLight *area = primitive->GetAreaLight();
     //     return area ? area->L(*this, w) : Spectrum(0.f); }
     virtual Spectrum L(const Interaction &intr, const Vector3f &w) const = 0;
+
+    // Returns Pdf_Li(ref, wi), given that the first surface along _wi_ from
+    // _ref_ is _lightIsect_ on this light.  Lights that can't find the
+    // surface that _wi_ reaches efficiently return true from PdfNeedsHit(),
+    // in which case integrators call this once they've traced the ray.
+    virtual bool PdfNeedsHit() const { return false; }
+    virtual Float Pdf_LiHit(const Interaction &ref, const Vector3f &wi,
+                            const SurfaceInteraction &lightIsect) const {
+        return Pdf_Li(ref, wi);
+    }
 };
 
 }  // namespace pbrt
@@ -80,6 +80,10 @@ class MIPMap {
     T Lookup(const Point2f &st, Float width = 0.f) const;
     T Lookup(const Point2f &st, Vector2f dstdx, Vector2f dstdy) const;
 
+    // Bounds what unfiltered lookups (width 0) return over _st_, using the
+    // texel ranges of power-of-two blocks that are built on first use
+    bool Bound(const Bounds2f &st, T *min, T *max) const;
+
   private:
     // MIPMap Private Methods
     
@@ -120,6 +124,8 @@ class MIPMap {
 
     T triangle(int level, const Point2f &st) const;
     T EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const;
+    void BuildRanges() const;
+    void BoundBlocks(int s0, int s1, int t0, int t1, T *min, T *max) const;
 
     // MIPMap Private Data
     const bool doTrilinear;
@@ -128,6 +134,10 @@ class MIPMap {
     Point2i resolution;
     // TODO: texture_pyramid pyramid; ֻһ vector Ƿ???
     std::vector<std::unique_ptr<BlockedArray<T>>> pyramid; // 
+    // (min, max) of the finest level over $2^l \times 2^l$ blocks of texels
+    mutable std::once_flag rangesBuilt;
+    mutable std::vector<Point2i> rangesResolution;
+    mutable std::vector<std::vector<std::pair<T, T>>> ranges;
 
     static PBRT_CONSTEXPR int WeightLUTSize = 128;
     static Float weightLut[WeightLUTSize];
@@ -459,6 +469,120 @@ T MIPMap<T>::EWA(int level, Point2f st, Vector2f dst0, Vector2f dst1) const
     return sum / sumWts; // P638
 }
 
+template <typename T>
+bool MIPMap<T>::Bound(const Bounds2f &st, T *min, T *max) const {
+    std::call_once(rangesBuilt, [this]() { BuildRanges(); });
+
+    // Find the finest-level texels that unfiltered lookups in $[x_0, x_1]$
+    // interpolate along an axis; repeating textures may need two intervals
+    bool outside = false;
+    auto texelIntervals = [&](Float x0, Float x1, int res, int iv[2][2]) {
+        if (!(x0 <= x1)) return 0;
+        if (wrapMode == ImageWrap::Repeat) {
+            if (x1 - x0 >= res - 1) {
+                iv[0][0] = 0;
+                iv[0][1] = res - 1;
+                return 1;
+            }
+            if (std::abs(x0) > (1 << 30) || std::abs(x1) > (1 << 30)) return 0;
+            int a = std::floor(x0), b = (int)std::floor(x1) + 1;
+            int start = Mod(a, res), end = start + (b - a);
+            iv[0][0] = start;
+            iv[0][1] = std::min(end, res - 1);
+            if (end < res) return 1;
+            iv[1][0] = 0;
+            iv[1][1] = end - res;
+            return 2;
+        }
+        int a = std::floor(Clamp(x0, -1, res));
+        int b = (int)std::floor(Clamp(x1, -1, res)) + 1;
+        if (a < 0 || b >= res) outside = true;
+        iv[0][0] = Clamp(a, 0, res - 1);
+        iv[0][1] = Clamp(b, 0, res - 1);
+        return 1;
+    };
+
+    // Lookups interpolate between the four texels around
+    // $(s w - 1/2, t h - 1/2)$; pad the region to cover round-off in the
+    // $(s,t)$ they're given
+    const Point2i &res = rangesResolution[0];
+    Float pad = 1e-5f * (1 + std::max({std::abs(st.pMin[0]), std::abs(st.pMin[1]),
+                                       std::abs(st.pMax[0]), std::abs(st.pMax[1])}));
+    int sIntervals[2][2], tIntervals[2][2];
+    int nS = texelIntervals((st.pMin[0] - pad) * res.x - .5f,
+                            (st.pMax[0] + pad) * res.x - .5f, res.x, sIntervals);
+    int nT = texelIntervals((st.pMin[1] - pad) * res.y - .5f,
+                            (st.pMax[1] + pad) * res.y - .5f, res.y, tIntervals);
+    if (nS == 0 || nT == 0) return false;
+
+    *min = T(Infinity);
+    *max = T(-Infinity);
+    for (int i = 0; i < nS; ++i)
+        for (int j = 0; j < nT; ++j)
+            BoundBlocks(sIntervals[i][0], sIntervals[i][1], tIntervals[j][0],
+                        tIntervals[j][1], min, max);
+    if (outside && wrapMode == ImageWrap::Black) {
+        *min = std::min(*min, T(0.f));
+        *max = std::max(*max, T(0.f));
+    }
+    return true;
+}
+
+template <typename T>
+void MIPMap<T>::BuildRanges() const {
+    const BlockedArray<T> &finest = *pyramid[0];
+    Point2i res(finest.uSize(), finest.vSize());
+    rangesResolution.push_back(res);
+    ranges.emplace_back(res.x * res.y);
+    for (int t = 0; t < res.y; ++t)
+        for (int s = 0; s < res.x; ++s)
+            ranges[0][t * res.x + s] = std::make_pair(finest(s, t), finest(s, t));
+    size_t nEntries = ranges[0].size();
+
+    // Each coarser level merges the ranges of $2 \times 2$ finer blocks
+    while (res.x > 1 || res.y > 1) {
+        Point2i coarseRes(std::max(1, res.x / 2), std::max(1, res.y / 2));
+        std::vector<std::pair<T, T>> coarse(coarseRes.x * coarseRes.y);
+        const std::vector<std::pair<T, T>> &fine = ranges.back();
+        for (int t = 0; t < coarseRes.y; ++t)
+            for (int s = 0; s < coarseRes.x; ++s) {
+                std::pair<T, T> &r = coarse[t * coarseRes.x + s];
+                r = fine[2 * t * res.x + 2 * s];
+                for (int dt = 0; dt < 2; ++dt)
+                    for (int ds = 0; ds < 2; ++ds) {
+                        int fs = std::min(2 * s + ds, res.x - 1);
+                        int ft = std::min(2 * t + dt, res.y - 1);
+                        const std::pair<T, T> &f = fine[ft * res.x + fs];
+                        r.first = std::min(r.first, f.first);
+                        r.second = std::max(r.second, f.second);
+                    }
+            }
+        nEntries += coarse.size();
+        ranges.push_back(std::move(coarse));
+        rangesResolution.push_back(coarseRes);
+        res = coarseRes;
+    }
+    mipMapMemory += nEntries * sizeof(std::pair<T, T>);
+}
+
+template <typename T>
+void MIPMap<T>::BoundBlocks(int s0, int s1, int t0, int t1, T *min,
+                            T *max) const {
+    // Use the finest level at which the texels span at most $4 \times 4$
+    // blocks
+    int level = 0;
+    while (level + 1 < (int)ranges.size() &&
+           ((s1 >> level) - (s0 >> level) > 3 || (t1 >> level) - (t0 >> level) > 3))
+        ++level;
+    const Point2i &res = rangesResolution[level];
+    const std::vector<std::pair<T, T>> &r = ranges[level];
+    for (int t = t0 >> level; t <= std::min(t1 >> level, res.y - 1); ++t)
+        for (int s = s0 >> level; s <= std::min(s1 >> level, res.x - 1); ++s) {
+            *min = std::min(*min, r[t * res.x + s].first);
+            *max = std::max(*max, r[t * res.x + s].second);
+        }
+}
+
 template <typename T>
 Float MIPMap<T>::weightLut[WeightLUTSize];
 
@@ -1021,6 +1021,9 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 for (int i = 0; i < 4; ++i)
                     v[i] = parseNumber(nextToken(TokenRequired));
                 pbrtRotate(v[0], v[1], v[2], v[3]);
+            } else if (tok == "RenderFrame") {
+                string_view n = dequoteString(nextToken(TokenRequired));
+                pbrtRenderFrame(toString(n));
             } else
                 syntaxError(tok);
             break;
@@ -1077,6 +1080,14 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 syntaxError(tok);
             break;
 
+        case 'U':
+            if (tok == "UpdateMesh")
+                basicParamListEntrypoint(SpectrumType::Reflectance,
+                                         pbrtUpdateMesh);
+            else
+                syntaxError(tok);
+            break;
+
         case 'W':
             if (tok == "WorldBegin")
                 pbrtWorldBegin();
@@ -183,6 +183,8 @@ struct Options
     bool quickRender = false;
     bool quiet = false;
     bool cat = false, toPly = false;
+    // Memory budget of the cache of tessellated displaced geometry
+    int geometryCacheMB = 1024;
     std::string imageFile;
     // x0, x1, y0, y1
     Float cropWindow[2][2];
@@ -36,6 +36,7 @@
 #include "light.h"
 #include "interaction.h"
 #include "stats.h"
+#include <unordered_set>
 
 namespace pbrt {
 
@@ -43,6 +44,59 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+Bounds3f Primitive::ClippedWorldBound(const Bounds3f &clip) const {
+    return pbrt::Intersect(WorldBound(), clip);
+}
+
+void Primitive::IntersectBatch(const Ray *rays, int nRays,
+                               SurfaceInteraction *isects, bool *hits) const {
+    for (int i = 0; i < nRays; ++i) hits[i] = Intersect(rays[i], &isects[i]);
+}
+
+void Primitive::IntersectPBatch(const Ray *rays, int nRays, bool *hits) const {
+    for (int i = 0; i < nRays; ++i) hits[i] = IntersectP(rays[i]);
+}
+
+bool Primitive::FindOccluder(const Ray &r, const Primitive **occluder) const {
+    if (!IntersectP(r)) return false;
+    *occluder = this;
+    return true;
+}
+
+void Primitive::Refit() {}
+
+// Primitives refit so far by the outermost RefitPrimitives() call in
+// progress on this thread
+static PBRT_THREAD_LOCAL std::unordered_set<const Primitive *> *refitPrims;
+
+void RefitPrimitives(const std::vector<std::shared_ptr<Primitive>> &prims) {
+    std::unordered_set<const Primitive *> refit;
+    bool outermost = !refitPrims;
+    if (outermost) refitPrims = &refit;
+    for (const std::shared_ptr<Primitive> &p : prims) {
+        Primitive *prim = p.get();
+        while (const TransformedPrimitive *t =
+                   dynamic_cast<const TransformedPrimitive *>(prim))
+            prim = t->GetPrimitive().get();
+        // Shapes have nothing to refit
+        if (dynamic_cast<const GeometricPrimitive *>(prim)) continue;
+        if (refitPrims->insert(prim).second) prim->Refit();
+    }
+    if (outermost) refitPrims = nullptr;
+}
+
+// Aggregate Method Definitions
+bool Aggregate::FindOccluder(const Ray &r, const Primitive **occluder) const {
+    // Testing the whole aggregate again wouldn't save anything
+    *occluder = nullptr;
+    return IntersectP(r);
+}
+
+void Aggregate::Refit() {
+    Warning("Acceleration structure can't be refit; intersections with "
+            "modified geometry may be incorrect.");
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -102,6 +156,19 @@ bool TransformedPrimitive::IntersectP(const Ray &r) const {
     return primitive->IntersectP(InterpolatedWorldToPrim(r));
 }
 
+bool TransformedPrimitive::FindOccluder(const Ray &r,
+                                        const Primitive **occluder) const {
+    Transform InterpolatedPrimToWorld;
+    PrimitiveToWorld.Interpolate(r.time, &InterpolatedPrimToWorld);
+    const Primitive *inner = nullptr;
+    if (!primitive->FindOccluder(Inverse(InterpolatedPrimToWorld)(r), &inner))
+        return false;
+    // Primitives inside an aggregate expect rays in its space, so only a
+    // single transformed primitive can stand for the occluder
+    *occluder = inner == primitive.get() ? this : nullptr;
+    return true;
+}
+
 // GeometricPrimitive Method Definitions
 GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape> &shape,
                                        const std::shared_ptr<Material> &material,
@@ -116,6 +183,10 @@ GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape> &shape,
 
 Bounds3f GeometricPrimitive::WorldBound() const { return shape->WorldBound(); }
 
+Bounds3f GeometricPrimitive::ClippedWorldBound(const Bounds3f &clip) const {
+    return shape->ClippedWorldBound(clip);
+}
+
 bool GeometricPrimitive::IntersectP(const Ray &r) const {
     return shape->IntersectP(r);
 }
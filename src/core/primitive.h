@@ -57,12 +57,31 @@ class Primitive {
 
 	// 返回图片在世界空间中的包围盒, 最大的用处是构建空间加速结构
     virtual Bounds3f WorldBound() const = 0;
+    // Bounds of the part of the primitive inside _clip_; may be empty
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
 
 	// Primitive::Intersect() is responsible for updating Ray::tMax with this value if an intersection is found.
 	// 每次求交后都更新 ray.tMax, 避免比该交点更远的求交计算
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
 
+    // Batched versions of Intersect() and IntersectP() for _nRays_ rays;
+    // _hits[i]_ records whether _rays[i]_ found an intersection.  The
+    // default implementations handle the rays one at a time; aggregates
+    // override them to share node traversal across the batch.
+    virtual void IntersectBatch(const Ray *rays, int nRays,
+                                SurfaceInteraction *isects, bool *hits) const;
+    virtual void IntersectPBatch(const Ray *rays, int nRays,
+                                 bool *hits) const;
+    // Like IntersectP(), but also returns the primitive that blocks the
+    // ray in _occluder_, so that callers can test it first for similar
+    // rays.  _occluder_ is set to nullptr if no primitive more specific
+    // than this one is known.
+    virtual bool FindOccluder(const Ray &r, const Primitive **occluder) const;
+    // Brings any bounds the primitive caches up to date after the
+    // geometry beneath it has been modified in place.
+    virtual void Refit();
+
 	// P249
 	// GetAreaLight() returns a pointer to the AreaLight that describes the primitive’s emission distribution,
     // if the primitive is itself a light source.If the primitive is not emissive, this method should return nullptr.
@@ -94,6 +113,7 @@ class GeometricPrimitive : public Primitive {
   public:
     // GeometricPrimitive Public Methods
     virtual Bounds3f WorldBound() const;
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
     virtual bool IntersectP(const Ray &r) const;
     GeometricPrimitive(const std::shared_ptr<Shape> &shape,
@@ -105,6 +125,7 @@ class GeometricPrimitive : public Primitive {
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
                                     MemoryArena &arena, TransportMode mode,
                                     bool allowMultipleLobes) const;
+    const Shape *GetShape() const { return shape.get(); }
 
   private:
     // GeometricPrimitive Private Data
@@ -132,6 +153,7 @@ class TransformedPrimitive : public Primitive {
                          const AnimatedTransform &PrimitiveToWorld);
     bool Intersect(const Ray &r, SurfaceInteraction *in) const;
     bool IntersectP(const Ray &r) const;
+    bool FindOccluder(const Ray &r, const Primitive **occluder) const;
     const AreaLight *GetAreaLight() const { return nullptr; }
     const Material *GetMaterial() const { return nullptr; }
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -145,6 +167,10 @@ class TransformedPrimitive : public Primitive {
     Bounds3f WorldBound() const {
         return PrimitiveToWorld.MotionBounds(primitive->WorldBound());
     }
+    void Refit() { primitive->Refit(); }
+    const std::shared_ptr<Primitive> &GetPrimitive() const {
+        return primitive;
+    }
 
   private:
     // TransformedPrimitive Private Data
@@ -175,6 +201,8 @@ class TransformedPrimitive : public Primitive {
 class Aggregate : public Primitive {
   public:
     // Aggregate Public Methods
+    bool FindOccluder(const Ray &r, const Primitive **occluder) const;
+    void Refit();
     const AreaLight *GetAreaLight() const;
     const Material *GetMaterial() const;
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -182,6 +210,12 @@ class Aggregate : public Primitive {
                                     bool allowMultipleLobes) const;
 };
 
+// Calls Refit() on each of _prims_, or on the primitive inside each
+// _TransformedPrimitive_, skipping those that were already refit during the
+// outermost call in progress, so that objects shared by several instances
+// are refit once.
+void RefitPrimitives(const std::vector<std::shared_ptr<Primitive>> &prims);
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_PRIMITIVE_H
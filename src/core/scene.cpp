@@ -40,8 +40,28 @@ namespace pbrt {
 STAT_COUNTER("Intersections/Regular ray intersection tests",
              nIntersectionTests);
 STAT_COUNTER("Intersections/Shadow ray intersection tests", nShadowTests);
+STAT_PERCENT("Intersections/Shadow rays blocked by cached occluder",
+             nCachedOccluderHits, nCachedOccluderTests);
+
+// Per-thread cache of the primitive that last blocked a shadow ray toward
+// a light, indexed by a hash of the light's address
+struct OccluderCacheEntry {
+    uint64_t sceneId;
+    const Light *light;
+    const Primitive *occluder;
+};
+static PBRT_CONSTEXPR int occluderCacheSize = 64;
+static PBRT_THREAD_LOCAL OccluderCacheEntry occluderCache[occluderCacheSize];
+
+std::atomic<uint64_t> Scene::nextId{0};
 
 // Scene Method Definitions
+void Scene::Refit() {
+    aggregate->Refit();
+    worldBound = aggregate->WorldBound();
+    for (const auto &light : lights) light->Preprocess(*this);
+}
+
 bool Scene::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     ++nIntersectionTests;
     DCHECK_NE(ray.d, Vector3f(0,0,0));
@@ -54,6 +74,39 @@ bool Scene::IntersectP(const Ray &ray) const {
     return aggregate->IntersectP(ray);
 }
 
+bool Scene::IntersectP(const Ray &ray, const Light *light) const {
+    if (!light) return IntersectP(ray);
+    ++nShadowTests;
+    DCHECK_NE(ray.d, Vector3f(0,0,0));
+    OccluderCacheEntry &entry =
+        occluderCache[(reinterpret_cast<uintptr_t>(light) >> 4) %
+                      occluderCacheSize];
+    if (entry.sceneId == id && entry.light == light && entry.occluder) {
+        ++nCachedOccluderTests;
+        if (entry.occluder->IntersectP(ray)) {
+            ++nCachedOccluderHits;
+            return true;
+        }
+    }
+    const Primitive *occluder = nullptr;
+    if (!aggregate->FindOccluder(ray, &occluder)) return false;
+    entry = {id, light, occluder};
+    return true;
+}
+
+void Scene::IntersectBatch(const Ray *rays, int nRays,
+                           SurfaceInteraction *isects, bool *hits) const {
+    nIntersectionTests += nRays;
+    for (int i = 0; i < nRays; ++i) DCHECK_NE(rays[i].d, Vector3f(0, 0, 0));
+    aggregate->IntersectBatch(rays, nRays, isects, hits);
+}
+
+void Scene::IntersectPBatch(const Ray *rays, int nRays, bool *hits) const {
+    nShadowTests += nRays;
+    for (int i = 0; i < nRays; ++i) DCHECK_NE(rays[i].d, Vector3f(0, 0, 0));
+    aggregate->IntersectPBatch(rays, nRays, hits);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                         Spectrum *Tr) const {
     *Tr = Spectrum(1.f);
@@ -43,6 +43,7 @@
 #include "geometry.h"
 #include "primitive.h"
 #include "light.h"
+#include <atomic>
 
 namespace pbrt {
 
@@ -52,7 +53,7 @@ class Scene {
     // Scene Public Methods
     Scene(std::shared_ptr<Primitive> aggregate,
           const std::vector<std::shared_ptr<Light>> &lights)
-        : lights(lights), aggregate(aggregate) 
+        : lights(lights), aggregate(aggregate), id(++nextId)
 	{
         // Scene Constructor Implementation
         worldBound = aggregate->WorldBound();
@@ -66,9 +67,20 @@ class Scene {
         }
     }
     const Bounds3f &WorldBound() const { return worldBound; }
+    // Brings the acceleration structures, scene bounds and lights up to
+    // date after shapes have been modified in place.
+    void Refit();
 
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Shadow ray test for a ray toward _light_.  Each thread remembers the
+    // primitive that last blocked a shadow ray toward each light and tests
+    // it before traversing the scene, since neighboring shadow rays are
+    // often blocked by the same primitive.
+    bool IntersectP(const Ray &ray, const Light *light) const;
+    void IntersectBatch(const Ray *rays, int nRays, SurfaceInteraction *isects,
+                        bool *hits) const;
+    void IntersectPBatch(const Ray *rays, int nRays, bool *hits) const;
     bool IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                      Spectrum *transmittance) const;
 
@@ -82,6 +94,10 @@ class Scene {
     // Scene Private Data
     std::shared_ptr<Primitive> aggregate;
     Bounds3f worldBound;
+    // Distinguishes scenes in the occluder caches, even when a new scene is
+    // allocated where an old one was
+    const uint64_t id;
+    static std::atomic<uint64_t> nextId;
 };
 
 }  // namespace pbrt
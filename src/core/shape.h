@@ -72,6 +72,9 @@ class Shape {
 	// ʹöİΧнǰཻ, ԽʡཻĿ
     virtual Bounds3f ObjectBound() const = 0;
     virtual Bounds3f WorldBound() const;
+    // Bounds of the part of the shape inside _clip_, used by spatial-split
+    // BVH construction; the default is just the clipped world bound.
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
 
 	// ж ray Ƿ shape ཻ, ཻ㽻ϵ΢ּ
 	// ϸڼ Section 3.1.3 Intersection Tests
@@ -56,6 +56,12 @@ Point2f UVMapping2D::Map(const SurfaceInteraction &si, Vector2f *dstdx,
     return Point2f(su * si.uv[0] + du, sv * si.uv[1] + dv);
 }
 
+bool UVMapping2D::MapUVBounds(const Bounds2f &uv, Bounds2f *st) const {
+    *st = Bounds2f(Point2f(su * uv.pMin[0] + du, sv * uv.pMin[1] + dv),
+                   Point2f(su * uv.pMax[0] + du, sv * uv.pMax[1] + dv));
+    return true;
+}
+
 Point2f SphericalMapping2D::Map(const SurfaceInteraction &si, Vector2f *dstdx,
                                 Vector2f *dstdy) const 
 {
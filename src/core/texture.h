@@ -64,6 +64,12 @@ class TextureMapping2D {
     // ռĻռı仯
     virtual Point2f Map(const SurfaceInteraction &si, Vector2f *dstdx,
                         Vector2f *dstdy) const = 0;
+
+    // Bounds the (s, t) that Map() returns at points whose (u, v) are
+    // within _uv_, for mappings that depend only on (u, v)
+    virtual bool MapUVBounds(const Bounds2f &uv, Bounds2f *st) const {
+        return false;
+    }
 };
 
 class UVMapping2D : public TextureMapping2D {
@@ -72,6 +78,7 @@ class UVMapping2D : public TextureMapping2D {
     UVMapping2D(Float su = 1, Float sv = 1, Float du = 0, Float dv = 0);
     Point2f Map(const SurfaceInteraction &si, Vector2f *dstdx,
                 Vector2f *dstdy) const;
+    bool MapUVBounds(const Bounds2f &uv, Bounds2f *st) const;
 
   private:
     const Float su, sv, // scale
@@ -152,6 +159,13 @@ class Texture {
     // Texture Interface
     virtual T Evaluate(const SurfaceInteraction &) const = 0;
     virtual ~Texture() {}
+
+    // Bounds the values that Evaluate() returns at points whose (u, v)
+    // are within _uv_ and that have no differentials, if the texture can
+    // do so cheaply; triangles use this to bake their alpha textures.
+    virtual bool Bound(const Bounds2f &uv, T *min, T *max) const {
+        return false;
+    }
 };
 
 
@@ -78,7 +78,10 @@ Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
         Vector3f s = Normalize(isect.dpdu);
         Vector3f t = Cross(isect.n, s);
 
+        // Generate all of the occlusion rays and trace them as one batch
         const Point2f *u = sampler.Get2DArray(nSamples);
+        Ray *rays = arena.Alloc<Ray>(nSamples);
+        Float *weights = arena.Alloc<Float>(nSamples);
         for (int i = 0; i < nSamples; ++i) {
             Vector3f wi;
             Float pdf;
@@ -95,9 +98,13 @@ Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
                           s.y * wi.x + t.y * wi.y + n.y * wi.z,
                           s.z * wi.x + t.z * wi.y + n.z * wi.z);
 
-            if (!scene.IntersectP(isect.SpawnRay(wi)))
-                L += Dot(wi, n) / (pdf * nSamples);
+            rays[i] = isect.SpawnRay(wi);
+            weights[i] = Dot(wi, n) / (pdf * nSamples);
         }
+        bool *occluded = arena.Alloc<bool>(nSamples);
+        scene.IntersectPBatch(rays, nSamples, occluded);
+        for (int i = 0; i < nSamples; ++i)
+            if (!occluded[i]) L += weights[i];
     }
     return L;
 }
@@ -37,25 +37,55 @@
 #include "film.h"
 #include "interaction.h"
 #include "paramset.h"
+#include "parallel.h"
+#include "progressreporter.h"
+#include "sampler.h"
 #include "scene.h"
 #include "stats.h"
+#include <algorithm>
 
 namespace pbrt {
 
 // 꽫ͳ·ܹ··ȵϢ
 STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
 STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
+STAT_COUNTER("Integrator/Sorted ray batches", nSortedRayBatches);
+
+// State of a path between bounces
+struct PathState {
+    PathState(const RayDifferential &ray) : ray(ray) {}
+    Spectrum L = Spectrum(0.f), beta = Spectrum(1.f);  // P876, beta holds path throughput weight
+    RayDifferential ray;
+    bool specularBounce = false;  // ¼һǷھ
+    int bounces = 0;
+
+    // Added after book publication: etaScale tracks the accumulated effect
+    // of radiance scaling due to rays passing through refractive
+    // boundaries (see the derivation on p. 527 of the third edition). We
+    // track this value in order to remove it from beta when we apply
+    // Russian roulette; this is worthwhile, since it lets us sometimes
+    // avoid terminating refracted rays that are about to be refracted back
+    // out of a medium and thus have their beta value increased.
+    //
+	// etaScale ٹʱۼƷЧ(P527)
+	// Ӧö˹̶ʱͿԽ beta Ƴ
+	// ֹ media ĹԼ beta ???
+    Float etaScale = 1;
+};
 
 // PathIntegrator Method Definitions
 PathIntegrator::PathIntegrator(int maxDepth,
                                std::shared_ptr<const Camera> camera,
                                std::shared_ptr<Sampler> sampler,
                                const Bounds2i &pixelBounds, Float rrThreshold,
-                               const std::string &lightSampleStrategy)
+                               const std::string &lightSampleStrategy,
+                               bool sortRays)
     : SamplerIntegrator(camera, sampler, pixelBounds),
       maxDepth(maxDepth),
       rrThreshold(rrThreshold),
-      lightSampleStrategy(lightSampleStrategy) {}
+      lightSampleStrategy(lightSampleStrategy),
+      sortRays(sortRays) {}
 
 void PathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
     lightDistribution =
@@ -67,169 +97,310 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                             int depth) const 
 {
     ProfilePhase p(Prof::SamplerIntegratorLi);
+    PathState path(r);
+    for (;; ++path.bounces) {
+        // Intersect _ray_ with scene and store intersection in _isect_
+        SurfaceInteraction isect;
+        bool foundIntersection = scene.Intersect(path.ray, &isect);
+        if (!bounce(&path, foundIntersection, &isect, scene, sampler, arena))
+            break;
+    }
 
-    Spectrum L(0.f), beta(1.f);		// P876, beta holds path throughput weight
-    RayDifferential ray(r);
-    bool specularBounce = false;	// ¼һǷھ
-    int bounces;
+    ReportValue(pathLength, path.bounces);
 
-    // Added after book publication: etaScale tracks the accumulated effect
-    // of radiance scaling due to rays passing through refractive
-    // boundaries (see the derivation on p. 527 of the third edition). We
-    // track this value in order to remove it from beta when we apply
-    // Russian roulette; this is worthwhile, since it lets us sometimes
-    // avoid terminating refracted rays that are about to be refracted back
-    // out of a medium and thus have their beta value increased.
-    //
-	// etaScale ٹʱۼƷЧ(P527)
-	// Ӧö˹̶ʱͿԽ beta Ƴ
-	// ֹ media ĹԼ beta ???
-    Float etaScale = 1;
+    return path.L;
+}
 
-    for (bounces = 0;; ++bounces) 
+// Accounts for the path vertex at _isect_, if the ray found one, and
+// samples the ray for the next bounce; returns false once the path ends.
+bool PathIntegrator::bounce(PathState *path, bool foundIntersection,
+                            SurfaceInteraction *isectp, const Scene &scene,
+                            Sampler &sampler, MemoryArena &arena) const {
+    Spectrum &L = path->L, &beta = path->beta;
+    RayDifferential &ray = path->ray;
+    bool &specularBounce = path->specularBounce;
+    int &bounces = path->bounces;
+    Float &etaScale = path->etaScale;
+    SurfaceInteraction &isect = *isectp;
+
+    // Find next path vertex and accumulate contribution
+	// һۼƹ
+    VLOG(2) << "Path tracer bounce " << bounces << ", current L = " << L
+            << ", beta = " << beta;
+
+    // P877
+    // Possibly add emitted light at intersection
+	// Լ뽻㴦ԷɹԴֱĹ
+	// м佻 Le ᱻһֱӹռڣ BSDF δ룩
+	// ֻҪ򺬾 BSDF  Le
+    if (bounces == 0 || specularBounce) 
     {
-        // Find next path vertex and accumulate contribution
-		// һۼƹ
-        VLOG(2) << "Path tracer bounce " << bounces << ", current L = " << L
-                << ", beta = " << beta;
-
-        // Intersect _ray_ with scene and store intersection in _isect_
-        SurfaceInteraction isect;
-        bool foundIntersection = scene.Intersect(ray, &isect);
-
-        // P877
-        // Possibly add emitted light at intersection
-		// Լ뽻㴦ԷɹԴֱĹ
-		// м佻 Le ᱻһֱӹռڣ BSDF δ룩
-		// ֻҪ򺬾 BSDF  Le
-        if (bounces == 0 || specularBounce) 
+        // Add emitted light at path vertex or from the environment
+        if (foundIntersection) 
         {
-            // Add emitted light at path vertex or from the environment
-            if (foundIntersection) 
-            {
-                L += beta * isect.Le(-ray.d);
-                VLOG(2) << "Added Le -> L = " << L;
-            } 
-            else 
-            {
-                for (const auto &light : scene.infiniteLights)
-                    L += beta * light->Le(ray);
-                VLOG(2) << "Added infinite area lights -> L = " << L;
-            }
+            L += beta * isect.Le(-ray.d);
+            VLOG(2) << "Added Le -> L = " << L;
+        } 
+        else 
+        {
+            for (const auto &light : scene.infiniteLights)
+                L += beta * light->Le(ray);
+            VLOG(2) << "Added infinite area lights -> L = " << L;
         }
+    }
 
 
-        // Terminate path if ray escaped or _maxDepth_ was reached
-		// δҵ(뿪)Ѵ׷ȣֹ·
-        if (!foundIntersection || bounces >= maxDepth) break;
+    // Terminate path if ray escaped or _maxDepth_ was reached
+	// δҵ(뿪)Ѵ׷ȣֹ·
+    if (!foundIntersection || bounces >= maxDepth) return false;
 
 
-        // Compute scattering functions and skip over medium boundaries
-		//  surface ϵĲʼ bsdf medium ı߽(volpath )
-        isect.ComputeScatteringFunctions(ray, arena, true);
-        if (!isect.bsdf)
-        {
-            VLOG(2) << "Skipping intersection due to null bsdf";
-            ray = isect.SpawnRay(ray.d);
-            bounces--;
-            continue;
-        }
+    // Compute scattering functions and skip over medium boundaries
+	//  surface ϵĲʼ bsdf medium ı߽(volpath )
+    isect.ComputeScatteringFunctions(ray, arena, true);
+    if (!isect.bsdf)
+    {
+        VLOG(2) << "Skipping intersection due to null bsdf";
+        ray = isect.SpawnRay(ray.d);
+        bounces--;
+        return true;
+    }
 
-        const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
+    const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
 
-        // Sample illumination from lights to find path contribution.
-        // (But skip this for perfectly specular BSDFs.)
-		// ݹԴķֲ lights вԼ·ϵĹ
-		//  BSDFs , ֻȫ BSDFs ʱ
-        if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
-            0) 
-        {
-            ++totalPaths;
-            Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena,
-                                                       sampler, false, distrib); // Ĭϲ BSDFs
+    // Sample illumination from lights to find path contribution.
+    // (But skip this for perfectly specular BSDFs.)
+	// ݹԴķֲ lights вԼ·ϵĹ
+	//  BSDFs , ֻȫ BSDFs ʱ
+    if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
+        0) 
+    {
+        ++totalPaths;
+        Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena,
+                                                   sampler, false, distrib); // Ĭϲ BSDFs
 
-            VLOG(2) << "Sampled direct lighting Ld = " << Ld;
-            if (Ld.IsBlack()) ++zeroRadiancePaths;
-            CHECK_GE(Ld.y(), 0.f);
+        VLOG(2) << "Sampled direct lighting Ld = " << Ld;
+        if (Ld.IsBlack()) ++zeroRadiancePaths;
+        CHECK_GE(Ld.y(), 0.f);
 
-            L += Ld;
-        }
+        L += Ld;
+    }
+
+    // Sample BSDF to get new path direction
+	//  BSDF вµ·򣨼һߣ
+    Vector3f wo = -ray.d, wi;
+    Float pdf;
+    BxDFType flags;
+    Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
+                                      BSDF_ALL, &flags);
+    VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
+    if (f.IsBlack() || pdf == 0.f) return false;
+
+	// ·
+    beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+    VLOG(2) << "Updated beta = " << beta;
+    CHECK_GE(beta.y(), 0.f);
+    DCHECK(!std::isinf(beta.y()));
+
+    specularBounce = (flags & BSDF_SPECULAR) != 0;
+	// õ BSDF ˾͸ BTDF,  etaScale
+    if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) 
+    {
+        Float eta = isect.bsdf->eta;
+        // Update the term that tracks radiance scaling for refraction
+        // depending on whether the ray is entering or leaving the
+        // medium.
+		// ŴСȡڹǽ뻹뿪 medium
+        etaScale *= (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+    }
+
+    ray = isect.SpawnRay(wi); // ݵǰͳ䷽ wi ¹
 
-        // Sample BSDF to get new path direction
-		//  BSDF вµ·򣨼һߣ
-        Vector3f wo = -ray.d, wi;
-        Float pdf;
-        BxDFType flags;
-        Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
-                                          BSDF_ALL, &flags);
-        VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
-        if (f.IsBlack() || pdf == 0.f) break;
-
-		// ·
-        beta *= f * AbsDot(wi, isect.shading.n) / pdf;
-        VLOG(2) << "Updated beta = " << beta;
-        CHECK_GE(beta.y(), 0.f);
-        DCHECK(!std::isinf(beta.y()));
 
+    // Account for subsurface scattering, if applicable
+	// αɢ
+    if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) 
+    {
+        // Importance sample the BSSRDF
+        SurfaceInteraction pi;
+        Spectrum S = isect.bssrdf->Sample_S(
+            scene, sampler.Get1D(), sampler.Get2D(), arena, &pi, &pdf);
+        DCHECK(!std::isinf(beta.y()));
+        if (S.IsBlack() || pdf == 0) return false;
+        beta *= S / pdf;
+
+        // Account for the direct subsurface scattering component
+        L += beta * UniformSampleOneLight(pi, scene, arena, sampler, false,
+                                          lightDistribution->Lookup(pi.p));
+
+        // Account for the indirect subsurface scattering component
+        Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
+                                       BSDF_ALL, &flags);
+        if (f.IsBlack() || pdf == 0) return false;
+        beta *= f * AbsDot(wi, pi.shading.n) / pdf;
+        DCHECK(!std::isinf(beta.y()));
         specularBounce = (flags & BSDF_SPECULAR) != 0;
-		// õ BSDF ˾͸ BTDF,  etaScale
-        if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) 
-        {
-            Float eta = isect.bsdf->eta;
-            // Update the term that tracks radiance scaling for refraction
-            // depending on whether the ray is entering or leaving the
-            // medium.
-			// ŴСȡڹǽ뻹뿪 medium
-            etaScale *= (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
-        }
+        ray = pi.SpawnRay(wi);
+    }
 
-        ray = isect.SpawnRay(wi); // ݵǰͳ䷽ wi ¹
 
+    // Possibly terminate the path with Russian roulette.
+    // Factor out radiance scaling due to refraction in rrBeta.
+	// ݶ˹̶ĵĽֹ
+	// Ƕ beta зȻ
+    Spectrum rrBeta = beta * etaScale;
+    if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) 
+    {
+        Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+        if (sampler.Get1D() < q) return false;
+        beta /= 1 - q;
+        DCHECK(!std::isinf(beta.y()));
+    }
+    return true;
+}
 
-        // Account for subsurface scattering, if applicable
-		// αɢ
-        if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) 
-        {
-            // Importance sample the BSSRDF
-            SurfaceInteraction pi;
-            Spectrum S = isect.bssrdf->Sample_S(
-                scene, sampler.Get1D(), sampler.Get2D(), arena, &pi, &pdf);
-            DCHECK(!std::isinf(beta.y()));
-            if (S.IsBlack() || pdf == 0) break;
-            beta *= S / pdf;
-
-            // Account for the direct subsurface scattering component
-            L += beta * UniformSampleOneLight(pi, scene, arena, sampler, false,
-                                              lightDistribution->Lookup(pi.p));
-
-            // Account for the indirect subsurface scattering component
-            Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
-                                           BSDF_ALL, &flags);
-            if (f.IsBlack() || pdf == 0) break;
-            beta *= f * AbsDot(wi, pi.shading.n) / pdf;
-            DCHECK(!std::isinf(beta.y()));
-            specularBounce = (flags & BSDF_SPECULAR) != 0;
-            ray = pi.SpawnRay(wi);
-        }
+// Sort key for a ray: its direction octant, then the Morton code of its
+// origin's cell in a grid over the scene bounds
+static uint64_t RaySortKey(const Ray &ray, const Bounds3f &bounds) {
+    Vector3f o = bounds.Offset(ray.o);
+    for (int i = 0; i < 3; ++i) o[i] = Clamp(o[i], 0, 1) * 1024;
+    uint64_t octant = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+    return (octant << 30) | EncodeMorton3(o);
+}
 
+void PathIntegrator::Render(const Scene &scene) {
+    if (sortRays)
+        renderSorted(scene);
+    else
+        SamplerIntegrator::Render(scene);
+}
 
-        // Possibly terminate the path with Russian roulette.
-        // Factor out radiance scaling due to refraction in rrBeta.
-		// ݶ˹̶ĵĽֹ
-		// Ƕ beta зȻ
-        Spectrum rrBeta = beta * etaScale;
-        if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) 
-        {
-            Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
-            if (sampler.Get1D() < q) break;
-            beta /= 1 - q;
-            DCHECK(!std::isinf(beta.y()));
+// Renders the image like SamplerIntegrator::Render(), but with the paths
+// through all of a tile's pixels traced together.  Each pixel has a
+// sampler of its own, since its path has to keep drawing samples while
+// the other pixels' paths are in flight.
+void PathIntegrator::renderSorted(const Scene &scene) {
+    Preprocess(scene, *sampler);
+
+    // Larger tiles than SamplerIntegrator::Render()'s give larger batches
+    // of rays to sort
+    const int tileSize = 32;
+    Bounds2i sampleBounds = camera->film->GetSampleBounds();
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+    const Bounds3f sceneBounds = scene.WorldBound();
+    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
+    ParallelFor2D([&](Point2i tile) {
+        MemoryArena arena;
+        int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+        int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+        Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+        LOG(INFO) << "Starting image tile " << tileBounds;
+        std::unique_ptr<FilmTile> filmTile =
+            camera->film->GetFilmTile(tileBounds);
+
+        // Get a sampler for each pixel of the tile
+        std::vector<Point2i> pixels;
+        std::vector<std::unique_ptr<Sampler>> pixelSamplers;
+        for (Point2i pixel : tileBounds) {
+            if (!InsideExclusive(pixel, pixelBounds)) continue;
+            Vector2i offset = pixel - sampleBounds.pMin;
+            pixelSamplers.push_back(
+                sampler->Clone(offset.y * sampleExtent.x + offset.x));
+            ProfilePhase pp(Prof::StartPixel);
+            pixelSamplers.back()->StartPixel(pixel);
+            pixels.push_back(pixel);
         }
-    }
 
-    ReportValue(pathLength, bounces);
+        int nPixels = pixels.size();
+        std::vector<CameraSample> cameraSamples(nPixels);
+        std::vector<Float> rayWeights(nPixels);
+        std::vector<PathState> paths;
+        std::vector<int> active;
+        std::vector<std::pair<uint64_t, int>> keys;
+        std::vector<Ray> rays;
+        std::vector<SurfaceInteraction> isects;
+        std::unique_ptr<bool[]> hits(new bool[nPixels]);
+        bool moreSamples = nPixels > 0;
+        while (moreSamples) {
+            // Start a path through each pixel
+            paths.clear();
+            active.clear();
+            for (int i = 0; i < nPixels; ++i) {
+                cameraSamples[i] = pixelSamplers[i]->GetCameraSample(pixels[i]);
+                RayDifferential ray;
+                rayWeights[i] =
+                    camera->GenerateRayDifferential(cameraSamples[i], &ray);
+                ray.ScaleDifferentials(
+                    1 / std::sqrt((Float)pixelSamplers[i]->samplesPerPixel));
+                ++nCameraRays;
+                paths.push_back(PathState(ray));
+                if (rayWeights[i] > 0) active.push_back(i);
+            }
+
+            // Trace the paths one bounce at a time
+            for (int depth = 0; !active.empty(); ++depth) {
+                // Camera rays are already coherent; sort the others
+                if (depth > 0) {
+                    keys.clear();
+                    for (int i : active)
+                        keys.push_back(std::make_pair(
+                            RaySortKey(paths[i].ray, sceneBounds), i));
+                    std::sort(keys.begin(), keys.end());
+                    for (size_t j = 0; j < keys.size(); ++j)
+                        active[j] = keys[j].second;
+                    ++nSortedRayBatches;
+                }
+
+                int nRays = active.size();
+                rays.clear();
+                for (int i : active) rays.push_back(paths[i].ray);
+                isects.assign(nRays, SurfaceInteraction());
+                scene.IntersectBatch(rays.data(), nRays, isects.data(),
+                                     hits.get());
+
+                ProfilePhase pp(Prof::SamplerIntegratorLi);
+                int nActive = 0;
+                for (int j = 0; j < nRays; ++j) {
+                    int i = active[j];
+                    paths[i].ray.tMax = rays[j].tMax;
+                    if (bounce(&paths[i], hits[j], &isects[j], scene,
+                               *pixelSamplers[i], arena)) {
+                        ++paths[i].bounces;
+                        active[nActive++] = i;
+                    } else
+                        ReportValue(pathLength, paths[i].bounces);
+                }
+                active.resize(nActive);
+            }
 
-    return L;
+            // Add the paths' radiance to the image
+            for (int i = 0; i < nPixels; ++i) {
+                Spectrum L = paths[i].L;
+                if (L.HasNaNs() || L.y() < -1e-5 || std::isinf(L.y())) {
+                    LOG(ERROR) << StringPrintf(
+                        "Invalid radiance value returned for pixel (%d, %d), "
+                        "sample %d. Setting to black.",
+                        pixels[i].x, pixels[i].y,
+                        (int)pixelSamplers[i]->CurrentSampleNumber());
+                    L = Spectrum(0.f);
+                }
+                filmTile->AddSample(cameraSamples[i].pFilm, L, rayWeights[i]);
+            }
+            arena.Reset();
+            for (const auto &pixelSampler : pixelSamplers)
+                moreSamples = pixelSampler->StartNextSample();
+        }
+        LOG(INFO) << "Finished image tile " << tileBounds;
+        camera->film->MergeFilmTile(std::move(filmTile));
+        reporter.Update();
+    }, nTiles);
+    reporter.Done();
+    LOG(INFO) << "Rendering finished";
+    camera->film->WriteImage();
 }
 
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
@@ -253,8 +424,9 @@ PathIntegrator *CreatePathIntegrator(const ParamSet &params,
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     std::string lightStrategy =
         params.FindOneString("lightsamplestrategy", "spatial");
+    bool sortRays = params.FindOneBool("sortrays", false);
     return new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-                              rrThreshold, lightStrategy);
+                              rrThreshold, lightStrategy, sortRays);
 }
 
 }  // namespace pbrt
@@ -45,25 +45,41 @@
 
 namespace pbrt {
 
+// PathIntegrator Forward Declarations
+struct PathState;
+
 // PathIntegrator Declarations
 class PathIntegrator : public SamplerIntegrator {
   public:
     // PathIntegrator Public Methods
+    // With _sortRays_, each thread traces the paths through all of the
+    // pixels of an image tile together, one bounce at a time, and sorts
+    // each bounce's rays by direction octant and origin before tracing
+    // them, so that nearby rays go through the BVH one after another.
     PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
                    std::shared_ptr<Sampler> sampler,
                    const Bounds2i &pixelBounds, Float rrThreshold = 1,
-                   const std::string &lightSampleStrategy = "spatial");	// ĬϲûڿռĹԴ
+                   const std::string &lightSampleStrategy = "spatial",	// ĬϲûڿռĹԴ
+                   bool sortRays = false);
 
     void Preprocess(const Scene &scene, Sampler &sampler);
+    void Render(const Scene &scene);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
 
   private:
+    // PathIntegrator Private Methods
+    bool bounce(PathState *path, bool foundIntersection,
+                SurfaceInteraction *isect, const Scene &scene,
+                Sampler &sampler, MemoryArena &arena) const;
+    void renderSorted(const Scene &scene);
+
     // PathIntegrator Private Data
     const int maxDepth; // ݹ, ﵽʱ, ûΪ Russian Roulette ֹͣ, Ҳֹ·
     const Float rrThreshold;	// Russian Roulette Threshold˹̶ĵķ
 
     const std::string lightSampleStrategy;
+    const bool sortRays;
     std::unique_ptr<LightDistribution> lightDistribution;
 };
 
@@ -75,7 +75,7 @@ Spectrum WhittedIntegrator::Li(const RayDifferential &ray, const Scene &scene,
             light->Sample_Li(isect, sampler.Get2D(), &wi, &pdf, &visibility);
         if (Li.IsBlack() || pdf == 0) continue;
         Spectrum f = isect.bsdf->f(wo, wi);
-        if (!f.IsBlack() && visibility.Unoccluded(scene))
+        if (!f.IsBlack() && visibility.Unoccluded(scene, light.get()))
             L += f * Li * AbsDot(wi, n) / pdf;
     }
     if (depth + 1 < maxDepth) {
@@ -39,6 +39,41 @@
 
 namespace pbrt {
 
+// Diffuse Light Local Definitions
+// Samples a cosine-weighted direction leaving a diffuse emitter at a point
+// with normal _n_, on either side if it's _twoSided_
+static Vector3f SampleEmittedDirection(const Point2f &u2, const Normal3f &n,
+                                       bool twoSided, Float *pdfDir) {
+    Vector3f w;
+    if (twoSided) {
+        Point2f u = u2;
+        // Choose a side to sample and then remap u[0] to [0,1] before
+        // applying cosine-weighted hemisphere sampling for the chosen side.
+        if (u[0] < .5) {
+            u[0] = std::min(u[0] * 2, OneMinusEpsilon);
+            w = CosineSampleHemisphere(u);
+        } else {
+            u[0] = std::min((u[0] - .5f) * 2, OneMinusEpsilon);
+            w = CosineSampleHemisphere(u);
+            w.z *= -1;
+        }
+        *pdfDir = 0.5f * CosineHemispherePdf(std::abs(w.z));
+    } else {
+        w = CosineSampleHemisphere(u2);
+        *pdfDir = CosineHemispherePdf(w.z);
+    }
+
+    Vector3f v1, v2;
+    CoordinateSystem(Vector3f(n), &v1, &v2);
+    return w.x * v1 + w.y * v2 + w.z * Vector3f(n);
+}
+
+static Float EmittedDirectionPdf(const Vector3f &w, const Normal3f &n,
+                                 bool twoSided) {
+    return twoSided ? (.5 * CosineHemispherePdf(AbsDot(n, w)))
+                    : CosineHemispherePdf(Dot(n, w));
+}
+
 // DiffuseAreaLight Method Definitions
 DiffuseAreaLight::DiffuseAreaLight(const Transform &LightToWorld,
                                    const MediumInterface &mediumInterface,
@@ -103,28 +138,7 @@ Spectrum DiffuseAreaLight::Sample_Le(const Point2f &u1, const Point2f &u2,
     *nLight = pShape.n;
 
     // Sample a cosine-weighted outgoing direction _w_ for area light
-    Vector3f w;
-    if (twoSided) {
-        Point2f u = u2;
-        // Choose a side to sample and then remap u[0] to [0,1] before
-        // applying cosine-weighted hemisphere sampling for the chosen side.
-        if (u[0] < .5) {
-            u[0] = std::min(u[0] * 2, OneMinusEpsilon);
-            w = CosineSampleHemisphere(u);
-        } else {
-            u[0] = std::min((u[0] - .5f) * 2, OneMinusEpsilon);
-            w = CosineSampleHemisphere(u);
-            w.z *= -1;
-        }
-        *pdfDir = 0.5f * CosineHemispherePdf(std::abs(w.z));
-    } else {
-        w = CosineSampleHemisphere(u2);
-        *pdfDir = CosineHemispherePdf(w.z);
-    }
-
-    Vector3f v1, v2, n(pShape.n);
-    CoordinateSystem(n, &v1, &v2);
-    w = w.x * v1 + w.y * v2 + w.z * n;
+    Vector3f w = SampleEmittedDirection(u2, pShape.n, twoSided, pdfDir);
     *ray = pShape.SpawnRay(w);
     return L(pShape, w);
 }
@@ -135,8 +149,7 @@ void DiffuseAreaLight::Pdf_Le(const Ray &ray, const Normal3f &n, Float *pdfPos,
     Interaction it(ray.o, n, Vector3f(), Vector3f(n), ray.time,
                    mediumInterface);
     *pdfPos = shape->Pdf(it);
-    *pdfDir = twoSided ? (.5 * CosineHemispherePdf(AbsDot(n, ray.d)))
-                       : CosineHemispherePdf(Dot(n, ray.d));
+    *pdfDir = EmittedDirectionPdf(ray.d, n, twoSided);
 }
 
 std::shared_ptr<AreaLight> CreateDiffuseAreaLight(
@@ -152,4 +165,126 @@ std::shared_ptr<AreaLight> CreateDiffuseAreaLight(
                                               nSamples, shape, twoSided);
 }
 
+// DiffuseMeshLight Method Definitions
+DiffuseMeshLight::DiffuseMeshLight(const Transform &LightToWorld,
+                                   const MediumInterface &mediumInterface,
+                                   const Spectrum &Lemit, int nSamples,
+                                   std::vector<std::shared_ptr<Shape>> shapes,
+                                   bool twoSided)
+    : AreaLight(LightToWorld, mediumInterface, nSamples),
+      Lemit(Lemit),
+      shapes(std::move(shapes)),
+      twoSided(twoSided) {
+    CHECK(!this->shapes.empty());
+    // All of the shapes emit the same radiance, so their power is
+    // proportional to their area
+    std::vector<Float> shapeArea;
+    shapeArea.reserve(this->shapes.size());
+    double areaSum = 0;
+    for (const auto &shape : this->shapes) {
+        shapeArea.push_back(shape->Area());
+        areaSum += shapeArea.back();
+    }
+    area = areaSum;
+    shapeDistrib.reset(new Distribution1D(shapeArea.data(), shapeArea.size()));
+
+    if (WorldToLight.HasScale() &&
+        dynamic_cast<const Triangle *>(this->shapes[0].get()) == nullptr)
+        Warning(
+            "Scaling detected in world to light transformation! "
+            "The system has numerous assumptions, implicit and explicit, "
+            "that this transform will have no scale factors in it. "
+            "Proceed at your own risk; your image may have errors.");
+}
+
+Spectrum DiffuseMeshLight::Power() const {
+    return (twoSided ? 2 : 1) * Lemit * area * Pi;
+}
+
+Spectrum DiffuseMeshLight::Sample_Li(const Interaction &ref, const Point2f &u,
+                                     Vector3f *wi, Float *pdf,
+                                     VisibilityTester *vis) const {
+    ProfilePhase _(Prof::LightSample);
+    // Choose a shape in proportion to its area and sample a point on it
+    Float shapePdf, uRemapped;
+    int index = shapeDistrib->SampleDiscrete(u[0], &shapePdf, &uRemapped);
+    Interaction pShape =
+        shapes[index]->Sample(ref, Point2f(uRemapped, u[1]), pdf);
+    pShape.mediumInterface = mediumInterface;
+    *pdf *= shapePdf;
+    if (*pdf == 0 || (pShape.p - ref.p).LengthSquared() == 0) {
+        *pdf = 0;
+        return 0.f;
+    }
+
+    *wi = Normalize(pShape.p - ref.p);
+    *vis = VisibilityTester(ref, pShape);
+    return L(pShape, -*wi);
+}
+
+Float DiffuseMeshLight::Pdf_Li(const Interaction &ref,
+                               const Vector3f &wi) const {
+    ProfilePhase _(Prof::LightPdf);
+    // Find the first shape along _wi_; this has to test all of them, so
+    // integrators use Pdf_LiHit() with the surface they find instead
+    Ray ray = ref.SpawnRay(wi);
+    const Shape *first = nullptr;
+    for (const auto &shape : shapes) {
+        Float tHit;
+        SurfaceInteraction isect;
+        if (shape->Intersect(ray, &tHit, &isect, false)) {
+            ray.tMax = tHit;
+            first = shape.get();
+        }
+    }
+    return first ? first->Pdf(ref, wi) * first->Area() / area : 0;
+}
+
+Float DiffuseMeshLight::Pdf_LiHit(const Interaction &ref, const Vector3f &wi,
+                                  const SurfaceInteraction &lightIsect) const {
+    ProfilePhase _(Prof::LightPdf);
+    return lightIsect.shape->Pdf(ref, wi) * lightIsect.shape->Area() / area;
+}
+
+Spectrum DiffuseMeshLight::Sample_Le(const Point2f &u1, const Point2f &u2,
+                                     Float time, Ray *ray, Normal3f *nLight,
+                                     Float *pdfPos, Float *pdfDir) const {
+    ProfilePhase _(Prof::LightSample);
+    // Sample a point on one of the shapes, _pShape_
+    Float shapePdf, uRemapped;
+    int index = shapeDistrib->SampleDiscrete(u1[0], &shapePdf, &uRemapped);
+    Interaction pShape = shapes[index]->Sample(Point2f(uRemapped, u1[1]), pdfPos);
+    pShape.mediumInterface = mediumInterface;
+    *pdfPos *= shapePdf;
+    *nLight = pShape.n;
+
+    // Sample a cosine-weighted outgoing direction _w_ for area light
+    Vector3f w = SampleEmittedDirection(u2, pShape.n, twoSided, pdfDir);
+    *ray = pShape.SpawnRay(w);
+    return L(pShape, w);
+}
+
+void DiffuseMeshLight::Pdf_Le(const Ray &ray, const Normal3f &n, Float *pdfPos,
+                              Float *pdfDir) const {
+    ProfilePhase _(Prof::LightPdf);
+    // Choosing shapes in proportion to their area makes the density of
+    // sampled points uniform over all of them
+    *pdfPos = 1 / area;
+    *pdfDir = EmittedDirectionPdf(ray.d, n, twoSided);
+}
+
+std::shared_ptr<AreaLight> CreateDiffuseMeshLight(
+    const Transform &light2world, const Medium *medium,
+    const ParamSet &paramSet, std::vector<std::shared_ptr<Shape>> shapes) {
+    Spectrum L = paramSet.FindOneSpectrum("L", Spectrum(1.0));
+    Spectrum sc = paramSet.FindOneSpectrum("scale", Spectrum(1.0));
+    int nSamples = paramSet.FindOneInt("samples",
+                                       paramSet.FindOneInt("nsamples", 1));
+    bool twoSided = paramSet.FindOneBool("twosided", false);
+    if (PbrtOptions.quickRender) nSamples = std::max(1, nSamples / 4);
+    return std::make_shared<DiffuseMeshLight>(light2world, medium, L * sc,
+                                              nSamples, std::move(shapes),
+                                              twoSided);
+}
+
 }  // namespace pbrt
@@ -42,6 +42,7 @@
 #include "pbrt.h"
 #include "light.h"
 #include "primitive.h"
+#include "sampling.h"
 
 namespace pbrt {
 
@@ -79,9 +80,49 @@ class DiffuseAreaLight : public AreaLight {
     const Float area;
 };
 
+// DiffuseMeshLight Declarations
+// A DiffuseMeshLight is a single light for many shapes with the same uniform
+// emission, like the triangles of an emissive mesh, which chooses among them
+// in proportion to their power (and so their area) when it's sampled.
+class DiffuseMeshLight : public AreaLight {
+  public:
+    // DiffuseMeshLight Public Methods
+    DiffuseMeshLight(const Transform &LightToWorld,
+                     const MediumInterface &mediumInterface, const Spectrum &Le,
+                     int nSamples, std::vector<std::shared_ptr<Shape>> shapes,
+                     bool twoSided = false);
+
+    Spectrum L(const Interaction &intr, const Vector3f &w) const {
+        return (twoSided || Dot(intr.n, w) > 0) ? Lemit : Spectrum(0.f);
+    }
+    Spectrum Power() const;
+    Spectrum Sample_Li(const Interaction &ref, const Point2f &u, Vector3f *wo,
+                       Float *pdf, VisibilityTester *vis) const;
+    Float Pdf_Li(const Interaction &, const Vector3f &) const;
+    bool PdfNeedsHit() const { return true; }
+    Float Pdf_LiHit(const Interaction &ref, const Vector3f &wi,
+                    const SurfaceInteraction &lightIsect) const;
+    Spectrum Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
+                       Ray *ray, Normal3f *nLight, Float *pdfPos,
+                       Float *pdfDir) const;
+    void Pdf_Le(const Ray &, const Normal3f &, Float *pdfPos,
+                Float *pdfDir) const;
+
+  private:
+    // DiffuseMeshLight Private Data
+    const Spectrum Lemit;
+    const std::vector<std::shared_ptr<Shape>> shapes;
+    const bool twoSided;
+    Float area;
+    std::unique_ptr<Distribution1D> shapeDistrib;
+};
+
 std::shared_ptr<AreaLight> CreateDiffuseAreaLight(
     const Transform &light2world, const Medium *medium,
     const ParamSet &paramSet, const std::shared_ptr<Shape> &shape);
+std::shared_ptr<AreaLight> CreateDiffuseMeshLight(
+    const Transform &light2world, const Medium *medium,
+    const ParamSet &paramSet, std::vector<std::shared_ptr<Shape>> shapes);
 
 }  // namespace pbrt
 
@@ -47,6 +47,8 @@ static void usage(const char *msg = nullptr) {
     fprintf(stderr, R"(usage: pbrt [<options>] <filename.pbrt...>
 Rendering options:
   --cropwindow <x0,x1,y0,y1> Specify an image crop window.
+  --geomcache <MB>     Memory budget for displaced geometry that's tessellated
+                       during rendering. Default: 1024.
   --help               Print this help text.
   --nthreads <num>     Use specified number of threads for rendering.
   --outfile <filename> Write the final image to the given filename.
@@ -98,6 +100,17 @@ int main(int argc, char *argv[]) {
             options.cropWindow[0][1] = atof(argv[++i]);
             options.cropWindow[1][0] = atof(argv[++i]);
             options.cropWindow[1][1] = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--geomcache") ||
+                   !strcmp(argv[i], "-geomcache")) {
+            if (i + 1 == argc)
+                usage("missing value after --geomcache argument");
+            options.geometryCacheMB = atoi(argv[++i]);
+            if (options.geometryCacheMB <= 0)
+                usage("--geomcache must be given a positive size in MB");
+        } else if (!strncmp(argv[i], "--geomcache=", 12)) {
+            options.geometryCacheMB = atoi(&argv[i][12]);
+            if (options.geometryCacheMB <= 0)
+                usage("--geomcache must be given a positive size in MB");
         } else if (!strncmp(argv[i], "--outfile=", 10)) {
             options.imageFile = &argv[i][10];
         } else if (!strcmp(argv[i], "--logdir") || !strcmp(argv[i], "-logdir")) {
@@ -33,8 +33,15 @@
 
 // shapes/curve.cpp*
 #include "shapes/curve.h"
+#include "accelerators/bvh.h"
 #include "paramset.h"
+#include "parallel.h"
 #include "stats.h"
+#include <limits>
+#if defined(PBRT_HAVE_SSE) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <xmmintrin.h>
+#define PBRT_CURVE_SSE
+#endif
 
 namespace pbrt {
 
@@ -43,6 +50,11 @@ STAT_PERCENT("Intersections/Ray-curve intersection tests", nHits, nTests);
 STAT_INT_DISTRIBUTION("Intersections/Curve refinement level", refinementLevel);
 STAT_COUNTER("Scene/Curves", nCurves);
 STAT_COUNTER("Scene/Split curves", nSplitCurves);
+STAT_RATIO("Intersections/Curve segments tested exactly per test",
+           nSegmentCandidates, nSegmentTests);
+STAT_MEMORY_COUNTER("Memory/Curve set BVHs", curveSetBVHBytes);
+
+static PBRT_CONSTEXPR int maxPiecesInNode = 4;
 
 // Curve Utility Functions
 static Point3f BlossomBezier(const Point3f p[4], Float u0, Float u1, Float u2) {
@@ -83,6 +95,75 @@ static Point3f EvalBezier(const Point3f cp[4], Float u,
     return Lerp(u, cp2[0], cp2[1]);
 }
 
+// Returns how many times to split a curve segment in half for the line
+// segments approximating it to be within _eps_ of it, given the largest
+// second difference _L0_ of its control points
+static int RefinementDepth(Float L0, Float eps) {
+    auto Log2 = [](float v) -> int {
+        if (v < 1) return 0;
+        uint32_t bits = FloatToBits(v);
+        // https://graphics.stanford.edu/~seander/bithacks.html#IntegerLog
+        // (With an additional add so get round-to-nearest rather than
+        // round down.)
+        return (bits >> 23) - 127 + (bits & (1 << 22) ? 1 : 0);
+    };
+    // Compute log base 4 by dividing log2 in half.
+    int r0 = Log2(1.41421356237f * 6.f * L0 / (8.f * eps)) / 2;
+    return Clamp(r0, 0, 10);
+}
+
+// Bounds the part of the curve between _uMin_ and _uMax_ in object space
+static Bounds3f CurveBound(const CurveCommon &common, Float uMin, Float uMax) {
+    // Compute object-space control points for curve segment, _cpObj_
+    Point3f cpObj[4];
+    cpObj[0] = BlossomBezier(common.cpObj, uMin, uMin, uMin);
+    cpObj[1] = BlossomBezier(common.cpObj, uMin, uMin, uMax);
+    cpObj[2] = BlossomBezier(common.cpObj, uMin, uMax, uMax);
+    cpObj[3] = BlossomBezier(common.cpObj, uMax, uMax, uMax);
+    Bounds3f b =
+        Union(Bounds3f(cpObj[0], cpObj[1]), Bounds3f(cpObj[2], cpObj[3]));
+    Float width[2] = {Lerp(uMin, common.width[0], common.width[1]),
+                      Lerp(uMax, common.width[0], common.width[1])};
+    return Expand(b, std::max(width[0], width[1]) * 0.5f);
+}
+
+static Float CurveArea(const CurveCommon &common, Float uMin, Float uMax) {
+    // Compute object-space control points for curve segment, _cpObj_
+    Point3f cpObj[4];
+    cpObj[0] = BlossomBezier(common.cpObj, uMin, uMin, uMin);
+    cpObj[1] = BlossomBezier(common.cpObj, uMin, uMin, uMax);
+    cpObj[2] = BlossomBezier(common.cpObj, uMin, uMax, uMax);
+    cpObj[3] = BlossomBezier(common.cpObj, uMax, uMax, uMax);
+    Float width0 = Lerp(uMin, common.width[0], common.width[1]);
+    Float width1 = Lerp(uMax, common.width[0], common.width[1]);
+    Float avgWidth = (width0 + width1) * 0.5f;
+    Float approxLength = 0.f;
+    for (int i = 0; i < 3; ++i)
+        approxLength += Distance(cpObj[i], cpObj[i + 1]);
+    return approxLength * avgWidth;
+}
+
+// Intersects the object-space ray with the part of the curve between
+// _uMin_ and _uMax_, refining it as needed
+static bool IntersectCurve(const Shape &shape, const CurveCommon &common,
+                           Float uMin, Float uMax, const Ray &ray, Float *tHit,
+                           SurfaceInteraction *isect);
+
+static bool RecursiveIntersect(const Shape &shape, const CurveCommon &common,
+                               const Ray &ray, Float *tHit,
+                               SurfaceInteraction *isect, const Point3f cp[4],
+                               const Transform &rayToObject, Float u0, Float u1,
+                               int depth);
+
+// Intersects the ray with a curve segment given in ray space, treating it
+// as flat enough to need no further refinement
+static bool IntersectCurveSegment(const Shape &shape, const CurveCommon &common,
+                                  const Ray &ray, Float *tHit,
+                                  SurfaceInteraction *isect,
+                                  const Point3f cp[4],
+                                  const Transform &rayToObject, Float u0,
+                                  Float u1);
+
 // Curve Method Definitions
 CurveCommon::CurveCommon(const Point3f c[4], Float width0, Float width1,
                          CurveType type, const Normal3f *norm)
@@ -97,16 +178,41 @@ CurveCommon::CurveCommon(const Point3f c[4], Float width0, Float width1,
         normalAngle = std::acos(Clamp(Dot(n[0], n[1]), 0, 1));
         invSinNormalAngle = 1 / std::sin(normalAngle);
     }
-    ++nCurves;
 }
 
 std::vector<std::shared_ptr<Shape>> CreateCurve(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const Point3f *c, Float w0, Float w1, CurveType type,
-    const Normal3f *norm, int splitDepth) {
+    const Normal3f *norm, int splitDepth, bool presplit) {
     std::vector<std::shared_ptr<Shape>> segments;
     std::shared_ptr<CurveCommon> common =
         std::make_shared<CurveCommon>(c, w0, w1, type, norm);
+    ++nCurves;
+    if (presplit) {
+        // Split as far as Curve::Intersect() would refine the curve for
+        // any ray.  The control points' second differences bound their
+        // components in any ray coordinate system.  Each group of segments
+        // covers no more of the curve than one _Curve_ would, so that the
+        // BVH sees bounds that are just as tight.
+        Float L0 = 0;
+        for (int i = 0; i < 2; ++i)
+            L0 = std::max(L0, (Vector3f(c[i]) - 2 * Vector3f(c[i + 1]) +
+                               Vector3f(c[i + 2])).Length());
+        int depth = std::max(RefinementDepth(L0, std::max(w0, w1) * .05f),
+                             splitDepth + Log2Int(CurveSegmentLanes));
+        const int nSegments = 1 << depth;
+        for (int i = 0; i < nSegments; i += CurveSegmentLanes) {
+            int n = std::min(CurveSegmentLanes, nSegments - i);
+            segments.push_back(std::make_shared<CurveSegments>(
+                o2w, w2o, reverseOrientation, common, i / (Float)nSegments,
+                (i + n) / (Float)nSegments, n));
+        }
+        nSplitCurves += nSegments;
+        curveBytes +=
+            sizeof(CurveCommon) + segments.size() * sizeof(CurveSegments);
+        return segments;
+    }
+
     const int nSegments = 1 << splitDepth;
     segments.reserve(nSegments);
     for (int i = 0; i < nSegments; ++i) {
@@ -121,17 +227,7 @@ std::vector<std::shared_ptr<Shape>> CreateCurve(
 }
 
 Bounds3f Curve::ObjectBound() const {
-    // Compute object-space control points for curve segment, _cpObj_
-    Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
-    Bounds3f b =
-        Union(Bounds3f(cpObj[0], cpObj[1]), Bounds3f(cpObj[2], cpObj[3]));
-    Float width[2] = {Lerp(uMin, common->width[0], common->width[1]),
-                      Lerp(uMax, common->width[0], common->width[1])};
-    return Expand(b, std::max(width[0], width[1]) * 0.5f);
+    return CurveBound(*common, uMin, uMax);
 }
 
 bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
@@ -141,13 +237,18 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     // Transform _Ray_ to object space
     Vector3f oErr, dErr;
     Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+    return IntersectCurve(*this, *common, uMin, uMax, ray, tHit, isect);
+}
 
+static bool IntersectCurve(const Shape &shape, const CurveCommon &common,
+                           Float uMin, Float uMax, const Ray &ray, Float *tHit,
+                           SurfaceInteraction *isect) {
     // Compute object-space control points for curve segment, _cpObj_
     Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
+    cpObj[0] = BlossomBezier(common.cpObj, uMin, uMin, uMin);
+    cpObj[1] = BlossomBezier(common.cpObj, uMin, uMin, uMax);
+    cpObj[2] = BlossomBezier(common.cpObj, uMin, uMax, uMax);
+    cpObj[3] = BlossomBezier(common.cpObj, uMax, uMax, uMax);
 
     // Project curve control points to plane perpendicular to ray
 
@@ -158,7 +259,7 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     //
     // In turn (especially for curves that are approaching stright lines),
     // we get curve bounds with minimal extent in y, which in turn lets us
-    // early out more quickly in recursiveIntersect().
+    // early out more quickly in RecursiveIntersect().
     Vector3f dx = Cross(ray.d, cpObj[3] - cpObj[0]);
     if (dx.LengthSquared() == 0) {
         // If the ray and the vector between the first and last control
@@ -177,8 +278,8 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     // the curve's bounding box. We start with the y dimension, since the y
     // extent is generally the smallest (and is often tiny) due to our
     // careful orientation of the ray coordinate ysstem above.
-    Float maxWidth = std::max(Lerp(uMin, common->width[0], common->width[1]),
-                              Lerp(uMax, common->width[0], common->width[1]));
+    Float maxWidth = std::max(Lerp(uMin, common.width[0], common.width[1]),
+                              Lerp(uMax, common.width[0], common.width[1]));
     if (std::max(std::max(cp[0].y, cp[1].y), std::max(cp[2].y, cp[3].y)) +
             0.5f * maxWidth < 0 ||
         std::min(std::min(cp[0].y, cp[1].y), std::min(cp[2].y, cp[3].y)) -
@@ -211,28 +312,19 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
                     std::abs(cp[i].z - 2 * cp[i + 1].z + cp[i + 2].z)));
 
     Float eps =
-        std::max(common->width[0], common->width[1]) * .05f;  // width / 20
-    auto Log2 = [](float v) -> int {
-        if (v < 1) return 0;
-        uint32_t bits = FloatToBits(v);
-        // https://graphics.stanford.edu/~seander/bithacks.html#IntegerLog
-        // (With an additional add so get round-to-nearest rather than
-        // round down.)
-        return (bits >> 23) - 127 + (bits & (1 << 22) ? 1 : 0);
-    };
-    // Compute log base 4 by dividing log2 in half.
-    int r0 = Log2(1.41421356237f * 6.f * L0 / (8.f * eps)) / 2;
-    int maxDepth = Clamp(r0, 0, 10);
+        std::max(common.width[0], common.width[1]) * .05f;  // width / 20
+    int maxDepth = RefinementDepth(L0, eps);
     ReportValue(refinementLevel, maxDepth);
 
-    return recursiveIntersect(ray, tHit, isect, cp, Inverse(objectToRay), uMin,
-                              uMax, maxDepth);
+    return RecursiveIntersect(shape, common, ray, tHit, isect, cp,
+                              Inverse(objectToRay), uMin, uMax, maxDepth);
 }
 
-bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
+static bool RecursiveIntersect(const Shape &shape, const CurveCommon &common,
+                               const Ray &ray, Float *tHit,
                                SurfaceInteraction *isect, const Point3f cp[4],
                                const Transform &rayToObject, Float u0, Float u1,
-                               int depth) const {
+                               int depth) {
     Float rayLength = ray.d.Length();
 
     if (depth > 0) {
@@ -249,8 +341,8 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
         const Point3f *cps = cpSplit;
         for (int seg = 0; seg < 2; ++seg, cps += 3) {
             Float maxWidth =
-                std::max(Lerp(u[seg], common->width[0], common->width[1]),
-                         Lerp(u[seg + 1], common->width[0], common->width[1]));
+                std::max(Lerp(u[seg], common.width[0], common.width[1]),
+                         Lerp(u[seg + 1], common.width[0], common.width[1]));
 
             // As above, check y first, since it most commonly lets us exit
             // out early.
@@ -279,179 +371,735 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
                         0.5 * maxWidth > zMax)
                 continue;
 
-            hit |= recursiveIntersect(ray, tHit, isect, cps, rayToObject,
-                                      u[seg], u[seg + 1], depth - 1);
+            hit |= RecursiveIntersect(shape, common, ray, tHit, isect, cps,
+                                      rayToObject, u[seg], u[seg + 1],
+                                      depth - 1);
             // If we found an intersection and this is a shadow ray,
             // we can exit out immediately.
             if (hit && !tHit) return true;
         }
         return hit;
+    } else
+        return IntersectCurveSegment(shape, common, ray, tHit, isect, cp,
+                                     rayToObject, u0, u1);
+}
+
+static bool IntersectCurveSegment(const Shape &shape, const CurveCommon &common,
+                                  const Ray &ray, Float *tHit,
+                                  SurfaceInteraction *isect,
+                                  const Point3f cp[4],
+                                  const Transform &rayToObject, Float u0,
+                                  Float u1) {
+    Float rayLength = ray.d.Length();
+
+    // Test ray against segment endpoint boundaries
+
+    // Test sample point against tangent perpendicular at curve start
+    Float edge =
+        (cp[1].y - cp[0].y) * -cp[0].y + cp[0].x * (cp[0].x - cp[1].x);
+    if (edge < 0) return false;
+
+    // Test sample point against tangent perpendicular at curve end
+    edge = (cp[2].y - cp[3].y) * -cp[3].y + cp[3].x * (cp[3].x - cp[2].x);
+    if (edge < 0) return false;
+
+    // Compute line $w$ that gives minimum distance to sample point
+    Vector2f segmentDirection = Point2f(cp[3]) - Point2f(cp[0]);
+    Float denom = segmentDirection.LengthSquared();
+    if (denom == 0) return false;
+    Float w = Dot(-Vector2f(cp[0]), segmentDirection) / denom;
+
+    // Compute $u$ coordinate of curve intersection point and _hitWidth_
+    Float u = Clamp(Lerp(w, u0, u1), u0, u1);
+    Float hitWidth = Lerp(u, common.width[0], common.width[1]);
+    Normal3f nHit;
+    if (common.type == CurveType::Ribbon) {
+        // Scale _hitWidth_ based on ribbon orientation
+        Float sin0 = std::sin((1 - u) * common.normalAngle) *
+                     common.invSinNormalAngle;
+        Float sin1 =
+            std::sin(u * common.normalAngle) * common.invSinNormalAngle;
+        nHit = sin0 * common.n[0] + sin1 * common.n[1];
+        hitWidth *= AbsDot(nHit, ray.d) / rayLength;
+    }
+
+    // Test intersection point against curve width
+    Vector3f dpcdw;
+    Point3f pc = EvalBezier(cp, Clamp(w, 0, 1), &dpcdw);
+    Float ptCurveDist2 = pc.x * pc.x + pc.y * pc.y;
+    if (ptCurveDist2 > hitWidth * hitWidth * .25) return false;
+    Float zMax = rayLength * ray.tMax;
+    if (pc.z < 0 || pc.z > zMax) return false;
+
+    // Compute $v$ coordinate of curve intersection point
+    Float ptCurveDist = std::sqrt(ptCurveDist2);
+    Float edgeFunc = dpcdw.x * -pc.y + pc.x * dpcdw.y;
+    Float v = (edgeFunc > 0) ? 0.5f + ptCurveDist / hitWidth
+                             : 0.5f - ptCurveDist / hitWidth;
+
+    // Compute hit _t_ and partial derivatives for curve intersection
+    if (tHit != nullptr) {
+        // FIXME: this tHit isn't quite right for ribbons...
+        *tHit = pc.z / rayLength;
+        // Compute error bounds for curve intersection
+        Vector3f pError(2 * hitWidth, 2 * hitWidth, 2 * hitWidth);
+
+        // Compute $\dpdu$ and $\dpdv$ for curve intersection
+        Vector3f dpdu, dpdv;
+        EvalBezier(common.cpObj, u, &dpdu);
+        CHECK_NE(Vector3f(0, 0, 0), dpdu) << "u = " << u << ", cp = " <<
+            common.cpObj[0] << ", " << common.cpObj[1] << ", " <<
+            common.cpObj[2] << ", " << common.cpObj[3];
+
+        if (common.type == CurveType::Ribbon)
+            dpdv = Normalize(Cross(nHit, dpdu)) * hitWidth;
+        else {
+            // Compute curve $\dpdv$ for flat and cylinder curves
+            Vector3f dpduPlane = (Inverse(rayToObject))(dpdu);
+            Vector3f dpdvPlane =
+                Normalize(Vector3f(-dpduPlane.y, dpduPlane.x, 0)) *
+                hitWidth;
+            if (common.type == CurveType::Cylinder) {
+                // Rotate _dpdvPlane_ to give cylindrical appearance
+                Float theta = Lerp(v, -90., 90.);
+                Transform rot = Rotate(-theta, dpduPlane);
+                dpdvPlane = rot(dpdvPlane);
+            }
+            dpdv = rayToObject(dpdvPlane);
+        }
+        *isect = (*shape.ObjectToWorld)(SurfaceInteraction(
+            ray(*tHit), pError, Point2f(u, v), -ray.d, dpdu, dpdv,
+            Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time, &shape));
+    }
+    ++nHits;
+    return true;
+}
+
+Float Curve::Area() const { return CurveArea(*common, uMin, uMax); }
+
+Interaction Curve::Sample(const Point2f &u, Float *pdf) const {
+    LOG(FATAL) << "Curve::Sample not implemented.";
+    return Interaction();
+}
+
+// CurveSegments Method Definitions
+CurveSegments::CurveSegments(const Transform *ObjectToWorld,
+                             const Transform *WorldToObject,
+                             bool reverseOrientation,
+                             const std::shared_ptr<CurveCommon> &common,
+                             Float uMin, Float uMax, int nSegments)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      common(common),
+      nSegments(nSegments) {
+    CHECK(nSegments >= 1 && nSegments <= CurveSegmentLanes);
+    for (int s = 0; s <= CurveSegmentLanes; ++s)
+        u[s] = Lerp(std::min(s, nSegments) / (Float)nSegments, uMin, uMax);
+    for (int s = 0; s < CurveSegmentLanes; ++s) {
+        // Compute object-space control points for the segment, as
+        // Curve::Intersect() does
+        int seg = std::min(s, nSegments - 1);
+        Float u0 = u[seg], u1 = u[seg + 1];
+        Point3f cpObj[4] = {BlossomBezier(common->cpObj, u0, u0, u0),
+                            BlossomBezier(common->cpObj, u0, u0, u1),
+                            BlossomBezier(common->cpObj, u0, u1, u1),
+                            BlossomBezier(common->cpObj, u1, u1, u1)};
+        for (int i = 0; i < 4; ++i)
+            for (int c = 0; c < 3; ++c) cp[i][c][s] = cpObj[i][c];
+        halfWidth[s] =
+            0.5f * std::max(Lerp(u0, common->width[0], common->width[1]),
+                            Lerp(u1, common->width[0], common->width[1]));
+    }
+}
+
+Bounds3f CurveSegments::ObjectBound() const {
+    Bounds3f b;
+    Float maxHalfWidth = 0;
+    for (int s = 0; s < nSegments; ++s) {
+        for (int i = 0; i < 4; ++i)
+            b = Union(b, Point3f(cp[i][0][s], cp[i][1][s], cp[i][2][s]));
+        maxHalfWidth = std::max(maxHalfWidth, halfWidth[s]);
+    }
+    return Expand(b, maxHalfWidth);
+}
+
+Bounds3f CurveSegments::WorldBound() const {
+    // Bound the control points in world space, which is tighter than
+    // transforming the object-space bounds, and then the width, which
+    // each world space axis sees scaled by the corresponding row of
+    // _ObjectToWorld_
+    Bounds3f b;
+    Float maxHalfWidth = 0;
+    for (int s = 0; s < nSegments; ++s) {
+        for (int i = 0; i < 4; ++i)
+            b = Union(b, (*ObjectToWorld)(
+                             Point3f(cp[i][0][s], cp[i][1][s], cp[i][2][s])));
+        maxHalfWidth = std::max(maxHalfWidth, halfWidth[s]);
+    }
+    const Matrix4x4 &m = ObjectToWorld->GetMatrix();
+    for (int a = 0; a < 3; ++a) {
+        Float scale = Vector3f(m.m[a][0], m.m[a][1], m.m[a][2]).Length();
+        b.pMin[a] -= maxHalfWidth * scale;
+        b.pMax[a] += maxHalfWidth * scale;
+    }
+    return b;
+}
+
+bool CurveSegments::Intersect(const Ray &r, Float *tHit,
+                              SurfaceInteraction *isect,
+                              bool testAlphaTexture) const {
+    ProfilePhase p(isect ? Prof::CurveIntersect : Prof::CurveIntersectP);
+    ++nTests;
+    // Transform _Ray_ to object space
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+
+    // Orient the ray coordinate system along the chord of all of the
+    // segments, as Curve::Intersect() does for a single one
+    Point3f pStart(cp[0][0][0], cp[0][1][0], cp[0][2][0]);
+    Point3f pEnd(cp[3][0][nSegments - 1], cp[3][1][nSegments - 1],
+                 cp[3][2][nSegments - 1]);
+    Vector3f dx = Cross(ray.d, pEnd - pStart);
+    if (dx.LengthSquared() == 0) {
+        Vector3f dy;
+        CoordinateSystem(ray.d, &dx, &dy);
+    }
+    Transform objectToRay = LookAt(ray.o, ray.o + ray.d, dx);
+
+    // Find the segments that the ray may hit, then test them exactly,
+    // nearest first
+    Float cpRay[4][3][CurveSegmentLanes], z[CurveSegmentLanes];
+    int candidates = findCandidates(objectToRay, ray, cpRay, z);
+    if (!candidates) return false;
+    Transform rayToObject = Inverse(objectToRay);
+    bool hit = false;
+    while (candidates) {
+        int s = -1;
+        for (int i = 0; i < CurveSegmentLanes; ++i)
+            if ((candidates & (1 << i)) && (s == -1 || z[i] < z[s])) s = i;
+        candidates &= ~(1 << s);
+        ++nSegmentCandidates;
+
+        Point3f cps[4];
+        for (int i = 0; i < 4; ++i)
+            cps[i] = Point3f(cpRay[i][0][s], cpRay[i][1][s], cpRay[i][2][s]);
+        if (IntersectCurveSegment(*this, *common, ray, tHit, isect, cps,
+                                  rayToObject, u[s], u[s + 1])) {
+            if (!tHit) return true;
+            hit = true;
+            ray.tMax = *tHit;
+        }
+    }
+    return hit;
+}
+
+// Transforms the segments' control points to ray space and returns the
+// segments that pass the tests of IntersectCurveSegment() that don't
+// depend on the curve type, along with the depth of their closest point
+// to the ray.  The tests are conservative; those segments must still be
+// tested exactly.
+int CurveSegments::findCandidates(const Transform &objectToRay, const Ray &ray,
+                                  Float cpRay[4][3][CurveSegmentLanes],
+                                  Float z[CurveSegmentLanes]) const {
+    ++nSegmentTests;
+    Float zMax = ray.d.Length() * ray.tMax;
+    const Matrix4x4 &m = objectToRay.GetMatrix();
+#ifdef PBRT_CURVE_SSE
+    auto add = [](__m128 a, __m128 b) { return _mm_add_ps(a, b); };
+    auto sub = [](__m128 a, __m128 b) { return _mm_sub_ps(a, b); };
+    auto mul = [](__m128 a, __m128 b) { return _mm_mul_ps(a, b); };
+    auto lerp = [&](__m128 t, __m128 a, __m128 b) {
+        return add(mul(sub(_mm_set1_ps(1), t), a), mul(t, b));
+    };
+    const __m128 zero = _mm_setzero_ps();
+
+    // Transform the control points as _Transform_ does, one segment per
+    // lane; _objectToRay_ is a rigid transformation
+    __m128 c[4][3];
+    for (int i = 0; i < 4; ++i) {
+        __m128 p[3] = {_mm_loadu_ps(cp[i][0]), _mm_loadu_ps(cp[i][1]),
+                       _mm_loadu_ps(cp[i][2])};
+        for (int a = 0; a < 3; ++a) {
+            c[i][a] = add(add(add(mul(_mm_set1_ps(m.m[a][0]), p[0]),
+                                  mul(_mm_set1_ps(m.m[a][1]), p[1])),
+                              mul(_mm_set1_ps(m.m[a][2]), p[2])),
+                          _mm_set1_ps(m.m[a][3]));
+            _mm_storeu_ps(cpRay[i][a], c[i][a]);
+        }
+    }
+
+    // Test the ray against the segments' bounds in ray space
+    __m128 hw = _mm_loadu_ps(halfWidth);
+    __m128 reject = zero;
+    for (int a = 0; a < 3; ++a) {
+        __m128 cMin = _mm_min_ps(_mm_min_ps(c[0][a], c[1][a]),
+                                 _mm_min_ps(c[2][a], c[3][a]));
+        __m128 cMax = _mm_max_ps(_mm_max_ps(c[0][a], c[1][a]),
+                                 _mm_max_ps(c[2][a], c[3][a]));
+        reject = _mm_or_ps(reject, _mm_cmplt_ps(add(cMax, hw), zero));
+        reject = _mm_or_ps(
+            reject, _mm_cmpgt_ps(sub(cMin, hw),
+                                 a == 2 ? _mm_set1_ps(zMax) : zero));
+    }
+
+    // Test against the tangent perpendiculars at the segments' ends
+    const __m128 signBit = _mm_set1_ps(-0.f);
+    auto neg = [&](__m128 a) { return _mm_xor_ps(a, signBit); };
+    __m128 edge0 = add(mul(sub(c[1][1], c[0][1]), neg(c[0][1])),
+                       mul(c[0][0], sub(c[0][0], c[1][0])));
+    __m128 edge1 = add(mul(sub(c[2][1], c[3][1]), neg(c[3][1])),
+                       mul(c[3][0], sub(c[3][0], c[2][0])));
+    reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(edge0, zero),
+                                         _mm_cmplt_ps(edge1, zero)));
+
+    // Evaluate the segments where they're closest to the ray
+    __m128 dirX = sub(c[3][0], c[0][0]), dirY = sub(c[3][1], c[0][1]);
+    __m128 denom = add(mul(dirX, dirX), mul(dirY, dirY));
+    reject = _mm_or_ps(reject, _mm_cmpeq_ps(denom, zero));
+    __m128 w = _mm_div_ps(add(mul(neg(c[0][0]), dirX), mul(neg(c[0][1]), dirY)),
+                          denom);
+    __m128 u0 = _mm_loadu_ps(&u[0]), u1 = _mm_loadu_ps(&u[1]);
+    __m128 uHit = _mm_min_ps(_mm_max_ps(lerp(w, u0, u1), u0), u1);
+    __m128 hitWidth = lerp(uHit, _mm_set1_ps(common->width[0]),
+                           _mm_set1_ps(common->width[1]));
+    __m128 t = _mm_min_ps(_mm_max_ps(w, zero), _mm_set1_ps(1));
+    __m128 pc[3];
+    for (int a = 0; a < 3; ++a) {
+        __m128 cp1[3] = {lerp(t, c[0][a], c[1][a]), lerp(t, c[1][a], c[2][a]),
+                         lerp(t, c[2][a], c[3][a])};
+        pc[a] = lerp(t, lerp(t, cp1[0], cp1[1]), lerp(t, cp1[1], cp1[2]));
+    }
+
+    // Test the distance to the curve against its unscaled width, with a
+    // little slack, since ribbons only get narrower
+    __m128 dist2 = add(mul(pc[0], pc[0]), mul(pc[1], pc[1]));
+    __m128 maxDist2 =
+        mul(mul(hitWidth, hitWidth), _mm_set1_ps(.25f * 1.0001f));
+    reject = _mm_or_ps(reject, _mm_cmpgt_ps(dist2, maxDist2));
+    reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(pc[2], zero),
+                                         _mm_cmpgt_ps(pc[2], _mm_set1_ps(zMax))));
+    _mm_storeu_ps(z, pc[2]);
+    return ~_mm_movemask_ps(reject) & ((1 << nSegments) - 1);
+#else
+    int candidates = 0;
+    for (int s = 0; s < nSegments; ++s) {
+        Point3f cps[4];
+        for (int i = 0; i < 4; ++i) {
+            cps[i] = objectToRay(Point3f(cp[i][0][s], cp[i][1][s], cp[i][2][s]));
+            for (int a = 0; a < 3; ++a) cpRay[i][a][s] = cps[i][a];
+        }
+        // Test the ray against the segment's bounds in ray space
+        Bounds3f b = Expand(Union(Bounds3f(cps[0], cps[1]),
+                                  Bounds3f(cps[2], cps[3])),
+                            halfWidth[s]);
+        if (b.pMax.x < 0 || b.pMin.x > 0 || b.pMax.y < 0 || b.pMin.y > 0 ||
+            b.pMax.z < 0 || b.pMin.z > zMax)
+            continue;
+        candidates |= 1 << s;
+        z[s] = b.pMin.z;
+    }
+    return candidates;
+#endif
+}
+
+Float CurveSegments::Area() const {
+    Float area = 0;
+    for (int s = 0; s < nSegments; ++s) {
+        Float approxLength = 0;
+        for (int i = 0; i < 3; ++i)
+            approxLength += Distance(
+                Point3f(cp[i][0][s], cp[i][1][s], cp[i][2][s]),
+                Point3f(cp[i + 1][0][s], cp[i + 1][1][s], cp[i + 1][2][s]));
+        area += approxLength * halfWidth[s] * 2;
+    }
+    return area;
+}
+
+Interaction CurveSegments::Sample(const Point2f &u, Float *pdf) const {
+    LOG(FATAL) << "CurveSegments::Sample not implemented.";
+    return Interaction();
+}
+
+// CurveSet Method Definitions
+CurveSet::CurveSet(const Transform *ObjectToWorld,
+                   const Transform *WorldToObject, bool reverseOrientation,
+                   CurveType type, int nSegments, const Point3f *c,
+                   const Float *w, const Normal3f *norm, int splitDepth,
+                   bool quantize)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      type(type),
+      nSegments(nSegments),
+      splitDepth(Clamp(splitDepth, 0, 10)) {
+    CHECK_LE((int64_t)nSegments << this->splitDepth,
+             std::numeric_limits<int>::max());
+    cp.assign(c, c + 4 * nSegments);
+    if (quantize) {
+        // Store widths as fractions of the widest one
+        for (int i = 0; i < 2 * nSegments; ++i)
+            widthScale = std::max(widthScale, w[i]);
+        quantizedWidth.resize(2 * nSegments);
+        for (int i = 0; i < 2 * nSegments; ++i)
+            quantizedWidth[i] =
+                widthScale > 0 ? std::round(w[i] / widthScale * 65535) : 0;
+        widthScale /= 65535;
+        if (norm) {
+            quantizedNormal.resize(2 * nSegments);
+            for (int i = 0; i < 2 * nSegments; ++i)
+                quantizedNormal[i] = EncodeOctahedral(norm[i]);
+        }
+    } else {
+        width.assign(w, w + 2 * nSegments);
+        if (norm) n.assign(norm, norm + 2 * nSegments);
+    }
+
+    // Build the BVH over the segments' pieces and reorder them so that
+    // each leaf's pieces are contiguous
+    int nPieces = nSegments << this->splitDepth;
+    std::vector<Bounds3f> pieceBounds(nPieces);
+    ParallelFor([&](int64_t segment) {
+        CurveCommon common = segmentCommon(segment);
+        int nSplit = 1 << this->splitDepth;
+        for (int i = 0; i < nSplit; ++i)
+            pieceBounds[(segment << this->splitDepth) + i] =
+                CurveBound(common, Float(i) / nSplit, Float(i + 1) / nSplit);
+    }, nSegments, 1024);
+    pieces.resize(nPieces);
+    for (int i = 0; i < nPieces; ++i) pieces[i] = i;
+    if (nPieces > 0) {
+        nodes.reserve(2 * nPieces / maxPiecesInNode + 1);
+        recursiveBuild(pieces, pieceBounds, 0, nPieces);
+        nodes.shrink_to_fit();
+        bounds = nodes[0].bounds;
+    }
+
+    nCurves += nSegments;
+    nSplitCurves += nPieces;
+    curveBytes += sizeof(*this) + cp.size() * sizeof(cp[0]) +
+                  width.size() * sizeof(width[0]) +
+                  quantizedWidth.size() * sizeof(quantizedWidth[0]) +
+                  n.size() * sizeof(n[0]) +
+                  quantizedNormal.size() * sizeof(quantizedNormal[0]);
+    curveSetBVHBytes += pieces.size() * sizeof(pieces[0]) +
+                        nodes.size() * sizeof(LinearBVHNode);
+}
+
+CurveSet::~CurveSet() {}
+
+Float CurveSet::segmentWidth(int segment, int end) const {
+    int i = 2 * segment + end;
+    return quantizedWidth.empty() ? width[i] : quantizedWidth[i] * widthScale;
+}
+
+Normal3f CurveSet::segmentNormal(int segment, int end) const {
+    int i = 2 * segment + end;
+    return quantizedNormal.empty() ? n[i]
+                                   : DecodeOctahedral(quantizedNormal[i]);
+}
+
+CurveCommon CurveSet::segmentCommon(int segment) const {
+    Normal3f norm[2];
+    bool hasNormals = !n.empty() || !quantizedNormal.empty();
+    if (hasNormals)
+        for (int end = 0; end < 2; ++end) norm[end] = segmentNormal(segment, end);
+    return CurveCommon(&cp[4 * segment], segmentWidth(segment, 0),
+                       segmentWidth(segment, 1), type,
+                       hasNormals ? norm : nullptr);
+}
+
+// Binned SAH build, as for InstanceBVHAccel; returns the index of the new
+// node
+int CurveSet::recursiveBuild(std::vector<int> &order,
+                             const std::vector<Bounds3f> &pieceBounds,
+                             int start, int end) {
+    int nodeIndex = nodes.size();
+    nodes.push_back(LinearBVHNode());
+    Bounds3f b, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        const Bounds3f &pb = pieceBounds[order[i]];
+        b = Union(b, pb);
+        centroidBounds = Union(centroidBounds, .5f * pb.pMin + .5f * pb.pMax);
+    }
+    nodes[nodeIndex].bounds = b;
+
+    int n = end - start, dim = centroidBounds.MaximumExtent();
+    auto makeLeaf = [&]() {
+        nodes[nodeIndex].primitivesOffset = start;
+        nodes[nodeIndex].nPrimitives = n;
+        return nodeIndex;
+    };
+    if (n == 1) return makeLeaf();
+    auto centroid = [&](int i) {
+        const Bounds3f &pb = pieceBounds[i];
+        return .5f * (pb.pMin[dim] + pb.pMax[dim]);
+    };
+
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        if (n <= maxPiecesInNode) return makeLeaf();
     } else {
-        // Intersect ray with curve segment
-
-        // Test ray against segment endpoint boundaries
-
-        // Test sample point against tangent perpendicular at curve start
-        Float edge =
-            (cp[1].y - cp[0].y) * -cp[0].y + cp[0].x * (cp[0].x - cp[1].x);
-        if (edge < 0) return false;
-
-        // Test sample point against tangent perpendicular at curve end
-        edge = (cp[2].y - cp[3].y) * -cp[3].y + cp[3].x * (cp[3].x - cp[2].x);
-        if (edge < 0) return false;
-
-        // Compute line $w$ that gives minimum distance to sample point
-        Vector2f segmentDirection = Point2f(cp[3]) - Point2f(cp[0]);
-        Float denom = segmentDirection.LengthSquared();
-        if (denom == 0) return false;
-        Float w = Dot(-Vector2f(cp[0]), segmentDirection) / denom;
-
-        // Compute $u$ coordinate of curve intersection point and _hitWidth_
-        Float u = Clamp(Lerp(w, u0, u1), u0, u1);
-        Float hitWidth = Lerp(u, common->width[0], common->width[1]);
-        Normal3f nHit;
-        if (common->type == CurveType::Ribbon) {
-            // Scale _hitWidth_ based on ribbon orientation
-            Float sin0 = std::sin((1 - u) * common->normalAngle) *
-                         common->invSinNormalAngle;
-            Float sin1 =
-                std::sin(u * common->normalAngle) * common->invSinNormalAngle;
-            nHit = sin0 * common->n[0] + sin1 * common->n[1];
-            hitWidth *= AbsDot(nHit, ray.d) / rayLength;
+        // Find the cheapest split between SAH buckets
+        PBRT_CONSTEXPR int nBuckets = 12;
+        int counts[nBuckets] = {0};
+        Bounds3f bucketBounds[nBuckets];
+        auto bucketOf = [&](int i) {
+            int bucket = nBuckets * (centroid(i) - centroidBounds.pMin[dim]) /
+                         (centroidBounds.pMax[dim] - centroidBounds.pMin[dim]);
+            return std::min(bucket, nBuckets - 1);
+        };
+        for (int i = start; i < end; ++i) {
+            int bucket = bucketOf(order[i]);
+            ++counts[bucket];
+            bucketBounds[bucket] =
+                Union(bucketBounds[bucket], pieceBounds[order[i]]);
+        }
+        Float minCost = Infinity;
+        int minCostSplitBucket = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            Bounds3f b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, bucketBounds[j]);
+                count0 += counts[j];
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = Union(b1, bucketBounds[j]);
+                count1 += counts[j];
+            }
+            Float cost = 1 + (count0 * b0.SurfaceArea() +
+                              count1 * b1.SurfaceArea()) / b.SurfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
         }
+        if (n <= maxPiecesInNode && minCost >= n) return makeLeaf();
+        int *pmid = std::partition(
+            &order[start], &order[end - 1] + 1,
+            [&](int i) { return bucketOf(i) <= minCostSplitBucket; });
+        mid = pmid - &order[0];
+    }
+    if (mid == start || mid == end) {
+        mid = (start + end) / 2;
+        std::nth_element(&order[start], &order[mid], &order[end - 1] + 1,
+                         [&](int a, int b) { return centroid(a) < centroid(b); });
+    }
 
-        // Test intersection point against curve width
-        Vector3f dpcdw;
-        Point3f pc = EvalBezier(cp, Clamp(w, 0, 1), &dpcdw);
-        Float ptCurveDist2 = pc.x * pc.x + pc.y * pc.y;
-        if (ptCurveDist2 > hitWidth * hitWidth * .25) return false;
-        Float zMax = rayLength * ray.tMax;
-        if (pc.z < 0 || pc.z > zMax) return false;
-
-        // Compute $v$ coordinate of curve intersection point
-        Float ptCurveDist = std::sqrt(ptCurveDist2);
-        Float edgeFunc = dpcdw.x * -pc.y + pc.x * dpcdw.y;
-        Float v = (edgeFunc > 0) ? 0.5f + ptCurveDist / hitWidth
-                                 : 0.5f - ptCurveDist / hitWidth;
-
-        // Compute hit _t_ and partial derivatives for curve intersection
-        if (tHit != nullptr) {
-            // FIXME: this tHit isn't quite right for ribbons...
-            *tHit = pc.z / rayLength;
-            // Compute error bounds for curve intersection
-            Vector3f pError(2 * hitWidth, 2 * hitWidth, 2 * hitWidth);
-
-            // Compute $\dpdu$ and $\dpdv$ for curve intersection
-            Vector3f dpdu, dpdv;
-            EvalBezier(common->cpObj, u, &dpdu);
-            CHECK_NE(Vector3f(0, 0, 0), dpdu) << "u = " << u << ", cp = " <<
-                common->cpObj[0] << ", " << common->cpObj[1] << ", " <<
-                common->cpObj[2] << ", " << common->cpObj[3];
-
-            if (common->type == CurveType::Ribbon)
-                dpdv = Normalize(Cross(nHit, dpdu)) * hitWidth;
-            else {
-                // Compute curve $\dpdv$ for flat and cylinder curves
-                Vector3f dpduPlane = (Inverse(rayToObject))(dpdu);
-                Vector3f dpdvPlane =
-                    Normalize(Vector3f(-dpduPlane.y, dpduPlane.x, 0)) *
-                    hitWidth;
-                if (common->type == CurveType::Cylinder) {
-                    // Rotate _dpdvPlane_ to give cylindrical appearance
-                    Float theta = Lerp(v, -90., 90.);
-                    Transform rot = Rotate(-theta, dpduPlane);
-                    dpdvPlane = rot(dpdvPlane);
+    recursiveBuild(order, pieceBounds, start, mid);
+    int second = recursiveBuild(order, pieceBounds, mid, end);
+    nodes[nodeIndex].axis = dim;
+    nodes[nodeIndex].nPrimitives = 0;
+    nodes[nodeIndex].secondChildOffset = second;
+    return nodeIndex;
+}
+
+bool CurveSet::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
+                         bool testAlphaTexture) const {
+    if (nodes.empty()) return false;
+    ProfilePhase p(isect ? Prof::CurveIntersect : Prof::CurveIntersectP);
+    // Transform _Ray_ to object space, once for all of the curves
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+
+    bool hit = false;
+    Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    const Float pieceLength = Float(1) / (1 << splitDepth);
+    const int pieceMask = (1 << splitDepth) - 1;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                // Intersect ray with the leaf's curve pieces
+                for (int i = 0; i < node->nPrimitives; ++i) {
+                    int piece = pieces[node->primitivesOffset + i];
+                    int segment = piece >> splitDepth;
+                    Float uMin = (piece & pieceMask) * pieceLength;
+                    ++nTests;
+                    if (IntersectCurve(*this, segmentCommon(segment), uMin,
+                                       uMin + pieceLength, ray, tHit, isect)) {
+                        if (!tHit) return true;
+                        ray.tMax = *tHit;
+                        hit = true;
+                    }
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
                 }
-                dpdv = rayToObject(dpdvPlane);
             }
-            *isect = (*ObjectToWorld)(SurfaceInteraction(
-                ray(*tHit), pError, Point2f(u, v), -ray.d, dpdu, dpdv,
-                Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time, this));
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
-        ++nHits;
-        return true;
     }
+    return hit;
 }
 
-Float Curve::Area() const {
-    // Compute object-space control points for curve segment, _cpObj_
-    Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
-    Float width0 = Lerp(uMin, common->width[0], common->width[1]);
-    Float width1 = Lerp(uMax, common->width[0], common->width[1]);
-    Float avgWidth = (width0 + width1) * 0.5f;
-    Float approxLength = 0.f;
-    for (int i = 0; i < 3; ++i)
-        approxLength += Distance(cpObj[i], cpObj[i + 1]);
-    return approxLength * avgWidth;
+Float CurveSet::Area() const {
+    Float area = 0;
+    for (int segment = 0; segment < nSegments; ++segment)
+        area += CurveArea(segmentCommon(segment), 0, 1);
+    return area;
 }
 
-Interaction Curve::Sample(const Point2f &u, Float *pdf) const {
-    LOG(FATAL) << "Curve::Sample not implemented.";
+Interaction CurveSet::Sample(const Point2f &u, Float *pdf) const {
+    LOG(FATAL) << "CurveSet::Sample not implemented.";
     return Interaction();
 }
 
-std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
-                                                     const Transform *w2o,
-                                                     bool reverseOrientation,
-                                                     const ParamSet &params) {
-    Float width = params.FindOneFloat("width", 1.f);
-    Float width0 = params.FindOneFloat("width0", width);
-    Float width1 = params.FindOneFloat("width1", width);
-
-    int degree = params.FindOneInt("degree", 3);
-    if (degree != 2 && degree != 3) {
+// Finds the curves' degree and basis; returns false (after reporting an
+// error) if they're not supported
+static bool FindCurveBasis(const ParamSet &params, int *degree,
+                           std::string *basis) {
+    *degree = params.FindOneInt("degree", 3);
+    if (*degree != 2 && *degree != 3) {
         Error("Invalid degree %d: only degree 2 and 3 curves are supported.",
-              degree);
-        return {};
+              *degree);
+        return false;
     }
 
-    std::string basis = params.FindOneString("basis", "bezier");
-    if (basis != "bezier" && basis != "bspline") {
+    *basis = params.FindOneString("basis", "bezier");
+    if (*basis != "bezier" && *basis != "bspline") {
         Error("Invalid basis \"%s\": only \"bezier\" and \"bspline\" are "
-              "supported.", basis.c_str());
-        return {};
+              "supported.", basis->c_str());
+        return false;
     }
+    return true;
+}
 
-    int ncp;
-    const Point3f *cp = params.FindPoint3f("P", &ncp);
-    int nSegments;
+// Returns the number of segments of a curve with _ncp_ control points, or
+// -1 (after reporting an error) if that isn't a valid number
+static int CurveSegmentCount(int ncp, int degree, const std::string &basis) {
     if (basis == "bezier") {
         // After the first segment, which uses degree+1 control points,
         // subsequent segments reuse the last control point of the previous
         // one and then use degree more control points.
-        if (((ncp - 1 - degree) % degree) != 0) {
+        if (ncp < degree + 1 || ((ncp - 1 - degree) % degree) != 0) {
             Error("Invalid number of control points %d: for the degree %d "
                   "Bezier basis %d + n * %d are required, for n >= 0.", ncp,
                   degree, degree + 1, degree);
-            return {};
+            return -1;
         }
-        nSegments = (ncp - 1) / degree;
+        return (ncp - 1) / degree;
     } else {
         if (ncp < degree + 1) {
             Error("Invalid number of control points %d: for the degree %d "
                   "b-spline basis, must have >= %d.", ncp, degree, degree + 1);
-            return {};
+            return -1;
         }
-        nSegments = ncp - degree;
+        return ncp - degree;
     }
+}
 
-
-    CurveType type;
+static CurveType FindCurveType(const ParamSet &params) {
     std::string curveType = params.FindOneString("type", "flat");
     if (curveType == "flat")
-        type = CurveType::Flat;
+        return CurveType::Flat;
     else if (curveType == "ribbon")
-        type = CurveType::Ribbon;
+        return CurveType::Ribbon;
     else if (curveType == "cylinder")
-        type = CurveType::Cylinder;
+        return CurveType::Cylinder;
     else {
         Error("Unknown curve type \"%s\".  Using \"cylinder\".", curveType.c_str());
-        type = CurveType::Cylinder;
+        return CurveType::Cylinder;
+    }
+}
+
+// Computes the cubic Bezier control points of the curve segment whose
+// control points start at _cpBase_ and returns where the next segment's
+// start.
+static const Point3f *CubicBezierSegment(const Point3f *cpBase, int degree,
+                                         const std::string &basis,
+                                         Point3f segCpBezier[4]) {
+    // (It is admittedly
+    // wasteful storage-wise to turn b-splines into Bezier segments and
+    // wasteful computationally to turn quadratic curves into cubics,
+    // but yolo.)
+    if (basis == "bezier") {
+        if (degree == 2) {
+            // Elevate to degree 3.
+            segCpBezier[0] = cpBase[0];
+            segCpBezier[1] = Lerp(2.f/3.f, cpBase[0], cpBase[1]);
+            segCpBezier[2] = Lerp(1.f/3.f, cpBase[1], cpBase[2]);
+            segCpBezier[3] = cpBase[2];
+        } else {
+            // Allset.
+            for (int i = 0; i < 4; ++i)
+                segCpBezier[i] = cpBase[i];
+        }
+        return cpBase + degree;
+    } else {
+        // Uniform b-spline.
+        if (degree == 2) {
+            // First compute equivalent Bezier control points via some
+            // blossiming.  We have three control points and a uniform
+            // knot vector; we'll label the points p01, p12, and p23.
+            // We want the Bezier control points of the equivalent
+            // curve, which are p11, p12, and p22.
+            Point3f p01 = cpBase[0];
+            Point3f p12 = cpBase[1];
+            Point3f p23 = cpBase[2];
+
+            // We already have p12.
+            Point3f p11 = Lerp(0.5, p01, p12);
+            Point3f p22 = Lerp(0.5, p12, p23);
+
+            // Now elevate to degree 3.
+            segCpBezier[0] = p11;
+            segCpBezier[1] = Lerp(2.f/3.f, p11, p12);
+            segCpBezier[2] = Lerp(1.f/3.f, p12, p22);
+            segCpBezier[3] = p22;
+        } else {
+            // Otherwise we will blossom from p012, p123, p234, and p345
+            // to the Bezier control points p222, p223, p233, and p333.
+            // https://people.eecs.berkeley.edu/~sequin/CS284/IMGS/cubicbsplinepoints.gif
+            Point3f p012 = cpBase[0];
+            Point3f p123 = cpBase[1];
+            Point3f p234 = cpBase[2];
+            Point3f p345 = cpBase[3];
+
+            Point3f p122 = Lerp(2.f/3.f, p012, p123);
+            Point3f p223 = Lerp(1.f/3.f, p123, p234);
+            Point3f p233 = Lerp(2.f/3.f, p123, p234);
+            Point3f p334 = Lerp(1.f/3.f, p234, p345);
+
+            Point3f p222 = Lerp(0.5f, p122, p223);
+            Point3f p333 = Lerp(0.5f, p233, p334);
+
+            segCpBezier[0] = p222;
+            segCpBezier[1] = p223;
+            segCpBezier[2] = p233;
+            segCpBezier[3] = p333;
+        }
+        return cpBase + 1;
     }
+}
+
+std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
+                                                     const Transform *w2o,
+                                                     bool reverseOrientation,
+                                                     const ParamSet &params) {
+    Float width = params.FindOneFloat("width", 1.f);
+    Float width0 = params.FindOneFloat("width0", width);
+    Float width1 = params.FindOneFloat("width1", width);
+
+    int degree;
+    std::string basis;
+    if (!FindCurveBasis(params, &degree, &basis)) return {};
+
+    int ncp;
+    const Point3f *cp = params.FindPoint3f("P", &ncp);
+    int nSegments = CurveSegmentCount(ncp, degree, basis);
+    if (nSegments < 0) return {};
+
+    CurveType type = FindCurveType(params);
 
     int nnorm;
     const Normal3f *n = params.FindNormal3f("N", &nnorm);
@@ -474,85 +1122,141 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
 
     int sd = params.FindOneInt("splitdepth",
                                int(params.FindOneFloat("splitdepth", 3)));
+    bool presplit = params.FindOneBool("presplit", false);
 
     std::vector<std::shared_ptr<Shape>> curves;
     // Pointer to the first control point for the current segment. This is
     // updated after each loop iteration depending on the current basis.
     const Point3f *cpBase = cp;
     for (int seg = 0; seg < nSegments; ++seg) {
-        Point3f segCpBezier[4];
-
         // First, compute the cubic Bezier control points for the current
-        // segment and store them in segCpBezier. (It is admittedly
-        // wasteful storage-wise to turn b-splines into Bezier segments and
-        // wasteful computationally to turn quadratic curves into cubics,
-        // but yolo.)
-        if (basis == "bezier") {
-            if (degree == 2) {
-                // Elevate to degree 3.
-                segCpBezier[0] = cpBase[0];
-                segCpBezier[1] = Lerp(2.f/3.f, cpBase[0], cpBase[1]);
-                segCpBezier[2] = Lerp(1.f/3.f, cpBase[1], cpBase[2]);
-                segCpBezier[3] = cpBase[2];
-            } else {
-                // Allset.
-                for (int i = 0; i < 4; ++i)
-                    segCpBezier[i] = cpBase[i];
-            }
-            cpBase += degree;
-        } else {
-            // Uniform b-spline.
-            if (degree == 2) {
-                // First compute equivalent Bezier control points via some
-                // blossiming.  We have three control points and a uniform
-                // knot vector; we'll label the points p01, p12, and p23.
-                // We want the Bezier control points of the equivalent
-                // curve, which are p11, p12, and p22.
-                Point3f p01 = cpBase[0];
-                Point3f p12 = cpBase[1];
-                Point3f p23 = cpBase[2];
-
-                // We already have p12.
-                Point3f p11 = Lerp(0.5, p01, p12);
-                Point3f p22 = Lerp(0.5, p12, p23);
-
-                // Now elevate to degree 3.
-                segCpBezier[0] = p11;
-                segCpBezier[1] = Lerp(2.f/3.f, p11, p12);
-                segCpBezier[2] = Lerp(1.f/3.f, p12, p22);
-                segCpBezier[3] = p22;
-            } else {
-                // Otherwise we will blossom from p012, p123, p234, and p345
-                // to the Bezier control points p222, p223, p233, and p333.
-                // https://people.eecs.berkeley.edu/~sequin/CS284/IMGS/cubicbsplinepoints.gif
-                Point3f p012 = cpBase[0];
-                Point3f p123 = cpBase[1];
-                Point3f p234 = cpBase[2];
-                Point3f p345 = cpBase[3];
-
-                Point3f p122 = Lerp(2.f/3.f, p012, p123);
-                Point3f p223 = Lerp(1.f/3.f, p123, p234);
-                Point3f p233 = Lerp(2.f/3.f, p123, p234);
-                Point3f p334 = Lerp(1.f/3.f, p234, p345);
-
-                Point3f p222 = Lerp(0.5f, p122, p223);
-                Point3f p333 = Lerp(0.5f, p233, p334);
-
-                segCpBezier[0] = p222;
-                segCpBezier[1] = p223;
-                segCpBezier[2] = p233;
-                segCpBezier[3] = p333;
-            }
-            ++cpBase;
-        }
+        // segment and store them in segCpBezier.
+        Point3f segCpBezier[4];
+        cpBase = CubicBezierSegment(cpBase, degree, basis, segCpBezier);
 
         auto c = CreateCurve(o2w, w2o, reverseOrientation, segCpBezier,
                              Lerp(Float(seg) / Float(nSegments), width0, width1),
                              Lerp(Float(seg + 1) / Float(nSegments), width0, width1),
-                             type, n ? &n[seg] : nullptr, sd);
+                             type, n ? &n[seg] : nullptr, sd, presplit);
         curves.insert(curves.end(), c.begin(), c.end());
     }
     return curves;
 }
 
+std::vector<std::shared_ptr<Shape>> CreateCurveSetShape(const Transform *o2w,
+                                                        const Transform *w2o,
+                                                        bool reverseOrientation,
+                                                        const ParamSet &params) {
+    int degree;
+    std::string basis;
+    if (!FindCurveBasis(params, &degree, &basis)) return {};
+    CurveType type = FindCurveType(params);
+
+    // Find the number of control points of each curve; without
+    // "nvertices", each curve is a single segment
+    int ncp;
+    const Point3f *cp = params.FindPoint3f("P", &ncp);
+    if (!cp) {
+        Error("Must provide control points \"P\" with \"curves\" shape.");
+        return {};
+    }
+    int nCurves;
+    const int *nvertices = params.FindInt("nvertices", &nCurves);
+    std::vector<int> nv;
+    if (nvertices)
+        nv.assign(nvertices, nvertices + nCurves);
+    else {
+        if (ncp % (degree + 1) != 0) {
+            Error("Number of control points %d isn't a multiple of %d: must "
+                  "provide \"nvertices\" for curves with more than one "
+                  "segment.", ncp, degree + 1);
+            return {};
+        }
+        nCurves = ncp / (degree + 1);
+        nv.assign(nCurves, degree + 1);
+    }
+    std::vector<int> curveSegments(nCurves);
+    int nSegments = 0, nControlPoints = 0;
+    for (int i = 0; i < nCurves; ++i) {
+        curveSegments[i] = CurveSegmentCount(nv[i], degree, basis);
+        if (curveSegments[i] < 0) return {};
+        nSegments += curveSegments[i];
+        nControlPoints += nv[i];
+    }
+    if (nControlPoints != ncp) {
+        Error("Invalid number of control points %d: \"nvertices\" requires "
+              "%d.", ncp, nControlPoints);
+        return {};
+    }
+
+    // Widths are given at the ends of each curve, either once for all of
+    // them or once per curve
+    Float defaultWidth = params.FindOneFloat("width", 1.f);
+    auto findWidths = [&](const char *name, std::vector<Float> *w) {
+        int nw;
+        const Float *pw = params.FindFloat(name, &nw);
+        if (!pw) pw = params.FindFloat("width", &nw);
+        if (!pw || nw == 1)
+            w->assign(nCurves, pw ? pw[0] : defaultWidth);
+        else if (nw == nCurves)
+            w->assign(pw, pw + nw);
+        else {
+            Error("Invalid number of \"%s\" values %d: must provide one, or "
+                  "one per curve (%d).", name, nw, nCurves);
+            return false;
+        }
+        return true;
+    };
+    std::vector<Float> width0, width1;
+    if (!findWidths("width0", &width0) || !findWidths("width1", &width1))
+        return {};
+
+    int nnorm;
+    const Normal3f *n = params.FindNormal3f("N", &nnorm);
+    if (n != nullptr) {
+        if (type != CurveType::Ribbon) {
+            Warning("Curve normals are only used with \"ribbon\" type curves.");
+            n = nullptr;
+        } else if (nnorm != nSegments + nCurves) {
+            Error("Invalid number of normals %d: must provide %d normals for "
+                  "ribbon curves with %d segments in %d curves.", nnorm,
+                  nSegments + nCurves, nSegments, nCurves);
+            return {};
+        }
+    } else if (type == CurveType::Ribbon) {
+        Error(
+            "Must provide normals \"N\" at curve endpoints with ribbon "
+            "curves.");
+        return {};
+    }
+
+    int sd = params.FindOneInt("splitdepth",
+                               int(params.FindOneFloat("splitdepth", 3)));
+    bool quantize = params.FindOneBool("quantize", false);
+
+    // Convert each segment to a cubic Bezier curve with its own widths
+    // and normals at its ends
+    std::vector<Point3f> segCp(4 * nSegments);
+    std::vector<Float> segWidth(2 * nSegments);
+    std::vector<Normal3f> segN(n ? 2 * nSegments : 0);
+    const Point3f *cpBase = cp;
+    for (int i = 0, seg = 0; i < nCurves; ++i) {
+        const Point3f *cpNext = cpBase + nv[i];
+        for (int j = 0; j < curveSegments[i]; ++j, ++seg) {
+            cpBase = CubicBezierSegment(cpBase, degree, basis, &segCp[4 * seg]);
+            for (int end = 0; end < 2; ++end) {
+                segWidth[2 * seg + end] =
+                    Lerp(Float(j + end) / Float(curveSegments[i]), width0[i],
+                         width1[i]);
+                // Each earlier curve has one more normal than segments
+                if (n) segN[2 * seg + end] = n[seg + i + end];
+            }
+        }
+        cpBase = cpNext;
+    }
+    return {std::make_shared<CurveSet>(
+        o2w, w2o, reverseOrientation, type, nSegments, segCp.data(),
+        segWidth.data(), n ? segN.data() : nullptr, sd, quantize)};
+}
+
 }  // namespace pbrt
@@ -43,6 +43,7 @@
 
 namespace pbrt {
 struct CurveCommon;
+struct LinearBVHNode;
 
 // CurveType Declarations
 enum class CurveType { Flat, Cylinder, Ribbon };
@@ -76,21 +77,109 @@ class Curve : public Shape {
     Interaction Sample(const Point2f &u, Float *pdf) const;
 
   private:
-    // Curve Private Methods
-    bool recursiveIntersect(const Ray &r, Float *tHit,
-                            SurfaceInteraction *isect, const Point3f cp[4],
-                            const Transform &rayToObject, Float u0, Float u1,
-                            int depth) const;
-
     // Curve Private Data
     const std::shared_ptr<CurveCommon> common;
     const Float uMin, uMax;
 };
 
+// Number of segments that a _CurveSegments_ shape holds and tests at once
+static PBRT_CONSTEXPR int CurveSegmentLanes = 4;
+
+// A run of consecutive segments of a curve that was split finely enough
+// ahead of time for each segment to be intersected directly, without the
+// per-ray refinement of Curve::Intersect().  The segments are tested
+// together, one per SIMD lane.
+class CurveSegments : public Shape {
+  public:
+    // CurveSegments Public Methods
+    CurveSegments(const Transform *ObjectToWorld,
+                  const Transform *WorldToObject, bool reverseOrientation,
+                  const std::shared_ptr<CurveCommon> &common, Float uMin,
+                  Float uMax, int nSegments);
+    Bounds3f ObjectBound() const;
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture) const;
+    Float Area() const;
+    Interaction Sample(const Point2f &u, Float *pdf) const;
+
+  private:
+    // CurveSegments Private Methods
+    int findCandidates(const Transform &objectToRay, const Ray &ray,
+                       Float cpRay[4][3][CurveSegmentLanes],
+                       Float z[CurveSegmentLanes]) const;
+
+    // CurveSegments Private Data
+    const std::shared_ptr<CurveCommon> common;
+    const int nSegments;
+    // Coordinate _c_ of control point _i_ of segment _s_ is _cp[i][c][s]_;
+    // unused lanes repeat the last segment
+    Float cp[4][3][CurveSegmentLanes];
+    Float u[CurveSegmentLanes + 1];
+    Float halfWidth[CurveSegmentLanes];  // half of the segments' widest
+};
+
+// CurveSet Declarations
+// Many curves in one shape, as for a hair groom: their control points,
+// widths and normals are kept in flat arrays, optionally with quantized
+// widths and normals, and the curves are organized in a BVH of their own.
+// Each curve segment then costs its control points and a few bytes per
+// BVH item, rather than the _Curve_ shapes and primitives that each piece
+// of it would otherwise need.
+class CurveSet : public Shape {
+  public:
+    // CurveSet Public Methods
+    CurveSet(const Transform *ObjectToWorld, const Transform *WorldToObject,
+             bool reverseOrientation, CurveType type, int nSegments,
+             const Point3f *cp, const Float *width, const Normal3f *n,
+             int splitDepth, bool quantize);
+    ~CurveSet();
+    Bounds3f ObjectBound() const { return bounds; }
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture) const;
+    Float Area() const;
+    Interaction Sample(const Point2f &u, Float *pdf) const;
+
+  private:
+    // CurveSet Private Methods
+    Float segmentWidth(int segment, int end) const;
+    Normal3f segmentNormal(int segment, int end) const;
+    CurveCommon segmentCommon(int segment) const;
+    int recursiveBuild(std::vector<int> &order,
+                       const std::vector<Bounds3f> &pieceBounds, int start,
+                       int end);
+
+    // CurveSet Private Data
+    const CurveType type;
+    const int nSegments, splitDepth;
+    // Four cubic Bezier control points per segment
+    std::vector<Point3f> cp;
+    // Widths and, for ribbons, normals at each segment's two ends; with
+    // quantization, widths are stored as fractions of _widthScale_ and
+    // normals in octahedral form
+    std::vector<Float> width;
+    std::vector<uint16_t> quantizedWidth;
+    Float widthScale = 0;
+    std::vector<Normal3f> n;
+    std::vector<uint32_t> quantizedNormal;
+    // The BVH's items are the pieces that segments are split into, each
+    // identified by (segment << splitDepth) + piece index
+    std::vector<int> pieces;
+    std::vector<LinearBVHNode> nodes;
+    Bounds3f bounds;
+};
+
+// With the "presplit" parameter, each curve segment is split ahead of
+// time into _CurveSegments_ shapes, as finely as Curve::Intersect() would
+// refine it
 std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
                                                      const Transform *w2o,
                                                      bool reverseOrientation,
                                                      const ParamSet &params);
+std::vector<std::shared_ptr<Shape>> CreateCurveSetShape(const Transform *o2w,
+                                                        const Transform *w2o,
+                                                        bool reverseOrientation,
+                                                        const ParamSet &params);
 
 }  // namespace pbrt
 
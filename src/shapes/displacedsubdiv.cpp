@@ -0,0 +1,728 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// shapes/displacedsubdiv.cpp*
+#include "shapes/displacedsubdiv.h"
+#include "shapes/loopsubdiv.h"
+#include "shapes/triangle.h"
+#include "textures/constant.h"
+#include "paramset.h"
+#include "sampling.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Displaced meshes", displacedMeshBytes);
+STAT_PERCENT("Intersections/Ray-displaced patch intersection tests",
+             nPatchHits, nPatchTests);
+
+// DisplacedSubdiv Local Definitions
+static PBRT_CONSTEXPR int MaxDisplacedLevels = 10;
+
+// Tessellations store the points of the lattice that subdividing a face
+// _nLevels_ times gives in triangular order, with the point at lattice
+// coordinates $(a,b)$ at the index this returns
+static int LatticeIndex(int n, int a, int b) {
+    return b * (n + 1) - b * (b - 1) / 2 + a;
+}
+
+// Returns the index of the first node at _level_ of a tree with four
+// children per node, stored level by level
+static int LevelOffset(int level) { return ((1 << (2 * level)) - 1) / 3; }
+
+// Returns the corners of the lattice triangle between rows _b_ and _b + 1_
+// at column _a_, pointing down or, if _upper_, up; there are $2(n - b) - 1$
+// in row _b_, and the last one points down
+static void LatticeTriangle(int a, int b, int upper, Point2i c[3]) {
+    c[0] = Point2i(a + upper, b);
+    c[1] = Point2i(a + 1, b + upper);
+    c[2] = Point2i(a, b + 1);
+}
+
+// Splits the lattice triangle with corners _c_ into the four triangles of
+// the next subdivision level, in the order that _CollectLattice()_ in
+// loopsubdiv.cpp uses
+static void SplitTriangle(const Point2i c[3], Point2i children[4][3]) {
+    Point2i mid[3];
+    for (int j = 0; j < 3; ++j)
+        mid[j] = Point2i((c[j].x + c[(j + 1) % 3].x) / 2,
+                         (c[j].y + c[(j + 1) % 3].y) / 2);
+    for (int j = 0; j < 3; ++j) {
+        children[j][j] = c[j];
+        children[j][(j + 1) % 3] = mid[j];
+        children[j][(j + 2) % 3] = mid[(j + 2) % 3];
+        children[3][j] = mid[j];
+    }
+}
+
+// Returns the $(u,v)$ coordinates of control face _face_'s vertices, which
+// default to those that _Triangle_ uses
+static void FaceUVs(const DisplacedMesh &mesh, int face, Point2f uv[3]) {
+    if (mesh.uv.empty()) {
+        uv[0] = Point2f(0, 0);
+        uv[1] = Point2f(1, 0);
+        uv[2] = Point2f(1, 1);
+    } else
+        for (int j = 0; j < 3; ++j)
+            uv[j] = mesh.uv[mesh.vertexIndices[3 * face + j]];
+}
+
+// Computes the partial derivatives of a triangle's position with respect to
+// $(u,v)$ as _Triangle::Intersect()_ does
+static void TriangleDerivatives(const Point3f p[3], const Point2f uv[3],
+                                Vector3f *dpdu, Vector3f *dpdv) {
+    Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
+    Vector3f dp02 = p[0] - p[2], dp12 = p[1] - p[2];
+    Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+    bool degenerateUV = std::abs(determinant) < 1e-8;
+    if (!degenerateUV) {
+        Float invdet = 1 / determinant;
+        *dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+        *dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
+    }
+    if (degenerateUV || Cross(*dpdu, *dpdv).LengthSquared() == 0) {
+        Vector3f ng = Cross(p[2] - p[0], p[1] - p[0]);
+        if (ng.LengthSquared() == 0)
+            *dpdu = *dpdv = Vector3f(0, 0, 0);
+        else
+            CoordinateSystem(Normalize(ng), dpdu, dpdv);
+    }
+}
+
+// Evaluates the displacement texture at world space point _p_ with surface
+// normal _n_; the texture sees no differentials, so it's filtered as little
+// as it can be
+static Float EvaluateDisplacement(const Texture<Float> &displacement,
+                                  const Point3f &p, const Normal3f &n,
+                                  const Point2f &uv, const Vector3f &dpdu,
+                                  const Vector3f &dpdv, const Shape *shape) {
+    SurfaceInteraction si(p, Vector3f(0, 0, 0), uv, Vector3f(0, 0, 0), dpdu,
+                          dpdv, Normal3f(0, 0, 0), Normal3f(0, 0, 0), 0,
+                          shape);
+    si.n = si.shading.n = n;
+    return displacement.Evaluate(si);
+}
+
+// The $(u,v)$ coordinates of a control face's vertices and the partial
+// derivatives of its world space position, which displacing the points of
+// its lattice needs
+struct FaceFrame {
+    FaceFrame(const DisplacedMesh &mesh, int face,
+              const Transform &ObjectToWorld) {
+        FaceUVs(mesh, face, uv);
+        const int *v = &mesh.vertexIndices[3 * face];
+        Point3f p[3] = {ObjectToWorld(mesh.p[v[0]]),
+                        ObjectToWorld(mesh.p[v[1]]),
+                        ObjectToWorld(mesh.p[v[2]])};
+        TriangleDerivatives(p, uv, &dpdu, &dpdv);
+    }
+    Point2f uv[3];
+    Vector3f dpdu, dpdv;
+};
+
+// Finds the undisplaced surface's object space points and normals over the
+// lattice of control face _face_, in triangular order
+static void FaceLattice(const DisplacedMesh &mesh, int face,
+                        std::vector<Point3f> *pObj,
+                        std::vector<Normal3f> *nObj) {
+    int n = 1 << mesh.nLevels;
+    const int *v = &mesh.vertexIndices[3 * face];
+    const Point3f &p0 = mesh.p[v[0]], &p1 = mesh.p[v[1]], &p2 = mesh.p[v[2]];
+    if (mesh.smooth) {
+        LoopSubdivFaceLimit(face, mesh.nLevels, mesh.vertexIndices.data(),
+                            mesh.p.data(), mesh.vertexFaceOffset,
+                            mesh.vertexFaces, pObj, nObj);
+        // Orient the limit surface's normals like the control face
+        Normal3f nFace(Cross(p1 - p0, p2 - p0));
+        for (Normal3f &nl : *nObj)
+            if (Dot(nl, nFace) < 0) nl = -nl;
+        return;
+    }
+    pObj->clear();
+    nObj->clear();
+    pObj->reserve((n + 1) * (n + 2) / 2);
+    nObj->reserve((n + 1) * (n + 2) / 2);
+    for (int b = 0; b <= n; ++b)
+        for (int a = 0; a + b <= n; ++a) {
+            Float b1 = Float(a) / n, b2 = Float(b) / n, b0 = 1 - b1 - b2;
+            pObj->push_back(b0 * p0 + b1 * p1 + b2 * p2);
+            nObj->push_back(b0 * mesh.n[v[0]] + b1 * mesh.n[v[1]] +
+                            b2 * mesh.n[v[2]]);
+        }
+}
+
+// Computes the bounds of the nodes of a tessellation's tree under the node
+// at _level_ and _index_ whose lattice triangle has corners _c_, and adds
+// up the area of its triangles
+static Bounds3f BoundNodes(const Point3f *p, int nLevels, int leafLevel,
+                           int level, int index, const Point2i c[3],
+                           Bounds3f *nodeBounds, double *area) {
+    Bounds3f bounds;
+    if (level == nLevels) {
+        int n = 1 << nLevels;
+        const Point3f &p0 = p[LatticeIndex(n, c[0].x, c[0].y)];
+        const Point3f &p1 = p[LatticeIndex(n, c[1].x, c[1].y)];
+        const Point3f &p2 = p[LatticeIndex(n, c[2].x, c[2].y)];
+        bounds = Union(Bounds3f(p0, p1), p2);
+        *area += 0.5 * Cross(p1 - p0, p2 - p0).Length();
+    } else {
+        Point2i children[4][3];
+        SplitTriangle(c, children);
+        for (int k = 0; k < 4; ++k)
+            bounds = Union(bounds, BoundNodes(p, nLevels, leafLevel, level + 1,
+                                              4 * index + k, children[k],
+                                              nodeBounds, area));
+    }
+    if (level <= leafLevel) nodeBounds[LevelOffset(level) + index] = bounds;
+    return bounds;
+}
+
+// DisplacedMesh Method Definitions
+DisplacedMesh::DisplacedMesh(int nTriangles, const int *vertexIndices,
+                             int nVertices, const Point3f *P,
+                             const Normal3f *N, const Point2f *UV,
+                             bool smooth, int nLevels,
+                             std::shared_ptr<Texture<Float>> displacement,
+                             Float maxDisplacement, GeometryCache *cache)
+    : nTriangles(nTriangles),
+      nVertices(nVertices),
+      vertexIndices(vertexIndices, vertexIndices + 3 * nTriangles),
+      p(P, P + nVertices),
+      smooth(smooth),
+      nLevels(nLevels),
+      displacement(std::move(displacement)),
+      maxDisplacement(maxDisplacement),
+      cache(cache),
+      firstCacheKey(GeometryCache::NewKeyRange(nTriangles)) {
+    if (UV) uv.assign(UV, UV + nVertices);
+    LoopSubdivVertexFaces(3 * nTriangles, vertexIndices, nVertices,
+                          &vertexFaceOffset, &vertexFaces);
+    if (!smooth && N)
+        n.assign(N, N + nVertices);
+    else if (!smooth) {
+        // Average the adjacent faces' normals, weighted by area, so that
+        // neighboring faces are displaced in the same direction along the
+        // edges they share
+        n.assign(nVertices, Normal3f(0, 0, 0));
+        for (int f = 0; f < nTriangles; ++f) {
+            const int *v = &vertexIndices[3 * f];
+            Normal3f nf(Cross(p[v[1]] - p[v[0]], p[v[2]] - p[v[0]]));
+            for (int j = 0; j < 3; ++j) n[v[j]] += nf;
+        }
+    }
+    displacedMeshBytes += sizeof(*this) +
+                          this->vertexIndices.size() * sizeof(int) +
+                          p.size() * sizeof(Point3f) +
+                          n.size() * sizeof(Normal3f) +
+                          uv.size() * sizeof(Point2f) +
+                          (vertexFaceOffset.size() + vertexFaces.size()) *
+                              sizeof(int);
+}
+
+// DisplacedPatch Declarations
+struct DisplacedPatch::Tessellation : public CachedGeometry {
+    size_t BytesUsed() const {
+        return sizeof(*this) + p.size() * sizeof(Point3f) +
+               uv.size() * sizeof(Point2f) +
+               nodeBounds.size() * sizeof(Bounds3f) +
+               (areaDistrib->func.size() + areaDistrib->cdf.size()) *
+                   sizeof(Float);
+    }
+    int nLevels, leafLevel;
+    // World space points and $(u,v)$ of the lattice, in triangular order
+    std::vector<Point3f> p;
+    std::vector<Point2f> uv;
+    // Bounds of the tree's nodes down to _leafLevel_, level by level; each
+    // leaf holds up to 16 of the lattice's triangles
+    std::vector<Bounds3f> nodeBounds;
+    Float area;
+    // The lattice's triangles' areas, row by row, for sampling them
+    std::unique_ptr<Distribution1D> areaDistrib;
+};
+
+// DisplacedPatch Method Definitions
+DisplacedPatch::DisplacedPatch(const Transform *ObjectToWorld,
+                               const Transform *WorldToObject,
+                               bool reverseOrientation,
+                               const std::shared_ptr<const DisplacedMesh> &mesh,
+                               int face)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      mesh(mesh),
+      face(face),
+      area(-1) {
+    // Bound the undisplaced surface; the limit surface of Loop subdivision
+    // is inside the convex hull of the faces around the face's vertices
+    const int *v = &mesh->vertexIndices[3 * face];
+    for (int j = 0; j < 3; ++j) {
+        if (!mesh->smooth) {
+            objectBound = Union(objectBound, mesh->p[v[j]]);
+            continue;
+        }
+        for (int k = mesh->vertexFaceOffset[v[j]];
+             k < mesh->vertexFaceOffset[v[j] + 1]; ++k)
+            for (int l = 0; l < 3; ++l)
+                objectBound = Union(
+                    objectBound,
+                    mesh->p[mesh->vertexIndices[3 * mesh->vertexFaces[k] + l]]);
+    }
+
+    // Expand the bounds by the largest displacement over the face's
+    // $(u,v)$ range, if the texture can bound it
+    Float dMin = -mesh->maxDisplacement, dMax = mesh->maxDisplacement;
+    Point2f uv[3];
+    FaceUVs(*mesh, face, uv);
+    Float texMin, texMax;
+    if (mesh->displacement->Bound(Union(Bounds2f(uv[0], uv[1]), uv[2]),
+                                  &texMin, &texMax)) {
+        dMin = std::max(dMin, texMin);
+        dMax = std::min(dMax, texMax);
+    }
+    objectBound =
+        Expand(objectBound, std::max(std::abs(dMin), std::abs(dMax)));
+    displacedMeshBytes += sizeof(*this);
+}
+
+Bounds3f DisplacedPatch::WorldBound() const {
+    // Pad the transformed bounds for the rounding error in the points of
+    // the tessellation
+    Bounds3f b = (*ObjectToWorld)(objectBound);
+    return Expand(b, gamma(5) * std::max(MaxComponent(Abs(Vector3f(b.pMin))),
+                                         MaxComponent(Abs(Vector3f(b.pMax)))));
+}
+
+std::shared_ptr<const DisplacedPatch::Tessellation>
+DisplacedPatch::GetTessellation() const {
+    return std::static_pointer_cast<const Tessellation>(mesh->cache->Lookup(
+        mesh->firstCacheKey + face,
+        [this]() -> std::shared_ptr<const CachedGeometry> {
+            return Tessellate();
+        }));
+}
+
+std::shared_ptr<const DisplacedPatch::Tessellation>
+DisplacedPatch::Tessellate() const {
+    std::shared_ptr<Tessellation> tess = std::make_shared<Tessellation>();
+    int nLevels = mesh->nLevels, n = 1 << nLevels;
+    tess->nLevels = nLevels;
+    tess->leafLevel = std::max(0, nLevels - 2);
+    int nPoints = (n + 1) * (n + 2) / 2;
+
+    // Displace the lattice's points along their normals and transform them
+    // to world space
+    auto displace = [&](const FaceFrame &frame, int a, int b,
+                        const Point3f &p, const Normal3f &nl, Point2f *uv) {
+        Float b1 = Float(a) / n, b2 = Float(b) / n, b0 = 1 - b1 - b2;
+        *uv = b0 * frame.uv[0] + b1 * frame.uv[1] + b2 * frame.uv[2];
+        Vector3f dir(nl);
+        Float d = 0;
+        if (dir.LengthSquared() > 0) {
+            dir = Normalize(dir);
+            d = EvaluateDisplacement(
+                *mesh->displacement, (*ObjectToWorld)(p),
+                Normalize((*ObjectToWorld)(Normal3f(dir))), *uv, frame.dpdu,
+                frame.dpdv, this);
+            // Keep the points inside the patch's bounds
+            d = Clamp(d, -mesh->maxDisplacement, mesh->maxDisplacement);
+        }
+        return (*ObjectToWorld)(p + d * dir);
+    };
+    const int *v = &mesh->vertexIndices[3 * face];
+    std::vector<Point3f> pObj;
+    std::vector<Normal3f> nObj;
+    FaceLattice(*mesh, face, &pObj, &nObj);
+    FaceFrame frame(*mesh, face, *ObjectToWorld);
+    tess->p.resize(nPoints);
+    tess->uv.resize(nPoints);
+    for (int b = 0, i = 0; b <= n; ++b)
+        for (int a = 0; a + b <= n; ++a, ++i)
+            tess->p[i] = displace(frame, a, b, pObj[i], nObj[i], &tess->uv[i]);
+
+    // The points on the face's edges are shared with its neighbors, which
+    // find them in a different order and so with different rounding.
+    // Each is taken from the lowest numbered face that has it, computed
+    // as that face's patch does, so that neighboring patches meet exactly.
+    std::map<int, std::vector<std::pair<int, Point2i>>> shared;
+    for (int b = 0, i = 0; b <= n; ++b)
+        for (int a = 0; a + b <= n; ++a, ++i) {
+            int w[3] = {n - a - b, a, b};
+            if (w[0] > 0 && w[1] > 0 && w[2] > 0) continue;
+            // The faces around a vertex are listed in order, so the first
+            // one with all of the point's vertices is its owner
+            int j0 = w[0] > 0 ? 0 : (w[1] > 0 ? 1 : 2);
+            int owner = -1, wOwner[3];
+            for (int k = mesh->vertexFaceOffset[v[j0]];
+                 owner < 0 && k < mesh->vertexFaceOffset[v[j0] + 1]; ++k) {
+                int g = mesh->vertexFaces[k];
+                const int *vg = &mesh->vertexIndices[3 * g];
+                int wg[3] = {0, 0, 0};
+                bool hasAll = true;
+                for (int j = 0; j < 3 && hasAll; ++j) {
+                    if (w[j] == 0) continue;
+                    int jg = std::find(vg, vg + 3, v[j]) - vg;
+                    if (jg == 3)
+                        hasAll = false;
+                    else
+                        wg[jg] += w[j];
+                }
+                if (!hasAll) continue;
+                owner = g;
+                std::copy(wg, wg + 3, wOwner);
+            }
+            if (owner != face)
+                shared[owner].push_back({i, Point2i(wOwner[1], wOwner[2])});
+        }
+    for (const auto &s : shared) {
+        FaceLattice(*mesh, s.first, &pObj, &nObj);
+        FaceFrame ownerFrame(*mesh, s.first, *ObjectToWorld);
+        for (const std::pair<int, Point2i> &pt : s.second) {
+            int a = pt.second.x, b = pt.second.y, i = LatticeIndex(n, a, b);
+            Point2f uv;
+            tess->p[pt.first] =
+                displace(ownerFrame, a, b, pObj[i], nObj[i], &uv);
+        }
+    }
+
+    // Bound the nodes of the tree over the lattice's triangles
+    tess->nodeBounds.resize(LevelOffset(tess->leafLevel + 1));
+    Point2i root[3] = {Point2i(0, 0), Point2i(n, 0), Point2i(0, n)};
+    double tessArea = 0;
+    BoundNodes(tess->p.data(), nLevels, tess->leafLevel, 0, 0, root,
+               tess->nodeBounds.data(), &tessArea);
+    tess->area = area = tessArea;
+
+    // Tabulate the lattice's triangles' areas in the order Sample() finds
+    // them in
+    std::vector<Float> triAreas;
+    triAreas.reserve(n * n);
+    for (int b = 0; b < n; ++b)
+        for (int a = 0; a + b < n; ++a)
+            for (int upper = 0; upper < 2; ++upper) {
+                if (upper && a + b + 1 == n) break;
+                Point2i c[3];
+                LatticeTriangle(a, b, upper, c);
+                const Point3f &p0 = tess->p[LatticeIndex(n, c[0].x, c[0].y)];
+                const Point3f &p1 = tess->p[LatticeIndex(n, c[1].x, c[1].y)];
+                const Point3f &p2 = tess->p[LatticeIndex(n, c[2].x, c[2].y)];
+                triAreas.push_back(0.5f * Cross(p1 - p0, p2 - p0).Length());
+            }
+    tess->areaDistrib.reset(new Distribution1D(triAreas.data(), n * n));
+    return tess;
+}
+
+bool DisplacedPatch::FindHit(const Tessellation &tess, const Ray &r,
+                             bool anyHit, Float *tHit, Point2i cHit[3],
+                             Float bHit[3]) const {
+    int n = 1 << tess.nLevels;
+    Ray ray = r;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+
+    struct Node {
+        int level, index;
+        Point2i c[3];
+    };
+    Node stack[64];
+    int top = 0;
+    CHECK_LT(3 * tess.leafLevel + 4, 64);
+    stack[top].level = stack[top].index = 0;
+    stack[top].c[0] = Point2i(0, 0);
+    stack[top].c[1] = Point2i(n, 0);
+    stack[top].c[2] = Point2i(0, n);
+    ++top;
+    bool hit = false;
+    while (top > 0) {
+        Node node = stack[--top];
+        const Bounds3f &bounds =
+            tess.nodeBounds[LevelOffset(node.level) + node.index];
+        if (!bounds.IntersectP(ray, invDir, dirIsNeg)) continue;
+
+        if (node.level < tess.leafLevel) {
+            // Visit the node's children
+            Point2i children[4][3];
+            SplitTriangle(node.c, children);
+            for (int k = 0; k < 4; ++k) {
+                Node &child = stack[top++];
+                child.level = node.level + 1;
+                child.index = 4 * node.index + k;
+                for (int j = 0; j < 3; ++j) child.c[j] = children[k][j];
+            }
+            continue;
+        }
+
+        // Split the leaf down to the lattice's triangles and test them
+        Point2i tris[16][3], split[16][3];
+        int nTris = 1;
+        for (int j = 0; j < 3; ++j) tris[0][j] = node.c[j];
+        for (int level = node.level; level < tess.nLevels; ++level) {
+            for (int i = 0; i < nTris; ++i) {
+                Point2i children[4][3];
+                SplitTriangle(tris[i], children);
+                for (int k = 0; k < 4; ++k)
+                    for (int j = 0; j < 3; ++j)
+                        split[4 * i + k][j] = children[k][j];
+            }
+            nTris *= 4;
+            std::copy(&split[0][0], &split[0][0] + 3 * nTris, &tris[0][0]);
+        }
+        for (int i = 0; i < nTris; ++i) {
+            const Point2i *c = tris[i];
+            Float t, b[3];
+            if (!IntersectTriangle(ray, tess.p[LatticeIndex(n, c[0].x, c[0].y)],
+                                   tess.p[LatticeIndex(n, c[1].x, c[1].y)],
+                                   tess.p[LatticeIndex(n, c[2].x, c[2].y)], &t,
+                                   b))
+                continue;
+            if (anyHit) return true;
+            hit = true;
+            ray.tMax = t;
+            for (int j = 0; j < 3; ++j) {
+                cHit[j] = c[j];
+                bHit[j] = b[j];
+            }
+        }
+    }
+    if (hit) *tHit = ray.tMax;
+    return hit;
+}
+
+bool DisplacedPatch::Intersect(const Ray &ray, Float *tHit,
+                               SurfaceInteraction *isect,
+                               bool testAlphaTexture) const {
+    ProfilePhase prof(Prof::ShapeIntersect);
+    ++nPatchTests;
+    std::shared_ptr<const Tessellation> tess = GetTessellation();
+    Point2i c[3];
+    Float t, b[3];
+    if (!FindHit(*tess, ray, false, &t, c, b)) return false;
+    ++nPatchHits;
+
+    // Compute the hit's _SurfaceInteraction_ as _Triangle::Intersect()_ does
+    int n = 1 << tess->nLevels;
+    Point3f p[3];
+    Point2f uv[3];
+    for (int j = 0; j < 3; ++j) {
+        int i = LatticeIndex(n, c[j].x, c[j].y);
+        p[j] = tess->p[i];
+        uv[j] = tess->uv[i];
+    }
+    Vector3f dpdu, dpdv;
+    TriangleDerivatives(p, uv, &dpdu, &dpdv);
+    Vector3f dp02 = p[0] - p[2], dp12 = p[1] - p[2];
+    if (Cross(dp02, dp12).LengthSquared() == 0) return false;
+    Float xAbsSum = (std::abs(b[0] * p[0].x) + std::abs(b[1] * p[1].x) +
+                     std::abs(b[2] * p[2].x));
+    Float yAbsSum = (std::abs(b[0] * p[0].y) + std::abs(b[1] * p[1].y) +
+                     std::abs(b[2] * p[2].y));
+    Float zAbsSum = (std::abs(b[0] * p[0].z) + std::abs(b[1] * p[1].z) +
+                     std::abs(b[2] * p[2].z));
+    Vector3f pError = gamma(7) * Vector3f(xAbsSum, yAbsSum, zAbsSum);
+    Point3f pHit = b[0] * p[0] + b[1] * p[1] + b[2] * p[2];
+    Point2f uvHit = b[0] * uv[0] + b[1] * uv[1] + b[2] * uv[2];
+    *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
+                                Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time,
+                                this);
+    isect->n = isect->shading.n = Normal3f(Normalize(Cross(dp02, dp12)));
+    if (reverseOrientation ^ transformSwapsHandedness)
+        isect->n = isect->shading.n = -isect->n;
+    *tHit = t;
+    return true;
+}
+
+bool DisplacedPatch::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    ProfilePhase prof(Prof::ShapeIntersectP);
+    ++nPatchTests;
+    std::shared_ptr<const Tessellation> tess = GetTessellation();
+    Point2i c[3];
+    Float t, b[3];
+    return FindHit(*tess, ray, true, &t, c, b);
+}
+
+Float DisplacedPatch::Area() const {
+    Float a = area;
+    return a >= 0 ? a : GetTessellation()->area;
+}
+
+Interaction DisplacedPatch::Sample(const Point2f &u, Float *pdf) const {
+    std::shared_ptr<const Tessellation> tess = GetTessellation();
+    int n = 1 << tess->nLevels;
+    // Pick a lattice triangle in proportion to its area and find where it
+    // is in the lattice
+    Float u0;
+    int t = tess->areaDistrib->SampleDiscrete(u[0], nullptr, &u0);
+    int b = 0;
+    while (t >= 2 * (n - b) - 1) t -= 2 * (n - b++) - 1;
+    Point2i c[3];
+    LatticeTriangle(t / 2, b, t % 2, c);
+    Point3f p[3];
+    for (int j = 0; j < 3; ++j)
+        p[j] = tess->p[LatticeIndex(n, c[j].x, c[j].y)];
+
+    // Sample a point uniformly on the triangle
+    Point2f bs = UniformSampleTriangle(Point2f(u0, u[1]));
+    Interaction it;
+    it.p = bs[0] * p[0] + bs[1] * p[1] + (1 - bs[0] - bs[1]) * p[2];
+    it.n = Normalize(Normal3f(Cross(p[1] - p[0], p[2] - p[0])));
+    if (reverseOrientation ^ transformSwapsHandedness) it.n *= -1;
+    Point3f pAbsSum = Abs(bs[0] * p[0]) + Abs(bs[1] * p[1]) +
+                      Abs((1 - bs[0] - bs[1]) * p[2]);
+    it.pError = gamma(6) * Vector3f(pAbsSum.x, pAbsSum.y, pAbsSum.z);
+    *pdf = tess->area > 0 ? 1 / tess->area : 0;
+    return it;
+}
+
+std::vector<Point3f> DisplacedPatch::TessellationPoints() const {
+    return GetTessellation()->p;
+}
+
+std::vector<std::shared_ptr<Shape>> CreateDisplacedSubdiv(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
+    int nLevels = params.FindOneInt("levels",
+                                    params.FindOneInt("nlevels", 3));
+    int nIndices, nps, nuv = 0, nn = 0;
+    const int *vertexIndices = params.FindInt("indices", &nIndices);
+    const Point3f *P = params.FindPoint3f("P", &nps);
+    if (!vertexIndices) {
+        Error("Vertex indices \"indices\" not provided for displacedsubdiv "
+              "shape.");
+        return {};
+    }
+    if (!P) {
+        Error("Vertex positions \"P\" not provided for displacedsubdiv shape.");
+        return {};
+    }
+    if (nIndices % 3 != 0) {
+        Error("Number of vertex indices %d not a multiple of 3 for "
+              "displacedsubdiv shape.", nIndices);
+        return {};
+    }
+    for (int i = 0; i < nIndices; ++i)
+        if (vertexIndices[i] < 0 || vertexIndices[i] >= nps) {
+            Error("displacedsubdiv has out of-bounds vertex index %d (%d "
+                  "\"P\" values were given)", vertexIndices[i], nps);
+            return {};
+        }
+
+    // "loop" subdivides the control mesh with Loop's rules, and "linear"
+    // splits its faces in place, for displacing a mesh as a height map
+    std::string scheme = params.FindOneString("scheme", "loop");
+    if (scheme != "loop" && scheme != "linear") {
+        Error("Subdivision scheme \"%s\" unknown. Using \"loop\".",
+              scheme.c_str());
+        scheme = "loop";
+    }
+    bool smooth = scheme == "loop";
+    const Point2f *uv = params.FindPoint2f("uv", &nuv);
+    if (uv && nuv != nps) {
+        Error("Number of \"uv\"s for displacedsubdiv must match \"P\"s. "
+              "Discarding \"uv\"s.");
+        uv = nullptr;
+    }
+    const Normal3f *N = smooth ? nullptr : params.FindNormal3f("N", &nn);
+    if (N && nn != nps) {
+        Error("Number of \"N\"s for displacedsubdiv must match \"P\"s. "
+              "Discarding \"N\"s.");
+        N = nullptr;
+    }
+    if (nLevels > MaxDisplacedLevels)
+        Warning("Clamping displacedsubdiv \"levels\" to %d.",
+                MaxDisplacedLevels);
+    nLevels = Clamp(nLevels, 0, MaxDisplacedLevels);
+
+    // Find the displacement texture, which gives distances in object space
+    std::shared_ptr<Texture<Float>> displacement;
+    std::string displacementTexName = params.FindTexture("displacement");
+    if (displacementTexName != "") {
+        if (floatTextures->find(displacementTexName) != floatTextures->end())
+            displacement = (*floatTextures)[displacementTexName];
+        else
+            Error("Couldn't find float texture \"%s\" for \"displacement\" "
+                  "parameter", displacementTexName.c_str());
+    }
+    if (!displacement)
+        displacement = std::make_shared<ConstantTexture<Float>>(
+            params.FindOneFloat("displacement", 0.f));
+
+    // Bound the magnitude of the displacement; patches are bounded with it
+    // and displacements beyond it are clamped
+    Float maxDisplacement = params.FindOneFloat("displacementbound", -1);
+    if (maxDisplacement < 0) {
+        Bounds2f uvBounds(Point2f(0, 0), Point2f(1, 1));
+        if (uv) {
+            uvBounds = Bounds2f(uv[0], uv[0]);
+            for (int i = 1; i < nps; ++i) uvBounds = Union(uvBounds, uv[i]);
+        }
+        Float dMin, dMax;
+        if (displacement->Bound(uvBounds, &dMin, &dMax))
+            maxDisplacement = std::max(std::abs(dMin), std::abs(dMax));
+        else {
+            Warning("No \"displacementbound\" given for displacement texture "
+                    "\"%s\"; estimating it from the displacement at the "
+                    "control vertices.", displacementTexName.c_str());
+            maxDisplacement = 0;
+            for (int f = 0; f < nIndices / 3; ++f) {
+                Point3f p[3];
+                Point2f uvf[3] = {Point2f(0, 0), Point2f(1, 0), Point2f(1, 1)};
+                for (int j = 0; j < 3; ++j) {
+                    p[j] = (*o2w)(P[vertexIndices[3 * f + j]]);
+                    if (uv) uvf[j] = uv[vertexIndices[3 * f + j]];
+                }
+                Vector3f ng = Cross(p[1] - p[0], p[2] - p[0]);
+                if (ng.LengthSquared() == 0) continue;
+                Vector3f dpdu, dpdv;
+                TriangleDerivatives(p, uvf, &dpdu, &dpdv);
+                for (int j = 0; j < 3; ++j)
+                    maxDisplacement = std::max(
+                        maxDisplacement,
+                        std::abs(EvaluateDisplacement(
+                            *displacement, p[j], Normal3f(Normalize(ng)),
+                            uvf[j], dpdu, dpdv, nullptr)));
+            }
+            maxDisplacement *= 2;
+        }
+    }
+
+    std::shared_ptr<const DisplacedMesh> mesh =
+        std::make_shared<DisplacedMesh>(
+            nIndices / 3, vertexIndices, nps, P, N, uv, smooth, nLevels,
+            displacement, maxDisplacement, GetGeometryCache());
+    std::vector<std::shared_ptr<Shape>> shapes;
+    shapes.reserve(nIndices / 3);
+    for (int f = 0; f < nIndices / 3; ++f)
+        shapes.push_back(std::make_shared<DisplacedPatch>(
+            o2w, w2o, reverseOrientation, mesh, f));
+    return shapes;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,127 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+#ifndef PBRT_SHAPES_DISPLACEDSUBDIV_H
+#define PBRT_SHAPES_DISPLACEDSUBDIV_H
+
+// shapes/displacedsubdiv.h*
+#include "shape.h"
+#include "texture.h"
+#include "geomcache.h"
+#include <map>
+
+namespace pbrt {
+
+// DisplacedSubdiv Declarations
+
+// A control mesh whose faces are subdivided, either with Loop's rules or
+// linearly, and displaced along the surface normal by a texture.
+struct DisplacedMesh {
+    // DisplacedMesh Public Methods
+    DisplacedMesh(int nTriangles, const int *vertexIndices, int nVertices,
+                  const Point3f *P, const Normal3f *N, const Point2f *UV,
+                  bool smooth, int nLevels,
+                  std::shared_ptr<Texture<Float>> displacement,
+                  Float maxDisplacement, GeometryCache *cache);
+
+    // DisplacedMesh Data
+    const int nTriangles, nVertices;
+    // Object space control mesh; _n_ is only used by linear subdivision
+    std::vector<int> vertexIndices;
+    std::vector<Point3f> p;
+    std::vector<Normal3f> n;
+    std::vector<Point2f> uv;
+    // The faces around each vertex, in increasing order
+    std::vector<int> vertexFaceOffset, vertexFaces;
+    const bool smooth;
+    const int nLevels;
+    const std::shared_ptr<Texture<Float>> displacement;
+    const Float maxDisplacement;
+    GeometryCache *cache;
+    const uint64_t firstCacheKey;
+};
+
+// The displaced surface over one face of a _DisplacedMesh_.  Its
+// tessellation is only generated when a ray first reaches the patch's
+// bounds, and is kept in a _GeometryCache_ that may later drop it.  The
+// tessellation's triangles are found through an implicit tree that splits
+// each triangle into four, as subdivision does.  Area() and Sample() need
+// the tessellation as well, so patches with area lights are tessellated
+// while the scene is created; the area is kept with the patch so that the
+// cache can still drop the tessellation.
+class DisplacedPatch : public Shape {
+  public:
+    // DisplacedPatch Public Methods
+    DisplacedPatch(const Transform *ObjectToWorld,
+                   const Transform *WorldToObject, bool reverseOrientation,
+                   const std::shared_ptr<const DisplacedMesh> &mesh,
+                   int face);
+    Bounds3f ObjectBound() const { return objectBound; }
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture = true) const;
+    bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
+    Float Area() const;
+    using Shape::Sample;
+    Interaction Sample(const Point2f &u, Float *pdf) const;
+    // Returns the world space points of the patch's tessellation, in the
+    // order that _LoopSubdivFaceLimit()_ gives its points in
+    std::vector<Point3f> TessellationPoints() const;
+
+  private:
+    // DisplacedPatch Private Methods
+    struct Tessellation;
+    std::shared_ptr<const Tessellation> GetTessellation() const;
+    std::shared_ptr<const Tessellation> Tessellate() const;
+    bool FindHit(const Tessellation &tess, const Ray &ray, bool anyHit,
+                 Float *tHit, Point2i c[3], Float b[3]) const;
+
+    // DisplacedPatch Private Data
+    std::shared_ptr<const DisplacedMesh> mesh;
+    const int face;
+    Bounds3f objectBound;
+    // Surface area of the tessellation, once it has been generated
+    mutable std::atomic<Float> area;
+};
+
+std::vector<std::shared_ptr<Shape>> CreateDisplacedSubdiv(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures);
+
+}  // namespace pbrt
+
+#endif  // PBRT_SHAPES_DISPLACEDSUBDIV_H
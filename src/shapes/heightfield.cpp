@@ -35,10 +35,312 @@
 #include "shapes/heightfield.h"
 #include "shapes/triangle.h"
 #include "paramset.h"
+#include "parallel.h"
+#include "stats.h"
+#include <algorithm>
+#include <numeric>
 
 namespace pbrt {
 
-// Heightfield Definitions
+STAT_MEMORY_COUNTER("Memory/Heightfields", heightfieldBytes);
+STAT_PERCENT("Intersections/Ray-heightfield intersection tests",
+             nHeightfieldHits, nHeightfieldTests);
+STAT_RATIO("Intersections/Heightfield cells tested per ray", nCellTests,
+           nHeightfieldRays);
+
+// Heightfield Method Definitions
+Heightfield::Heightfield(const Transform *ObjectToWorld,
+                         const Transform *WorldToObject,
+                         bool reverseOrientation, int nx, int ny,
+                         const Float *zp)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      nx(nx),
+      ny(ny),
+      z(zp, zp + nx * ny) {
+    // Compute the height ranges of the blocks of cells
+    Point2i res((nx - 2) / BlockSize + 1, (ny - 2) / BlockSize + 1);
+    ranges.push_back(std::vector<HeightRange>(res.x * res.y));
+    rangeRes.push_back(res);
+    ParallelFor([&](int64_t by) {
+        for (int bx = 0; bx < res.x; ++bx) {
+            HeightRange r{Infinity, -Infinity};
+            int x1 = std::min((bx + 1) * BlockSize, nx - 1);
+            int y1 = std::min(int(by + 1) * BlockSize, ny - 1);
+            for (int y = by * BlockSize; y <= y1; ++y)
+                for (int x = bx * BlockSize; x <= x1; ++x) {
+                    r.zMin = std::min(r.zMin, z[y * nx + x]);
+                    r.zMax = std::max(r.zMax, z[y * nx + x]);
+                }
+            ranges[0][by * res.x + bx] = r;
+        }
+    }, res.y, 64);
+    while (res.x > 1 || res.y > 1) {
+        const std::vector<HeightRange> &prev = ranges.back();
+        Point2i prevRes = res;
+        res = Point2i((res.x + 1) / 2, (res.y + 1) / 2);
+        std::vector<HeightRange> level(res.x * res.y,
+                                       HeightRange{Infinity, -Infinity});
+        for (int y = 0; y < prevRes.y; ++y)
+            for (int x = 0; x < prevRes.x; ++x) {
+                HeightRange &r = level[(y / 2) * res.x + x / 2];
+                r.zMin = std::min(r.zMin, prev[y * prevRes.x + x].zMin);
+                r.zMax = std::max(r.zMax, prev[y * prevRes.x + x].zMax);
+            }
+        ranges.push_back(std::move(level));
+        rangeRes.push_back(res);
+    }
+
+    // Compute the total area of the cells' triangles
+    std::vector<double> rowArea(ny - 1);
+    ParallelFor([&](int64_t y) {
+        double sum = 0;
+        for (int x = 0; x < nx - 1; ++x)
+            for (int tri = 0; tri < 2; ++tri) {
+                Point3f p[3];
+                Point2f uv[3];
+                GetTriangle(x, y, tri, p, uv);
+                sum += 0.5 * Cross(p[1] - p[0], p[2] - p[0]).Length();
+            }
+        rowArea[y] = sum;
+    }, ny - 1, 64);
+    area = std::accumulate(rowArea.begin(), rowArea.end(), 0.);
+
+    heightfieldBytes += sizeof(*this) + z.size() * sizeof(Float);
+    for (const std::vector<HeightRange> &level : ranges)
+        heightfieldBytes += level.size() * sizeof(HeightRange);
+}
+
+Bounds3f Heightfield::ObjectBound() const {
+    const HeightRange &r = ranges.back()[0];
+    return Bounds3f(Point3f(0, 0, r.zMin), Point3f(1, 1, r.zMax));
+}
+
+// Returns the world space vertices and $(u,v)$ coordinates of triangle
+// _tri_ of cell $(x,y)$, split as in a triangulated heightfield
+void Heightfield::GetTriangle(int x, int y, int tri, Point3f p[3],
+                              Point2f uv[3]) const {
+    Point3f v[3] = {Vertex(x, y),
+                    tri == 0 ? Vertex(x + 1, y) : Vertex(x + 1, y + 1),
+                    tri == 0 ? Vertex(x + 1, y + 1) : Vertex(x, y + 1)};
+    for (int i = 0; i < 3; ++i) {
+        p[i] = (*ObjectToWorld)(v[i]);
+        uv[i] = Point2f(v[i].x, v[i].y);
+    }
+}
+
+bool Heightfield::FindHit(const Ray &r, bool anyHit, Float *tHit, int *hitX,
+                          int *hitY, int *hitTri, Float bHit[3]) const {
+    ++nHeightfieldRays;
+    // Transform _Ray_ to object space for traversing the quadtree; the
+    // triangles are tested in world space, as a triangle mesh's would be
+    Vector3f oErr, dErr;
+    Ray ray = (*WorldToObject)(r, &oErr, &dErr);
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    // Pad the bounds for the error in the transformed ray and in the
+    // triangles' transformed vertices
+    const HeightRange &all = ranges.back()[0];
+    Float pad = MaxComponent(oErr) +
+                gamma(3) * (MaxComponent(Abs(Vector3f(ray.o))) + 2 +
+                            std::max(std::abs(all.zMin), std::abs(all.zMax)));
+
+    struct Node {
+        int level, x, y;
+    };
+    Node stack[64];
+    int top = 0;
+    CHECK_LT(3 * ranges.size(), 64);
+    stack[top++] = Node{int(ranges.size()) - 1, 0, 0};
+    bool hit = false;
+    Float tMax = r.tMax;
+    while (top > 0) {
+        Node node = stack[--top];
+        // Test the ray against the node's bounds
+        int size = BlockSize << node.level;
+        int x0 = node.x * size, y0 = node.y * size;
+        int x1 = std::min(x0 + size, nx - 1), y1 = std::min(y0 + size, ny - 1);
+        const HeightRange &range =
+            ranges[node.level][node.y * rangeRes[node.level].x + node.x];
+        Bounds3f bounds(Point3f((float)x0 / (float)(nx - 1) - pad,
+                                (float)y0 / (float)(ny - 1) - pad,
+                                range.zMin - pad),
+                        Point3f((float)x1 / (float)(nx - 1) + pad,
+                                (float)y1 / (float)(ny - 1) + pad,
+                                range.zMax + pad));
+        ray.tMax = tMax;
+        if (!bounds.IntersectP(ray, invDir, dirIsNeg)) continue;
+
+        if (node.level > 0) {
+            // Visit the node's children nearest first
+            const Point2i &res = rangeRes[node.level - 1];
+            for (int i = 3; i >= 0; --i) {
+                int cx = 2 * node.x + ((i & 1) ^ dirIsNeg[0]);
+                int cy = 2 * node.y + ((i >> 1) ^ dirIsNeg[1]);
+                if (cx < res.x && cy < res.y)
+                    stack[top++] = Node{node.level - 1, cx, cy};
+            }
+            continue;
+        }
+
+        // Test the triangles of the block's cells that the ray's bounds
+        // test passes, with their vertices transformed to world space once
+        Ray rt = r;
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x) {
+                Float z00 = z[y * nx + x], z10 = z[y * nx + x + 1];
+                Float z01 = z[(y + 1) * nx + x], z11 = z[(y + 1) * nx + x + 1];
+                Bounds3f cellBounds(
+                    Point3f((float)x / (float)(nx - 1) - pad,
+                            (float)y / (float)(ny - 1) - pad,
+                            std::min({z00, z10, z01, z11}) - pad),
+                    Point3f((float)(x + 1) / (float)(nx - 1) + pad,
+                            (float)(y + 1) / (float)(ny - 1) + pad,
+                            std::max({z00, z10, z01, z11}) + pad));
+                ray.tMax = tMax;
+                if (!cellBounds.IntersectP(ray, invDir, dirIsNeg)) continue;
+                ++nCellTests;
+                Point3f p00 = (*ObjectToWorld)(Vertex(x, y));
+                Point3f p10 = (*ObjectToWorld)(Vertex(x + 1, y));
+                Point3f p01 = (*ObjectToWorld)(Vertex(x, y + 1));
+                Point3f p11 = (*ObjectToWorld)(Vertex(x + 1, y + 1));
+                for (int tri = 0; tri < 2; ++tri) {
+                    Float t, b[3];
+                    rt.tMax = tMax;
+                    if (!IntersectTriangle(rt, p00, tri == 0 ? p10 : p11,
+                                           tri == 0 ? p11 : p01, &t, b))
+                        continue;
+                    if (anyHit) return true;
+                    hit = true;
+                    tMax = t;
+                    *hitX = x;
+                    *hitY = y;
+                    *hitTri = tri;
+                    for (int i = 0; i < 3; ++i) bHit[i] = b[i];
+                }
+            }
+    }
+    if (hit) *tHit = tMax;
+    return hit;
+}
+
+bool Heightfield::Intersect(const Ray &ray, Float *tHit,
+                            SurfaceInteraction *isect,
+                            bool testAlphaTexture) const {
+    ProfilePhase prof(Prof::ShapeIntersect);
+    ++nHeightfieldTests;
+    int x, y, tri;
+    Float t, b[3];
+    if (!FindHit(ray, false, &t, &x, &y, &tri, b)) return false;
+    ++nHeightfieldHits;
+
+    // Compute the hit's _SurfaceInteraction_ as _Triangle::Intersect()_ does
+    Point3f p[3];
+    Point2f uv[3];
+    GetTriangle(x, y, tri, p, uv);
+    Vector3f dpdu, dpdv;
+    Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
+    Vector3f dp02 = p[0] - p[2], dp12 = p[1] - p[2];
+    Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+    bool degenerateUV = std::abs(determinant) < 1e-8;
+    if (!degenerateUV) {
+        Float invdet = 1 / determinant;
+        dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+        dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
+    }
+    if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0) {
+        Vector3f ng = Cross(p[2] - p[0], p[1] - p[0]);
+        if (ng.LengthSquared() == 0) return false;
+        CoordinateSystem(Normalize(ng), &dpdu, &dpdv);
+    }
+    Float xAbsSum = (std::abs(b[0] * p[0].x) + std::abs(b[1] * p[1].x) +
+                     std::abs(b[2] * p[2].x));
+    Float yAbsSum = (std::abs(b[0] * p[0].y) + std::abs(b[1] * p[1].y) +
+                     std::abs(b[2] * p[2].y));
+    Float zAbsSum = (std::abs(b[0] * p[0].z) + std::abs(b[1] * p[1].z) +
+                     std::abs(b[2] * p[2].z));
+    Vector3f pError = gamma(7) * Vector3f(xAbsSum, yAbsSum, zAbsSum);
+    Point3f pHit = b[0] * p[0] + b[1] * p[1] + b[2] * p[2];
+    Point2f uvHit = b[0] * uv[0] + b[1] * uv[1] + b[2] * uv[2];
+    *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
+                                Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time,
+                                this);
+    isect->n = isect->shading.n = Normal3f(Normalize(Cross(dp02, dp12)));
+    if (reverseOrientation ^ transformSwapsHandedness)
+        isect->n = isect->shading.n = -isect->n;
+    *tHit = t;
+    return true;
+}
+
+bool Heightfield::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    ProfilePhase prof(Prof::ShapeIntersectP);
+    int x, y, tri;
+    Float t, b[3];
+    return FindHit(ray, true, &t, &x, &y, &tri, b);
+}
+
+// Returns the density with respect to area of _Sample()_'s points on
+// triangle _tri_ of cell $(x,y)$
+Float Heightfield::TrianglePdf(int x, int y, int tri) const {
+    Point3f p[3];
+    Point2f uv[3];
+    GetTriangle(x, y, tri, p, uv);
+    Float triArea = 0.5f * Cross(p[1] - p[0], p[2] - p[0]).Length();
+    if (triArea == 0) return 0;
+    return 1 / (2 * Float(nx - 1) * Float(ny - 1) * triArea);
+}
+
+Interaction Heightfield::Sample(const Point2f &u, Float *pdf) const {
+    // Find the cell and the triangle in it that contain _u_
+    Float fx = u[0] * (nx - 1), fy = u[1] * (ny - 1);
+    int x = Clamp(int(fx), 0, nx - 2), y = Clamp(int(fy), 0, ny - 2);
+    fx = Clamp(fx - x, 0, 1);
+    fy = Clamp(fy - y, 0, 1);
+    int tri = fx >= fy ? 0 : 1;
+    Float b[3];
+    if (tri == 0) {
+        b[0] = 1 - fx;
+        b[1] = fx - fy;
+        b[2] = fy;
+    } else {
+        b[0] = 1 - fy;
+        b[1] = fx;
+        b[2] = fy - fx;
+    }
+
+    Point3f p[3];
+    Point2f uv[3];
+    GetTriangle(x, y, tri, p, uv);
+    Interaction it;
+    it.p = b[0] * p[0] + b[1] * p[1] + b[2] * p[2];
+    it.n = Normalize(Normal3f(Cross(p[1] - p[0], p[2] - p[0])));
+    if (reverseOrientation ^ transformSwapsHandedness) it.n *= -1;
+    Point3f pAbsSum = Abs(b[0] * p[0]) + Abs(b[1] * p[1]) + Abs(b[2] * p[2]);
+    it.pError = gamma(6) * Vector3f(pAbsSum.x, pAbsSum.y, pAbsSum.z);
+    *pdf = TrianglePdf(x, y, tri);
+    return it;
+}
+
+Float Heightfield::Pdf(const Interaction &it) const {
+    Point3f pObj = (*WorldToObject)(it.p);
+    Float fx = pObj.x * (nx - 1), fy = pObj.y * (ny - 1);
+    int x = Clamp(int(fx), 0, nx - 2), y = Clamp(int(fy), 0, ny - 2);
+    return TrianglePdf(x, y, fx - x >= fy - y ? 0 : 1);
+}
+
+Float Heightfield::Pdf(const Interaction &ref, const Vector3f &wi) const {
+    // Intersect sample ray with the heightfield
+    Ray ray = ref.SpawnRay(wi);
+    Float tHit;
+    SurfaceInteraction isectLight;
+    if (!Intersect(ray, &tHit, &isectLight, false)) return 0;
+
+    // Convert the area density to solid angle measure
+    Float pdf = Pdf(isectLight) * DistanceSquared(ref.p, isectLight.p) /
+                AbsDot(isectLight.n, -wi);
+    if (std::isinf(pdf)) pdf = 0.f;
+    return pdf;
+}
+
 std::vector<std::shared_ptr<Shape>> CreateHeightfield(
     const Transform *ObjectToWorld, const Transform *WorldToObject,
     bool reverseOrientation, const ParamSet &params) {
@@ -46,44 +348,16 @@ std::vector<std::shared_ptr<Shape>> CreateHeightfield(
     int ny = params.FindOneInt("nv", -1);
     int nitems;
     const Float *z = params.FindFloat("Pz", &nitems);
-    CHECK_EQ(nitems, nx * ny);
-    CHECK(nx != -1 && ny != -1 && z != nullptr);
-
-    int ntris = 2 * (nx - 1) * (ny - 1);
-    std::unique_ptr<int[]> indices(new int[3 * ntris]);
-    std::unique_ptr<Point3f[]> P(new Point3f[nx * ny]);
-    std::unique_ptr<Point2f[]> uvs(new Point2f[nx * ny]);
-    int nverts = nx * ny;
-    // Compute heightfield vertex positions
-    int pos = 0;
-    for (int y = 0; y < ny; ++y) {
-        for (int x = 0; x < nx; ++x) {
-            P[pos].x = uvs[pos].x = (float)x / (float)(nx - 1);
-            P[pos].y = uvs[pos].y = (float)y / (float)(ny - 1);
-            P[pos].z = z[pos];
-            ++pos;
-        }
+    if (nx < 2 || ny < 2) {
+        Error("Heightfield needs \"nu\" and \"nv\" of at least two.");
+        return {};
     }
-
-    // Fill in heightfield vertex offset array
-    int *vp = indices.get();
-    for (int y = 0; y < ny - 1; ++y) {
-        for (int x = 0; x < nx - 1; ++x) {
-#define VERT(x, y) ((x) + (y)*nx)
-            *vp++ = VERT(x, y);
-            *vp++ = VERT(x + 1, y);
-            *vp++ = VERT(x + 1, y + 1);
-
-            *vp++ = VERT(x, y);
-            *vp++ = VERT(x + 1, y + 1);
-            *vp++ = VERT(x, y + 1);
-        }
-#undef VERT
+    if (!z || nitems != nx * ny) {
+        Error("Heightfield needs \"nu\" * \"nv\" heights in \"Pz\".");
+        return {};
     }
-
-    return CreateTriangleMesh(ObjectToWorld, WorldToObject, reverseOrientation,
-                              ntris, indices.get(), nverts, P.get(), nullptr,
-                              nullptr, uvs.get(), nullptr, nullptr);
+    return {std::make_shared<Heightfield>(ObjectToWorld, WorldToObject,
+                                          reverseOrientation, nx, ny, z)};
 }
 
 }  // namespace pbrt
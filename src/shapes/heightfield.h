@@ -44,6 +44,56 @@
 namespace pbrt {
 
 // Heightfield Declarations
+
+// A grid of heights over $[0,1]^2$ in object space, intersected directly
+// instead of through a triangle mesh.  Each cell is split into the same two
+// triangles as a triangulated heightfield, and a quadtree of the height
+// ranges of blocks of cells limits the cells that a ray visits.
+class Heightfield : public Shape {
+  public:
+    // Heightfield Public Methods
+    Heightfield(const Transform *ObjectToWorld, const Transform *WorldToObject,
+                bool reverseOrientation, int nx, int ny, const Float *z);
+    Bounds3f ObjectBound() const;
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture = true) const;
+    bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
+    Float Area() const { return area; }
+    // Points are sampled uniformly over the grid's $(x,y)$ domain, not by
+    // area
+    using Shape::Sample;
+    Interaction Sample(const Point2f &u, Float *pdf) const;
+    Float Pdf(const Interaction &it) const;
+    Float Pdf(const Interaction &ref, const Vector3f &wi) const;
+
+  private:
+    // Heightfield Private Declarations
+    struct HeightRange {
+        Float zMin, zMax;
+    };
+
+    // Heightfield Private Methods
+    Point3f Vertex(int x, int y) const {
+        return Point3f((float)x / (float)(nx - 1), (float)y / (float)(ny - 1),
+                       z[y * nx + x]);
+    }
+    void GetTriangle(int x, int y, int tri, Point3f p[3], Point2f uv[3]) const;
+    Float TrianglePdf(int x, int y, int tri) const;
+    bool FindHit(const Ray &ray, bool anyHit, Float *tHit, int *x, int *y,
+                 int *tri, Float b[3]) const;
+
+    // Heightfield Private Data
+    const int nx, ny;
+    std::vector<Float> z;
+    // _ranges[0]_ holds the height ranges of blocks of _BlockSize_ x
+    // _BlockSize_ cells and each following level those of 2x2 blocks of
+    // the previous one
+    static PBRT_CONSTEXPR int BlockSize = 4;
+    std::vector<std::vector<HeightRange>> ranges;
+    std::vector<Point2i> rangeRes;
+    Float area;
+};
+
 std::vector<std::shared_ptr<Shape>> CreateHeightfield(const Transform *o2w,
                                                       const Transform *w2o,
                                                       bool ro,
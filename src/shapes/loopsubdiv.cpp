@@ -35,8 +35,11 @@
 #include "shapes/loopsubdiv.h"
 #include "shapes/triangle.h"
 #include "paramset.h"
+#include "parallel.h"
+#include <algorithm>
 #include <set>
 #include <map>
+#include <unordered_map>
 
 namespace pbrt {
 
@@ -146,28 +149,15 @@ inline Float loopGamma(int valence) {
 }
 
 // LoopSubdiv Function Definitions
-static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
-    const Transform *ObjectToWorld, const Transform *WorldToObject,
-    bool reverseOrientation, int nLevels, int nIndices,
-    const int *vertexIndices, int nVertices, const Point3f *p) {
-    std::vector<SDVertex *> vertices;
-    std::vector<SDFace *> faces;
-    // Allocate _LoopSubdiv_ vertices and faces
-    std::unique_ptr<SDVertex[]> verts(new SDVertex[nVertices]);
-    for (int i = 0; i < nVertices; ++i) {
-        verts[i] = SDVertex(p[i]);
-        vertices.push_back(&verts[i]);
-    }
-    int nFaces = nIndices / 3;
-    std::unique_ptr<SDFace[]> fs(new SDFace[nFaces]);
-    for (int i = 0; i < nFaces; ++i) faces.push_back(&fs[i]);
-
+static void InitializeTopology(int nFaces, const int *vertexIndices,
+                               int nVertices, SDVertex *verts,
+                               SDFace *faces) {
     // Set face to vertex pointers
     const int *vp = vertexIndices;
     for (int i = 0; i < nFaces; ++i, vp += 3) {
-        SDFace *f = faces[i];
+        SDFace *f = &faces[i];
         for (int j = 0; j < 3; ++j) {
-            SDVertex *v = vertices[vp[j]];
+            SDVertex *v = &verts[vp[j]];
             f->v[j] = v;
             v->startFace = f;
         }
@@ -176,7 +166,7 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
     // Set neighbor pointers in _faces_
     std::set<SDEdge> edges;
     for (int i = 0; i < nFaces; ++i) {
-        SDFace *f = faces[i];
+        SDFace *f = &faces[i];
         for (int edgeNum = 0; edgeNum < 3; ++edgeNum) {
             // Update neighbor pointer for _edgeNum_
             int v0 = edgeNum, v1 = NEXT(edgeNum);
@@ -198,7 +188,7 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
 
     // Finish vertex initialization
     for (int i = 0; i < nVertices; ++i) {
-        SDVertex *v = vertices[i];
+        SDVertex *v = &verts[i];
         SDFace *f = v->startFace;
         do {
             f = f->nextFace(v);
@@ -211,125 +201,123 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
         else
             v->regular = false;
     }
+}
 
-    // Refine _LoopSubdiv_ into triangles
-    std::vector<SDFace *> f = faces;
-    std::vector<SDVertex *> v = vertices;
-    MemoryArena arena;
-    for (int i = 0; i < nLevels; ++i) {
-        // Update _f_ and _v_ for next level of subdivision
-        std::vector<SDFace *> newFaces;
-        std::vector<SDVertex *> newVertices;
-
-        // Allocate next level of children in mesh tree
-        for (SDVertex *vertex : v) {
-            vertex->child = arena.Alloc<SDVertex>();
-            vertex->child->regular = vertex->regular;
-            vertex->child->boundary = vertex->boundary;
-            newVertices.push_back(vertex->child);
-        }
-        for (SDFace *face : f) {
-            for (int k = 0; k < 4; ++k) {
-                face->children[k] = arena.Alloc<SDFace>();
-                newFaces.push_back(face->children[k]);
-            }
+static void Refine(std::vector<SDFace *> &f, std::vector<SDVertex *> &v,
+                   MemoryArena &arena) {
+    // Update _f_ and _v_ for next level of subdivision
+    std::vector<SDFace *> newFaces;
+    std::vector<SDVertex *> newVertices;
+
+    // Allocate next level of children in mesh tree
+    for (SDVertex *vertex : v) {
+        vertex->child = arena.Alloc<SDVertex>();
+        vertex->child->regular = vertex->regular;
+        vertex->child->boundary = vertex->boundary;
+        newVertices.push_back(vertex->child);
+    }
+    for (SDFace *face : f) {
+        for (int k = 0; k < 4; ++k) {
+            face->children[k] = arena.Alloc<SDFace>();
+            newFaces.push_back(face->children[k]);
         }
+    }
 
-        // Update vertex positions and create new edge vertices
-
-        // Update vertex positions for even vertices
-        for (SDVertex *vertex : v) {
-            if (!vertex->boundary) {
-                // Apply one-ring rule for even vertex
-                if (vertex->regular)
-                    vertex->child->p = weightOneRing(vertex, 1.f / 16.f);
-                else
-                    vertex->child->p =
-                        weightOneRing(vertex, beta(vertex->valence()));
-            } else {
-                // Apply boundary rule for even vertex
-                vertex->child->p = weightBoundary(vertex, 1.f / 8.f);
-            }
+    // Update vertex positions and create new edge vertices
+
+    // Update vertex positions for even vertices
+    for (SDVertex *vertex : v) {
+        if (!vertex->boundary) {
+            // Apply one-ring rule for even vertex
+            if (vertex->regular)
+                vertex->child->p = weightOneRing(vertex, 1.f / 16.f);
+            else
+                vertex->child->p =
+                    weightOneRing(vertex, beta(vertex->valence()));
+        } else {
+            // Apply boundary rule for even vertex
+            vertex->child->p = weightBoundary(vertex, 1.f / 8.f);
         }
+    }
 
-        // Compute new odd edge vertices
-        std::map<SDEdge, SDVertex *> edgeVerts;
-        for (SDFace *face : f) {
-            for (int k = 0; k < 3; ++k) {
-                // Compute odd vertex on _k_th edge
-                SDEdge edge(face->v[k], face->v[NEXT(k)]);
-                SDVertex *vert = edgeVerts[edge];
-                if (!vert) {
-                    // Create and initialize new odd vertex
-                    vert = arena.Alloc<SDVertex>();
-                    newVertices.push_back(vert);
-                    vert->regular = true;
-                    vert->boundary = (face->f[k] == nullptr);
-                    vert->startFace = face->children[3];
-
-                    // Apply edge rules to compute new vertex position
-                    if (vert->boundary) {
-                        vert->p = 0.5f * edge.v[0]->p;
-                        vert->p += 0.5f * edge.v[1]->p;
-                    } else {
-                        vert->p = 3.f / 8.f * edge.v[0]->p;
-                        vert->p += 3.f / 8.f * edge.v[1]->p;
-                        vert->p += 1.f / 8.f *
-                                   face->otherVert(edge.v[0], edge.v[1])->p;
-                        vert->p +=
-                            1.f / 8.f *
-                            face->f[k]->otherVert(edge.v[0], edge.v[1])->p;
-                    }
-                    edgeVerts[edge] = vert;
+    // Compute new odd edge vertices
+    std::map<SDEdge, SDVertex *> edgeVerts;
+    for (SDFace *face : f) {
+        for (int k = 0; k < 3; ++k) {
+            // Compute odd vertex on _k_th edge
+            SDEdge edge(face->v[k], face->v[NEXT(k)]);
+            SDVertex *vert = edgeVerts[edge];
+            if (!vert) {
+                // Create and initialize new odd vertex
+                vert = arena.Alloc<SDVertex>();
+                newVertices.push_back(vert);
+                vert->regular = true;
+                vert->boundary = (face->f[k] == nullptr);
+                vert->startFace = face->children[3];
+
+                // Apply edge rules to compute new vertex position
+                if (vert->boundary) {
+                    vert->p = 0.5f * edge.v[0]->p;
+                    vert->p += 0.5f * edge.v[1]->p;
+                } else {
+                    vert->p = 3.f / 8.f * edge.v[0]->p;
+                    vert->p += 3.f / 8.f * edge.v[1]->p;
+                    vert->p += 1.f / 8.f *
+                               face->otherVert(edge.v[0], edge.v[1])->p;
+                    vert->p += 1.f / 8.f *
+                               face->f[k]->otherVert(edge.v[0], edge.v[1])->p;
                 }
+                edgeVerts[edge] = vert;
             }
         }
+    }
 
-        // Update new mesh topology
+    // Update new mesh topology
 
-        // Update even vertex face pointers
-        for (SDVertex *vertex : v) {
-            int vertNum = vertex->startFace->vnum(vertex);
-            vertex->child->startFace = vertex->startFace->children[vertNum];
-        }
+    // Update even vertex face pointers
+    for (SDVertex *vertex : v) {
+        int vertNum = vertex->startFace->vnum(vertex);
+        vertex->child->startFace = vertex->startFace->children[vertNum];
+    }
 
-        // Update face neighbor pointers
-        for (SDFace *face : f) {
-            for (int j = 0; j < 3; ++j) {
-                // Update children _f_ pointers for siblings
-                face->children[3]->f[j] = face->children[NEXT(j)];
-                face->children[j]->f[NEXT(j)] = face->children[3];
-
-                // Update children _f_ pointers for neighbor children
-                SDFace *f2 = face->f[j];
-                face->children[j]->f[j] =
-                    f2 ? f2->children[f2->vnum(face->v[j])] : nullptr;
-                f2 = face->f[PREV(j)];
-                face->children[j]->f[PREV(j)] =
-                    f2 ? f2->children[f2->vnum(face->v[j])] : nullptr;
-            }
+    // Update face neighbor pointers
+    for (SDFace *face : f) {
+        for (int j = 0; j < 3; ++j) {
+            // Update children _f_ pointers for siblings
+            face->children[3]->f[j] = face->children[NEXT(j)];
+            face->children[j]->f[NEXT(j)] = face->children[3];
+
+            // Update children _f_ pointers for neighbor children
+            SDFace *f2 = face->f[j];
+            face->children[j]->f[j] =
+                f2 ? f2->children[f2->vnum(face->v[j])] : nullptr;
+            f2 = face->f[PREV(j)];
+            face->children[j]->f[PREV(j)] =
+                f2 ? f2->children[f2->vnum(face->v[j])] : nullptr;
         }
+    }
 
-        // Update face vertex pointers
-        for (SDFace *face : f) {
-            for (int j = 0; j < 3; ++j) {
-                // Update child vertex pointer to new even vertex
-                face->children[j]->v[j] = face->v[j]->child;
-
-                // Update child vertex pointer to new odd vertex
-                SDVertex *vert =
-                    edgeVerts[SDEdge(face->v[j], face->v[NEXT(j)])];
-                face->children[j]->v[NEXT(j)] = vert;
-                face->children[NEXT(j)]->v[j] = vert;
-                face->children[3]->v[j] = vert;
-            }
+    // Update face vertex pointers
+    for (SDFace *face : f) {
+        for (int j = 0; j < 3; ++j) {
+            // Update child vertex pointer to new even vertex
+            face->children[j]->v[j] = face->v[j]->child;
+
+            // Update child vertex pointer to new odd vertex
+            SDVertex *vert = edgeVerts[SDEdge(face->v[j], face->v[NEXT(j)])];
+            face->children[j]->v[NEXT(j)] = vert;
+            face->children[NEXT(j)]->v[j] = vert;
+            face->children[3]->v[j] = vert;
         }
-
-        // Prepare for next level of subdivision
-        f = newFaces;
-        v = newVertices;
     }
 
+    // Prepare for next level of subdivision
+    f = std::move(newFaces);
+    v = std::move(newVertices);
+}
+
+static void PushToLimit(const std::vector<SDVertex *> &v,
+                        std::vector<Normal3f> *Ns) {
     // Push vertices to limit surface
     std::unique_ptr<Point3f[]> pLimit(new Point3f[v.size()]);
     for (size_t i = 0; i < v.size(); ++i) {
@@ -341,8 +329,8 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
     for (size_t i = 0; i < v.size(); ++i) v[i]->p = pLimit[i];
 
     // Compute vertex tangents on limit surface
-    std::vector<Normal3f> Ns;
-    Ns.reserve(v.size());
+    Ns->clear();
+    Ns->reserve(v.size());
     std::vector<Point3f> pRing(16, Point3f());
     for (SDVertex *vertex : v) {
         Vector3f S(0, 0, 0), T(0, 0, 0);
@@ -375,34 +363,411 @@ static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
                 T = -T;
             }
         }
-        Ns.push_back(Normal3f(Cross(S, T)));
+        Ns->push_back(Normal3f(Cross(S, T)));
     }
+}
 
-    // Create triangle mesh from subdivision mesh
-    {
-        size_t ntris = f.size();
-        std::unique_ptr<int[]> verts(new int[3 * ntris]);
-        int *vp = verts.get();
-        size_t totVerts = v.size();
-        std::map<SDVertex *, int> usedVerts;
-        for (size_t i = 0; i < totVerts; ++i) usedVerts[v[i]] = i;
-        for (size_t i = 0; i < ntris; ++i) {
+// Records the level-_depth_ descendants' vertices of _face_ in _lattice_,
+// indexed by barycentric lattice coordinates (i, j) where _face_'s
+// vertices are at (0, 0), (n, 0) and (0, n).
+static void CollectLattice(SDFace *face, int depth, const Point2i c[3], int n,
+                           std::vector<SDVertex *> &lattice) {
+    if (depth == 0) {
+        for (int j = 0; j < 3; ++j) lattice[c[j].y * (n + 1) + c[j].x] = face->v[j];
+        return;
+    }
+    Point2i mid[3];
+    for (int j = 0; j < 3; ++j)
+        mid[j] = Point2i((c[j].x + c[NEXT(j)].x) / 2,
+                         (c[j].y + c[NEXT(j)].y) / 2);
+    for (int j = 0; j < 3; ++j) {
+        Point2i cc[3];
+        cc[j] = c[j];
+        cc[NEXT(j)] = mid[j];
+        cc[PREV(j)] = mid[PREV(j)];
+        CollectLattice(face->children[j], depth - 1, cc, n, lattice);
+    }
+    CollectLattice(face->children[3], depth - 1, mid, n, lattice);
+}
+
+// The part of a control mesh made of the faces _faces_ and of all of the
+// faces that share a vertex with them, which is all of the control mesh
+// that the limit surface of _faces_ depends on.  _faces_ come first in the
+// local mesh's faces.
+struct LocalControlMesh {
+    LocalControlMesh(std::vector<int> coreFaces, const int *vertexIndices,
+                     const Point3f *p,
+                     const std::vector<int> &vertexFaceOffset,
+                     const std::vector<int> &vertexFaces)
+        : faces(std::move(coreFaces)) {
+        int nCoreFaces = faces.size();
+        std::unordered_map<int, int> faceToLocal, vertexToLocal;
+        for (int i = 0; i < nCoreFaces; ++i) faceToLocal[faces[i]] = i;
+        for (int i = 0; i < nCoreFaces; ++i)
+            for (int j = 0; j < 3; ++j) {
+                int vi = vertexIndices[3 * faces[i] + j];
+                for (int k = vertexFaceOffset[vi]; k < vertexFaceOffset[vi + 1];
+                     ++k)
+                    if (faceToLocal.insert({vertexFaces[k],
+                                            (int)faces.size()}).second)
+                        faces.push_back(vertexFaces[k]);
+            }
+        std::vector<int> localIndices;
+        for (int fi : faces)
             for (int j = 0; j < 3; ++j) {
-                *vp = usedVerts[f[i]->v[j]];
-                ++vp;
+                int vi = vertexIndices[3 * fi + j];
+                auto iter = vertexToLocal.find(vi);
+                if (iter == vertexToLocal.end()) {
+                    iter = vertexToLocal.insert({vi, (int)verts.size()})
+                               .first;
+                    verts.push_back(SDVertex(p[vi]));
+                }
+                localIndices.push_back(iter->second);
+            }
+        fs.reset(new SDFace[faces.size()]);
+        InitializeTopology(faces.size(), localIndices.data(), verts.size(),
+                           verts.data(), fs.get());
+    }
+    std::vector<int> faces;
+    std::vector<SDVertex> verts;
+    std::unique_ptr<SDFace[]> fs;
+};
+
+void LoopSubdivVertexFaces(int nIndices, const int *vertexIndices,
+                           int nVertices, std::vector<int> *vertexFaceOffset,
+                           std::vector<int> *vertexFaces) {
+    vertexFaceOffset->assign(nVertices + 1, 0);
+    for (int i = 0; i < nIndices; ++i)
+        ++(*vertexFaceOffset)[vertexIndices[i] + 1];
+    for (int i = 0; i < nVertices; ++i)
+        (*vertexFaceOffset)[i + 1] += (*vertexFaceOffset)[i];
+    vertexFaces->resize(nIndices);
+    std::vector<int> next(vertexFaceOffset->begin(),
+                          vertexFaceOffset->end() - 1);
+    for (int i = 0; i < nIndices; ++i)
+        (*vertexFaces)[next[vertexIndices[i]]++] = i / 3;
+}
+
+void LoopSubdivFaceLimit(int face, int nLevels, const int *vertexIndices,
+                         const Point3f *p,
+                         const std::vector<int> &vertexFaceOffset,
+                         const std::vector<int> &vertexFaces,
+                         std::vector<Point3f> *pLimit,
+                         std::vector<Normal3f> *nLimit) {
+    // Refine the face and its neighbors and push them to the limit surface
+    LocalControlMesh local({face}, vertexIndices, p, vertexFaceOffset,
+                           vertexFaces);
+    std::vector<SDFace *> f;
+    std::vector<SDVertex *> v;
+    for (size_t i = 0; i < local.faces.size(); ++i) f.push_back(&local.fs[i]);
+    for (SDVertex &vertex : local.verts) v.push_back(&vertex);
+    MemoryArena arena;
+    for (int i = 0; i < nLevels; ++i) Refine(f, v, arena);
+    std::vector<Normal3f> Ns;
+    PushToLimit(v, &Ns);
+    std::unordered_map<const SDVertex *, int> limitIndex;
+    for (size_t i = 0; i < v.size(); ++i) limitIndex[v[i]] = i;
+
+    // Copy the face's lattice of limit points in triangular order
+    int n = 1 << nLevels;
+    std::vector<SDVertex *> lattice((n + 1) * (n + 1));
+    Point2i corners[3] = {Point2i(0, 0), Point2i(n, 0), Point2i(0, n)};
+    CollectLattice(&local.fs[0], nLevels, corners, n, lattice);
+    pLimit->clear();
+    nLimit->clear();
+    pLimit->reserve((n + 1) * (n + 2) / 2);
+    nLimit->reserve((n + 1) * (n + 2) / 2);
+    for (int b = 0; b <= n; ++b)
+        for (int a = 0; a + b <= n; ++a) {
+            const SDVertex *sv = lattice[b * (n + 1) + a];
+            pLimit->push_back(sv->p);
+            nLimit->push_back(Ns[limitIndex[sv]]);
+        }
+}
+
+static std::vector<std::shared_ptr<Shape>> LoopSubdivide(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, int nLevels, int nIndices,
+    const int *vertexIndices, int nVertices, const Point3f *p,
+    Float edgeLength, Float flatness, const SubdivisionView *view) {
+    // Allocate _LoopSubdiv_ vertices and faces for the control mesh
+    int nFaces = nIndices / 3;
+    std::unique_ptr<SDVertex[]> verts(new SDVertex[nVertices]);
+    for (int i = 0; i < nVertices; ++i) verts[i] = SDVertex(p[i]);
+    std::unique_ptr<SDFace[]> fs(new SDFace[nFaces]);
+    InitializeTopology(nFaces, vertexIndices, nVertices, verts.get(),
+                       fs.get());
+    auto vertexIndex = [&](const SDVertex *v) { return int(v - verts.get()); };
+    auto faceIndex = [&](const SDFace *f) { return int(f - fs.get()); };
+
+    // Find the faces incident to each control vertex
+    std::vector<int> vertexFaceOffset, vertexFaces;
+    LoopSubdivVertexFaces(nIndices, vertexIndices, nVertices,
+                          &vertexFaceOffset, &vertexFaces);
+
+    // Choose a subdivision level for each control face
+    std::vector<int> faceLevel(nFaces, nLevels);
+    bool useEdgeLength = edgeLength > 0 && view;
+    if (useEdgeLength || flatness > 0) {
+        ParallelFor([&](int64_t fi) {
+            const SDFace &face = fs[fi];
+            Point3f v[3] = {face.v[0]->p, face.v[1]->p, face.v[2]->p};
+            Float maxEdge = std::max({Distance(v[0], v[1]),
+                                      Distance(v[1], v[2]),
+                                      Distance(v[2], v[0])});
+            Vector3f n = Cross(v[1] - v[0], v[2] - v[0]);
+            if (maxEdge == 0 || n.LengthSquared() == 0) return;
+            n = Normalize(n);
+            int level = 0;
+            if (flatness > 0) {
+                // Each level halves the deviation of the neighboring
+                // control points from the face's plane relative to the
+                // size of the resulting triangles
+                Float dev = 0;
+                for (int j = 0; j < 3; ++j) {
+                    int vi = vertexIndex(face.v[j]);
+                    for (int k = vertexFaceOffset[vi];
+                         k < vertexFaceOffset[vi + 1]; ++k)
+                        for (int l = 0; l < 3; ++l)
+                            dev = std::max(
+                                dev, std::abs(Dot(n, fs[vertexFaces[k]].v[l]->p -
+                                                         v[0])));
+                }
+                Float ratio = dev / (maxEdge * flatness);
+                if (ratio > 1)
+                    level = std::max(level, int(std::ceil(std::log2(ratio))));
             }
+            if (useEdgeLength) {
+                // Bound the projected length of the longest edge
+                Point3f vw[3];
+                for (int j = 0; j < 3; ++j) vw[j] = (*ObjectToWorld)(v[j]);
+                Point3f pc = (vw[0] + vw[1] + vw[2]) / 3;
+                Float radius = std::max({Distance(pc, vw[0]),
+                                         Distance(pc, vw[1]),
+                                         Distance(pc, vw[2])});
+                Float dist = Distance(view->pCamera, pc) - radius;
+                Float worldEdge = std::max({Distance(vw[0], vw[1]),
+                                            Distance(vw[1], vw[2]),
+                                            Distance(vw[2], vw[0])});
+                if (dist <= 0)
+                    level = nLevels;
+                else {
+                    Float ratio =
+                        worldEdge * view->pixelsPerUnit / (dist * edgeLength);
+                    if (ratio > 1)
+                        level =
+                            std::max(level, int(std::ceil(std::log2(ratio))));
+                }
+            }
+            faceLevel[fi] = std::min(level, nLevels);
+        }, nFaces, 4096);
+    }
+
+    // Number the control mesh edges; each edge is subdivided at the lower
+    // of its faces' levels and its vertices are taken from that face
+    std::vector<int> faceEdge(3 * nFaces);
+    std::vector<int> edgeStart, edgeLevel, edgeOwner;
+    for (int fi = 0; fi < nFaces; ++fi) {
+        SDFace &face = fs[fi];
+        for (int k = 0; k < 3; ++k) {
+            SDFace *nbr = face.f[k];
+            int ni = nbr ? faceIndex(nbr) : -1;
+            if (ni >= 0 && ni < fi) {
+                // Reuse the index assigned when the neighbor was visited
+                SDEdge edge(face.v[k], face.v[NEXT(k)]);
+                int k2 = 0;
+                for (; k2 < 3; ++k2) {
+                    SDEdge e2(nbr->v[k2], nbr->v[NEXT(k2)]);
+                    if (nbr->f[k2] == &face && !(e2 < edge) && !(edge < e2))
+                        break;
+                }
+                CHECK_LT(k2, 3);
+                faceEdge[3 * fi + k] = faceEdge[3 * ni + k2];
+                continue;
+            }
+            faceEdge[3 * fi + k] = edgeStart.size();
+            edgeStart.push_back(vertexIndex(face.v[k]));
+            int level = faceLevel[fi], owner = fi;
+            if (ni >= 0 && faceLevel[ni] < level) {
+                level = faceLevel[ni];
+                owner = ni;
+            }
+            edgeLevel.push_back(level);
+            edgeOwner.push_back(owner);
+        }
+    }
+
+    // Assign output vertex indices: control vertices first, then the
+    // interior vertices of each edge, then those of each face
+    int nEdges = edgeStart.size();
+    std::vector<int> edgeOffset(nEdges + 1), faceOffset(nFaces + 1);
+    edgeOffset[0] = nVertices;
+    for (int e = 0; e < nEdges; ++e)
+        edgeOffset[e + 1] = edgeOffset[e] + (1 << edgeLevel[e]) - 1;
+    faceOffset[0] = edgeOffset[nEdges];
+    for (int fi = 0; fi < nFaces; ++fi) {
+        int n = 1 << faceLevel[fi];
+        faceOffset[fi + 1] = faceOffset[fi] + (n - 1) * (n - 2) / 2;
+    }
+    int nOutVertices = faceOffset[nFaces];
+    std::vector<int> vertexOwner(nVertices, -1);
+    for (int vi = 0; vi < nVertices; ++vi)
+        if (vertexFaceOffset[vi] < vertexFaceOffset[vi + 1])
+            vertexOwner[vi] = vertexFaces[vertexFaceOffset[vi]];
+
+    // Returns the output vertex for lattice point (i, j) of face _fi_
+    // subdivided _n_ times along each edge.  Points on an edge that is
+    // subdivided more coarsely on the other side are snapped to the
+    // nearest vertex along it, which keeps the mesh watertight.
+    auto latticeVertex = [&](int fi, int i, int j, int n, bool *owned) {
+        const SDFace &face = fs[fi];
+        int corner = -1;
+        if (i == 0 && j == 0)
+            corner = 0;
+        else if (i == n && j == 0)
+            corner = 1;
+        else if (i == 0 && j == n)
+            corner = 2;
+        if (corner >= 0) {
+            int vi = vertexIndex(face.v[corner]);
+            *owned = vertexOwner[vi] == fi;
+            return vi;
         }
-        return CreateTriangleMesh(ObjectToWorld, WorldToObject,
-                                  reverseOrientation, ntris, verts.get(),
-                                  totVerts, pLimit.get(), nullptr, &Ns[0],
-                                  nullptr, nullptr, nullptr);
+        int edgeNum = -1, k = 0;
+        if (j == 0) {
+            edgeNum = 0;
+            k = i;
+        } else if (i + j == n) {
+            edgeNum = 1;
+            k = j;
+        } else if (i == 0) {
+            edgeNum = 2;
+            k = n - j;
+        }
+        if (edgeNum < 0) {
+            *owned = true;
+            return faceOffset[fi] + (i - 1) * (n - 1) - (i - 1) * i / 2 +
+                   (j - 1);
+        }
+        int e = faceEdge[3 * fi + edgeNum];
+        int ne = 1 << edgeLevel[e];
+        int m = (2 * k * ne + n) / (2 * n);
+        *owned = edgeOwner[e] == fi;
+        if (m == 0) return vertexIndex(face.v[edgeNum]);
+        if (m == ne) return vertexIndex(face.v[NEXT(edgeNum)]);
+        if (edgeStart[e] != vertexIndex(face.v[edgeNum])) m = ne - m;
+        return edgeOffset[e] + m - 1;
+    };
+
+    // Group the control faces into connected clusters
+    int maxLevel = *std::max_element(faceLevel.begin(), faceLevel.end());
+    size_t clusterSize = maxLevel < 8 ? (65536 >> (2 * maxLevel)) : 1;
+    std::vector<int> clusterFaces, clusterOffset;
+    {
+        std::vector<bool> visited(nFaces, false);
+        for (int seed = 0; seed < nFaces; ++seed) {
+            if (visited[seed]) continue;
+            clusterOffset.push_back(clusterFaces.size());
+            size_t start = clusterFaces.size();
+            clusterFaces.push_back(seed);
+            visited[seed] = true;
+            for (size_t q = start; q < clusterFaces.size() &&
+                                   clusterFaces.size() - start < clusterSize;
+                 ++q)
+                for (int k = 0; k < 3; ++k) {
+                    SDFace *nbr = fs[clusterFaces[q]].f[k];
+                    if (!nbr || visited[faceIndex(nbr)]) continue;
+                    visited[faceIndex(nbr)] = true;
+                    clusterFaces.push_back(faceIndex(nbr));
+                    if (clusterFaces.size() - start == clusterSize) break;
+                }
+        }
+        clusterOffset.push_back(clusterFaces.size());
     }
+    int nClusters = clusterOffset.size() - 1;
+
+    // Subdivide each cluster along with its neighboring faces, which is
+    // all of the control mesh that its limit surface depends on
+    std::unique_ptr<Point3f[]> pOut(new Point3f[nOutVertices]);
+    std::unique_ptr<Normal3f[]> nOut(new Normal3f[nOutVertices]);
+    std::vector<std::vector<int>> clusterIndices(nClusters);
+    ParallelFor([&](int64_t c) {
+        LocalControlMesh local(
+            std::vector<int>(clusterFaces.begin() + clusterOffset[c],
+                             clusterFaces.begin() + clusterOffset[c + 1]),
+            vertexIndices, p, vertexFaceOffset, vertexFaces);
+        const std::vector<int> &localFaces = local.faces;
+        const std::unique_ptr<SDFace[]> &localFs = local.fs;
+        int nClusterFaces = clusterOffset[c + 1] - clusterOffset[c];
+
+        // Refine to the finest level needed by the cluster's faces
+        int level = 0;
+        for (int i = 0; i < nClusterFaces; ++i)
+            level = std::max(level, faceLevel[localFaces[i]]);
+        std::vector<SDFace *> f;
+        std::vector<SDVertex *> v;
+        for (size_t i = 0; i < localFaces.size(); ++i) f.push_back(&localFs[i]);
+        for (SDVertex &vertex : local.verts) v.push_back(&vertex);
+        MemoryArena arena;
+        for (int i = 0; i < level; ++i) Refine(f, v, arena);
+        std::vector<Normal3f> Ns;
+        PushToLimit(v, &Ns);
+        std::unordered_map<const SDVertex *, int> limitIndex;
+        for (size_t i = 0; i < v.size(); ++i) limitIndex[v[i]] = i;
+
+        // Emit each cluster face at its own level
+        int nFine = 1 << level;
+        std::vector<SDVertex *> lattice((nFine + 1) * (nFine + 1));
+        std::vector<int> &indices = clusterIndices[c];
+        for (int i = 0; i < nClusterFaces; ++i) {
+            int fi = localFaces[i];
+            Point2i corners[3] = {Point2i(0, 0), Point2i(nFine, 0),
+                                  Point2i(0, nFine)};
+            CollectLattice(&localFs[i], level, corners, nFine, lattice);
+            int n = 1 << faceLevel[fi], stride = nFine / n;
+            std::vector<int> vertex((n + 1) * (n + 1));
+            for (int b = 0; b <= n; ++b)
+                for (int a = 0; a + b <= n; ++a) {
+                    bool owned;
+                    int vo = latticeVertex(fi, a, b, n, &owned);
+                    vertex[b * (n + 1) + a] = vo;
+                    if (!owned) continue;
+                    const SDVertex *sv =
+                        lattice[b * stride * (nFine + 1) + a * stride];
+                    pOut[vo] = sv->p;
+                    nOut[vo] = Ns[limitIndex[sv]];
+                }
+            auto emit = [&](int v0, int v1, int v2) {
+                if (v0 == v1 || v1 == v2 || v2 == v0) return;
+                indices.push_back(v0);
+                indices.push_back(v1);
+                indices.push_back(v2);
+            };
+            for (int b = 0; b < n; ++b)
+                for (int a = 0; a + b < n; ++a) {
+                    int v00 = vertex[b * (n + 1) + a];
+                    int v10 = vertex[b * (n + 1) + a + 1];
+                    int v01 = vertex[(b + 1) * (n + 1) + a];
+                    emit(v00, v10, v01);
+                    if (a + b + 1 < n)
+                        emit(v10, vertex[(b + 1) * (n + 1) + a + 1], v01);
+                }
+        }
+    }, nClusters);
+
+    // Create triangle mesh from subdivision mesh
+    std::vector<int> indices;
+    for (const std::vector<int> &ci : clusterIndices)
+        indices.insert(indices.end(), ci.begin(), ci.end());
+    return CreateTriangleMesh(ObjectToWorld, WorldToObject, reverseOrientation,
+                              indices.size() / 3, indices.data(), nOutVertices,
+                              pOut.get(), nullptr, nOut.get(), nullptr,
+                              nullptr, nullptr);
 }
 
-std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
-                                                     const Transform *w2o,
-                                                     bool reverseOrientation,
-                                                     const ParamSet &params) {
+std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, const SubdivisionView *view) {
     int nLevels = params.FindOneInt("levels",
                                     params.FindOneInt("nlevels", 3));
     int nps, nIndices;
@@ -416,11 +781,21 @@ std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
         Error("Vertex positions \"P\" not provided for LoopSubdiv shape.");
         return std::vector<std::shared_ptr<Shape>>();
     }
+    nLevels = std::max(nLevels, 0);
+
+    // Adaptive subdivision: "levels" becomes the maximum level, and each
+    // face is refined until its edges project to at most "edgelength"
+    // pixels and/or it deviates from flat by at most "flatness" times its
+    // size.
+    Float edgeLength = params.FindOneFloat("edgelength", 0.f);
+    Float flatness = params.FindOneFloat("flatness", 0.f);
+    if (edgeLength > 0 && !view)
+        Warning("\"edgelength\" requires a perspective camera; ignoring it.");
 
     // don't actually use this for now...
     std::string scheme = params.FindOneString("scheme", "loop");
     return LoopSubdivide(o2w, w2o, reverseOrientation, nLevels, nIndices,
-                         vertexIndices, nps, P);
+                         vertexIndices, nps, P, edgeLength, flatness, view);
 }
 
 static Point3f weightOneRing(SDVertex *vert, Float beta) {
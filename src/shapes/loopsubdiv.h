@@ -44,10 +44,37 @@
 namespace pbrt {
 
 // LoopSubdiv Declarations
-std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(const Transform *o2w,
-                                                     const Transform *w2o,
-                                                     bool reverseOrientation,
-                                                     const ParamSet &params);
+
+// Viewing information for choosing subdivision levels from the projected
+// size of the control mesh's faces
+struct SubdivisionView {
+    Point3f pCamera;
+    // Projected length in pixels of a unit-length segment at unit distance
+    Float pixelsPerUnit;
+};
+
+std::vector<std::shared_ptr<Shape>> CreateLoopSubdiv(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, const SubdivisionView *view = nullptr);
+
+// Lists the faces around each vertex of a triangle mesh: those of vertex
+// _i_ are _vertexFaces[vertexFaceOffset[i]]_ through
+// _vertexFaces[vertexFaceOffset[i + 1] - 1]_.
+void LoopSubdivVertexFaces(int nIndices, const int *vertexIndices,
+                           int nVertices, std::vector<int> *vertexFaceOffset,
+                           std::vector<int> *vertexFaces);
+
+// Computes the limit surface points and (unnormalized) normals of control
+// face _face_ subdivided _nLevels_ times.  With $n = 2^{nLevels}$, the point
+// with lattice coordinates $(a,b)$, where the face's vertices are at
+// $(0,0)$, $(n,0)$ and $(0,n)$, is stored at index
+// $b (n + 1) - b (b - 1) / 2 + a$.
+void LoopSubdivFaceLimit(int face, int nLevels, const int *vertexIndices,
+                         const Point3f *p,
+                         const std::vector<int> &vertexFaceOffset,
+                         const std::vector<int> &vertexFaces,
+                         std::vector<Point3f> *pLimit,
+                         std::vector<Normal3f> *nLimit);
 
 }  // namespace pbrt
 
@@ -35,9 +35,19 @@
 #include "shapes/triangle.h"
 #include "textures/constant.h"
 #include "paramset.h"
+#include "parallel.h"
 #include "ext/rply.h"
 
+#include <atomic>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 using namespace std;
@@ -154,20 +164,348 @@ int rply_face_callback(p_ply_argument argument) {
     return 1;
 }
 
-std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
-    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
-    const ParamSet &params,
-    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
-    const std::string filename = params.FindOneFilename("filename", "");
+// Binary PLY Fast Path
+
+// A read-only view of a whole file, mapped into memory where possible
+class MappedFile {
+  public:
+    MappedFile(const std::string &filename) {
+#ifdef PBRT_HAVE_MMAP
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr != MAP_FAILED) {
+                data = (const char *)ptr;
+                length = st.st_size;
+            }
+        }
+        close(fd);
+#else
+        FILE *f = fopen(filename.c_str(), "rb");
+        if (!f) return;
+        if (fseek(f, 0, SEEK_END) == 0) {
+            long size = ftell(f);
+            if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+                contents.resize(size);
+                if (fread(&contents[0], 1, size, f) == size_t(size)) {
+                    data = contents.data();
+                    length = size;
+                }
+            }
+        }
+        fclose(f);
+#endif
+    }
+    ~MappedFile() {
+#ifdef PBRT_HAVE_MMAP
+        if (data) munmap((void *)data, length);
+#endif
+    }
+    const char *data = nullptr;
+    size_t length = 0;
+
+  private:
+#ifndef PBRT_HAVE_MMAP
+    std::vector<char> contents;
+#endif
+};
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+static bool ParsePlyType(const std::string &name, PlyType *type, int *size) {
+    static const struct {
+        const char *name, *altName;
+        PlyType type;
+        int size;
+    } types[] = {{"char", "int8", PlyType::Int8, 1},
+                 {"uchar", "uint8", PlyType::UInt8, 1},
+                 {"short", "int16", PlyType::Int16, 2},
+                 {"ushort", "uint16", PlyType::UInt16, 2},
+                 {"int", "int32", PlyType::Int32, 4},
+                 {"uint", "uint32", PlyType::UInt32, 4},
+                 {"float", "float32", PlyType::Float32, 4},
+                 {"double", "float64", PlyType::Float64, 8}};
+    for (const auto &t : types)
+        if (name == t.name || name == t.altName) {
+            *type = t.type;
+            *size = t.size;
+            return true;
+        }
+    return false;
+}
+
+// Reads a little-endian value of the given type at _ptr_
+static inline double PlyValue(const char *ptr, PlyType type) {
+    switch (type) {
+    case PlyType::Int8: return *(const int8_t *)ptr;
+    case PlyType::UInt8: return *(const uint8_t *)ptr;
+    case PlyType::Int16: { int16_t v; memcpy(&v, ptr, 2); return v; }
+    case PlyType::UInt16: { uint16_t v; memcpy(&v, ptr, 2); return v; }
+    case PlyType::Int32: { int32_t v; memcpy(&v, ptr, 4); return v; }
+    case PlyType::UInt32: { uint32_t v; memcpy(&v, ptr, 4); return v; }
+    case PlyType::Float32: { float v; memcpy(&v, ptr, 4); return v; }
+    case PlyType::Float64: { double v; memcpy(&v, ptr, 8); return v; }
+    }
+    return 0;
+}
+
+static inline float PlyFloat(const char *ptr, PlyType type) {
+    if (type == PlyType::Float32) {
+        float v;
+        memcpy(&v, ptr, 4);
+        return v;
+    }
+    return (float)PlyValue(ptr, type);
+}
+
+static inline int PlyInt(const char *ptr, PlyType type) {
+    if (type == PlyType::Int32 || type == PlyType::UInt32) {
+        int32_t v;
+        memcpy(&v, ptr, 4);
+        return v;
+    }
+    return (int)PlyValue(ptr, type);
+}
+
+struct PlyProperty {
+    std::string name;
+    bool isList = false;
+    PlyType type, countType;
+    int size, countSize;
+    int offset = 0;  // within the element's record
+};
+
+struct PlyElement {
+    std::string name;
+    long count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+// Reads binary little-endian PLY files whose faces all have the same
+// number of vertices directly from the mapped file, converting all of the
+// vertices and faces in parallel.  Returns false, leaving _context_
+// untouched, for files that must be read through rply instead; files with
+// out-of-bounds vertex references are reported and flag _context->error_.
+static bool ReadBinaryPLY(const std::string &filename,
+                          CallbackContext *context) {
+    uint16_t endianTest = 1;
+    if (*(const uint8_t *)&endianTest != 1) return false;
+    MappedFile file(filename);
+    if (!file.data) return false;
+
+    // Parse the header
+    const char *end = file.data + file.length;
+    const char *headerEnd = nullptr;
+    for (const char *p = file.data; p + 10 <= end && !headerEnd; ++p) {
+        if (*p != '\n' || p + 11 > end || memcmp(p + 1, "end_header", 10))
+            continue;
+        const char *q = p + 11;
+        if (q < end && *q == '\r') ++q;
+        if (q < end && *q == '\n') headerEnd = q + 1;
+        if (!headerEnd) return false;
+    }
+    if (!headerEnd) return false;
+    std::istringstream header(std::string(file.data, headerEnd));
+    std::string line;
+    std::vector<PlyElement> elements;
+    bool binaryLittleEndian = false;
+    while (std::getline(header, line)) {
+        std::istringstream tokens(line);
+        std::string keyword;
+        tokens >> keyword;
+        if (keyword == "format") {
+            std::string format;
+            tokens >> format;
+            binaryLittleEndian = format == "binary_little_endian";
+        } else if (keyword == "element") {
+            elements.push_back(PlyElement());
+            tokens >> elements.back().name >> elements.back().count;
+        } else if (keyword == "property") {
+            if (elements.empty()) return false;
+            PlyProperty prop;
+            std::string type;
+            tokens >> type;
+            if (type == "list") {
+                std::string countType;
+                tokens >> countType >> type;
+                prop.isList = true;
+                if (!ParsePlyType(countType, &prop.countType, &prop.countSize))
+                    return false;
+            }
+            if (!ParsePlyType(type, &prop.type, &prop.size)) return false;
+            tokens >> prop.name;
+            elements.back().properties.push_back(prop);
+        }
+    }
+    if (!binaryLittleEndian) return false;
+
+    // Find the vertex and face elements and their records' layouts; the
+    // faces' records are laid out according to the first face's size
+    const char *data = headerEnd;
+    const char *vertexData = nullptr, *faceData = nullptr;
+    const PlyElement *vertices = nullptr, *faces = nullptr;
+    int vertexStride = 0, faceStride = 0, faceSize = 0;
+    for (PlyElement &element : elements) {
+        int stride = 0;
+        if (element.name == "face" && element.count > 0) {
+            int nLists = 0;
+            for (PlyProperty &prop : element.properties) {
+                prop.offset = stride;
+                if (!prop.isList) {
+                    stride += prop.size;
+                    continue;
+                }
+                if (++nLists > 1 || prop.name != "vertex_indices" ||
+                    data + stride + prop.countSize > end)
+                    return false;
+                faceSize = PlyInt(data + stride, prop.countType);
+                if (faceSize != 3 && faceSize != 4) return false;
+                stride += prop.countSize + faceSize * prop.size;
+            }
+            if (nLists != 1) return false;
+            faces = &element;
+            faceData = data;
+            faceStride = stride;
+        } else {
+            for (PlyProperty &prop : element.properties) {
+                if (prop.isList) return false;
+                prop.offset = stride;
+                stride += prop.size;
+            }
+            if (element.name == "vertex") {
+                vertices = &element;
+                vertexData = data;
+                vertexStride = stride;
+            }
+        }
+        if (size_t(end - data) < size_t(element.count) * stride) return false;
+        data += element.count * stride;
+    }
+    // Anything but an exact fit means the faces weren't all the same size
+    if (data != end || !vertices || !faces || vertices->count == 0)
+        return false;
+
+    auto findProperty = [](const PlyElement *element, const char *name) {
+        for (const PlyProperty &prop : element->properties)
+            if (prop.name == name) return &prop;
+        return (const PlyProperty *)nullptr;
+    };
+    const PlyProperty *xyz[3] = {findProperty(vertices, "x"),
+                                 findProperty(vertices, "y"),
+                                 findProperty(vertices, "z")};
+    if (!xyz[0] || !xyz[1] || !xyz[2]) return false;
+    const PlyProperty *nxyz[3] = {findProperty(vertices, "nx"),
+                                  findProperty(vertices, "ny"),
+                                  findProperty(vertices, "nz")};
+    bool hasNormals = nxyz[0] && nxyz[1] && nxyz[2];
+    const PlyProperty *uv[2] = {nullptr, nullptr};
+    const char *uvNames[4][2] = {{"u", "v"},
+                                 {"s", "t"},
+                                 {"texture_u", "texture_v"},
+                                 {"texture_s", "texture_t"}};
+    for (int i = 0; i < 4 && !(uv[0] && uv[1]); ++i) {
+        uv[0] = findProperty(vertices, uvNames[i][0]);
+        uv[1] = findProperty(vertices, uvNames[i][1]);
+    }
+    bool hasUV = uv[0] && uv[1];
+    const PlyProperty *faceIndex = findProperty(faces, "face_indices");
+    if (faceIndex && faceIndex->isList) return false;
+    const PlyProperty *indices = findProperty(faces, "vertex_indices");
+
+    // Convert the vertices
+    long vertexCount = vertices->count, faceCount = faces->count;
+    const int chunkSize = 65536;
+    std::unique_ptr<Point3f[]> p(new Point3f[vertexCount]);
+    std::unique_ptr<Normal3f[]> n(hasNormals ? new Normal3f[vertexCount]
+                                             : nullptr);
+    std::unique_ptr<Point2f[]> uvs(hasUV ? new Point2f[vertexCount] : nullptr);
+    ParallelFor([&](int64_t chunk) {
+        long start = chunk * chunkSize;
+        long last = std::min(start + chunkSize, vertexCount);
+        for (long i = start; i < last; ++i) {
+            const char *rec = vertexData + i * vertexStride;
+            for (int c = 0; c < 3; ++c)
+                p[i][c] = PlyFloat(rec + xyz[c]->offset, xyz[c]->type);
+            if (hasNormals)
+                for (int c = 0; c < 3; ++c)
+                    n[i][c] = PlyFloat(rec + nxyz[c]->offset, nxyz[c]->type);
+            if (hasUV)
+                for (int c = 0; c < 2; ++c)
+                    uvs[i][c] = PlyFloat(rec + uv[c]->offset, uv[c]->type);
+        }
+    }, (vertexCount + chunkSize - 1) / chunkSize);
+
+    // Convert the faces, splitting quads into two triangles
+    int trisPerFace = faceSize == 4 ? 2 : 1;
+    std::unique_ptr<int[]> vi(new int[3 * trisPerFace * faceCount]);
+    std::unique_ptr<int[]> fi(faceIndex ? new int[trisPerFace * faceCount]
+                                        : nullptr);
+    std::atomic<bool> mixedSizes(false);
+    // Any face with an out-of-bounds vertex reference; indices beyond the
+    // range of _int_ are narrowed to negative values and caught too
+    std::atomic<long> badFace(-1);
+    ParallelFor([&](int64_t chunk) {
+        long start = chunk * chunkSize;
+        long last = std::min(start + chunkSize, faceCount);
+        for (long i = start; i < last; ++i) {
+            const char *rec = faceData + i * faceStride;
+            if (PlyInt(rec + indices->offset, indices->countType) != faceSize) {
+                mixedSizes = true;
+                return;
+            }
+            int v[4];
+            const char *vp = rec + indices->offset + indices->countSize;
+            for (int j = 0; j < faceSize; ++j, vp += indices->size) {
+                v[j] = PlyInt(vp, indices->type);
+                if (v[j] < 0 || v[j] >= vertexCount) badFace = i;
+            }
+            int *out = &vi[3 * trisPerFace * i];
+            for (int j = 0; j < 3; ++j) out[j] = v[j];
+            if (faceSize == 4) {
+                out[3] = v[3];
+                out[4] = v[0];
+                out[5] = v[2];
+            }
+            if (faceIndex) {
+                int index = PlyInt(rec + faceIndex->offset, faceIndex->type);
+                for (int j = 0; j < trisPerFace; ++j)
+                    fi[trisPerFace * i + j] = index;
+            }
+        }
+    }, (faceCount + chunkSize - 1) / chunkSize);
+    if (mixedSizes) return false;
+    if (badFace >= 0) {
+        Error("plymesh: Face %ld has a vertex reference that is out of "
+              "bounds! Valid range is [0..%ld)", badFace.load(), vertexCount);
+        context->error = true;
+        return true;
+    }
+
+    context->p = p.release();
+    context->n = n.release();
+    context->uv = uvs.release();
+    context->indices = vi.release();
+    context->faceIndices = fi.release();
+    context->indexCtr = 3 * trisPerFace * faceCount;
+    context->vertexCount = vertexCount;
+    return true;
+}
+
+// Reads the PLY file through rply, which handles ASCII and big-endian files
+// and faces of varying sizes.  Returns false after reporting any error.
+static bool ReadPLYWithRPly(const std::string &filename,
+                            CallbackContext *context) {
     p_ply ply = ply_open(filename.c_str(), rply_message_callback, 0, nullptr);
     if (!ply) {
         Error("Couldn't open PLY file \"%s\"", filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
     if (!ply_read_header(ply)) {
         Error("Unable to read the header of PLY file \"%s\"", filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
     p_ply_element element = nullptr;
@@ -188,71 +526,81 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     if (vertexCount == 0 || faceCount == 0) {
         Error("%s: PLY file is invalid! No face/vertex elements found!",
               filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
-    CallbackContext context;
-
-    if (ply_set_read_cb(ply, "vertex", "x", rply_vertex_callback, &context,
+    if (ply_set_read_cb(ply, "vertex", "x", rply_vertex_callback, context,
                         0x030) &&
-        ply_set_read_cb(ply, "vertex", "y", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "y", rply_vertex_callback, context,
                         0x031) &&
-        ply_set_read_cb(ply, "vertex", "z", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "z", rply_vertex_callback, context,
                         0x032)) {
-        context.p = new Point3f[vertexCount];
+        context->p = new Point3f[vertexCount];
     } else {
         Error("%s: Vertex coordinate property not found!",
               filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
-    if (ply_set_read_cb(ply, "vertex", "nx", rply_vertex_callback, &context,
+    if (ply_set_read_cb(ply, "vertex", "nx", rply_vertex_callback, context,
                         0x130) &&
-        ply_set_read_cb(ply, "vertex", "ny", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "ny", rply_vertex_callback, context,
                         0x131) &&
-        ply_set_read_cb(ply, "vertex", "nz", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "nz", rply_vertex_callback, context,
                         0x132))
-        context.n = new Normal3f[vertexCount];
+        context->n = new Normal3f[vertexCount];
 
     /* There seem to be lots of different conventions regarding UV coordinate
      * names */
-    if ((ply_set_read_cb(ply, "vertex", "u", rply_vertex_callback, &context,
+    if ((ply_set_read_cb(ply, "vertex", "u", rply_vertex_callback, context,
                          0x220) &&
-         ply_set_read_cb(ply, "vertex", "v", rply_vertex_callback, &context,
+         ply_set_read_cb(ply, "vertex", "v", rply_vertex_callback, context,
                          0x221)) ||
-        (ply_set_read_cb(ply, "vertex", "s", rply_vertex_callback, &context,
+        (ply_set_read_cb(ply, "vertex", "s", rply_vertex_callback, context,
                          0x220) &&
-         ply_set_read_cb(ply, "vertex", "t", rply_vertex_callback, &context,
+         ply_set_read_cb(ply, "vertex", "t", rply_vertex_callback, context,
                          0x221)) ||
         (ply_set_read_cb(ply, "vertex", "texture_u", rply_vertex_callback,
-                         &context, 0x220) &&
+                         context, 0x220) &&
          ply_set_read_cb(ply, "vertex", "texture_v", rply_vertex_callback,
-                         &context, 0x221)) ||
+                         context, 0x221)) ||
         (ply_set_read_cb(ply, "vertex", "texture_s", rply_vertex_callback,
-                         &context, 0x220) &&
+                         context, 0x220) &&
          ply_set_read_cb(ply, "vertex", "texture_t", rply_vertex_callback,
-                         &context, 0x221)))
-        context.uv = new Point2f[vertexCount];
+                         context, 0x221)))
+        context->uv = new Point2f[vertexCount];
 
     /* Allocate enough space in case all faces are quads */
-    context.indices = new int[faceCount * 6];
-    context.vertexCount = vertexCount;
+    context->indices = new int[faceCount * 6];
+    context->vertexCount = vertexCount;
 
-    ply_set_read_cb(ply, "face", "vertex_indices", rply_face_callback, &context,
+    ply_set_read_cb(ply, "face", "vertex_indices", rply_face_callback, context,
                     0);
-    if (ply_set_read_cb(ply, "face", "face_indices", rply_face_callback, &context,
+    if (ply_set_read_cb(ply, "face", "face_indices", rply_face_callback, context,
                         1))
         // Extra space in case they're quads
-        context.faceIndices = new int[faceCount];
+        context->faceIndices = new int[faceCount];
 
     if (!ply_read(ply)) {
         Error("%s: unable to read the contents of PLY file",
               filename.c_str());
         ply_close(ply);
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
     ply_close(ply);
+    return true;
+}
+
+std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
+    const std::string filename = params.FindOneFilename("filename", "");
+    CallbackContext context;
+    if (!ReadBinaryPLY(filename, &context) &&
+        !ReadPLYWithRPly(filename, &context))
+        return std::vector<std::shared_ptr<Shape>>();
 
     if (context.error) return std::vector<std::shared_ptr<Shape>>();
 
@@ -282,11 +630,12 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
         shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
 
+    bool compact = params.FindOneBool("compact", false);
     return CreateTriangleMesh(o2w, w2o, reverseOrientation,
                               context.indexCtr / 3, context.indices,
-                              vertexCount, context.p, nullptr, context.n,
-                              context.uv, alphaTex, shadowAlphaTex,
-                              context.faceIndices);
+                              context.vertexCount, context.p, nullptr,
+                              context.n, context.uv, alphaTex, shadowAlphaTex,
+                              context.faceIndices, compact);
 }
 
 }  // namespace pbrt
@@ -37,18 +37,132 @@
 #include "paramset.h"
 #include "sampling.h"
 #include "efloat.h"
+#include "primitive.h"
+#include "parallel.h"
 #include "ext/rply.h"
 #include <array>
+#include <atomic>
+#include <map>
+#if defined(PBRT_HAVE_SSE) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <xmmintrin.h>
+#define PBRT_TRIANGLE_SSE
+#endif
+#if defined(PBRT_HAVE_AVX) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#include <immintrin.h>
+#define PBRT_TRIANGLE_AVX
+#endif
 
 namespace pbrt {
 
 STAT_PERCENT("Intersections/Ray-triangle intersection tests", nHits, nTests);
+STAT_COUNTER("Intersections/Batched ray-triangle tests", nBatchTests);
+STAT_MEMORY_COUNTER("Memory/Packed triangle vertices", packedTriangleBytes);
+STAT_MEMORY_COUNTER("Memory/Opacity micromaps", micromapBytes);
+STAT_PERCENT("Intersections/Alpha tests settled by micromaps",
+             nMicromapAlphaTests, nAlphaTests);
 
 // Triangle Local Definitions
 static void PlyErrorCallback(p_ply, const char *message) {
     Error("PLY writing error: %s", message);
 }
 
+// Returns the index of the micro-triangle around barycentrics $(b_0, b_1)$.
+// Row _i_ of the micro-triangles, with $b_0$ between $i/n$ and $(i+1)/n$,
+// alternates between ones pointing up and down in $b_1$.
+static inline int MicroTriangle(Float b0, Float b1) {
+    const int n = 1 << TriangleMesh::MicromapLevel;
+    Float u = b0 * n, v = b1 * n;
+    int i = Clamp((int)u, 0, n - 1);
+    int j = Clamp((int)v, 0, n - 1 - i);
+    bool flipped = (u - i) + (v - j) > 1 && i + j < n - 1;
+    return 2 * n * i - i * i + 2 * j + flipped;
+}
+
+// Records the opacity of the part of a triangle with barycentric corners _b_
+// (as $(b_0, b_1)$) in _words_, splitting it in four at its edge midpoints
+// until _alpha_'s bounds settle it or it's a single micro-triangle.
+// Returns whether any micro-triangle's opacity is known.
+static bool BakeMicroTriangles(const Texture<Float> &alpha,
+                               const Point2f uv[3], const Point2f b[3],
+                               int level, TriangleMesh::MicroOpacity opacity,
+                               uint64_t *words) {
+    if (opacity == TriangleMesh::UnknownOpacity) {
+        Point2f uvCorner[3];
+        for (int i = 0; i < 3; ++i)
+            uvCorner[i] = b[i].x * uv[0] + b[i].y * uv[1] +
+                          (1 - b[i].x - b[i].y) * uv[2];
+        Float min, max;
+        if (alpha.Bound(Union(Bounds2f(uvCorner[0], uvCorner[1]), uvCorner[2]),
+                        &min, &max)) {
+            if (min > 0 || max < 0)
+                opacity = TriangleMesh::Opaque;
+            else if (min == 0 && max == 0)
+                opacity = TriangleMesh::Transparent;
+        }
+    }
+    if (level == TriangleMesh::MicromapLevel) {
+        if (opacity == TriangleMesh::UnknownOpacity) return false;
+        Point2f centroid = (b[0] + b[1] + b[2]) / 3;
+        int index = MicroTriangle(centroid.x, centroid.y);
+        words[index / 32] |= uint64_t(opacity) << (2 * (index % 32));
+        return true;
+    }
+    Point2f m01 = (b[0] + b[1]) / 2, m12 = (b[1] + b[2]) / 2,
+            m20 = (b[2] + b[0]) / 2;
+    Point2f children[4][3] = {{b[0], m01, m20},
+                              {m01, b[1], m12},
+                              {m20, m12, b[2]},
+                              {m12, m20, m01}};
+    bool anyKnown = false;
+    for (int c = 0; c < 4; ++c)
+        anyKnown |= BakeMicroTriangles(alpha, uv, children[c], level + 1,
+                                       opacity, words);
+    return anyKnown;
+}
+
+// Bakes _alpha_ into opacity micromaps for all of _mesh_'s triangles,
+// returning none if the opacity of no micro-triangle is known
+static std::vector<uint64_t> BakeMicromaps(const TriangleMesh &mesh,
+                                           const Texture<Float> &alpha) {
+    // A micromap only depends on its triangle's $(u,v)$s, which are often
+    // shared, as by the copies of a card that make up foliage; bake each
+    // distinct set once
+    std::vector<int> bakedAs(mesh.nTriangles);
+    std::map<std::array<Float, 6>, int> firstWithUVs;
+    for (int tri = 0; tri < mesh.nTriangles; ++tri) {
+        int v[3];
+        mesh.GetVertexIndices(tri, v);
+        Point2f uv[3];
+        mesh.GetUVs(v, uv);
+        std::array<Float, 6> key = {uv[0].x, uv[0].y, uv[1].x,
+                                    uv[1].y, uv[2].x, uv[2].y};
+        bakedAs[tri] = firstWithUVs.insert(std::make_pair(key, tri)).first->second;
+    }
+
+    std::vector<uint64_t> micromaps(
+        (size_t)mesh.nTriangles * TriangleMesh::MicromapWords, 0);
+    std::atomic<bool> anyKnown(false);
+    ParallelFor([&](int64_t tri) {
+        if (bakedAs[tri] != tri) return;
+        int v[3];
+        mesh.GetVertexIndices(tri, v);
+        Point2f uv[3];
+        mesh.GetUVs(v, uv);
+        const Point2f b[3] = {Point2f(1, 0), Point2f(0, 1), Point2f(0, 0)};
+        if (BakeMicroTriangles(alpha, uv, b, 0, TriangleMesh::UnknownOpacity,
+                               &micromaps[tri * TriangleMesh::MicromapWords]))
+            anyKnown = true;
+    }, mesh.nTriangles, 64);
+    for (int tri = 0; tri < mesh.nTriangles; ++tri)
+        if (bakedAs[tri] != tri)
+            std::copy_n(&micromaps[bakedAs[tri] * TriangleMesh::MicromapWords],
+                        TriangleMesh::MicromapWords,
+                        &micromaps[tri * TriangleMesh::MicromapWords]);
+    if (!anyKnown) return std::vector<uint64_t>();
+    micromapBytes += micromaps.size() * sizeof(uint64_t);
+    return micromaps;
+}
+
 // Triangle Method Definitions
 STAT_RATIO("Scene/Triangles per triangle mesh", nTris, nMeshes);
 TriangleMesh::TriangleMesh(
@@ -57,22 +171,37 @@ TriangleMesh::TriangleMesh(
     const Vector3f *S, const Normal3f *N, const Point2f *UV, 
     const std::shared_ptr<Texture<Float>> &alphaMask,
     const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-    const int *fIndices)
+    const int *fIndices, bool compact)
     // ͨƻ
     : nTriangles(nTriangles),
       nVertices(nVertices),
-      vertexIndices(vertexIndices, vertexIndices + 3 * nTriangles),
       alphaMask(alphaMask),
-      shadowAlphaMask(shadowAlphaMask) 
+      shadowAlphaMask(shadowAlphaMask),
+      compact(compact)
 {
     ++nMeshes;
     nTris += nTriangles;
-    triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
-                    nVertices * (sizeof(*P) + 
-                                 (N ? sizeof(*N) : 0) +
-                                 (S ? sizeof(*S) : 0) + 
-                                 (UV ? sizeof(*UV) : 0) +
-                                 (fIndices ? sizeof(*fIndices) : 0));
+    // Compact meshes use 16-bit indices, either absolute or relative to
+    // each triangle's first vertex, where they fit
+    bool relativeIndicesFit = compact && nVertices > 65536;
+    for (int i = 0; i < 3 * nTriangles && relativeIndicesFit; ++i) {
+        int delta = vertexIndices[i] - vertexIndices[i - i % 3];
+        relativeIndicesFit = delta >= -32768 && delta <= 32767;
+    }
+    if (compact && nVertices <= 65536)
+        vertexIndices16.assign(vertexIndices, vertexIndices + 3 * nTriangles);
+    else if (relativeIndicesFit) {
+        this->vertexIndices.resize(nTriangles);
+        vertexIndices16.resize(2 * nTriangles);
+        for (int i = 0; i < nTriangles; ++i) {
+            this->vertexIndices[i] = vertexIndices[3 * i];
+            for (int j = 1; j < 3; ++j)
+                vertexIndices16[2 * i + j - 1] =
+                    vertexIndices[3 * i + j] - vertexIndices[3 * i];
+        }
+    } else
+        this->vertexIndices.assign(vertexIndices,
+                                   vertexIndices + 3 * nTriangles);
 
     // Transform mesh vertices to world space
     p.reset(new Point3f[nVertices]);
@@ -80,21 +209,72 @@ TriangleMesh::TriangleMesh(
         p[i] = ObjectToWorld(P[i]); // תռ, 󽻵Ƶظ
 
     // Copy _UV_, _N_, and _S_ vertex data, if present
-    if (UV) {
+    if (UV && compact) {
+        for (int i = 0; i < nVertices; ++i) uvBounds = Union(uvBounds, UV[i]);
+        compactUV.resize(2 * nVertices);
+        for (int i = 0; i < nVertices; ++i) {
+            Vector2f t = uvBounds.Offset(UV[i]);
+            for (int c = 0; c < 2; ++c)
+                compactUV[2 * i + c] = std::round(Clamp(t[c], 0, 1) * 65535);
+        }
+    } else if (UV) {
         uv.reset(new Point2f[nVertices]);
         memcpy(uv.get(), UV, nVertices * sizeof(Point2f));
     }
-    if (N) {
+    if (N && compact) {
+        compactN.resize(nVertices);
+        for (int i = 0; i < nVertices; ++i)
+            compactN[i] = EncodeOctahedral(ObjectToWorld(N[i]));
+    } else if (N) {
         n.reset(new Normal3f[nVertices]);
         for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(N[i]);
     }
-    if (S) {
+    if (S && !compact) {
         s.reset(new Vector3f[nVertices]);
         for (int i = 0; i < nVertices; ++i) s[i] = ObjectToWorld(S[i]);
     }
 
     if (fIndices)
         faceIndices = std::vector<int>(fIndices, fIndices + nTriangles);
+    if (alphaMask) alphaMicromap = BakeMicromaps(*this, *alphaMask);
+    if (shadowAlphaMask)
+        shadowAlphaMicromap = BakeMicromaps(*this, *shadowAlphaMask);
+    triMeshBytes += sizeof(*this) +
+                    this->vertexIndices.size() * sizeof(int) +
+                    vertexIndices16.size() * sizeof(uint16_t) +
+                    nVertices * (sizeof(Point3f) +
+                                 (n ? sizeof(Normal3f) : 0) +
+                                 (s ? sizeof(Vector3f) : 0) +
+                                 (uv ? sizeof(Point2f) : 0)) +
+                    compactN.size() * sizeof(uint32_t) +
+                    compactUV.size() * sizeof(uint16_t) +
+                    faceIndices.size() * sizeof(int);
+}
+
+TriangleMesh::MicroOpacity TriangleMesh::Opacity(
+    const std::vector<uint64_t> &micromap, int triNumber, Float b0,
+    Float b1) const {
+    ++nAlphaTests;
+    if (micromap.empty()) return UnknownOpacity;
+    int index = MicroTriangle(b0, b1);
+    MicroOpacity o = MicroOpacity(
+        (micromap[triNumber * MicromapWords + index / 32] >>
+         (2 * (index % 32))) & 3);
+    if (o != UnknownOpacity) ++nMicromapAlphaTests;
+    return o;
+}
+
+void TriangleMesh::UpdateVertices(const Transform &ObjectToWorld,
+                                  const Point3f *P, const Normal3f *N) {
+    for (int i = 0; i < nVertices; ++i) p[i] = ObjectToWorld(P[i]);
+    if (N && compact) {
+        compactN.resize(nVertices);
+        for (int i = 0; i < nVertices; ++i)
+            compactN[i] = EncodeOctahedral(ObjectToWorld(N[i]));
+    } else if (N) {
+        if (!n) n.reset(new Normal3f[nVertices]);
+        for (int i = 0; i < nVertices; ++i) n[i] = ObjectToWorld(N[i]);
+    }
 }
 
 // ӱ shape (ͨϸ???)б
@@ -105,11 +285,11 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Vector3f *s, const Normal3f *n, const Point2f *uv, 
     const std::shared_ptr<Texture<Float>> &alphaMask,
     const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-    const int *faceIndices) 
+    const int *faceIndices, bool compact)
 {
     std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
         *ObjectToWorld, nTriangles, vertexIndices, nVertices, p, s, n, uv,
-        alphaMask, shadowAlphaMask, faceIndices);
+        alphaMask, shadowAlphaMask, faceIndices, compact);
 
     std::vector<std::shared_ptr<Shape>> tris;
     tris.reserve(nTriangles);
@@ -181,6 +361,8 @@ bool WritePlyFile(const std::string &filename, int nTriangles,
 
 Bounds3f Triangle::ObjectBound() const {
     // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    GetVertexIndices(v);
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
     const Point3f &p2 = mesh->p[v[2]];
@@ -191,6 +373,8 @@ Bounds3f Triangle::ObjectBound() const {
 
 Bounds3f Triangle::WorldBound() const {
     // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    GetVertexIndices(v);
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
     const Point3f &p2 = mesh->p[v[2]];
@@ -198,17 +382,50 @@ Bounds3f Triangle::WorldBound() const {
     return Union(Bounds3f(p0, p1), p2);
 }
 
-// ཻԺ
-bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
-                         bool testAlphaTexture) const {
-    ProfilePhase p(Prof::TriIntersect);
-    ++nTests;
+Bounds3f Triangle::ClippedWorldBound(const Bounds3f &clip) const {
+    // Clip the triangle against the six planes of _clip_ in turn; each
+    // plane adds at most one vertex to the polygon
+    Point3f poly[9], clipped[9];
+    int v[3];
+    GetVertexIndices(v);
+    poly[0] = mesh->p[v[0]];
+    poly[1] = mesh->p[v[1]];
+    poly[2] = mesh->p[v[2]];
+    int nVerts = 3;
+    for (int axis = 0; axis < 3; ++axis)
+        for (int side = 0; side < 2; ++side) {
+            Float plane = clip[side][axis];
+            if (std::isinf(plane)) continue;
+            int nClipped = 0;
+            for (int i = 0; i < nVerts; ++i) {
+                const Point3f &pa = poly[i], &pb = poly[(i + 1) % nVerts];
+                bool aInside = side == 0 ? pa[axis] >= plane : pa[axis] <= plane;
+                bool bInside = side == 0 ? pb[axis] >= plane : pb[axis] <= plane;
+                if (aInside) clipped[nClipped++] = pa;
+                if (aInside != bInside) {
+                    Float t = (plane - pa[axis]) / (pb[axis] - pa[axis]);
+                    Point3f p = Lerp(t, pa, pb);
+                    p[axis] = plane;
+                    clipped[nClipped++] = p;
+                }
+            }
+            if (nClipped == 0) return Bounds3f();
+            for (int i = 0; i < nClipped; ++i) poly[i] = clipped[i];
+            nVerts = nClipped;
+        }
 
-    // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
+    // Bound the clipped polygon, allowing for rounding error in the
+    // computed vertices
+    Bounds3f b(poly[0]);
+    for (int i = 1; i < nVerts; ++i) b = Union(b, poly[i]);
+    Vector3f err = gamma(3) * Vector3f(Max(Abs(b.pMin), Abs(b.pMax)));
+    b = Bounds3f(b.pMin - err, b.pMax + err);
+    return pbrt::Intersect(pbrt::Intersect(b, clip), WorldBound());
+}
 
+// ཻԺ
+bool IntersectTriangle(const Ray &ray, const Point3f &p0, const Point3f &p1,
+                       const Point3f &p2, Float *tHit, Float b[3]) {
     // Perform ray--triangle intersection test
     // ཻǰ, Ƚ ray  triangle 任һ ray.o Ϊԭ, ray.d Ϊ +z Ŀռ, Լ򻯺
 
@@ -300,9 +517,9 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
     // Compute barycentric coordinates and $t$ value for triangle intersection
     Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
+    b[0] = e0 * invDet;
+    b[1] = e1 * invDet;
+    b[2] = e2 * invDet;
     Float t = tScaled * invDet; // (e0 * p0t.z + e1 * p1t.z + e2 * p2t.z) / (e0 + e1 + e2)
 
     // Ensure that computed triangle $t$ is conservatively greater than zero
@@ -325,11 +542,32 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    std::abs(invDet);
     if (t <= deltaT) return false;
 
+    *tHit = t;
+    return true;
+}
+
+bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                         bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersect);
+    ++nTests;
+
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    GetVertexIndices(v);
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+
+    // Perform ray--triangle intersection test
+    Float t, b[3];
+    if (!IntersectTriangle(ray, p0, p1, p2, &t, b)) return false;
+    Float b0 = b[0], b1 = b[1], b2 = b[2];
+
     //  dpdu, dpdv
     // Compute triangle partial derivatives
     Vector3f dpdu, dpdv;
     Point2f uv[3];
-    GetUVs(uv);
+    GetUVs(v, uv);
     // Compute deltas for triangle partial derivatives
     Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
     Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
@@ -371,10 +609,15 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     // This functionality is less often useful for other shapes, so pbrt only supports it for triangles.
     // Ƿ͸
     if (testAlphaTexture && mesh->alphaMask) {
-        SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
-                                      dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+        TriangleMesh::MicroOpacity opacity =
+            mesh->Opacity(mesh->alphaMicromap, triNumber, b0, b1);
+        if (opacity == TriangleMesh::Transparent) return false;
+        if (opacity == TriangleMesh::UnknownOpacity) {
+            SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit,
+                                          -ray.d, dpdu, dpdv, Normal3f(0, 0, 0),
+                                          Normal3f(0, 0, 0), ray.time, this);
+            if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+        }
     }
 
     // Fill in _SurfaceInteraction_ from triangle hit
@@ -390,16 +633,19 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     if (reverseOrientation ^ transformSwapsHandedness)
         isect->n = isect->shading.n = -isect->n;
 
-    if (mesh->n || mesh->s) {
+    if (mesh->HasNormals() || mesh->s) {
         // Initialize _Triangle_ shading geometry
+        Normal3f n[3];
+        if (mesh->HasNormals())
+            for (int i = 0; i < 3; ++i) n[i] = mesh->N(v[i]);
 
         // ʹɫ ns,  ts
         // Ȼ ns  ts һ ss
 
         // Compute shading normal _ns_ for triangle
         Normal3f ns;
-        if (mesh->n) {
-            ns = (b0 * mesh->n[v[0]] + b1 * mesh->n[v[1]] + b2 * mesh->n[v[2]]);
+        if (mesh->HasNormals()) {
+            ns = (b0 * n[0] + b1 * n[1] + b2 * n[2]);
             if (ns.LengthSquared() > 0)
                 ns = Normalize(ns);
             else
@@ -430,13 +676,13 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
         // ʹɫߺ, ƫ dndu, dndv Ͳֻ 0 
         //  dpdu, dpdv Ĺ
         Normal3f dndu, dndv;
-        if (mesh->n) 
+        if (mesh->HasNormals())
         {
             // Compute deltas for triangle partial derivatives of normal
             Vector2f duv02 = uv[0] - uv[2];
             Vector2f duv12 = uv[1] - uv[2];
-            Normal3f dn1 = mesh->n[v[0]] - mesh->n[v[2]];
-            Normal3f dn2 = mesh->n[v[1]] - mesh->n[v[2]];
+            Normal3f dn1 = n[0] - n[2];
+            Normal3f dn2 = n[1] - n[2];
             Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
             bool degenerateUV = std::abs(determinant) < 1e-8;
             if (degenerateUV) {
@@ -447,8 +693,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                 // rays reflected from triangles with degenerate
                 // parameterizations are still reasonable.
                 // 㷨ƫֵʱ, һ
-                Vector3f dn = Cross(Vector3f(mesh->n[v[2]] - mesh->n[v[0]]),
-                                    Vector3f(mesh->n[v[1]] - mesh->n[v[0]]));
+                Vector3f dn = Cross(Vector3f(n[2] - n[0]),
+                                    Vector3f(n[1] - n[0]));
                 if (dn.LengthSquared() == 0)
                     dndu = dndv = Normal3f(0, 0, 0);
                 else {
@@ -477,6 +723,8 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
     ProfilePhase p(Prof::TriIntersectP);
     ++nTests;
     // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    GetVertexIndices(v);
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
     const Point3f &p2 = mesh->p[v[2]];
@@ -578,11 +826,22 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
     if (t <= deltaT) return false;
 
     // Test shadow ray intersection against alpha texture, if present
-    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask)) {
+    TriangleMesh::MicroOpacity alpha = TriangleMesh::Opaque,
+                               shadowAlpha = TriangleMesh::Opaque;
+    if (testAlphaTexture && mesh->alphaMask)
+        alpha = mesh->Opacity(mesh->alphaMicromap, triNumber, b0, b1);
+    if (testAlphaTexture && mesh->shadowAlphaMask)
+        shadowAlpha =
+            mesh->Opacity(mesh->shadowAlphaMicromap, triNumber, b0, b1);
+    if (alpha == TriangleMesh::Transparent ||
+        shadowAlpha == TriangleMesh::Transparent)
+        return false;
+    if (alpha == TriangleMesh::UnknownOpacity ||
+        shadowAlpha == TriangleMesh::UnknownOpacity) {
         // Compute triangle partial derivatives
         Vector3f dpdu, dpdv;
         Point2f uv[3];
-        GetUVs(uv);
+        GetUVs(v, uv);
 
         // Compute deltas for triangle partial derivatives
         Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -611,9 +870,10 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
         SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
                                       dpdu, dpdv, Normal3f(0, 0, 0),
                                       Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask && mesh->alphaMask->Evaluate(isectLocal) == 0)
+        if (alpha == TriangleMesh::UnknownOpacity &&
+            mesh->alphaMask->Evaluate(isectLocal) == 0)
             return false;
-        if (mesh->shadowAlphaMask &&
+        if (shadowAlpha == TriangleMesh::UnknownOpacity &&
             mesh->shadowAlphaMask->Evaluate(isectLocal) == 0)
             return false;
     }
@@ -621,8 +881,337 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
     return true;
 }
 
+// Batched Triangle Intersection Definitions
+TriangleBatchRay::TriangleBatchRay(const Ray &ray) {
+    kz = MaxDimension(Abs(ray.d));
+    kx = kz + 1;
+    if (kx == 3) kx = 0;
+    ky = kx + 1;
+    if (ky == 3) ky = 0;
+    Vector3f d = Permute(ray.d, kx, ky, kz);
+    Sx = -d.x / d.z;
+    Sy = -d.y / d.z;
+    Sz = 1.f / d.z;
+    o[0] = ray.o[kx];
+    o[1] = ray.o[ky];
+    o[2] = ray.o[kz];
+}
+
+#ifdef PBRT_TRIANGLE_SSE
+// The operations of the triangle test on a vector of lanes
+template <typename V>
+struct TriangleLanes;
+
+template <>
+struct TriangleLanes<__m128> {
+    static __m128 Load(const float *p) { return _mm_loadu_ps(p); }
+    static void Store(float *p, __m128 a) { _mm_storeu_ps(p, a); }
+    static __m128 Set(float f) { return _mm_set1_ps(f); }
+    static __m128 Add(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+    static __m128 Sub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+    static __m128 Mul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+    static __m128 Div(__m128 a, __m128 b) { return _mm_div_ps(a, b); }
+    static __m128 Max(__m128 a, __m128 b) { return _mm_max_ps(a, b); }
+    static __m128 Abs(__m128 a) {
+        return _mm_andnot_ps(_mm_set1_ps(-0.f), a);
+    }
+    static __m128 And(__m128 a, __m128 b) { return _mm_and_ps(a, b); }
+    static __m128 Or(__m128 a, __m128 b) { return _mm_or_ps(a, b); }
+    static __m128 Eq(__m128 a, __m128 b) { return _mm_cmpeq_ps(a, b); }
+    static __m128 Lt(__m128 a, __m128 b) { return _mm_cmplt_ps(a, b); }
+    static __m128 Le(__m128 a, __m128 b) { return _mm_cmple_ps(a, b); }
+    static __m128 Gt(__m128 a, __m128 b) { return _mm_cmpgt_ps(a, b); }
+    static __m128 Ge(__m128 a, __m128 b) { return _mm_cmpge_ps(a, b); }
+    static int Mask(__m128 a) { return _mm_movemask_ps(a); }
+};
+
+#ifdef PBRT_TRIANGLE_AVX
+template <>
+struct TriangleLanes<__m256> {
+    static __m256 Load(const float *p) { return _mm256_loadu_ps(p); }
+    static void Store(float *p, __m256 a) { _mm256_storeu_ps(p, a); }
+    static __m256 Set(float f) { return _mm256_set1_ps(f); }
+    static __m256 Add(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+    static __m256 Sub(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+    static __m256 Mul(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+    static __m256 Div(__m256 a, __m256 b) { return _mm256_div_ps(a, b); }
+    static __m256 Max(__m256 a, __m256 b) { return _mm256_max_ps(a, b); }
+    static __m256 Abs(__m256 a) {
+        return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a);
+    }
+    static __m256 And(__m256 a, __m256 b) { return _mm256_and_ps(a, b); }
+    static __m256 Or(__m256 a, __m256 b) { return _mm256_or_ps(a, b); }
+    static __m256 Eq(__m256 a, __m256 b) {
+        return _mm256_cmp_ps(a, b, _CMP_EQ_OQ);
+    }
+    static __m256 Lt(__m256 a, __m256 b) {
+        return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+    }
+    static __m256 Le(__m256 a, __m256 b) {
+        return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+    }
+    static __m256 Gt(__m256 a, __m256 b) {
+        return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+    }
+    static __m256 Ge(__m256 a, __m256 b) {
+        return _mm256_cmp_ps(a, b, _CMP_GE_OQ);
+    }
+    static int Mask(__m256 a) { return _mm256_movemask_ps(a); }
+};
+#endif  // PBRT_TRIANGLE_AVX
+
+// Triangle::Intersect()'s test, with _V_'s lanes holding different
+// triangles; _v[i][c]_ points to coordinate _c_ of vertex _i_ of the
+// first one, already permuted for the ray
+template <typename V>
+static void IntersectTriangleLanes(const Float *const v[3][3], int count,
+                                   const TriangleBatchRay &r,
+                                   TriangleBatchHits *hits) {
+    typedef TriangleLanes<V> L;
+    // Transform the vertices to ray coordinate space
+    V p[3][3];
+    for (int i = 0; i < 3; ++i)
+        for (int c = 0; c < 3; ++c)
+            p[i][c] = L::Sub(L::Load(v[i][c]), L::Set(r.o[c]));
+    V Sx = L::Set(r.Sx), Sy = L::Set(r.Sy), Sz = L::Set(r.Sz);
+    for (int i = 0; i < 3; ++i) {
+        p[i][0] = L::Add(p[i][0], L::Mul(Sx, p[i][2]));
+        p[i][1] = L::Add(p[i][1], L::Mul(Sy, p[i][2]));
+    }
+
+    // Compute the edge functions; zero ones are left to the triangle
+    V e[3];
+    for (int i = 0; i < 3; ++i) {
+        const V *pa = p[(i + 1) % 3], *pb = p[(i + 2) % 3];
+        e[i] = L::Sub(L::Mul(pa[0], pb[1]), L::Mul(pa[1], pb[0]));
+    }
+    const V zero = L::Set(0);
+    int fallback = L::Mask(L::Or(L::Or(L::Eq(e[0], zero), L::Eq(e[1], zero)),
+                                 L::Eq(e[2], zero)));
+
+    // Reject edge function sign mismatches and degenerate determinants
+    V anyNeg = L::Or(L::Or(L::Lt(e[0], zero), L::Lt(e[1], zero)),
+                     L::Lt(e[2], zero));
+    V anyPos = L::Or(L::Or(L::Gt(e[0], zero), L::Gt(e[1], zero)),
+                     L::Gt(e[2], zero));
+    V reject = L::And(anyNeg, anyPos);
+    V det = L::Add(L::Add(e[0], e[1]), e[2]);
+    reject = L::Or(reject, L::Eq(det, zero));
+
+    // Compute the scaled hit distance and test it against zero
+    for (int i = 0; i < 3; ++i) p[i][2] = L::Mul(p[i][2], Sz);
+    V tScaled = L::Add(L::Add(L::Mul(e[0], p[0][2]), L::Mul(e[1], p[1][2])),
+                       L::Mul(e[2], p[2][2]));
+    reject = L::Or(reject, L::And(L::Lt(det, zero), L::Ge(tScaled, zero)));
+    reject = L::Or(reject, L::And(L::Gt(det, zero), L::Le(tScaled, zero)));
+    V invDet = L::Div(L::Set(1.f), det);
+    V t = L::Mul(tScaled, invDet);
+
+    // Reject hits too close to the origin to be certain
+    V maxAbs[3];
+    for (int c = 0; c < 3; ++c)
+        maxAbs[c] = L::Max(L::Abs(p[0][c]),
+                           L::Max(L::Abs(p[1][c]), L::Abs(p[2][c])));
+    V maxXt = maxAbs[0], maxYt = maxAbs[1], maxZt = maxAbs[2];
+    V g2 = L::Set(gamma(2)), g3 = L::Set(gamma(3)), g5 = L::Set(gamma(5));
+    V deltaZ = L::Mul(g3, maxZt);
+    V deltaX = L::Mul(g5, L::Add(maxXt, maxZt));
+    V deltaY = L::Mul(g5, L::Add(maxYt, maxZt));
+    V deltaE = L::Mul(L::Set(2),
+                      L::Add(L::Add(L::Mul(L::Mul(g2, maxXt), maxYt),
+                                    L::Mul(deltaY, maxXt)),
+                             L::Mul(deltaX, maxYt)));
+    V maxE = L::Max(L::Abs(e[0]), L::Max(L::Abs(e[1]), L::Abs(e[2])));
+    V deltaT = L::Mul(L::Mul(L::Set(3),
+                             L::Add(L::Add(L::Mul(L::Mul(g3, maxE), maxZt),
+                                           L::Mul(deltaE, maxZt)),
+                                    L::Mul(deltaZ, maxE))),
+                      L::Abs(invDet));
+    reject = L::Or(reject, L::Le(t, deltaT));
+
+    int lanes = (1 << count) - 1;
+    hits->fallback = fallback & lanes;
+    hits->candidates = ~L::Mask(reject) & ~fallback & lanes;
+    L::Store(hits->t, t);
+    L::Store(hits->tScaled, tScaled);
+    L::Store(hits->det, det);
+}
+#endif  // PBRT_TRIANGLE_SSE
+
+void IntersectTriangleBatch(const Float *vertices, int stride, int offset,
+                            int count, const TriangleBatchRay &r,
+                            TriangleBatchHits *hits) {
+    ++nBatchTests;
+    const Float *v[3][3];
+    int k[3] = {r.kx, r.ky, r.kz};
+    for (int i = 0; i < 3; ++i)
+        for (int c = 0; c < 3; ++c)
+            v[i][c] = &vertices[(3 * i + k[c]) * stride + offset];
+#if defined(PBRT_TRIANGLE_AVX)
+    if (count > 4)
+        IntersectTriangleLanes<__m256>(v, count, r, hits);
+    else
+        IntersectTriangleLanes<__m128>(v, count, r, hits);
+#elif defined(PBRT_TRIANGLE_SSE)
+    IntersectTriangleLanes<__m128>(v, count, r, hits);
+#else
+    const Float g2 = gamma(2), g3 = gamma(3), g5 = gamma(5);
+    hits->candidates = hits->fallback = 0;
+    for (int j = 0; j < count; ++j) {
+        Float p[3][3];
+        for (int i = 0; i < 3; ++i)
+            for (int c = 0; c < 3; ++c) p[i][c] = v[i][c][j] - r.o[c];
+        for (int i = 0; i < 3; ++i) {
+            p[i][0] += r.Sx * p[i][2];
+            p[i][1] += r.Sy * p[i][2];
+        }
+        Float e[3];
+        for (int i = 0; i < 3; ++i) {
+            const Float *pa = p[(i + 1) % 3], *pb = p[(i + 2) % 3];
+            e[i] = pa[0] * pb[1] - pa[1] * pb[0];
+        }
+        if (e[0] == 0 || e[1] == 0 || e[2] == 0) {
+            hits->fallback |= 1 << j;
+            continue;
+        }
+        if ((e[0] < 0 || e[1] < 0 || e[2] < 0) &&
+            (e[0] > 0 || e[1] > 0 || e[2] > 0))
+            continue;
+        Float det = e[0] + e[1] + e[2];
+        if (det == 0) continue;
+        for (int i = 0; i < 3; ++i) p[i][2] *= r.Sz;
+        Float tScaled = e[0] * p[0][2] + e[1] * p[1][2] + e[2] * p[2][2];
+        if ((det < 0 && tScaled >= 0) || (det > 0 && tScaled <= 0)) continue;
+        Float invDet = 1 / det;
+        Float t = tScaled * invDet;
+        Float maxAbs[3];
+        for (int c = 0; c < 3; ++c)
+            maxAbs[c] = std::max(std::abs(p[0][c]),
+                                 std::max(std::abs(p[1][c]), std::abs(p[2][c])));
+        Float maxXt = maxAbs[0], maxYt = maxAbs[1], maxZt = maxAbs[2];
+        Float deltaZ = g3 * maxZt;
+        Float deltaX = g5 * (maxXt + maxZt);
+        Float deltaY = g5 * (maxYt + maxZt);
+        Float deltaE = 2 * (g2 * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+        Float maxE = std::max(std::abs(e[0]),
+                              std::max(std::abs(e[1]), std::abs(e[2])));
+        Float deltaT = 3 * (g3 * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
+                       std::abs(invDet);
+        if (t <= deltaT) continue;
+        hits->candidates |= 1 << j;
+        hits->t[j] = t;
+        hits->tScaled[j] = tScaled;
+        hits->det[j] = det;
+    }
+#endif
+}
+
+void DeferredTriangleHit::Resolve(const Ray &ray,
+                                  SurfaceInteraction *isect) const {
+    if (!primitive) return;
+    Ray r = ray;
+    r.tMax = tMax;
+    bool found = primitive->Intersect(r, isect);
+    CHECK(found);
+    ray.tMax = r.tMax;
+}
+
+// Returns the triangle of a primitive that is just a triangle without an
+// alpha mask, if it is one
+static const Triangle *PackableTriangle(const Primitive *prim) {
+    const GeometricPrimitive *gp =
+        dynamic_cast<const GeometricPrimitive *>(prim);
+    const Triangle *tri =
+        gp ? dynamic_cast<const Triangle *>(gp->GetShape()) : nullptr;
+    if (!tri) return nullptr;
+    const TriangleMesh &mesh = *tri->GetMesh();
+    if (mesh.alphaMask || mesh.shadowAlphaMask) return nullptr;
+    return tri;
+}
+
+PackedTriangles::PackedTriangles(std::vector<const Primitive *> prims)
+    : primitives(std::move(prims)) {
+    int n = primitives.size();
+    // Round up past the padding that the last batch reads
+    stride = (n + 2 * TriangleBatchWidth - 2) & ~(TriangleBatchWidth - 1);
+    vertices.resize(9 * stride, 0);
+    isTriangle.resize(n, 0);
+    for (int i = 0; i < n; ++i) {
+        const Triangle *tri = PackableTriangle(primitives[i]);
+        if (!tri) continue;
+        const TriangleMesh &mesh = *tri->GetMesh();
+        int v[3];
+        tri->GetVertexIndices(v);
+        const Point3f &p0 = mesh.p[v[0]], &p1 = mesh.p[v[1]], &p2 = mesh.p[v[2]];
+        // Degenerate triangles are rejected by their own test before
+        // the one here, so leave them to it
+        if (Cross(p2 - p0, p1 - p0).LengthSquared() == 0) continue;
+        isTriangle[i] = 1;
+        for (int j = 0; j < 3; ++j)
+            for (int c = 0; c < 3; ++c)
+                vertices[(3 * j + c) * stride + i] = mesh.p[v[j]][c];
+    }
+    packedTriangleBytes += BytesUsed();
+}
+
+size_t PackedTriangles::BytesUsed() const {
+    return vertices.size() * sizeof(Float) +
+           primitives.size() * (sizeof(primitives[0]) + sizeof(isTriangle[0]));
+}
+
+bool PackedTriangles::Intersect(int offset, int count, const Ray &ray,
+                                const TriangleBatchRay &r,
+                                SurfaceInteraction *isect,
+                                DeferredTriangleHit *deferred) const {
+    bool hit = false;
+    for (int start = 0; start < count; start += TriangleBatchWidth) {
+        int n = std::min(TriangleBatchWidth, count - start);
+        TriangleBatchHits hits;
+        IntersectTriangleBatch(vertices.data(), stride, offset + start, n, r,
+                               &hits);
+        for (int j = 0; j < n; ++j) {
+            int i = offset + start + j;
+            if (!isTriangle[i] || (hits.fallback & (1 << j))) {
+                if (primitives[i]->Intersect(ray, isect)) {
+                    hit = true;
+                    deferred->primitive = nullptr;
+                }
+            } else if ((hits.candidates & (1 << j)) &&
+                       hits.InRayExtent(j, ray.tMax)) {
+                hit = true;
+                deferred->primitive = primitives[i];
+                deferred->tMax = ray.tMax;
+                ray.tMax = hits.t[j];
+            }
+        }
+    }
+    return hit;
+}
+
+const Primitive *PackedTriangles::FindOccluder(int offset, int count,
+                                               const Ray &ray,
+                                               const TriangleBatchRay &r) const {
+    for (int start = 0; start < count; start += TriangleBatchWidth) {
+        int n = std::min(TriangleBatchWidth, count - start);
+        TriangleBatchHits hits;
+        IntersectTriangleBatch(vertices.data(), stride, offset + start, n, r,
+                               &hits);
+        for (int j = 0; j < n; ++j) {
+            int i = offset + start + j;
+            if ((!isTriangle[i] || (hits.fallback & (1 << j)))
+                    ? primitives[i]->IntersectP(ray)
+                    : ((hits.candidates & (1 << j)) &&
+                       hits.InRayExtent(j, ray.tMax)))
+                return primitives[i];
+        }
+    }
+    return nullptr;
+}
+
 Float Triangle::Area() const {
     // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    GetVertexIndices(v);
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
     const Point3f &p2 = mesh->p[v[2]];
@@ -636,6 +1225,8 @@ Interaction Triangle::Sample(const Point2f &u, Float *pdf) const
     Point2f b = UniformSampleTriangle(u);
 
     // Get triangle vertices in _p0_, _p1_, and _p2_
+    int v[3];
+    GetVertexIndices(v);
     const Point3f &p0 = mesh->p[v[0]];
     const Point3f &p1 = mesh->p[v[1]];
     const Point3f &p2 = mesh->p[v[2]];
@@ -648,9 +1239,9 @@ Interaction Triangle::Sample(const Point2f &u, Float *pdf) const
 
     // Ensure correct orientation of the geometric normal; follow the same
     // approach as was used in Triangle::Intersect().
-    if (mesh->n) {
-        Normal3f ns(b[0] * mesh->n[v[0]] + b[1] * mesh->n[v[1]] +
-                    (1 - b[0] - b[1]) * mesh->n[v[2]]);
+    if (mesh->HasNormals()) {
+        Normal3f ns(b[0] * mesh->N(v[0]) + b[1] * mesh->N(v[1]) +
+                    (1 - b[0] - b[1]) * mesh->N(v[2]));
         it.n = Faceforward(it.n, ns);
     } else if (reverseOrientation ^ transformSwapsHandedness)
         it.n *= -1;
@@ -666,6 +1257,8 @@ Interaction Triangle::Sample(const Point2f &u, Float *pdf) const
 
 Float Triangle::SolidAngle(const Point3f &p, int nSamples) const {
     // Project the vertices into the unit sphere around p.
+    int v[3];
+    GetVertexIndices(v);
     std::array<Vector3f, 3> pSphere = {
         Normalize(mesh->p[v[0]] - p), Normalize(mesh->p[v[1]] - p),
         Normalize(mesh->p[v[2]] - p)
@@ -796,8 +1389,10 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
         shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
 
+    bool compact = params.FindOneBool("compact", false);
     return CreateTriangleMesh(o2w, w2o, reverseOrientation, nvi / 3, vi, npi, P,
-                              S, N, uvs, alphaTex, shadowAlphaTex, faceIndices);
+                              S, N, uvs, alphaTex, shadowAlphaTex, faceIndices,
+                              compact);
 }
 
 }  // namespace pbrt
@@ -61,11 +61,72 @@ struct TriangleMesh {
                  const Vector3f *S, const Normal3f *N, const Point2f *uv,
                  const std::shared_ptr<Texture<Float>> &alphaMask,
                  const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
-                 const int *faceIndices);
+                 const int *faceIndices, bool compact = false);
+
+    // Replaces the vertex positions, and the normals if _N_ is given, with
+    // new object space values.  The bounds of the primitives and
+    // aggregates holding the mesh must be refit afterward.
+    void UpdateVertices(const Transform &ObjectToWorld, const Point3f *P,
+                        const Normal3f *N);
+
+    // Returns the vertex indices of the _triNumber_th triangle
+    void GetVertexIndices(int triNumber, int v[3]) const {
+        if (vertexIndices16.empty())
+            for (int i = 0; i < 3; ++i) v[i] = vertexIndices[3 * triNumber + i];
+        else if (vertexIndices.empty())
+            for (int i = 0; i < 3; ++i)
+                v[i] = vertexIndices16[3 * triNumber + i];
+        else {
+            v[0] = vertexIndices[triNumber];
+            v[1] = v[0] + (int16_t)vertexIndices16[2 * triNumber];
+            v[2] = v[0] + (int16_t)vertexIndices16[2 * triNumber + 1];
+        }
+    }
+
+    // Per-vertex normals and uvs, decoded from their compact forms if
+    // necessary
+    bool HasNormals() const { return n || !compactN.empty(); }
+    Normal3f N(int i) const { return n ? n[i] : DecodeOctahedral(compactN[i]); }
+    bool HasUVs() const { return uv || !compactUV.empty(); }
+    Point2f UV(int i) const {
+        if (uv) return uv[i];
+        return uvBounds.Lerp(Point2f(compactUV[2 * i] / Float(65535),
+                                     compactUV[2 * i + 1] / Float(65535)));
+    }
+    // Returns the uvs of a triangle's vertices, or default ones if the
+    // mesh has none
+    void GetUVs(const int v[3], Point2f uv[3]) const {
+        if (HasUVs()) {
+            uv[0] = UV(v[0]);
+            uv[1] = UV(v[1]);
+            uv[2] = UV(v[2]);
+        } else {
+            uv[0] = Point2f(0, 0);
+            uv[1] = Point2f(1, 0);
+            uv[2] = Point2f(1, 1);
+        }
+    }
+
+    // Opacity micromaps record whether the alpha textures are known to be
+    // nonzero or zero over each of the (1 << 2 * MicromapLevel)
+    // micro-triangles that a triangle's barycentric domain is divided
+    // into, with two bits per micro-triangle.  The alpha textures only
+    // have to be evaluated for hits on the rest.
+    enum MicroOpacity { UnknownOpacity = 0, Opaque = 1, Transparent = 2 };
+    static PBRT_CONSTEXPR int MicromapLevel = 4;
+    static PBRT_CONSTEXPR int MicromapWords = (1 << 2 * MicromapLevel) / 32;
+    MicroOpacity Opacity(const std::vector<uint64_t> &micromap,
+                         int triNumber, Float b0, Float b1) const;
 
     // TriangleMesh Data
     const int nTriangles, nVertices;
-    std::vector<int> vertexIndices; // vertexIndices.size() == 3 * nTriangles
+    // vertexIndices.size() == 3 * nTriangles, unless the mesh is compact.
+    // Then meshes with at most 65536 vertices keep their indices in
+    // _vertexIndices16_, and larger ones whose triangles' vertices are all
+    // close enough keep each triangle's first index in _vertexIndices_
+    // and the other two as 16-bit offsets from it in _vertexIndices16_.
+    std::vector<int> vertexIndices;
+    std::vector<uint16_t> vertexIndices16;
 
     // (vertex attribute)
     // For the ith triangle, its three vertex positions are 
@@ -75,7 +136,17 @@ struct TriangleMesh {
     std::unique_ptr<Vector3f[]> s; // ֻ¼ tangent, һ bitangent  tangent  normal ˵õ
     std::unique_ptr<Point2f[]> uv;
 
+    // Compact meshes store their normals in octahedral form and their uvs
+    // as 16-bit fractions of _uvBounds_ instead.  They don't keep tangents;
+    // Triangle::Intersect() falls back to ones along dpdu.
+    std::vector<uint32_t> compactN;
+    std::vector<uint16_t> compactUV;
+    Bounds2f uvBounds;
+
     std::shared_ptr<Texture<Float>> alphaMask, shadowAlphaMask;
+    // Empty unless some micro-triangles' opacity is known
+    std::vector<uint64_t> alphaMicromap, shadowAlphaMicromap;
+    const bool compact;
 
 	// Added after book publication. Shapes can optionally provide a face
     // index with an intersection point for use in Ptex texture lookups.
@@ -90,14 +161,16 @@ class Triangle : public Shape {
     Triangle(const Transform *ObjectToWorld, const Transform *WorldToObject,
              bool reverseOrientation, const std::shared_ptr<TriangleMesh> &mesh,
              int triNumber) // triNumber Ϊ triIndex Щ
-        : Shape(ObjectToWorld, WorldToObject, reverseOrientation), mesh(mesh) {
-        v = &mesh->vertexIndices[3 * triNumber]; // ֻ洢׸ĵַ, Խʡ洢ռ
+        : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+          mesh(mesh),
+          triNumber(triNumber) {
         triMeshBytes += sizeof(*this);
         faceIndex = mesh->faceIndices.size() ? mesh->faceIndices[triNumber] : 0;
     }
 
     Bounds3f ObjectBound() const override;
     Bounds3f WorldBound() const override;
+    Bounds3f ClippedWorldBound(const Bounds3f &clip) const override;
 
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture = true) const;
@@ -112,34 +185,118 @@ class Triangle : public Shape {
     // reference point p.
     Float SolidAngle(const Point3f &p, int nSamples = 0) const;
 
+    const std::shared_ptr<TriangleMesh> &GetMesh() const { return mesh; }
+    void GetVertexIndices(int v[3]) const {
+        mesh->GetVertexIndices(triNumber, v);
+    }
+
   private:
     // Triangle Private Methods
     // ֱ UV 
-    void GetUVs(Point2f uv[3]) const {
-        if (mesh->uv) {
-            uv[0] = mesh->uv[v[0]];
-            uv[1] = mesh->uv[v[1]];
-            uv[2] = mesh->uv[v[2]];
-        } else {
-            uv[0] = Point2f(0, 0);
-            uv[1] = Point2f(1, 0);
-            uv[2] = Point2f(1, 1);
-        }
+    void GetUVs(const int v[3], Point2f uv[3]) const {
+        mesh->GetUVs(v, uv);
     }
 
     // Triangle Private Data
     std::shared_ptr<TriangleMesh> mesh;
-    const int *v;
+    int triNumber; // ֻ洢εı,  mesh , Խʡ洢ռ
     int faceIndex;
 };
 
+// Batched Triangle Intersection
+// A ray is tested against several triangles at once, one per SIMD lane,
+// with the watertight test of Triangle::Intersect() performed step by
+// step so that it accepts and rejects exactly the same hits.  Only the
+// closest hit's _SurfaceInteraction_ (and its error bounds) is then
+// computed, by the triangle itself.
+#if defined(PBRT_HAVE_AVX) && !defined(PBRT_FLOAT_AS_DOUBLE)
+static PBRT_CONSTEXPR int TriangleBatchWidth = 8;
+#else
+static PBRT_CONSTEXPR int TriangleBatchWidth = 4;
+#endif
+
+// Per-ray values of the watertight ray-triangle test
+struct TriangleBatchRay {
+    TriangleBatchRay() {}
+    TriangleBatchRay(const Ray &ray);
+    int kx, ky, kz;
+    Float o[3], Sx, Sy, Sz;
+};
+
+// Results of testing a batch of triangles: the ones that pass all of the
+// tests but the one against the ray's _tMax_, which depends on the hits
+// before them, and the ones whose edge functions are zero and must be
+// recomputed in double precision by the triangle itself
+struct TriangleBatchHits {
+    // Whether candidate _j_ is within a ray extent of _tMax_
+    bool InRayExtent(int j, Float tMax) const {
+        return det[j] < 0 ? !(tScaled[j] < tMax * det[j])
+                          : !(tScaled[j] > tMax * det[j]);
+    }
+    int candidates, fallback;
+    Float t[TriangleBatchWidth], tScaled[TriangleBatchWidth],
+        det[TriangleBatchWidth];
+};
+
+// Tests _count_ <= _TriangleBatchWidth_ triangles, where coordinate _c_ of
+// vertex _v_ of the _i_th one is at
+// _vertices[(3 * v + c) * stride + offset + i]_.  A full batch is always
+// read, so the arrays need _TriangleBatchWidth - 1_ entries of padding.
+void IntersectTriangleBatch(const Float *vertices, int stride, int offset,
+                            int count, const TriangleBatchRay &ray,
+                            TriangleBatchHits *hits);
+
+// The closest triangle hit found by _PackedTriangles_, whose
+// _SurfaceInteraction_ hasn't been computed yet
+struct DeferredTriangleHit {
+    // Computes the hit's _SurfaceInteraction_ if there is one
+    void Resolve(const Ray &ray, SurfaceInteraction *isect) const;
+    const Primitive *primitive = nullptr;
+    Float tMax;  // the ray's extent before the hit
+};
+
+// Copies of the vertices of triangle primitives, in the order that an
+// accelerator's leaves list them, for _IntersectTriangleBatch()_.  Other
+// primitives, and triangles with alpha masks or no area, may be listed
+// too; they are intersected through the primitive.
+class PackedTriangles {
+  public:
+    PackedTriangles(std::vector<const Primitive *> prims);
+
+    // Returns whether the _i_th primitive's vertices were copied
+    bool IsTriangle(int i) const { return isTriangle[i]; }
+    size_t BytesUsed() const;
+
+    // Intersect the ray with primitives _offset_ through
+    // _offset + count - 1_ in order, as their own Intersect() methods
+    // would.  The closest hit is left in _deferred_ if it is one of the
+    // copied triangles; the ray's _tMax_ is updated either way.
+    bool Intersect(int offset, int count, const Ray &ray,
+                   const TriangleBatchRay &r, SurfaceInteraction *isect,
+                   DeferredTriangleHit *deferred) const;
+    const Primitive *FindOccluder(int offset, int count, const Ray &ray,
+                                  const TriangleBatchRay &r) const;
+
+  private:
+    std::vector<const Primitive *> primitives;
+    std::vector<char> isTriangle;
+    int stride;
+    std::vector<Float> vertices;
+};
+
+// Performs the watertight ray-triangle test of _Triangle::Intersect()_ on
+// the given vertices, returning the hit's distance and barycentric
+// coordinates
+bool IntersectTriangle(const Ray &ray, const Point3f &p0, const Point3f &p1,
+                       const Point3f &p2, Float *tHit, Float b[3]);
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     int nTriangles, const int *vertexIndices, int nVertices, const Point3f *p,
     const Vector3f *s, const Normal3f *n, const Point2f *uv,
     const std::shared_ptr<Texture<Float>> &alphaTexture,
     const std::shared_ptr<Texture<Float>> &shadowAlphaTexture,
-    const int *faceIndices = nullptr);
+    const int *faceIndices = nullptr, bool compact = false);
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
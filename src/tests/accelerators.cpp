@@ -0,0 +1,796 @@
+
+#include "tests/gtest/gtest.h"
+#include <functional>
+#include "pbrt.h"
+#include "rng.h"
+#include "paramset.h"
+#include "primitive.h"
+#include "interaction.h"
+#include "sampling.h"
+#include "parallel.h"
+#include "accelerators/bvh.h"
+#include "accelerators/instancebvh.h"
+#include "accelerators/kdtreeaccel.h"
+#include "accelerators/widebvh.h"
+#include "lights/point.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+
+using namespace pbrt;
+
+static Transform identity;
+
+// Random triangles and spheres scattered through [-10,10]^3.
+static std::vector<std::shared_ptr<Primitive>> RandomPrimitives(
+    RNG &rng, int nTriangles, int nSpheres) {
+    auto pUnif = [&rng](Float range) {
+        return Lerp(rng.UniformFloat(), -range, range);
+    };
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < nTriangles; ++i) {
+        Point3f center(pUnif(10), pUnif(10), pUnif(10));
+        for (int v = 0; v < 3; ++v) {
+            indices.push_back(p.size());
+            p.push_back(center + Vector3f(pUnif(1), pUnif(1), pUnif(1)));
+        }
+    }
+    std::vector<std::shared_ptr<Shape>> shapes;
+    if (nTriangles > 0)
+        shapes = CreateTriangleMesh(&identity, &identity, false, nTriangles,
+                                    indices.data(), p.size(), p.data(),
+                                    nullptr, nullptr, nullptr, nullptr,
+                                    nullptr);
+    for (int i = 0; i < nSpheres; ++i) {
+        Transform *o2w = new Transform(
+            Translate(Vector3f(pUnif(10), pUnif(10), pUnif(10))));
+        Transform *w2o = new Transform(Inverse(*o2w));
+        Float radius = .1f + rng.UniformFloat();
+        shapes.push_back(std::make_shared<Sphere>(o2w, w2o, false, radius,
+                                                  -radius, radius, 360));
+    }
+
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &s : shapes)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            s, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+// Checks that _accel_ finds the same closest hits as _reference_ for
+// random rays, including axis-aligned ones; returns the number of hits.
+static int CompareHits(const Primitive &reference, const Primitive &accel,
+                       RNG &rng) {
+    int nHits = 0;
+    for (int i = 0; i < 2000; ++i) {
+        Point2f u(rng.UniformFloat(), rng.UniformFloat());
+        Point3f o(Lerp(rng.UniformFloat(), -15, 15),
+                  Lerp(rng.UniformFloat(), -15, 15),
+                  Lerp(rng.UniformFloat(), -15, 15));
+        Vector3f d = UniformSampleSphere(u);
+        if (i % 10 == 0) {
+            // Exercise the infinite reciprocal directions
+            d = Vector3f(0, 0, 0);
+            d[i % 3] = (i % 20 == 0) ? 1 : -1;
+        }
+        Float tMax = (i % 3 == 0) ? Infinity : 15 * rng.UniformFloat();
+        Ray rayRef(o, d, tMax), ray(o, d, tMax);
+
+        SurfaceInteraction isectRef, isect;
+        bool hitRef = reference.Intersect(rayRef, &isectRef);
+        bool hit = accel.Intersect(ray, &isect);
+        EXPECT_EQ(hitRef, hit) << "ray " << ray;
+        if (hitRef) ++nHits;
+        if (hitRef && hit) {
+            EXPECT_EQ(rayRef.tMax, ray.tMax);
+            EXPECT_EQ(isectRef.p, isect.p);
+        }
+
+        Ray shadowRay(o, d, tMax);
+        bool occluded = reference.IntersectP(shadowRay);
+        EXPECT_EQ(occluded, accel.IntersectP(shadowRay)) << "ray " << shadowRay;
+        const Primitive *occluder = nullptr;
+        EXPECT_EQ(occluded, accel.FindOccluder(shadowRay, &occluder))
+            << "ray " << shadowRay;
+        if (occluded && occluder) EXPECT_TRUE(occluder->IntersectP(shadowRay));
+    }
+    return nHits;
+}
+
+// Checks _accel_ against a reference _BVHAccel_ over random primitives.
+static void CompareToBVH(
+    std::function<std::shared_ptr<Primitive>(
+        std::vector<std::shared_ptr<Primitive>>)> create) {
+    RNG rng;
+    for (int trial = 0; trial < 4; ++trial) {
+        std::vector<std::shared_ptr<Primitive>> prims =
+            RandomPrimitives(rng, trial == 0 ? 1 : 1000, trial * 20);
+        BVHAccel reference(prims, 4);
+        std::shared_ptr<Primitive> accel = create(prims);
+        EXPECT_EQ(reference.WorldBound(), accel->WorldBound());
+
+        int nHits = CompareHits(reference, *accel, rng);
+        // Make sure that the comparison isn't only over misses
+        if (trial > 0) EXPECT_GT(nHits, 200);
+    }
+}
+
+TEST(Accelerators, WideBVH4) {
+    CompareToBVH([](std::vector<std::shared_ptr<Primitive>> prims) {
+        return CreateWideBVHAccelerator(std::move(prims), ParamSet(), 4);
+    });
+}
+
+TEST(Accelerators, WideBVH8) {
+    CompareToBVH([](std::vector<std::shared_ptr<Primitive>> prims) {
+        return CreateWideBVHAccelerator(std::move(prims), ParamSet(), 8);
+    });
+}
+
+TEST(Accelerators, CompressedBVH) {
+    CompareToBVH([](std::vector<std::shared_ptr<Primitive>> prims) {
+        return std::make_shared<BVHAccel>(std::move(prims), 4,
+                                          BVHAccel::SplitMethod::SAH, true);
+    });
+    CompareToBVH([](std::vector<std::shared_ptr<Primitive>> prims) {
+        return std::make_shared<BVHAccel>(std::move(prims), 1,
+                                          BVHAccel::SplitMethod::HLBVH, true);
+    });
+}
+
+TEST(Accelerators, SBVH) {
+    CompareToBVH([](std::vector<std::shared_ptr<Primitive>> prims) {
+        return std::make_shared<BVHAccel>(std::move(prims), 4,
+                                          BVHAccel::SplitMethod::SBVH);
+    });
+}
+
+// Long, thin triangles running diagonally through the scene, where spatial
+// splits pay off.
+static std::vector<std::shared_ptr<Primitive>> DiagonalSlivers(RNG &rng,
+                                                               int n) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < n; ++i) {
+        Point3f a(Lerp(rng.UniformFloat(), -10, 10), -10,
+                  Lerp(rng.UniformFloat(), -10, 10));
+        Point3f b = a + Vector3f(Lerp(rng.UniformFloat(), -8, 8), 20,
+                                 Lerp(rng.UniformFloat(), -8, 8));
+        for (Point3f v : {a, b, a + Vector3f(.05f, 0, .05f)}) {
+            indices.push_back(p.size());
+            p.push_back(v);
+        }
+    }
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &s :
+         CreateTriangleMesh(&identity, &identity, false, n, indices.data(),
+                            p.size(), p.data(), nullptr, nullptr, nullptr,
+                            nullptr, nullptr))
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            s, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+TEST(Accelerators, SBVHDiagonalSlivers) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = DiagonalSlivers(rng, 500);
+    BVHAccel reference(prims, 4);
+    BVHAccel sbvh(prims, 4, BVHAccel::SplitMethod::SBVH, false, .5f);
+    EXPECT_EQ(reference.WorldBound(), sbvh.WorldBound());
+    int nHits = 0;
+    for (int i = 0; i < 4000; ++i) {
+        Point3f o(Lerp(rng.UniformFloat(), -12, 12),
+                  Lerp(rng.UniformFloat(), -12, 12), -20);
+        Vector3f d = Normalize(Vector3f(Lerp(rng.UniformFloat(), -.2f, .2f),
+                                        Lerp(rng.UniformFloat(), -.2f, .2f),
+                                        1));
+        Ray rayRef(o, d), ray(o, d);
+        SurfaceInteraction isectRef, isect;
+        bool hitRef = reference.Intersect(rayRef, &isectRef);
+        ASSERT_EQ(hitRef, sbvh.Intersect(ray, &isect));
+        if (hitRef) {
+            ++nHits;
+            EXPECT_EQ(rayRef.tMax, ray.tMax);
+        }
+        EXPECT_EQ(reference.IntersectP(Ray(o, d)), sbvh.IntersectP(Ray(o, d)));
+    }
+    EXPECT_GT(nHits, 100);
+}
+
+TEST(Accelerators, TriangleClippedWorldBound) {
+    RNG rng;
+    for (int tri = 0; tri < 200; ++tri) {
+        Point3f p[3];
+        for (int v = 0; v < 3; ++v)
+            p[v] = Point3f(Lerp(rng.UniformFloat(), -1, 1),
+                           Lerp(rng.UniformFloat(), -1, 1),
+                           Lerp(rng.UniformFloat(), -1, 1));
+        int indices[3] = {0, 1, 2};
+        std::shared_ptr<Shape> triangle =
+            CreateTriangleMesh(&identity, &identity, false, 1, indices, 3, p,
+                               nullptr, nullptr, nullptr, nullptr, nullptr)[0];
+        Bounds3f wb = triangle->WorldBound();
+
+        for (int trial = 0; trial < 10; ++trial) {
+            Point3f c[2];
+            for (int i = 0; i < 2; ++i)
+                c[i] = wb.Lerp(Point3f(rng.UniformFloat(), rng.UniformFloat(),
+                                       rng.UniformFloat()));
+            Bounds3f clip(c[0], c[1]);
+            if (trial % 3 == 0) clip.pMax.x = Infinity;
+            Bounds3f clipped = triangle->ClippedWorldBound(clip);
+
+            // Points on the triangle inside _clip_ must be inside _clipped_
+            for (int i = 0; i < 200; ++i) {
+                Point2f b = UniformSampleTriangle(
+                    Point2f(rng.UniformFloat(), rng.UniformFloat()));
+                Point3f pt = b[0] * p[0] + b[1] * p[1] +
+                             (1 - b[0] - b[1]) * p[2];
+                if (Inside(pt, clip)) EXPECT_TRUE(Inside(pt, clipped));
+            }
+
+            // And the clipped bounds must not extend past either bound
+            if (clipped.pMin.x <= clipped.pMax.x) {
+                Bounds3f limit = Intersect(clip, wb);
+                EXPECT_TRUE(Inside(clipped.pMin, limit));
+                EXPECT_TRUE(Inside(clipped.pMax, limit));
+            }
+        }
+    }
+}
+
+TEST(Accelerators, WideBVHEmpty) {
+    WideBVHAccel<4> accel({});
+    Ray ray(Point3f(0, 0, 0), Vector3f(1, 0, 0));
+    SurfaceInteraction isect;
+    EXPECT_FALSE(accel.Intersect(ray, &isect));
+    EXPECT_FALSE(accel.IntersectP(ray));
+}
+
+// Checks that the batched entry points of _accel_ agree with tracing the
+// rays one at a time, for a batch of coherent rays leaving a common tile.
+static void CompareBatchToSingle(const Primitive &accel, RNG &rng,
+                                 bool expectHits = true) {
+    const int nRays = 256;
+    std::vector<Ray> rays, batchRays;
+    for (int i = 0; i < nRays; ++i) {
+        Point3f o(-15, Lerp(rng.UniformFloat(), -1, 1),
+                  Lerp(rng.UniformFloat(), -1, 1));
+        Vector3f d = Normalize(
+            Vector3f(1, Lerp(rng.UniformFloat(), -.7f, .7f),
+                     Lerp(rng.UniformFloat(), -.7f, .7f)));
+        if (i % 2) d = -d;
+        rays.push_back(Ray(o, d, (i % 3 == 0) ? Infinity : 30));
+    }
+    batchRays = rays;
+
+    std::vector<SurfaceInteraction> isects(nRays), batchIsects(nRays);
+    std::unique_ptr<bool[]> batchHits(new bool[nRays]);
+    accel.IntersectBatch(batchRays.data(), nRays, batchIsects.data(),
+                         batchHits.get());
+    std::unique_ptr<bool[]> batchOccluded(new bool[nRays]);
+    accel.IntersectPBatch(rays.data(), nRays, batchOccluded.get());
+
+    int nHits = 0;
+    for (int i = 0; i < nRays; ++i) {
+        EXPECT_EQ(accel.IntersectP(rays[i]), batchOccluded[i]);
+        bool hit = accel.Intersect(rays[i], &isects[i]);
+        EXPECT_EQ(hit, batchHits[i]);
+        if (hit && batchHits[i]) {
+            ++nHits;
+            EXPECT_EQ(rays[i].tMax, batchRays[i].tMax);
+            EXPECT_EQ(isects[i].p, batchIsects[i].p);
+        }
+    }
+    if (expectHits) EXPECT_GT(nHits, 10);
+}
+
+TEST(Accelerators, Batch) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomPrimitives(rng, 2000, 50);
+    CompareBatchToSingle(BVHAccel(prims, 4), rng);
+    CompareBatchToSingle(BVHAccel(prims, 1), rng);
+    CompareBatchToSingle(
+        BVHAccel(prims, 4, BVHAccel::SplitMethod::SAH, true), rng);
+    CompareBatchToSingle(BVHAccel(prims, 4, BVHAccel::SplitMethod::SAH, false,
+                                  .3f, 1.5f, "", 0, true),
+                         rng);
+    CompareBatchToSingle(WideBVHAccel<4>(prims, 4), rng);
+    CompareBatchToSingle(KdTreeAccel(prims), rng);
+    CompareBatchToSingle(KdTreeAccel(prims, 80, 1, .5f, 1, -1, true), rng);
+    CompareBatchToSingle(BVHAccel({}), rng, false);
+}
+
+// Gives access to BVHAccel's flattened nodes.
+class BVHInspector : public BVHAccel {
+  public:
+    using BVHAccel::BVHAccel;
+    const LinearBVHNode *Nodes() const { return nodes; }
+    const Primitive *GetPrimitive(int i) const { return primitives[i].get(); }
+};
+
+// Checks that the subtrees rooted at _a_'s node _ia_ and _b_'s node _ib_
+// are identical; returns the number of nodes in the subtree.
+static int CompareTrees(const BVHInspector &a, int ia, const BVHInspector &b,
+                        int ib) {
+    const LinearBVHNode &na = a.Nodes()[ia], &nb = b.Nodes()[ib];
+    EXPECT_EQ(na.bounds, nb.bounds);
+    EXPECT_EQ(na.nPrimitives, nb.nPrimitives);
+    if (na.bounds != nb.bounds || na.nPrimitives != nb.nPrimitives) return 0;
+    if (na.nPrimitives > 0) {
+        EXPECT_EQ(na.primitivesOffset, nb.primitivesOffset);
+        for (int i = 0; i < na.nPrimitives; ++i)
+            EXPECT_EQ(a.GetPrimitive(na.primitivesOffset + i),
+                      b.GetPrimitive(nb.primitivesOffset + i));
+        return 1;
+    }
+    EXPECT_EQ(na.axis, nb.axis);
+    return 1 + CompareTrees(a, ia + 1, b, ib + 1) +
+           CompareTrees(a, na.secondChildOffset, b, nb.secondChildOffset);
+}
+
+TEST(Accelerators, ParallelBuildDeterministic) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomPrimitives(rng, 80000, 100);
+    int nThreads = PbrtOptions.nThreads;
+    for (auto splitMethod :
+         {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::EqualCounts,
+          BVHAccel::SplitMethod::HLBVH}) {
+        PbrtOptions.nThreads = 1;
+        BVHInspector serial(prims, 4, splitMethod);
+
+        PbrtOptions.nThreads = 4;
+        ParallelInit();
+        BVHInspector parallel(prims, 4, splitMethod);
+        ParallelCleanup();
+
+        EXPECT_GT(CompareTrees(serial, 0, parallel, 0), 80100 / 4);
+    }
+    PbrtOptions.nThreads = nThreads;
+}
+
+TEST(Accelerators, Refit) {
+    std::vector<std::function<std::shared_ptr<Primitive>(
+        std::vector<std::shared_ptr<Primitive>>)>> creators = {
+        [](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<BVHAccel>(std::move(prims), 4);
+        },
+        [](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<BVHAccel>(std::move(prims), 1,
+                                              BVHAccel::SplitMethod::HLBVH);
+        },
+        [](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<BVHAccel>(
+                std::move(prims), 4, BVHAccel::SplitMethod::SAH, true);
+        },
+        [](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<BVHAccel>(std::move(prims), 4,
+                                              BVHAccel::SplitMethod::SBVH);
+        },
+        [](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<BVHAccel>(
+                std::move(prims), 4, BVHAccel::SplitMethod::SAH, false, .3f,
+                1.5f, "", 0, true);
+        },
+        [](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<WideBVHAccel<4>>(std::move(prims), 4);
+        }};
+
+    for (const auto &create : creators) {
+        RNG rng;
+        auto pUnif = [&rng](Float range) {
+            return Lerp(rng.UniformFloat(), -range, range);
+        };
+        const int nTriangles = 1000;
+        std::vector<Point3f> p;
+        std::vector<int> indices;
+        for (int i = 0; i < nTriangles; ++i) {
+            Point3f center(pUnif(10), pUnif(10), pUnif(10));
+            for (int v = 0; v < 3; ++v) {
+                indices.push_back(p.size());
+                p.push_back(center + Vector3f(pUnif(1), pUnif(1), pUnif(1)));
+            }
+        }
+        std::vector<std::shared_ptr<Shape>> shapes = CreateTriangleMesh(
+            &identity, &identity, false, nTriangles, indices.data(), p.size(),
+            p.data(), nullptr, nullptr, nullptr, nullptr, nullptr);
+        std::shared_ptr<TriangleMesh> mesh =
+            static_cast<const Triangle *>(shapes[0].get())->GetMesh();
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const auto &s : shapes)
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                s, nullptr, nullptr, MediumInterface()));
+        std::shared_ptr<Primitive> accel = create(prims);
+
+        // Jitter the vertices slightly, then move half of the triangles
+        // far away, then scatter all of them, so that refitting, subtree
+        // rebuilds and full rebuilds are all exercised.
+        for (int frame = 0; frame < 3; ++frame) {
+            for (int i = 0; i < nTriangles; ++i) {
+                Vector3f offset;
+                if (frame == 0)
+                    offset = Vector3f(pUnif(.05f), pUnif(.05f), pUnif(.05f));
+                else if (frame == 2 || i < nTriangles / 2)
+                    offset = Vector3f(pUnif(8), pUnif(8), pUnif(8));
+                for (int v = 0; v < 3; ++v) p[3 * i + v] += offset;
+            }
+            mesh->UpdateVertices(identity, p.data(), nullptr);
+            accel->Refit();
+
+            BVHAccel reference(prims, 4);
+            EXPECT_EQ(reference.WorldBound(), accel->WorldBound());
+            EXPECT_GT(CompareHits(reference, *accel, rng), 100);
+        }
+    }
+}
+
+TEST(Accelerators, RefitInstances) {
+    // A top-level BVH over two instances of a BVH over a mesh must pick
+    // up changes to the mesh when it is refit
+    RNG rng;
+    Transform identity;
+    const int nTriangles = 200;
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < 3 * nTriangles; ++i) {
+        indices.push_back(i);
+        p.push_back(Point3f(Lerp(rng.UniformFloat(), -5, 5),
+                            Lerp(rng.UniformFloat(), -5, 5),
+                            Lerp(rng.UniformFloat(), -5, 5)));
+    }
+    std::vector<std::shared_ptr<Shape>> shapes = CreateTriangleMesh(
+        &identity, &identity, false, nTriangles, indices.data(), p.size(),
+        p.data(), nullptr, nullptr, nullptr, nullptr, nullptr);
+    std::shared_ptr<TriangleMesh> mesh =
+        static_cast<const Triangle *>(shapes[0].get())->GetMesh();
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &s : shapes)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            s, nullptr, nullptr, MediumInterface()));
+
+    auto makeScene = [](std::shared_ptr<Primitive> object) {
+        std::vector<std::shared_ptr<Primitive>> instances;
+        for (int i = 0; i < 2; ++i) {
+            Transform *t = new Transform(Translate(Vector3f(3 * i, 0, 0)));
+            instances.push_back(std::make_shared<TransformedPrimitive>(
+                object, AnimatedTransform(t, 0, t, 1)));
+        }
+        return std::make_shared<BVHAccel>(std::move(instances));
+    };
+    std::shared_ptr<BVHAccel> accel =
+        makeScene(std::make_shared<BVHAccel>(prims, 4));
+
+    for (Point3f &pt : p) pt = Point3f(1.5f * pt.x, pt.y + 2, pt.z);
+    mesh->UpdateVertices(identity, p.data(), nullptr);
+    accel->Refit();
+
+    std::shared_ptr<BVHAccel> reference =
+        makeScene(std::make_shared<BVHAccel>(prims, 4));
+    EXPECT_EQ(reference->WorldBound(), accel->WorldBound());
+    EXPECT_GT(CompareHits(*reference, *accel, rng), 100);
+}
+
+// Counts how often it is refit
+class CountingBVHAccel : public BVHAccel {
+  public:
+    CountingBVHAccel(std::vector<std::shared_ptr<Primitive>> p)
+        : BVHAccel(std::move(p)) {}
+    void Refit() {
+        ++nRefits;
+        BVHAccel::Refit();
+    }
+    int nRefits = 0;
+};
+
+TEST(Accelerators, RefitSharedObjects) {
+    // An object that is used by several animated instances and by an
+    // instance BVH is only refit once by each refit of the scene
+    RNG rng;
+    std::shared_ptr<CountingBVHAccel> object =
+        std::make_shared<CountingBVHAccel>(RandomPrimitives(rng, 100, 0));
+    std::vector<std::shared_ptr<Primitive>> objects = {object};
+    std::vector<std::shared_ptr<Primitive>> top;
+    for (int i = 0; i < 3; ++i) {
+        Transform *t0 = new Transform(Translate(Vector3f(30 * i, 0, 0)));
+        Transform *t1 = new Transform(Translate(Vector3f(30 * i, 1, 0)));
+        top.push_back(std::make_shared<TransformedPrimitive>(
+            objects[0], AnimatedTransform(t0, 0, t1, 1)));
+    }
+    top.push_back(std::make_shared<InstanceBVHAccel>(
+        objects, std::vector<InstanceBVHAccel::Instance>{
+                     {0, Translate(Vector3f(0, 30, 0))}}));
+    BVHAccel accel(std::move(top));
+    for (int frame = 1; frame <= 2; ++frame) {
+        accel.Refit();
+        EXPECT_EQ(frame, object->nRefits);
+    }
+}
+
+TEST(Accelerators, BVHCache) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomPrimitives(rng, 3000, 30);
+    const char *filename = "bvhcache.tmp";
+    remove(filename);
+
+    BVHInspector reference(prims, 4);
+    {
+        // The first build writes the cache; later ones load it
+        BVHInspector built(prims, 4, BVHAccel::SplitMethod::SAH, false, .3f,
+                           1.5f, filename);
+        BVHInspector loaded(prims, 4, BVHAccel::SplitMethod::SAH, false, .3f,
+                            1.5f, filename);
+        EXPECT_GT(CompareTrees(reference, 0, built, 0), 3030 / 4);
+        EXPECT_GT(CompareTrees(reference, 0, loaded, 0), 3030 / 4);
+        BVHAccel compressed(prims, 4, BVHAccel::SplitMethod::SAH, true, .3f,
+                            1.5f, filename);
+        EXPECT_GT(CompareHits(reference, compressed, rng), 200);
+    }
+
+    // Different settings or geometry must not use the cached tree
+    BVHInspector otherSettings(prims, 1, BVHAccel::SplitMethod::SAH, false,
+                               .3f, 1.5f, filename);
+    EXPECT_GT(CompareTrees(BVHInspector(prims, 1), 0, otherSettings, 0),
+              3030 / 2);
+    std::vector<std::shared_ptr<Primitive>> otherPrims =
+        RandomPrimitives(rng, 3000, 30);
+    BVHInspector otherGeometry(otherPrims, 1, BVHAccel::SplitMethod::SAH,
+                               false, .3f, 1.5f, filename);
+    EXPECT_GT(CompareTrees(BVHInspector(otherPrims, 1), 0, otherGeometry, 0),
+              3030 / 2);
+
+    // A damaged file is detected and replaced
+    FILE *f = fopen(filename, "r+b");
+    ASSERT_TRUE(f != nullptr);
+    fseek(f, 64 + 8, SEEK_SET);
+    int bad = -1000;
+    fwrite(&bad, sizeof(bad), 1, f);
+    fclose(f);
+    BVHInspector repaired(otherPrims, 1, BVHAccel::SplitMethod::SAH, false,
+                          .3f, 1.5f, filename);
+    EXPECT_GT(CompareTrees(BVHInspector(otherPrims, 1), 0, repaired, 0),
+              3030 / 2);
+
+    // So is a file that is too short to hold a header
+    f = fopen(filename, "wb");
+    ASSERT_TRUE(f != nullptr);
+    fwrite("pbrtbvh", 1, 8, f);
+    fclose(f);
+    BVHInspector truncated(otherPrims, 1, BVHAccel::SplitMethod::SAH, false,
+                           .3f, 1.5f, filename);
+    EXPECT_GT(CompareTrees(BVHInspector(otherPrims, 1), 0, truncated, 0),
+              3030 / 2);
+    remove(filename);
+}
+
+TEST(Accelerators, InstanceBVH) {
+    RNG rng;
+    auto pUnif = [&rng](Float range) {
+        return Lerp(rng.UniformFloat(), -range, range);
+    };
+    std::vector<std::shared_ptr<Primitive>> objects;
+    for (int i = 0; i < 3; ++i)
+        objects.push_back(
+            std::make_shared<BVHAccel>(RandomPrimitives(rng, 100, 5), 4));
+
+    // Compare against _TransformedPrimitive_s in a regular _BVHAccel_
+    std::vector<InstanceBVHAccel::Instance> instances;
+    std::vector<std::shared_ptr<Primitive>> transformed;
+    for (int i = 0; i < 500; ++i) {
+        Transform InstanceToWorld;
+        if (i > 0)
+            InstanceToWorld =
+                Translate(Vector3f(pUnif(10), pUnif(10), pUnif(10))) *
+                Rotate(360 * rng.UniformFloat(),
+                       Vector3f(pUnif(1), pUnif(1), 1)) *
+                Scale(.1f, .2f, .15f);
+        int object = i % objects.size();
+        instances.push_back({object, InstanceToWorld});
+        Transform *t = new Transform(InstanceToWorld);
+        transformed.push_back(std::make_shared<TransformedPrimitive>(
+            objects[object], AnimatedTransform(t, 0, t, 1)));
+    }
+    BVHAccel reference(transformed, 4);
+    InstanceBVHAccel accel(objects, instances);
+    EXPECT_EQ(reference.WorldBound(), accel.WorldBound());
+    EXPECT_GT(CompareHits(reference, accel, rng), 200);
+
+    InstanceBVHAccel empty(objects, {});
+    Ray ray(Point3f(0, 0, 0), Vector3f(1, 0, 0));
+    SurfaceInteraction isect;
+    EXPECT_FALSE(empty.Intersect(ray, &isect));
+    EXPECT_FALSE(empty.IntersectP(ray));
+}
+
+// SAH cost of the subtree at node _i_, times its surface area
+static Float TreeCost(const BVHInspector &bvh, int i) {
+    const LinearBVHNode &node = bvh.Nodes()[i];
+    Float area = node.bounds.SurfaceArea();
+    if (node.nPrimitives > 0) return node.nPrimitives * area;
+    return area + TreeCost(bvh, i + 1) + TreeCost(bvh, node.secondChildOffset);
+}
+
+TEST(Accelerators, TreeletRestructuring) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomPrimitives(rng, 20000, 100);
+    int nThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 1;
+    Float sahCost = TreeCost(BVHInspector(prims, 4), 0);
+    for (auto splitMethod :
+         {BVHAccel::SplitMethod::HLBVH, BVHAccel::SplitMethod::SAH}) {
+        BVHInspector plain(prims, 4, splitMethod);
+        BVHInspector restructured(prims, 4, splitMethod, false, .3f, 1.5f,
+                                  "", 2);
+        EXPECT_EQ(plain.WorldBound(), restructured.WorldBound());
+        Float cost = TreeCost(plain, 0), newCost = TreeCost(restructured, 0);
+        EXPECT_LT(newCost, cost);
+        // Most of the gap to the SAH tree is in the leaves, which aren't
+        // restructured, but a good part of it should be recovered
+        if (splitMethod == BVHAccel::SplitMethod::HLBVH)
+            EXPECT_LT(newCost, cost - .3f * (cost - sahCost));
+        EXPECT_GT(CompareHits(plain, restructured, rng), 200);
+
+        // The result must not depend on the number of threads
+        PbrtOptions.nThreads = 4;
+        ParallelInit();
+        BVHInspector parallel(prims, 4, splitMethod, false, .3f, 1.5f, "", 2);
+        ParallelCleanup();
+        PbrtOptions.nThreads = 1;
+        EXPECT_GT(CompareTrees(restructured, 0, parallel, 0), 20100 / 4);
+    }
+    PbrtOptions.nThreads = nThreads;
+}
+
+TEST(Accelerators, OccluderCache) {
+    RNG rng;
+    std::shared_ptr<Primitive> accel =
+        std::make_shared<BVHAccel>(RandomPrimitives(rng, 1000, 20), 4);
+    PointLight light(Transform(), MediumInterface(), Spectrum(1.f));
+    Scene scene(accel, {});
+
+    // Shadow rays from nearby points toward the light, so that the cached
+    // occluder is often the right one
+    int nOccluded = 0;
+    for (int i = 0; i < 2000; ++i) {
+        Point3f o = Point3f(6, 2, -3) +
+                    2 * Vector3f(rng.UniformFloat(), rng.UniformFloat(),
+                                 rng.UniformFloat());
+        Ray ray(o, Point3f(0, 0, 0) - o, 1 - ShadowEpsilon);
+        bool occluded = scene.IntersectP(ray);
+        EXPECT_EQ(occluded, scene.IntersectP(ray, &light)) << "ray " << ray;
+        if (occluded) ++nOccluded;
+    }
+    EXPECT_GT(nOccluded, 100);
+    EXPECT_LT(nOccluded, 1900);
+}
+
+TEST(Accelerators, OccluderInsideAggregates) {
+    // Occluders found inside nested aggregates are the primitives that
+    // were hit; inside transformed aggregates, none can be reported
+    RNG rng;
+    std::shared_ptr<Primitive> nested =
+        std::make_shared<BVHAccel>(RandomPrimitives(rng, 1000, 0), 4);
+    Transform *t = new Transform(Translate(Vector3f(0, 40, 0)));
+    std::shared_ptr<Primitive> instanced =
+        std::make_shared<TransformedPrimitive>(nested,
+                                               AnimatedTransform(t, 0, t, 1));
+    for (bool wide : {false, true}) {
+        std::vector<std::shared_ptr<Primitive>> top = {nested, instanced};
+        std::shared_ptr<Primitive> accel;
+        if (wide)
+            accel = std::make_shared<WideBVHAccel<4>>(std::move(top));
+        else
+            accel = std::make_shared<BVHAccel>(std::move(top));
+
+        int nNested = 0, nInstanced = 0;
+        for (int i = 0; i < 1000; ++i) {
+            Point3f o(0, i % 2 ? 40 : 0, -30);
+            Vector3f d(Lerp(rng.UniformFloat(), -.3f, .3f),
+                       Lerp(rng.UniformFloat(), -.3f, .3f), 1);
+            Ray ray(o, d);
+            const Primitive *occluder = nullptr;
+            if (!accel->FindOccluder(ray, &occluder)) continue;
+            if (i % 2) {
+                EXPECT_EQ(nullptr, occluder);
+                ++nInstanced;
+            } else {
+                ASSERT_NE(nullptr, occluder);
+                EXPECT_EQ(nullptr, dynamic_cast<const Aggregate *>(occluder));
+                EXPECT_TRUE(occluder->IntersectP(ray));
+                ++nNested;
+            }
+        }
+        EXPECT_GT(nNested, 100);
+        EXPECT_GT(nInstanced, 100);
+    }
+}
+
+TEST(Accelerators, TriangleLeaves) {
+    for (int maxPrims : {1, 4, 7})
+        CompareToBVH([maxPrims](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<BVHAccel>(
+                std::move(prims), maxPrims, BVHAccel::SplitMethod::SAH, false,
+                .3f, 1.5f, "", 0, true);
+        });
+
+    // Rays through the shared edges and vertices of a grid, where the
+    // edge functions are zero and the triangles' own test decides
+    const int n = 20;
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int y = 0; y <= n; ++y)
+        for (int x = 0; x <= n; ++x) p.push_back(Point3f(x - n / 2, y - n / 2, 0));
+    for (int y = 0; y < n; ++y)
+        for (int x = 0; x < n; ++x) {
+            int v = y * (n + 1) + x;
+            for (int i : {v, v + 1, v + n + 2, v, v + n + 2, v + n + 1})
+                indices.push_back(i);
+        }
+    std::vector<std::shared_ptr<Shape>> shapes = CreateTriangleMesh(
+        &identity, &identity, false, indices.size() / 3, indices.data(),
+        p.size(), p.data(), nullptr, nullptr, nullptr, nullptr, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &s : shapes)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            s, nullptr, nullptr, MediumInterface()));
+    // Each accelerator is compared with its counterpart without triangle
+    // leaves, since they don't agree with each other on rays that hit
+    // the grid's bounds exactly
+    BVHAccel bvhRef(prims, 4);
+    BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, false, .3f, 1.5f, "",
+                 0, true);
+    KdTreeAccel kdTreeRef(prims, 80, 1, .5f, 4);
+    KdTreeAccel kdTree(prims, 80, 1, .5f, 4, -1, true);
+    std::pair<const Primitive *, const Primitive *> accels[] = {
+        {&bvhRef, &bvh}, {&kdTreeRef, &kdTree}};
+    for (const auto &accel : accels)
+        for (int y = -n / 2; y <= n / 2; ++y)
+            for (int x = -n / 2; x <= n / 2; ++x)
+                for (Float dx : {Float(0), Float(.5)}) {
+                    Ray rayRef(Point3f(x + dx, y, 1), Vector3f(0, 0, -1)),
+                        ray(Point3f(x + dx, y, 1), Vector3f(0, 0, -1));
+                    SurfaceInteraction isectRef, isect;
+                    EXPECT_EQ(accel.first->Intersect(rayRef, &isectRef),
+                              accel.second->Intersect(ray, &isect));
+                    EXPECT_EQ(rayRef.tMax, ray.tMax);
+                    EXPECT_EQ(accel.first->IntersectP(ray),
+                              accel.second->IntersectP(ray));
+                }
+}
+
+TEST(Accelerators, KdTree) {
+    CompareToBVH([](std::vector<std::shared_ptr<Primitive>> prims) {
+        return std::make_shared<KdTreeAccel>(std::move(prims));
+    });
+}
+
+TEST(Accelerators, KdTreeTriangleLeaves) {
+    for (int maxPrims : {1, 4})
+        CompareToBVH([maxPrims](std::vector<std::shared_ptr<Primitive>> prims) {
+            return std::make_shared<KdTreeAccel>(std::move(prims), 80, 1, .5f,
+                                                 maxPrims, -1, true);
+        });
+}
+
+TEST(Accelerators, KdTreeParallelBuild) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomPrimitives(rng, 20000, 100);
+    BVHAccel reference(prims, 4);
+    int nThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 1;
+    KdTreeAccel serial(prims);
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    KdTreeAccel parallel(prims);
+    ParallelCleanup();
+    PbrtOptions.nThreads = nThreads;
+
+    EXPECT_EQ(reference.WorldBound(), parallel.WorldBound());
+    EXPECT_GT(CompareHits(reference, parallel, rng), 200);
+    EXPECT_GT(CompareHits(serial, parallel, rng), 200);
+}
@@ -27,6 +27,7 @@
 #include "samplers/zerotwosequence.h"
 #include "scene.h"
 #include "shapes/sphere.h"
+#include "shapes/triangle.h"
 #include "spectrum.h"
 #include "textures/constant.h"
 
@@ -164,6 +165,50 @@ std::vector<TestScene> GetScenes() {
         scenes.push_back({std::move(scene), "Sphere, Kd = 0.5, Le = 0.5", 1.0});
     }
 
+    {
+        // Cube triangle mesh around the origin, Kd = 0.5, Le = 0.5, with
+        // a single light for all of its triangles
+        // -> With GI, should have radiance of 1.
+        static Transform id;
+        const Point3f p[8] = {Point3f(-2, -2, -2), Point3f(2, -2, -2),
+                              Point3f(-2, 2, -2),  Point3f(2, 2, -2),
+                              Point3f(-2, -2, 2),  Point3f(2, -2, 2),
+                              Point3f(-2, 2, 2),   Point3f(2, 2, 2)};
+        const int indices[36] = {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5,
+                                 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3,
+                                 0, 4, 5, 0, 5, 1, 2, 3, 7, 2, 7, 6};
+        std::vector<std::shared_ptr<Shape>> triangles = CreateTriangleMesh(
+            &id, &id, false, 12, indices, 8, p, nullptr, nullptr, nullptr,
+            nullptr, nullptr);
+
+        std::shared_ptr<Texture<Spectrum>> Kd =
+            std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+        std::shared_ptr<Texture<Float>> sigma =
+            std::make_shared<ConstantTexture<Float>>(0.);
+        std::shared_ptr<Material> material =
+            std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+
+        std::shared_ptr<AreaLight> areaLight =
+            std::make_shared<DiffuseMeshLight>(Transform(), nullptr,
+                                               Spectrum(0.5), 1, triangles,
+                                               true);
+
+        std::vector<std::shared_ptr<Light>> lights;
+        lights.push_back(areaLight);
+
+        MediumInterface mediumInterface;
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const auto &tri : triangles)
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                tri, material, areaLight, mediumInterface));
+        std::shared_ptr<BVHAccel> bvh = std::make_shared<BVHAccel>(prims);
+
+        std::unique_ptr<Scene> scene(new Scene(bvh, lights));
+
+        scenes.push_back(
+            {std::move(scene), "Triangle mesh light, Kd = 0.5, Le = 0.5", 1.0});
+    }
+
     {
         // Unit sphere, Kd = 0.25, Kr = .5, point light I = 7.4 at center
         // -> With GI, should have radiance of ~1.
@@ -294,6 +339,26 @@ std::vector<TestIntegrator> GetIntegrators() {
                                    scene});
         }
 
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., inTestDir("test.exr"), 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator = new PathIntegrator(
+                8, camera, sampler.first, film->croppedPixelBounds, 1,
+                "spatial", true);
+            integrators.push_back({integrator, film,
+                                   "Path, depth 8, sorted rays, Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+
         for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
             std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
             Film *film =
@@ -0,0 +1,34 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "mipmap.h"
+#include "rng.h"
+
+using namespace pbrt;
+
+TEST(MIPMap, Bound) {
+    RNG rng;
+    // A power-of-two resolution, so the texels aren't resampled
+    Point2i res(16, 8);
+    std::vector<Float> texels(res.x * res.y);
+    for (Float &t : texels) t = rng.UniformFloat() < .3f ? 0 : rng.UniformFloat();
+
+    for (ImageWrap wrap :
+         {ImageWrap::Repeat, ImageWrap::Black, ImageWrap::Clamp}) {
+        MIPMap<Float> mipmap(res, texels.data(), false, 8.f, wrap);
+        for (int i = 0; i < 500; ++i) {
+            Point2f p(Lerp(rng.UniformFloat(), -1.5f, 2.5f),
+                      Lerp(rng.UniformFloat(), -1.5f, 2.5f));
+            Float extent = std::pow(2.f, Lerp(rng.UniformFloat(), -8.f, 1.f));
+            Bounds2f st(p, p + Vector2f(extent * rng.UniformFloat(),
+                                        extent * rng.UniformFloat()));
+            Float min, max;
+            ASSERT_TRUE(mipmap.Bound(st, &min, &max));
+            for (int j = 0; j < 50; ++j) {
+                Point2f q = st.Lerp(Point2f(rng.UniformFloat(), rng.UniformFloat()));
+                Float v = mipmap.Lookup(q, Vector2f(0, 0), Vector2f(0, 0));
+                EXPECT_LE(min, v) << st << ", " << q;
+                EXPECT_GE(max, v) << st << ", " << q;
+            }
+        }
+    }
+}
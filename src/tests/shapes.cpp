@@ -2,17 +2,27 @@
 #include "tests/gtest/gtest.h"
 #include <cmath>
 #include <functional>
+#include <map>
 #include "pbrt.h"
 #include "rng.h"
 #include "shape.h"
 #include "lowdiscrepancy.h"
 #include "sampling.h"
+#include "paramset.h"
+#include "imageio.h"
 #include "shapes/cone.h"
+#include "shapes/curve.h"
 #include "shapes/cylinder.h"
 #include "shapes/disk.h"
+#include "shapes/displacedsubdiv.h"
+#include "shapes/heightfield.h"
+#include "shapes/loopsubdiv.h"
 #include "shapes/paraboloid.h"
+#include "shapes/plymesh.h"
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "textures/constant.h"
+#include "textures/imagemap.h"
 
 using namespace pbrt;
 
@@ -204,6 +214,60 @@ TEST(Triangle, Reintersect) {
     }
 }
 
+// Checks that IntersectTriangleBatch() accepts exactly the hits that
+// Triangle::Intersect() does, at the same distances, for rays aimed at
+// points on randomly-sized triangles.
+TEST(Triangle, Batch) {
+    const int n = 2 * TriangleBatchWidth + 1;
+    int stride = 3 * TriangleBatchWidth;
+    for (int i = 0; i < 200; ++i) {
+        RNG rng(i);
+        std::vector<std::shared_ptr<Triangle>> tris;
+        std::vector<Float> vertices(9 * stride, 0);
+        while (tris.size() < n) {
+            std::shared_ptr<Triangle> tri =
+                GetRandomTriangle([&]() { return pExp(rng); });
+            if (!tri) continue;
+            int v[3];
+            tri->GetVertexIndices(v);
+            for (int j = 0; j < 3; ++j)
+                for (int c = 0; c < 3; ++c)
+                    vertices[(3 * j + c) * stride + tris.size()] =
+                        tri->GetMesh()->p[v[j]][c];
+            tris.push_back(tri);
+        }
+
+        for (int j = 0; j < 100; ++j) {
+            // Aim at a point on one of the triangles
+            Float pdf;
+            Interaction target =
+                tris[j % n]->Sample(Point2f(rng.UniformFloat(),
+                                            rng.UniformFloat()), &pdf);
+            Point3f o;
+            for (int k = 0; k < 3; ++k) o[k] = pExp(rng);
+            Ray r(o, target.p - o, (j % 2) ? Infinity : rng.UniformFloat());
+            TriangleBatchRay batchRay(r);
+
+            for (int start = 0; start < n; start += TriangleBatchWidth) {
+                int count = std::min(TriangleBatchWidth, n - start);
+                TriangleBatchHits hits;
+                IntersectTriangleBatch(vertices.data(), stride, start, count,
+                                       batchRay, &hits);
+                for (int k = 0; k < count; ++k) {
+                    if (hits.fallback & (1 << k)) continue;
+                    Float tHit;
+                    SurfaceInteraction isect;
+                    bool hit = tris[start + k]->Intersect(r, &tHit, &isect,
+                                                          false);
+                    bool candidate = hits.candidates & (1 << k);
+                    EXPECT_EQ(hit, candidate && hits.InRayExtent(k, r.tMax));
+                    if (hit && candidate) EXPECT_EQ(tHit, hits.t[k]);
+                }
+            }
+        }
+    }
+}
+
 // Computes the projected solid angle subtended by a series of random
 // triangles both using uniform spherical sampling as well as
 // Triangle::Sample(), in order to verify Triangle::Sample().
@@ -557,3 +621,939 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+// Closest intersection of _ray_ with any of _shapes_, or zero if none
+static Float IntersectShapes(const std::vector<std::shared_ptr<Shape>> &shapes,
+                             Ray ray) {
+    Float tClosest = 0;
+    for (const auto &shape : shapes) {
+        Float tHit;
+        SurfaceInteraction isect;
+        if (shape->Intersect(ray, &tHit, &isect)) ray.tMax = tClosest = tHit;
+    }
+    return tClosest;
+}
+
+TEST(Curve, PresplitSegments) {
+    Transform identity;
+    const char *types[2] = {"flat", "cylinder"};
+    int nRays = 0, nMismatches = 0;
+    for (int i = 0; i < 50; ++i) {
+        RNG rng(i);
+        std::unique_ptr<Point3f[]> cp(new Point3f[4]);
+        for (int j = 0; j < 4; ++j)
+            cp[j] = Point3f(pUnif(rng, 1), pUnif(rng, 1), pUnif(rng, 1));
+        Point3f curve[4] = {cp[0], cp[1], cp[2], cp[3]};
+        Float width = Lerp(rng.UniformFloat(), .01f, .2f);
+
+        std::vector<std::shared_ptr<Shape>> shapes[2];
+        for (int presplit = 0; presplit < 2; ++presplit) {
+            ParamSet params;
+            std::unique_ptr<Point3f[]> p(new Point3f[4]);
+            for (int j = 0; j < 4; ++j) p[j] = curve[j];
+            params.AddPoint3f("P", std::move(p), 4);
+            params.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{width}),
+                            1);
+            params.AddString("type", std::unique_ptr<std::string[]>(
+                                         new std::string[1]{types[i & 1]}),
+                             1);
+            params.AddBool("presplit",
+                           std::unique_ptr<bool[]>(new bool[1]{presplit == 1}),
+                           1);
+            shapes[presplit] =
+                CreateCurveShape(&identity, &identity, false, params);
+        }
+
+        for (int j = 0; j < 200; ++j) {
+            // Aim a ray at a point near the curve
+            Float t = rng.UniformFloat();
+            Point3f a[3], b[2];
+            for (int k = 0; k < 3; ++k) a[k] = Lerp(t, curve[k], curve[k + 1]);
+            for (int k = 0; k < 2; ++k) b[k] = Lerp(t, a[k], a[k + 1]);
+            Point3f pTarget = Lerp(t, b[0], b[1]) +
+                              width * Vector3f(pUnif(rng, 1), pUnif(rng, 1),
+                                               pUnif(rng, 1));
+            Point3f o(pUnif(rng), pUnif(rng), pUnif(rng));
+            Ray ray(o, pTarget - o);
+
+            Float tRef = IntersectShapes(shapes[0], ray);
+            Float tPresplit = IntersectShapes(shapes[1], ray);
+            // Both are only accurate to within the curve's width, as the
+            // error bounds they report
+            ++nRays;
+            if ((tRef > 0) != (tPresplit > 0) ||
+                std::abs(tRef - tPresplit) * ray.d.Length() > width)
+                ++nMismatches;
+
+            bool occluded = false;
+            for (const auto &shape : shapes[1])
+                occluded |= shape->IntersectP(ray);
+            EXPECT_EQ(tPresplit > 0, occluded);
+        }
+    }
+    // The two refine the curve differently, so rays that graze it may
+    // disagree.
+    EXPECT_LT(nMismatches, .01 * nRays) << nMismatches << " / " << nRays;
+}
+
+TEST(Curve, CurveSet) {
+    Transform identity;
+    for (int quantize = 0; quantize < 2; ++quantize)
+        for (const char *type : {"flat", "cylinder", "ribbon"}) {
+            // Random two-segment curves, as individual "curve" shapes and
+            // as a single "curves" shape
+            RNG rng(quantize);
+            bool ribbon = std::string(type) == "ribbon";
+            const int nCurves = 20;
+            std::vector<Point3f> p(7 * nCurves);
+            std::vector<Normal3f> n(3 * nCurves);
+            std::vector<Float> width0(nCurves), width1(nCurves);
+            for (Point3f &pp : p)
+                pp = Point3f(pUnif(rng, 1), pUnif(rng, 1), pUnif(rng, 1));
+            for (Normal3f &nn : n)
+                nn = Normal3f(pUnif(rng, 1), pUnif(rng, 1), pUnif(rng, 1));
+            for (int i = 0; i < nCurves; ++i) {
+                width0[i] = Lerp(rng.UniformFloat(), .01f, .1f);
+                width1[i] = Lerp(rng.UniformFloat(), .01f, .1f);
+            }
+            auto addType = [&](ParamSet &params) {
+                params.AddString("type", std::unique_ptr<std::string[]>(
+                                             new std::string[1]{type}),
+                                 1);
+            };
+
+            std::vector<std::shared_ptr<Shape>> curves;
+            for (int i = 0; i < nCurves; ++i) {
+                ParamSet params;
+                params.AddPoint3f("P", std::unique_ptr<Point3f[]>(new Point3f[7]{
+                                           p[7 * i], p[7 * i + 1], p[7 * i + 2],
+                                           p[7 * i + 3], p[7 * i + 4],
+                                           p[7 * i + 5], p[7 * i + 6]}),
+                                  7);
+                params.AddFloat("width0",
+                                std::unique_ptr<Float[]>(new Float[1]{width0[i]}), 1);
+                params.AddFloat("width1",
+                                std::unique_ptr<Float[]>(new Float[1]{width1[i]}), 1);
+                if (ribbon)
+                    params.AddNormal3f("N", std::unique_ptr<Normal3f[]>(new Normal3f[3]{
+                                                n[3 * i], n[3 * i + 1], n[3 * i + 2]}),
+                                       3);
+                addType(params);
+                auto c = CreateCurveShape(&identity, &identity, false, params);
+                curves.insert(curves.end(), c.begin(), c.end());
+            }
+
+            ParamSet params;
+            std::unique_ptr<Point3f[]> pAll(new Point3f[p.size()]);
+            std::copy(p.begin(), p.end(), pAll.get());
+            params.AddPoint3f("P", std::move(pAll), p.size());
+            std::unique_ptr<int[]> nv(new int[nCurves]);
+            std::fill(nv.get(), nv.get() + nCurves, 7);
+            params.AddInt("nvertices", std::move(nv), nCurves);
+            std::unique_ptr<Float[]> w0(new Float[nCurves]), w1(new Float[nCurves]);
+            std::copy(width0.begin(), width0.end(), w0.get());
+            std::copy(width1.begin(), width1.end(), w1.get());
+            params.AddFloat("width0", std::move(w0), nCurves);
+            params.AddFloat("width1", std::move(w1), nCurves);
+            std::unique_ptr<Normal3f[]> nAll(new Normal3f[n.size()]);
+            std::copy(n.begin(), n.end(), nAll.get());
+            if (ribbon) params.AddNormal3f("N", std::move(nAll), n.size());
+            params.AddBool("quantize",
+                           std::unique_ptr<bool[]>(new bool[1]{quantize == 1}), 1);
+            addType(params);
+            auto curveSet = CreateCurveSetShape(&identity, &identity, false, params);
+            ASSERT_EQ(1, curveSet.size());
+
+            int nRays = 0, nMismatches = 0;
+            for (int i = 0; i < 2000; ++i) {
+                // Aim a ray near one of the curves' control points
+                Point3f o(pUnif(rng, 4), pUnif(rng, 4), pUnif(rng, 4));
+                Point3f pTarget =
+                    p[std::min<int>(rng.UniformFloat() * p.size(), p.size() - 1)] +
+                    .05f * Vector3f(pUnif(rng, 1), pUnif(rng, 1), pUnif(rng, 1));
+                Ray ray(o, pTarget - o);
+                Float tCurves = IntersectShapes(curves, ray);
+                Float tCurveSet = IntersectShapes(curveSet, ray);
+                bool occluded = curveSet[0]->IntersectP(ray);
+                EXPECT_EQ(tCurveSet > 0, occluded);
+                ++nRays;
+                if (quantize == 0)
+                    EXPECT_EQ(tCurves, tCurveSet);
+                else if ((tCurves > 0) != (tCurveSet > 0) ||
+                         std::abs(tCurves - tCurveSet) * ray.d.Length() > .01f)
+                    ++nMismatches;
+            }
+            // Quantized widths and normals only change rays that graze the
+            // curves.
+            EXPECT_LT(nMismatches, .01 * nRays) << type;
+        }
+}
+
+// Icosahedron with one vertex pulled outward, so that its curvature varies
+// across the surface.
+static void BumpyIcosahedron(std::vector<Point3f> *p, std::vector<int> *indices) {
+    const Float t = (1 + std::sqrt(5.f)) / 2;
+    *p = {Point3f(-1, t, 0), Point3f(1, t, 0),   Point3f(-1, -t, 0),
+          Point3f(1, -t, 0), Point3f(0, -1, t),  Point3f(0, 1, t),
+          Point3f(0, -1, -t), Point3f(0, 1, -t), Point3f(t, 0, -1),
+          Point3f(t, 0, 1),  Point3f(-t, 0, -1), Point3f(-t, 0, 1)};
+    (*p)[0] *= 2.5f;
+    *indices = {0, 11, 5, 0, 5,  1,  0, 1, 7, 0, 7,  10, 0, 10, 11,
+                1, 5,  9, 5, 11, 4,  11, 10, 2, 10, 7, 6, 7, 1, 8,
+                3, 9,  4, 3, 4,  2,  3, 2, 6, 3, 6,  8,  3, 8,  9,
+                4, 9,  5, 2, 4,  11, 6, 2, 10, 8, 6, 7, 9, 8, 1};
+}
+
+static std::shared_ptr<TriangleMesh> LoopSubdivMesh(
+    const std::vector<Point3f> &p, const std::vector<int> &indices,
+    int levels, Float flatness, Float edgeLength,
+    const SubdivisionView *view = nullptr) {
+    ParamSet params;
+    std::unique_ptr<Point3f[]> P(new Point3f[p.size()]);
+    std::copy(p.begin(), p.end(), P.get());
+    params.AddPoint3f("P", std::move(P), p.size());
+    std::unique_ptr<int[]> vi(new int[indices.size()]);
+    std::copy(indices.begin(), indices.end(), vi.get());
+    params.AddInt("indices", std::move(vi), indices.size());
+    params.AddInt("levels", std::unique_ptr<int[]>(new int[1]{levels}), 1);
+    params.AddFloat("flatness",
+                    std::unique_ptr<Float[]>(new Float[1]{flatness}), 1);
+    params.AddFloat("edgelength",
+                    std::unique_ptr<Float[]>(new Float[1]{edgeLength}), 1);
+    Transform identity;
+    auto shapes =
+        CreateLoopSubdiv(&identity, &identity, false, params, view);
+    if (shapes.empty()) return nullptr;
+    return std::static_pointer_cast<Triangle>(shapes[0])->GetMesh();
+}
+
+// Checks that every edge of a closed mesh is used once in each direction.
+static bool ClosedManifold(const TriangleMesh &mesh) {
+    std::map<std::pair<int, int>, int> edges;
+    for (int i = 0; i < mesh.nTriangles; ++i)
+        for (int j = 0; j < 3; ++j)
+            ++edges[std::make_pair(mesh.vertexIndices[3 * i + j],
+                                   mesh.vertexIndices[3 * i + (j + 1) % 3])];
+    for (const auto &e : edges) {
+        auto reverse =
+            edges.find(std::make_pair(e.first.second, e.first.first));
+        if (e.second != 1 || reverse == edges.end() || reverse->second != 1)
+            return false;
+    }
+    return true;
+}
+
+TEST(LoopSubdiv, Uniform) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    BumpyIcosahedron(&p, &indices);
+    for (int levels = 0; levels <= 4; ++levels) {
+        auto mesh = LoopSubdivMesh(p, indices, levels, 0, 0);
+        ASSERT_TRUE(mesh != nullptr);
+        int n = 1 << levels;
+        EXPECT_EQ(20 * n * n, mesh->nTriangles);
+        EXPECT_EQ(12 + 30 * (n - 1) + 20 * (n - 1) * (n - 2) / 2,
+                  mesh->nVertices);
+        EXPECT_TRUE(ClosedManifold(*mesh));
+    }
+}
+
+TEST(LoopSubdiv, Adaptive) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    BumpyIcosahedron(&p, &indices);
+    const int levels = 4;
+    auto uniform = LoopSubdivMesh(p, indices, levels, 0, 0);
+    ASSERT_TRUE(uniform != nullptr);
+
+    // A camera close to the bump, so that faces near it need more levels
+    // than those on the far side
+    SubdivisionView view;
+    view.pCamera = Point3f(-6, 10, 0);
+    view.pixelsPerUnit = 500;
+
+    for (int mode = 0; mode < 2; ++mode) {
+        auto mesh = mode == 0
+                        ? LoopSubdivMesh(p, indices, levels, .1f, 0)
+                        : LoopSubdivMesh(p, indices, levels, 0, 20, &view);
+        ASSERT_TRUE(mesh != nullptr);
+        // Some faces are refined less than others...
+        EXPECT_LT(mesh->nTriangles, uniform->nTriangles);
+        EXPECT_GT(mesh->nTriangles, 20 * 4);
+        // ...without leaving cracks between them.
+        EXPECT_TRUE(ClosedManifold(*mesh));
+
+        // All vertices are on the limit surface, which the uniformly
+        // subdivided mesh also samples.
+        for (int i = 0; i < mesh->nVertices; ++i) {
+            Float minDist = Infinity;
+            for (int j = 0; j < uniform->nVertices; ++j)
+                minDist =
+                    std::min(minDist, Distance(mesh->p[i], uniform->p[j]));
+            EXPECT_LT(minDist, 1e-4f) << mesh->p[i];
+        }
+    }
+}
+
+TEST(Heightfield, MatchesTriangles) {
+    const int nx = 19, ny = 13;
+    RNG rng;
+    std::vector<Float> z(nx * ny);
+    for (Float &zz : z) zz = .2f * rng.UniformFloat();
+    // The heightfield is tested against the triangle mesh it used to be
+    // turned into
+    std::unique_ptr<Point3f[]> P(new Point3f[nx * ny]);
+    std::unique_ptr<Point2f[]> uv(new Point2f[nx * ny]);
+    for (int y = 0; y < ny; ++y)
+        for (int x = 0; x < nx; ++x) {
+            P[y * nx + x] = Point3f((float)x / (float)(nx - 1),
+                                    (float)y / (float)(ny - 1), z[y * nx + x]);
+            uv[y * nx + x] = Point2f(P[y * nx + x].x, P[y * nx + x].y);
+        }
+    std::vector<int> indices;
+    for (int y = 0; y < ny - 1; ++y)
+        for (int x = 0; x < nx - 1; ++x) {
+            int v00 = y * nx + x, v10 = v00 + 1, v01 = v00 + nx,
+                v11 = v01 + 1;
+            indices.insert(indices.end(), {v00, v10, v11, v00, v11, v01});
+        }
+
+    Transform transforms[2] = {Transform(),
+                               Translate(Vector3f(1, -2, .5)) *
+                                   Scale(3, -2, 1.5f) * RotateZ(30)};
+    for (int ti = 0; ti < 2; ++ti) {
+        const Transform &o2w = transforms[ti];
+        Transform w2o = Inverse(o2w);
+        auto mesh = CreateTriangleMesh(&o2w, &w2o, false, indices.size() / 3,
+                                       indices.data(), nx * ny, P.get(),
+                                       nullptr, nullptr, uv.get(), nullptr,
+                                       nullptr);
+        Heightfield hf(&o2w, &w2o, false, nx, ny, z.data());
+        Bounds3f bounds = hf.WorldBound();
+        EXPECT_LT(std::abs(hf.Area() - [&]() {
+            Float area = 0;
+            for (const auto &tri : mesh) area += tri->Area();
+            return area;
+        }()), 1e-3f * hf.Area());
+
+        for (int i = 0; i < 10000; ++i) {
+            // Rays from random points toward the heightfield's bounds,
+            // including some nearly parallel to it
+            Point3f o = bounds.Lerp(Point3f(Lerp(rng.UniformFloat(), -1, 2),
+                                            Lerp(rng.UniformFloat(), -1, 2),
+                                            Lerp(rng.UniformFloat(), -2, 3)));
+            Point3f target = bounds.Lerp(Point3f(rng.UniformFloat(),
+                                                 rng.UniformFloat(),
+                                                 rng.UniformFloat()));
+            Ray ray(o, target - o);
+            if (i % 4 == 0) ray.d.z *= 1e-3f;
+
+            Float tMesh = IntersectShapes(mesh, ray);
+            Float tHit;
+            SurfaceInteraction isect;
+            bool hit = hf.Intersect(ray, &tHit, &isect);
+            ASSERT_EQ(tMesh > 0, hit) << ray;
+            EXPECT_EQ(hit, hf.IntersectP(ray)) << ray;
+            if (hit) {
+                EXPECT_EQ(tMesh, tHit) << ray;
+                EXPECT_LT(Distance(ray(tHit), isect.p), 1e-4f);
+            }
+        }
+    }
+}
+
+TEST(Heightfield, Sampling) {
+    const int nx = 9, ny = 7;
+    RNG rng;
+    std::vector<Float> z(nx * ny);
+    for (Float &zz : z) zz = rng.UniformFloat();
+    Transform o2w = Scale(2, 1, .5f), w2o = Inverse(o2w);
+    Heightfield hf(&o2w, &w2o, false, nx, ny, z.data());
+
+    // The expected inverse density of the sampled points is the area
+    double sum = 0;
+    const int n = 100000;
+    for (int i = 0; i < n; ++i) {
+        Float pdf;
+        Interaction it = hf.Sample(Point2f(rng.UniformFloat(),
+                                           rng.UniformFloat()), &pdf);
+        ASSERT_GT(pdf, 0);
+        EXPECT_LT(std::abs(pdf - hf.Pdf(it)), 1e-3f * pdf);
+        sum += 1 / pdf;
+    }
+    EXPECT_LT(std::abs(sum / n - hf.Area()), .01f * hf.Area());
+}
+
+// Writes a PLY file with the given faces in either ASCII or binary
+// little-endian form.  The vertex records carry an extra double to check
+// that unused properties are skipped.
+static void WriteTestPly(const std::string &filename, bool binary,
+                         const std::vector<std::vector<int>> &faces,
+                         const std::vector<Point3f> &p,
+                         const std::vector<Normal3f> &n,
+                         const std::vector<Point2f> &uv,
+                         const std::vector<int> &faceIndices) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, "ply\nformat %s 1.0\n",
+            binary ? "binary_little_endian" : "ascii");
+    fprintf(f, "element vertex %d\n", (int)p.size());
+    fprintf(f, "property float x\nproperty float y\nproperty float z\n");
+    fprintf(f, "property double quality\n");
+    if (!n.empty())
+        fprintf(f, "property float nx\nproperty float ny\nproperty float nz\n");
+    if (!uv.empty()) fprintf(f, "property float s\nproperty float t\n");
+    fprintf(f, "element face %d\n", (int)faces.size());
+    fprintf(f, "property list uchar int vertex_indices\n");
+    if (!faceIndices.empty()) fprintf(f, "property int face_indices\n");
+    fprintf(f, "end_header\n");
+
+    auto writeFloat = [&](float v) {
+        if (binary)
+            fwrite(&v, sizeof(v), 1, f);
+        else
+            fprintf(f, "%.9g ", v);
+    };
+    auto writeInt = [&](int v) {
+        if (binary)
+            fwrite(&v, sizeof(v), 1, f);
+        else
+            fprintf(f, "%d ", v);
+    };
+    for (size_t i = 0; i < p.size(); ++i) {
+        for (int c = 0; c < 3; ++c) writeFloat(p[i][c]);
+        double quality = i;
+        if (binary)
+            fwrite(&quality, sizeof(quality), 1, f);
+        else
+            fprintf(f, "%g ", quality);
+        if (!n.empty())
+            for (int c = 0; c < 3; ++c) writeFloat(n[i][c]);
+        if (!uv.empty())
+            for (int c = 0; c < 2; ++c) writeFloat(uv[i][c]);
+        if (!binary) fprintf(f, "\n");
+    }
+    for (size_t i = 0; i < faces.size(); ++i) {
+        uint8_t count = faces[i].size();
+        if (binary)
+            fwrite(&count, 1, 1, f);
+        else
+            fprintf(f, "%d ", count);
+        for (int v : faces[i]) writeInt(v);
+        if (!faceIndices.empty()) writeInt(faceIndices[i]);
+        if (!binary) fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+static std::shared_ptr<TriangleMesh> LoadTestPly(const std::string &filename) {
+    ParamSet params;
+    params.AddString("filename",
+                     std::unique_ptr<std::string[]>(new std::string[1]{filename}),
+                     1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> shapes =
+        CreatePLYMesh(&identity, &identity, false, params);
+    if (shapes.empty()) return nullptr;
+    return std::static_pointer_cast<Triangle>(shapes[0])->GetMesh();
+}
+
+static void ExpectSameMesh(const TriangleMesh &a, const TriangleMesh &b) {
+    ASSERT_EQ(a.nTriangles, b.nTriangles);
+    ASSERT_EQ(a.nVertices, b.nVertices);
+    EXPECT_EQ(a.vertexIndices, b.vertexIndices);
+    EXPECT_EQ(a.faceIndices, b.faceIndices);
+    ASSERT_EQ(a.n != nullptr, b.n != nullptr);
+    ASSERT_EQ(a.uv != nullptr, b.uv != nullptr);
+    for (int i = 0; i < a.nVertices; ++i) {
+        EXPECT_EQ(a.p[i], b.p[i]);
+        if (a.n) EXPECT_EQ(a.n[i], b.n[i]);
+        if (a.uv) EXPECT_EQ(a.uv[i], b.uv[i]);
+    }
+}
+
+TEST(PLYMesh, BinaryMatchesASCII) {
+    RNG rng;
+    const int nVertices = 500;
+    std::vector<Point3f> p;
+    std::vector<Normal3f> n;
+    std::vector<Point2f> uv;
+    for (int i = 0; i < nVertices; ++i) {
+        p.push_back(Point3f(pUnif(rng), pUnif(rng), pUnif(rng)));
+        n.push_back(Normalize(Normal3f(pUnif(rng), pUnif(rng), pUnif(rng))));
+        uv.push_back(Point2f(rng.UniformFloat(), rng.UniformFloat()));
+    }
+    auto randomFaces = [&](int nFaces, bool mixed) {
+        std::vector<std::vector<int>> faces(nFaces);
+        for (int i = 0; i < nFaces; ++i) {
+            int count = (mixed && (i % 3) == 0) ? 4 : 3;
+            for (int j = 0; j < count; ++j)
+                faces[i].push_back(rng.UniformUInt32(nVertices));
+        }
+        return faces;
+    };
+    std::vector<int> faceIndices;
+    for (int i = 0; i < 700; ++i) faceIndices.push_back(i * 7);
+
+    const std::string binaryName = "plymesh_binary.tmp.ply";
+    const std::string asciiName = "plymesh_ascii.tmp.ply";
+    // Triangles with all of the per-vertex data, quads, and a mix of the
+    // two, which is read through rply in both files
+    for (int test = 0; test < 4; ++test) {
+        std::vector<std::vector<int>> faces;
+        if (test < 2)
+            faces = randomFaces(700, false);
+        else if (test == 2) {
+            faces = randomFaces(700, false);
+            for (auto &face : faces) face.push_back(rng.UniformUInt32(nVertices));
+        } else
+            faces = randomFaces(700, true);
+        bool full = test == 0;
+        std::vector<Normal3f> meshN = full ? n : std::vector<Normal3f>();
+        std::vector<Point2f> meshUV = test < 2 ? uv : std::vector<Point2f>();
+        std::vector<int> meshFaceIndices =
+            full ? faceIndices : std::vector<int>();
+        WriteTestPly(binaryName, true, faces, p, meshN, meshUV,
+                     meshFaceIndices);
+        WriteTestPly(asciiName, false, faces, p, meshN, meshUV,
+                     meshFaceIndices);
+        std::shared_ptr<TriangleMesh> binary = LoadTestPly(binaryName);
+        std::shared_ptr<TriangleMesh> ascii = LoadTestPly(asciiName);
+        ASSERT_TRUE(binary && ascii);
+        ExpectSameMesh(*ascii, *binary);
+    }
+
+    // Out of range vertex indices are reported and no mesh is created,
+    // including negative ones and those that don't fit in an _int_
+    for (int badIndex : {nVertices, -1, int(0x80000000u)}) {
+        std::vector<std::vector<int>> faces = randomFaces(10, false);
+        faces[5][1] = badIndex;
+        WriteTestPly(binaryName, true, faces, p, {}, {}, {});
+        EXPECT_TRUE(LoadTestPly(binaryName) == nullptr) << badIndex;
+    }
+
+    EXPECT_EQ(0, remove(binaryName.c_str()));
+    EXPECT_EQ(0, remove(asciiName.c_str()));
+}
+
+TEST(Triangle, CompactMesh) {
+    // A sphere tessellated along its parameterization, with normals,
+    // tangents and uvs
+    const int nu = 40, nv = 20;
+    std::vector<Point3f> P;
+    std::vector<Normal3f> N;
+    std::vector<Vector3f> S;
+    std::vector<Point2f> uv;
+    for (int j = 0; j <= nv; ++j)
+        for (int i = 0; i <= nu; ++i) {
+            Float phi = 2 * Pi * i / nu, theta = Pi * (j + .5f) / (nv + 1);
+            Vector3f d = SphericalDirection(std::sin(theta), std::cos(theta),
+                                            phi);
+            P.push_back(Point3f(d.x, d.y, d.z));
+            N.push_back(Normal3f(d));
+            S.push_back(Vector3f(-std::sin(phi), std::cos(phi), 0));
+            uv.push_back(Point2f(3 * Float(i) / nu, 2 * Float(j) / nv));
+        }
+    std::vector<int> indices;
+    for (int j = 0; j < nv; ++j)
+        for (int i = 0; i < nu; ++i) {
+            int v00 = j * (nu + 1) + i, v10 = v00 + 1, v01 = v00 + nu + 1,
+                v11 = v01 + 1;
+            indices.insert(indices.end(), {v00, v10, v11, v00, v11, v01});
+        }
+
+    Transform o2w = Translate(Vector3f(1, 2, 3)) * RotateX(40),
+              w2o = Inverse(o2w);
+    auto createMesh = [&](bool compact) {
+        return CreateTriangleMesh(&o2w, &w2o, false, indices.size() / 3,
+                                  indices.data(), P.size(), P.data(),
+                                  S.data(), N.data(), uv.data(), nullptr,
+                                  nullptr, nullptr, compact);
+    };
+    std::vector<std::shared_ptr<Shape>> full = createMesh(false),
+                                        compact = createMesh(true);
+    const TriangleMesh &compactMesh =
+        *std::static_pointer_cast<Triangle>(compact[0])->GetMesh();
+    EXPECT_TRUE(compactMesh.vertexIndices.empty());
+    EXPECT_EQ(indices.size(), compactMesh.vertexIndices16.size());
+    EXPECT_TRUE(!compactMesh.n && !compactMesh.uv && !compactMesh.s);
+
+    // Positions are kept exactly, so the same rays hit the same points;
+    // the decoded normals and uvs are close to the original ones
+    RNG rng;
+    for (int i = 0; i < 2000; ++i) {
+        int t = rng.UniformUInt32(full.size());
+        Point2f u(rng.UniformFloat(), rng.UniformFloat());
+        Float pdf;
+        Interaction target = full[t]->Sample(u, &pdf);
+        Point3f o = o2w(Point3f(3 * pUnif(rng, 1), 3 * pUnif(rng, 1), 3));
+        Ray ray(o, target.p - o);
+        Float tFull, tCompact;
+        SurfaceInteraction isectFull, isectCompact;
+        bool hitFull = full[t]->Intersect(ray, &tFull, &isectFull);
+        ASSERT_EQ(hitFull, compact[t]->Intersect(ray, &tCompact,
+                                                 &isectCompact));
+        if (!hitFull) continue;
+        EXPECT_EQ(tFull, tCompact);
+        EXPECT_EQ(isectFull.p, isectCompact.p);
+        EXPECT_EQ(isectFull.n, isectCompact.n);
+        EXPECT_LT(Distance(isectFull.uv, isectCompact.uv), 1e-4f);
+        EXPECT_GT(Dot(isectFull.shading.n, isectCompact.shading.n), .9999f);
+    }
+
+    // Larger meshes store 16-bit offsets from each triangle's first
+    // vertex if they all fit, and full indices otherwise
+    std::vector<Point3f> manyP(70000);
+    for (size_t i = 0; i < manyP.size(); ++i)
+        manyP[i] = Point3f(i % 2, i % 3, i % 5);
+    for (int far : {69000, 1000}) {
+        int manyIndices[6] = {0, 1, 2, 69999, 69998, far};
+        std::vector<std::shared_ptr<Shape>> many = CreateTriangleMesh(
+            &o2w, &w2o, false, 2, manyIndices, manyP.size(), manyP.data(),
+            nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, true);
+        const TriangleMesh &mesh =
+            *std::static_pointer_cast<Triangle>(many[0])->GetMesh();
+        EXPECT_EQ(far > 60000 ? 2 : 6, mesh.vertexIndices.size());
+        for (int t = 0; t < 2; ++t) {
+            int v[3];
+            std::static_pointer_cast<Triangle>(many[t])->GetVertexIndices(v);
+            for (int j = 0; j < 3; ++j) EXPECT_EQ(manyIndices[3 * t + j], v[j]);
+        }
+    }
+}
+
+TEST(Triangle, AlphaMicromaps) {
+    // An alpha texture with opaque and partially transparent discs
+    const int res = 64;
+    std::vector<Float> rgb(3 * res * res, 0.f);
+    for (int y = 0; y < res; ++y)
+        for (int x = 0; x < res; ++x) {
+            Float dx = (x % 16) - 7.5f, dy = (y % 16) - 7.5f;
+            Float a = dx * dx + dy * dy < 30 ? ((x / 16) % 2 ? 1.f : .5f) : 0.f;
+            for (int c = 0; c < 3; ++c) rgb[3 * (y * res + x) + c] = a;
+        }
+    const std::string filename = "micromap_alpha.pfm";
+    WriteImage(filename, rgb.data(), Bounds2i({0, 0}, {res, res}),
+               Point2i(res, res));
+    std::shared_ptr<Texture<Float>> alpha =
+        std::make_shared<ImageTexture<Float, Float>>(
+            std::unique_ptr<TextureMapping2D>(new UVMapping2D(2, 2)),
+            filename, false, 8.f, ImageWrap::Repeat, 1.f, false);
+
+    // Random triangles, each covering a few texels' worth of uvs around a
+    // random point
+    RNG rng;
+    const int nTriangles = 200;
+    std::vector<Point3f> P;
+    std::vector<Point2f> uv;
+    std::vector<int> indices;
+    for (int i = 0; i < 3 * nTriangles; ++i) {
+        P.push_back(Point3f(pUnif(rng, 1), pUnif(rng, 1), pUnif(rng, 1)));
+        if (i % 3 == 0) uv.push_back(Point2f(pUnif(rng, 1), pUnif(rng, 1)));
+        else
+            uv.push_back(uv[i - i % 3] +
+                         Vector2f(pUnif(rng, .15f), pUnif(rng, .15f)));
+        indices.push_back(i);
+    }
+    Transform identity;
+    auto createMesh = [&]() {
+        return CreateTriangleMesh(&identity, &identity, false, nTriangles,
+                                  indices.data(), P.size(), P.data(), nullptr,
+                                  nullptr, uv.data(), alpha, alpha);
+    };
+    std::vector<std::shared_ptr<Shape>> baked = createMesh(),
+                                        reference = createMesh();
+    const std::shared_ptr<TriangleMesh> &mesh =
+        std::static_pointer_cast<Triangle>(reference[0])->GetMesh();
+    ASSERT_FALSE(mesh->alphaMicromap.empty());
+    ASSERT_FALSE(mesh->shadowAlphaMicromap.empty());
+    int nKnown = 0;
+    for (uint64_t word : mesh->alphaMicromap)
+        for (int i = 0; i < 32; ++i) nKnown += ((word >> (2 * i)) & 3) != 0;
+    EXPECT_GT(nKnown, nTriangles * 256 / 2);
+    mesh->alphaMicromap.clear();
+    mesh->shadowAlphaMicromap.clear();
+
+    // The micromaps don't change which rays hit the triangles
+    int nHits = 0;
+    for (int i = 0; i < 20000; ++i) {
+        int t = rng.UniformUInt32(nTriangles);
+        Float pdf;
+        Interaction target = reference[t]->Sample(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()), &pdf);
+        Point3f o(pUnif(rng, 3), pUnif(rng, 3), pUnif(rng, 3));
+        Ray ray(o, target.p - o);
+        Float tBaked, tReference;
+        SurfaceInteraction isectBaked, isectReference;
+        bool hit = reference[t]->Intersect(ray, &tReference, &isectReference);
+        ASSERT_EQ(hit, baked[t]->Intersect(ray, &tBaked, &isectBaked));
+        if (hit) EXPECT_EQ(tReference, tBaked);
+        ASSERT_EQ(reference[t]->IntersectP(ray), baked[t]->IntersectP(ray));
+        nHits += hit;
+    }
+    EXPECT_GT(nHits, 1000);
+    EXPECT_LT(nHits, 19000);
+    EXPECT_EQ(0, remove(filename.c_str()));
+}
+
+TEST(DisplacedSubdiv, MatchesLoopSubdiv) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    BumpyIcosahedron(&p, &indices);
+    const int levels = 3;
+    auto makeParams = [&](Float displacement) {
+        ParamSet params;
+        std::unique_ptr<Point3f[]> P(new Point3f[p.size()]);
+        std::copy(p.begin(), p.end(), P.get());
+        params.AddPoint3f("P", std::move(P), p.size());
+        std::unique_ptr<int[]> vi(new int[indices.size()]);
+        std::copy(indices.begin(), indices.end(), vi.get());
+        params.AddInt("indices", std::move(vi), indices.size());
+        params.AddInt("levels", std::unique_ptr<int[]>(new int[1]{levels}), 1);
+        params.AddFloat("displacement",
+                        std::unique_ptr<Float[]>(new Float[1]{displacement}),
+                        1);
+        return params;
+    };
+    Transform identity;
+    auto loop = CreateLoopSubdiv(&identity, &identity, false, makeParams(0));
+    ASSERT_FALSE(loop.empty());
+
+    for (Float displacement : {0.f, .25f}) {
+        std::map<std::string, std::shared_ptr<Texture<Float>>> floatTextures;
+        auto patches =
+            CreateDisplacedSubdiv(&identity, &identity, false,
+                                  makeParams(displacement), &floatTextures);
+        ASSERT_EQ(indices.size() / 3, patches.size());
+
+        // Without displacement, the patches are the same surface as the
+        // subdivided mesh; with it, they're pushed outward along its normal.
+        Float area = 0, meshArea = 0;
+        for (const auto &patch : patches) area += patch->Area();
+        for (const auto &tri : loop) meshArea += tri->Area();
+        if (displacement == 0)
+            EXPECT_LT(std::abs(area - meshArea), 1e-3f * meshArea);
+        else
+            EXPECT_GT(area, meshArea);
+
+        RNG rng;
+        for (int i = 0; i < 1000; ++i) {
+            Vector3f d = UniformSampleSphere(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+            Ray ray(Point3f(0, 0, 0) + 20 * d, -d);
+            Float tMesh = IntersectShapes(loop, ray);
+            Float tPatches = IntersectShapes(patches, ray);
+            ASSERT_GT(tMesh, 0);
+            ASSERT_GT(tPatches, 0);
+            if (displacement == 0)
+                EXPECT_LT(std::abs(tMesh - tPatches), 1e-3f) << ray;
+            else
+                EXPECT_LT(tPatches, tMesh) << ray;
+        }
+    }
+}
+
+TEST(DisplacedSubdiv, WatertightSeams) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    BumpyIcosahedron(&p, &indices);
+    const int levels = 3, n = 1 << levels;
+    for (const char *scheme : {"loop", "linear"}) {
+        ParamSet params;
+        std::unique_ptr<Point3f[]> P(new Point3f[p.size()]);
+        std::copy(p.begin(), p.end(), P.get());
+        params.AddPoint3f("P", std::move(P), p.size());
+        std::unique_ptr<int[]> vi(new int[indices.size()]);
+        std::copy(indices.begin(), indices.end(), vi.get());
+        params.AddInt("indices", std::move(vi), indices.size());
+        params.AddInt("levels", std::unique_ptr<int[]>(new int[1]{levels}), 1);
+        params.AddFloat("displacement",
+                        std::unique_ptr<Float[]>(new Float[1]{.25f}), 1);
+        params.AddString("scheme",
+                         std::unique_ptr<std::string[]>(
+                             new std::string[1]{scheme}),
+                         1);
+        std::map<std::string, std::shared_ptr<Texture<Float>>> floatTextures;
+        Transform identity;
+        auto patches = CreateDisplacedSubdiv(&identity, &identity, false,
+                                             params, &floatTextures);
+        ASSERT_EQ(indices.size() / 3, patches.size());
+        std::vector<std::vector<Point3f>> points;
+        for (const auto &patch : patches)
+            points.push_back(std::static_pointer_cast<DisplacedPatch>(patch)
+                                 ->TessellationPoints());
+
+        // Every lattice point on an edge or corner that two faces share is
+        // the same point in both of their patches
+        int nShared = 0;
+        for (size_t f = 0; f < patches.size(); ++f)
+            for (size_t g = 0; g < patches.size(); ++g) {
+                if (f == g) continue;
+                const int *vf = &indices[3 * f], *vg = &indices[3 * g];
+                for (int b = 0, i = 0; b <= n; ++b)
+                    for (int a = 0; a + b <= n; ++a, ++i) {
+                        int w[3] = {n - a - b, a, b}, wg[3] = {0, 0, 0};
+                        bool shared = true;
+                        for (int j = 0; j < 3; ++j) {
+                            if (w[j] == 0) continue;
+                            int jg = std::find(vg, vg + 3, vf[j]) - vg;
+                            if (jg == 3)
+                                shared = false;
+                            else
+                                wg[jg] = w[j];
+                        }
+                        if (!shared) continue;
+                        ++nShared;
+                        int ig = wg[2] * (n + 1) - wg[2] * (wg[2] - 1) / 2 +
+                                 wg[1];
+                        EXPECT_EQ(points[f][i], points[g][ig])
+                            << scheme << " faces " << f << ", " << g;
+                    }
+            }
+        // Each of the 30 edges has n - 1 points between its vertices, seen
+        // from both of its faces, and each of the 12 vertices is shared by
+        // 5 faces
+        EXPECT_EQ(30 * 2 * (n - 1) + 12 * 5 * 4, nShared);
+    }
+}
+
+TEST(DisplacedSubdiv, CachedTessellation) {
+    // A flat grid displaced upward as a height map, with a cache that can
+    // only hold some of its patches' tessellations at once
+    const int n = 8;
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int y = 0; y <= n; ++y)
+        for (int x = 0; x <= n; ++x) p.push_back(Point3f(x, y, 0));
+    for (int y = 0; y < n; ++y)
+        for (int x = 0; x < n; ++x) {
+            int v00 = y * (n + 1) + x, v10 = v00 + 1, v01 = v00 + n + 1,
+                v11 = v01 + 1;
+            indices.insert(indices.end(), {v00, v10, v11, v00, v11, v01});
+        }
+    GeometryCache cache(256 * 1024);
+    auto mesh = std::make_shared<DisplacedMesh>(
+        indices.size() / 3, indices.data(), p.size(), p.data(), nullptr,
+        nullptr, false, 4, std::make_shared<ConstantTexture<Float>>(.5f), .5f,
+        &cache);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> patches;
+    for (size_t f = 0; f < indices.size() / 3; ++f)
+        patches.push_back(std::make_shared<DisplacedPatch>(
+            &identity, &identity, false, mesh, f));
+
+    // Tessellations that were evicted are generated again when rays reach
+    // their patches' bounds, and give the same surface
+    RNG rng;
+    for (int pass = 0; pass < 3; ++pass) {
+        for (int i = 0; i < 1000; ++i) {
+            Point3f o(Lerp(rng.UniformFloat(), .1f, n - .1f),
+                      Lerp(rng.UniformFloat(), .1f, n - .1f), 5);
+            Ray ray(o, Vector3f(.002f, .001f, -1));
+            Float tHit = 0;
+            for (const auto &patch : patches) {
+                Float t;
+                SurfaceInteraction isect;
+                if (patch->WorldBound().IntersectP(ray) &&
+                    patch->Intersect(ray, &t, &isect))
+                    ray.tMax = tHit = t;
+            }
+            ASSERT_GT(tHit, 0) << ray;
+            EXPECT_LT(std::abs(ray(tHit).z - .5f), 1e-4f) << ray;
+        }
+        EXPECT_GT(cache.BytesUsed(), 0);
+        EXPECT_LE(cache.BytesUsed(), cache.MaxBytes());
+    }
+
+    // The patches' areas don't depend on their tessellations still being
+    // in the cache
+    for (int pass = 0; pass < 2; ++pass) {
+        Float area = 0;
+        for (const auto &patch : patches) area += patch->Area();
+        EXPECT_LT(std::abs(area - n * n), 1e-3f);
+    }
+
+    // Points sampled uniformly by area are spread over each patch's
+    // displaced face, with their mean at its centroid
+    for (size_t f = 0; f < patches.size(); ++f) {
+        Point3f centroid(0, 0, .5f);
+        for (int j = 0; j < 3; ++j) centroid += p[indices[3 * f + j]] / 3;
+        Point3f mean(0, 0, 0);
+        const int nSamples = 4096;
+        for (int i = 0; i < nSamples; ++i) {
+            Float pdf;
+            Interaction it = patches[f]->Sample(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()), &pdf);
+            EXPECT_LT(std::abs(it.p.z - .5f), 1e-4f);
+            EXPECT_LT(std::abs(pdf - 2), 1e-3f);
+            mean += it.p / nSamples;
+        }
+        EXPECT_LT(Distance(mean, centroid), .02f) << f;
+    }
+}
+
+// Cache entry that only reports a size
+struct TestGeometry : public CachedGeometry {
+    TestGeometry(size_t bytes) : bytes(bytes) {}
+    size_t BytesUsed() const { return bytes; }
+    size_t bytes;
+};
+
+TEST(GeometryCache, Budget) {
+    GeometryCache cache(10000);
+    int nCreated = 0;
+    auto lookup = [&](uint64_t key, size_t bytes) {
+        return cache.Lookup(key, [&]() {
+            ++nCreated;
+            return std::make_shared<TestGeometry>(bytes);
+        });
+    };
+
+    // Entries much larger than a shard's share of the budget stay cached
+    lookup(0, 4000);
+    lookup(0, 4000);
+    EXPECT_EQ(1, nCreated);
+    lookup(1, 4000);
+    lookup(0, 4000);
+    EXPECT_EQ(2, nCreated);
+    EXPECT_EQ(8000, cache.BytesUsed());
+
+    // Older entries are evicted to stay within the budget as a whole
+    for (uint64_t key = 2; key < 100; ++key) {
+        lookup(key, 1000);
+        EXPECT_LE(cache.BytesUsed(), cache.MaxBytes());
+    }
+    nCreated = 0;
+    lookup(99, 1000);
+    EXPECT_EQ(0, nCreated);
+
+    // The newest entry is kept even if it alone goes over the budget
+    lookup(100, 20000);
+    EXPECT_EQ(20000, cache.BytesUsed());
+    lookup(100, 20000);
+    EXPECT_EQ(1, nCreated);
+}
+
+TEST(GeometryCache, LeastRecentlyUsed) {
+    GeometryCache cache(10000);
+    int nCreated = 0;
+    auto lookup = [&](uint64_t key) {
+        return cache.Lookup(key, [&]() {
+            ++nCreated;
+            return std::make_shared<TestGeometry>(1000);
+        });
+    };
+
+    // Fill the cache, then use its first entry again; the next entry added
+    // evicts the second one, whichever shards they're in
+    for (uint64_t key = 0; key < 10; ++key) lookup(key);
+    lookup(0);
+    lookup(10);
+    EXPECT_EQ(10000, cache.BytesUsed());
+    nCreated = 0;
+    lookup(0);
+    for (uint64_t key = 2; key <= 10; ++key) lookup(key);
+    EXPECT_EQ(0, nCreated);
+    lookup(1);
+    EXPECT_EQ(1, nCreated);
+}
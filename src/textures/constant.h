@@ -52,6 +52,10 @@ class ConstantTexture : public Texture<T> {
     // ConstantTexture Public Methods
     ConstantTexture(const T &value) : value(value) {}
     T Evaluate(const SurfaceInteraction &) const { return value; } // ѳҲ, ͳһ˽ӿ
+    bool Bound(const Bounds2f &uv, T *min, T *max) const {
+        *min = *max = value;
+        return true;
+    }
 
   private:
     T value;
@@ -77,6 +77,16 @@ struct TexInfo {
     }
 };
 
+// Only float textures are bounded; spectra have no useful ordering
+inline bool BoundTexels(const MIPMap<Float> &mipmap, const Bounds2f &st,
+                        Float *min, Float *max) {
+    return mipmap.Bound(st, min, max);
+}
+inline bool BoundTexels(const MIPMap<RGBSpectrum> &mipmap, const Bounds2f &st,
+                        Spectrum *min, Spectrum *max) {
+    return false;
+}
+
 // ImageTexture Declarations
 template <typename Tmemory, typename Treturn>
 class ImageTexture : public Texture<Treturn> {
@@ -105,6 +115,12 @@ class ImageTexture : public Texture<Treturn> {
         return ret;
     }
 
+    bool Bound(const Bounds2f &uv, Treturn *min, Treturn *max) const {
+        Bounds2f st;
+        return mapping->MapUVBounds(uv, &st) &&
+               BoundTexels(*mipmap, st, min, max);
+    }
+
   private:
     // ImageTexture Private Methods
     static MIPMap<Tmemory> *GetTexture(const std::string &filename,
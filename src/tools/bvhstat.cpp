@@ -0,0 +1,388 @@
+//
+// bvhstat.cpp
+//
+// Builds each of pbrt's accelerators over the shapes of a scene and
+// reports statistics about the trees and about tracing a standard set of
+// rays through them, to help choose accelerator parameters for the scene.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include "pbrt.h"
+#include "api.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "paramset.h"
+#include "primitive.h"
+#include "rng.h"
+#include "sampling.h"
+#include "accelerators/bvh.h"
+#include "accelerators/kdtreeaccel.h"
+#include "accelerators/widebvh.h"
+#include <glog/logging.h>
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "bvhstat: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: bvhstat [options] <filename.pbrt>
+
+Builds a BVH with each split method and maximum leaf size, as well as the
+other accelerators, over the scene's shapes.  Reports their build time,
+memory, SAH cost, leaf sizes, and the average number of nodes visited and
+primitives tested per ray for rays from the scene's camera and for diffuse
+rays leaving the points those rays hit.
+
+options:
+    --maxprims <n,...> Maximum numbers of primitives in a BVH leaf to try.
+                       Default: 1,2,4,8
+    --nthreads <n>     Number of threads to build the accelerators with.
+                       Default: the number of cores
+    --rays <n>         Number of camera rays. Default: 65536
+
+)");
+    exit(1);
+}
+
+// Forwards to a primitive, counting the ray intersection tests made with
+// it.  Rays are only traced from the main thread.
+class CountingPrimitive : public Primitive {
+  public:
+    CountingPrimitive(std::shared_ptr<Primitive> primitive)
+        : primitive(std::move(primitive)) {}
+    Bounds3f WorldBound() const { return primitive->WorldBound(); }
+    Bounds3f ClippedWorldBound(const Bounds3f &clip) const {
+        return primitive->ClippedWorldBound(clip);
+    }
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const {
+        ++nTests;
+        return primitive->Intersect(r, isect);
+    }
+    bool IntersectP(const Ray &r) const {
+        ++nTests;
+        return primitive->IntersectP(r);
+    }
+    const AreaLight *GetAreaLight() const {
+        return primitive->GetAreaLight();
+    }
+    const Material *GetMaterial() const { return primitive->GetMaterial(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const {
+        primitive->ComputeScatteringFunctions(isect, arena, mode,
+                                              allowMultipleLobes);
+    }
+
+    static int64_t nTests;
+
+  private:
+    std::shared_ptr<Primitive> primitive;
+};
+
+int64_t CountingPrimitive::nTests = 0;
+
+// Gives access to the flattened nodes of a BVH.
+class BVHStats : public BVHAccel {
+  public:
+    using BVHAccel::BVHAccel;
+
+    size_t Bytes() const {
+        return totalNodes * sizeof(LinearBVHNode) +
+               primitives.size() * sizeof(primitives[0]);
+    }
+
+    // The same cost that Refit() measures trees with: one for each node
+    // visited and each primitive tested by a ray through the root, with
+    // nodes reached with probability proportional to their surface area.
+    Float SAHCost() const {
+        if (totalNodes == 0) return 0;
+        std::vector<Float> cost(totalNodes);
+        for (int i = totalNodes - 1; i >= 0; --i) {
+            const LinearBVHNode &node = nodes[i];
+            if (node.nPrimitives > 0) {
+                cost[i] = node.nPrimitives;
+                continue;
+            }
+            int second = node.secondChildOffset;
+            Float area = node.bounds.SurfaceArea();
+            if (area > 0)
+                cost[i] = 1 + (cost[i + 1] * nodes[i + 1].bounds.SurfaceArea() +
+                               cost[second] * nodes[second].bounds.SurfaceArea()) /
+                                  area;
+            else
+                cost[i] = 1 + cost[i + 1] + cost[second];
+        }
+        return cost[0];
+    }
+
+    std::map<int, int> LeafSizes() const {
+        std::map<int, int> sizes;
+        for (int i = 0; i < totalNodes; ++i)
+            if (nodes[i].nPrimitives > 0) ++sizes[nodes[i].nPrimitives];
+        return sizes;
+    }
+
+    // Traverses the BVH for the closest hit as BVHAccel::Intersect() does;
+    // returns the number of nodes visited.
+    int NodeVisits(const Ray &r) const {
+        if (!nodes) return 0;
+        Ray ray = r;
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+        SurfaceInteraction isect;
+        int nodesToVisit[64];
+        int toVisitOffset = 0, currentNodeIndex = 0, nVisits = 0;
+        while (true) {
+            const LinearBVHNode *node = &nodes[currentNodeIndex];
+            ++nVisits;
+            if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+                if (node->nPrimitives > 0) {
+                    for (int i = 0; i < node->nPrimitives; ++i)
+                        primitives[node->primitivesOffset + i]->Intersect(
+                            ray, &isect);
+                    if (toVisitOffset == 0) break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                } else if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            } else {
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+        }
+        return nVisits;
+    }
+};
+
+static std::vector<int> maxPrimsInNode = {1, 2, 4, 8};
+static int nCameraRays = 65536;
+
+// Rays through a jittered grid over the film, and a cosine-distributed
+// ray leaving each point that they hit
+static void MakeRays(const std::vector<std::shared_ptr<Primitive>> &prims,
+                     const Camera &camera, std::vector<Ray> *cameraRays,
+                     std::vector<Ray> *diffuseRays) {
+    BVHAccel reference(prims, 4);
+    Bounds2i sampleBounds = camera.film->GetSampleBounds();
+    Vector2i extent = sampleBounds.Diagonal();
+    Float scale = std::sqrt(nCameraRays / Float(extent.x * extent.y));
+    int nx = std::max(1, int(extent.x * scale + .5f));
+    int ny = std::max(1, int(extent.y * scale + .5f));
+    RNG rng;
+    for (int y = 0; y < ny; ++y)
+        for (int x = 0; x < nx; ++x) {
+            CameraSample cs;
+            cs.pFilm = Point2f(Lerp((x + rng.UniformFloat()) / nx,
+                                    sampleBounds.pMin.x, sampleBounds.pMax.x),
+                               Lerp((y + rng.UniformFloat()) / ny,
+                                    sampleBounds.pMin.y, sampleBounds.pMax.y));
+            cs.pLens = Point2f(rng.UniformFloat(), rng.UniformFloat());
+            cs.time = rng.UniformFloat();
+            Ray ray;
+            if (camera.GenerateRay(cs, &ray) == 0) continue;
+            cameraRays->push_back(ray);
+
+            SurfaceInteraction isect;
+            if (!reference.Intersect(ray, &isect)) continue;
+            Vector3f n(Faceforward(isect.n, -ray.d)), s, t;
+            CoordinateSystem(n, &s, &t);
+            Vector3f w = CosineSampleHemisphere(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+            diffuseRays->push_back(isect.SpawnRay(w.x * s + w.y * t + w.z * n));
+        }
+}
+
+struct AcceleratorStats {
+    std::string name;
+    double buildSeconds;
+    // Only known for _BVHStats_
+    size_t bytes = 0;
+    Float sahCost = 0;
+    std::map<int, int> leafSizes;
+    double nodesPerRay[2] = {0, 0};
+
+    double testsPerRay[2];
+    double raysPerSecond;
+};
+
+static void MeasureRays(const Primitive &accel, const BVHStats *bvh,
+                        const std::vector<Ray> rays[2],
+                        AcceleratorStats *stats) {
+    int64_t nRays = 0;
+    std::chrono::duration<double> elapsed(0);
+    for (int set = 0; set < 2; ++set) {
+        if (rays[set].empty()) {
+            stats->testsPerRay[set] = 0;
+            continue;
+        }
+        int64_t nTests = CountingPrimitive::nTests;
+        auto start = std::chrono::steady_clock::now();
+        for (const Ray &r : rays[set]) {
+            Ray ray = r;
+            SurfaceInteraction isect;
+            accel.Intersect(ray, &isect);
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+        nRays += rays[set].size();
+        stats->testsPerRay[set] =
+            double(CountingPrimitive::nTests - nTests) / rays[set].size();
+
+        if (bvh) {
+            int64_t nVisits = 0;
+            for (const Ray &ray : rays[set]) nVisits += bvh->NodeVisits(ray);
+            stats->nodesPerRay[set] = double(nVisits) / rays[set].size();
+        }
+    }
+    stats->raysPerSecond = elapsed.count() > 0 ? nRays / elapsed.count() : 0;
+}
+
+static void AnalyzeScene(std::vector<std::shared_ptr<Primitive>> scenePrims,
+                         const Camera &camera) {
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &p : scenePrims)
+        prims.push_back(std::make_shared<CountingPrimitive>(p));
+    std::vector<Ray> rays[2];
+    MakeRays(scenePrims, camera, &rays[0], &rays[1]);
+    printf("%d primitives, %d camera rays, %d diffuse rays\n\n",
+           (int)prims.size(), (int)rays[0].size(), (int)rays[1].size());
+
+    auto timeBuild = [](std::function<std::shared_ptr<Primitive>()> build,
+                        double *seconds) {
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<Primitive> accel = build();
+        *seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start).count();
+        return accel;
+    };
+
+    std::vector<AcceleratorStats> results;
+    std::pair<const char *, BVHAccel::SplitMethod> splitMethods[] = {
+        {"sah", BVHAccel::SplitMethod::SAH},
+        {"hlbvh", BVHAccel::SplitMethod::HLBVH},
+        {"middle", BVHAccel::SplitMethod::Middle},
+        {"equal", BVHAccel::SplitMethod::EqualCounts},
+        {"sbvh", BVHAccel::SplitMethod::SBVH}};
+    for (const auto &splitMethod : splitMethods)
+        for (int maxPrims : maxPrimsInNode) {
+            AcceleratorStats stats;
+            stats.name =
+                StringPrintf("bvh %s %d", splitMethod.first, maxPrims);
+            BVHAccel::SplitMethod method = splitMethod.second;
+            std::shared_ptr<Primitive> accel = timeBuild(
+                [&]() {
+                    return std::make_shared<BVHStats>(prims, maxPrims, method);
+                },
+                &stats.buildSeconds);
+            const BVHStats *bvh = static_cast<const BVHStats *>(accel.get());
+            stats.bytes = bvh->Bytes();
+            stats.sahCost = bvh->SAHCost();
+            stats.leafSizes = bvh->LeafSizes();
+            MeasureRays(*accel, bvh, rays, &stats);
+            results.push_back(stats);
+        }
+
+    std::pair<const char *, std::function<std::shared_ptr<Primitive>()>>
+        others[] = {
+            {"kdtree",
+             [&]() { return CreateKdTreeAccelerator(prims, ParamSet()); }},
+            {"widebvh 4",
+             [&]() { return CreateWideBVHAccelerator(prims, ParamSet(), 4); }},
+            {"widebvh 8",
+             [&]() { return CreateWideBVHAccelerator(prims, ParamSet(), 8); }}};
+    for (const auto &other : others) {
+        AcceleratorStats stats;
+        stats.name = other.first;
+        std::shared_ptr<Primitive> accel =
+            timeBuild(other.second, &stats.buildSeconds);
+        MeasureRays(*accel, nullptr, rays, &stats);
+        results.push_back(stats);
+    }
+
+    printf("%-16s %9s %8s %8s %18s %18s %8s\n", "", "", "", "",
+           "camera rays", "diffuse rays", "");
+    printf("%-16s %9s %8s %8s %9s %8s %9s %8s %8s\n", "accelerator",
+           "build ms", "MB", "SAH cost", "nodes", "prims", "nodes", "prims",
+           "Mrays/s");
+    for (const AcceleratorStats &s : results) {
+        printf("%-16s %9.1f ", s.name.c_str(), 1000 * s.buildSeconds);
+        if (s.bytes > 0)
+            printf("%8.2f %8.2f ", s.bytes / (1024. * 1024.), s.sahCost);
+        else
+            printf("%8s %8s ", "-", "-");
+        for (int set = 0; set < 2; ++set) {
+            if (s.nodesPerRay[set] > 0)
+                printf("%9.2f ", s.nodesPerRay[set]);
+            else
+                printf("%9s ", "-");
+            printf("%8.2f ", s.testsPerRay[set]);
+        }
+        printf("%8.2f\n", s.raysPerSecond / 1e6);
+    }
+
+    printf("\nBVH leaf sizes (primitives: leaves)\n");
+    for (const AcceleratorStats &s : results) {
+        if (s.leafSizes.empty()) continue;
+        printf("%-16s", s.name.c_str());
+        for (const auto &size : s.leafSizes)
+            printf(" %d:%d", size.first, size.second);
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1; // Warning and above.
+
+    Options opt;
+    opt.quiet = true;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--maxprims") || !strcmp(argv[i], "-maxprims")) {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            maxPrimsInNode.clear();
+            for (const char *p = argv[++i]; *p;) {
+                char *end;
+                long n = strtol(p, &end, 10);
+                if (end == p || n < 1 || n > 255)
+                    usage("invalid --maxprims value \"%s\"", argv[i]);
+                maxPrimsInNode.push_back(n);
+                p = (*end == ',') ? end + 1 : end;
+            }
+        } else if (!strcmp(argv[i], "--nthreads") ||
+                   !strcmp(argv[i], "-nthreads")) {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            opt.nThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rays") || !strcmp(argv[i], "-rays")) {
+            if (i + 1 == argc) usage("missing value after %s flag", argv[i]);
+            nCameraRays = atoi(argv[++i]);
+            if (nCameraRays < 1) usage("--rays must be >= 1");
+        } else if (argv[i][0] == '-')
+            usage("unknown option \"%s\"", argv[i]);
+        else if (!filename.empty())
+            usage("only one scene file may be given");
+        else
+            filename = argv[i];
+    }
+    if (filename.empty()) usage("no scene file given");
+
+    pbrtInit(opt);
+    pbrtSetWorldEndCallback(AnalyzeScene);
+    pbrtParseFile(filename);
+    pbrtCleanup();
+    return 0;
+}
@@ -404,11 +404,19 @@ bool CyHair::ToCubicBezierCurves(std::vector<float> *vertices,
 #include <vector>
 
 int main(int argc, char *argv[]) {
+    // With --curves, all of the strands are written as a single "curves"
+    // shape rather than as a "curve" shape each.
+    bool curveSet = false;
+    if (argc > 1 && strcmp(argv[1], "--curves") == 0) {
+        curveSet = true;
+        --argc;
+        ++argv;
+    }
     if (argc <= 2 || strcmp(argv[1], "--help") == 0 ||
         strcmp(argv[1], "-h") == 0) {
         fprintf(stderr,
-                "usage: cyhair2pbrt [CyHair filename] [pbrt output filename] "
-                "(max strands) (thickness)\n");
+                "usage: cyhair2pbrt [--curves] [CyHair filename] "
+                "[pbrt output filename] (max strands) (thickness)\n");
         return EXIT_FAILURE;
     }
 
@@ -468,7 +476,26 @@ int main(int argc, char *argv[]) {
             bounds[1][1], bounds[1][2]);
 
     const size_t num_curves = radiuss.size() / 4;
-    for (size_t i = 0; i < num_curves; i++) {
+    if (curveSet) {
+        fprintf(
+            f,
+            "Shape \"curves\" \"string type\" [ \"cylinder\" ] \"point P\" [\n");
+        for (size_t i = 0; i < num_curves; i++) {
+            for (size_t j = 0; j < 12; j++) {
+                fprintf(f, "%f ", static_cast<double>(points[12 * i + j]));
+            }
+            fprintf(f, "\n");
+        }
+        for (int end = 0; end < 2; end++) {
+            fprintf(f, "] \"float width%d\" [\n", end);
+            for (size_t i = 0; i < num_curves; i++) {
+                fprintf(f, "%f\n",
+                        static_cast<double>(radiuss[4 * i + 3 * end]));
+            }
+        }
+        fprintf(f, "]\n");
+    }
+    for (size_t i = 0; i < num_curves && !curveSet; i++) {
         fprintf(
             f,
             "Shape \"curve\" \"string type\" [ \"cylinder\" ] \"point P\" [ ");